@@ -28,15 +28,72 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
 
 #include <algorithm>
+#include <atomic>
 #include <memory>
 #include <new>
 #include <random>
 #include <thread>
+#include <vector>
 
 #include "run_benchmark.h"
 
+// Note, this benchmark is also built against system's malloc. So we
+// only peek at tcmalloc's numeric properties when those are actually
+// linked in.
+#if defined(__GNUC__) && !defined(_WIN32)
+extern "C" int MallocExtension_GetNumericProperty(const char* property, size_t* value)
+  __attribute__((weak));
+extern "C" int MallocExtension_SetNumericProperty(const char* property, size_t value)
+  __attribute__((weak));
+extern "C" void MallocExtension_ReleaseFreeMemory(void)
+  __attribute__((weak));
+extern "C" void MallocExtension_MarkThreadIdle(void)
+  __attribute__((weak));
+extern "C" size_t tc_malloc_batch(size_t size, void** ptrs, size_t count)
+  __attribute__((weak));
+extern "C" void tc_free_batch(size_t size, void** ptrs, size_t count)
+  __attribute__((weak));
+#endif
+
+static bool get_numeric_property(const char* name, size_t* value) {
+#if defined(__GNUC__) && !defined(_WIN32)
+  if (MallocExtension_GetNumericProperty != nullptr) {
+    return MallocExtension_GetNumericProperty(name, value);
+  }
+#endif
+  return false;
+}
+
+static bool set_numeric_property(const char* name, size_t value) {
+#if defined(__GNUC__) && !defined(_WIN32)
+  if (MallocExtension_SetNumericProperty != nullptr) {
+    return MallocExtension_SetNumericProperty(name, value);
+  }
+#endif
+  return false;
+}
+
+static void release_free_memory() {
+#if defined(__GNUC__) && !defined(_WIN32)
+  if (MallocExtension_ReleaseFreeMemory != nullptr) {
+    MallocExtension_ReleaseFreeMemory();
+  }
+#endif
+}
+
+static void mark_thread_idle() {
+#if defined(__GNUC__) && !defined(_WIN32)
+  if (MallocExtension_MarkThreadIdle != nullptr) {
+    MallocExtension_MarkThreadIdle();
+  }
+#endif
+}
+
 static void bench_fastpath_throughput(long iterations,
                                       uintptr_t param)
 {
@@ -157,6 +214,45 @@ static void bench_fastpath_stack_simple(long iterations,
   }
 }
 
+static void malloc_batch(size_t size, void** ptrs, size_t count) {
+#if defined(__GNUC__) && !defined(_WIN32)
+  if (tc_malloc_batch != nullptr) {
+    tc_malloc_batch(size, ptrs, count);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < count; i++) {
+    ptrs[i] = malloc(size);
+  }
+}
+
+static void free_batch(size_t size, void** ptrs, size_t count) {
+#if defined(__GNUC__) && !defined(_WIN32)
+  if (tc_free_batch != nullptr) {
+    tc_free_batch(size, ptrs, count);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < count; i++) {
+    free(ptrs[i]);
+  }
+}
+
+// Same as bench_fastpath_stack_simple, but uses batch API. Compare
+// the two to see the benefit of batching.
+static void bench_fastpath_stack_batch(long iterations,
+                                       uintptr_t _param)
+{
+  size_t sz = 32;
+  long param = static_cast<long>(_param);
+  param = std::max(1l, param);
+  std::unique_ptr<void*[]> stack = std::make_unique<void*[]>(param);
+  for (; iterations>0; iterations -= param) {
+    malloc_batch(sz, stack.get(), param);
+    free_batch(sz, stack.get(), param);
+  }
+}
+
 static void bench_fastpath_rnd_dependent(long iterations,
                                          uintptr_t _param)
 {
@@ -235,6 +331,414 @@ static void bench_fastpath_rnd_dependent_8cores(long iterations,
   }
 }
 
+// Bytes sitting in front-end caches (per-thread or per-CPU) right
+// after last run of bench_cached_bytes_threads, while all of its
+// threads are still alive.
+static size_t cached_bytes_threads_result;
+
+static void bench_cached_bytes_threads(long iterations,
+                                       uintptr_t param)
+{
+  const int nthreads = static_cast<int>(param);
+  std::atomic<int> done{0};
+  std::atomic<bool> release{false};
+
+  auto body = [&] () {
+    constexpr int kBatch = 64;
+    void* ptrs[kBatch];
+    size_t sz = 32;
+    for (long i = iterations; i > 0; i -= kBatch) {
+      for (int k = 0; k < kBatch; k++) {
+        ptrs[k] = (operator new)(sz);
+        sz = ((sz * 8191) & 2047) + 16;
+      }
+      for (int k = 0; k < kBatch; k++) {
+        (operator delete)(ptrs[k]);
+      }
+    }
+    done.fetch_add(1);
+    // Keep thread (and its cache) alive until we've looked at stats.
+    while (!release.load()) {
+      std::this_thread::yield();
+    }
+  };
+
+  std::vector<std::thread> ts;
+  for (int i = 0; i < nthreads; i++) {
+    ts.emplace_back(body);
+  }
+  while (done.load() != nthreads) {
+    std::this_thread::yield();
+  }
+
+  size_t thread_bytes = 0, cpu_bytes = 0;
+  get_numeric_property("tcmalloc.thread_cache_free_bytes", &thread_bytes);
+  get_numeric_property("tcmalloc.cpu_cache_free_bytes", &cpu_bytes);
+  cached_bytes_threads_result = thread_bytes + cpu_bytes;
+
+  release.store(true);
+  for (auto &t : ts) {
+    t.join();
+  }
+}
+
+// Minor page faults per iteration taken by last run of
+// bench_release_refault, or -1 if its release advice isn't supported.
+static double release_refault_result;
+
+// Param is release advice (see "tcmalloc.release_advice"). Each
+// iteration touches a 1 MiB block, frees it and releases free memory
+// to the OS. With MADV_DONTNEED every page of the block faults again
+// on next iteration, while with MADV_FREE pages stay in place unless
+// the OS is short of memory.
+static void bench_release_refault(long iterations,
+                                  uintptr_t param)
+{
+  release_refault_result = -1;
+  size_t old_advice;
+  if (!get_numeric_property("tcmalloc.release_advice", &old_advice)
+      || !set_numeric_property("tcmalloc.release_advice", param)) {
+    return;
+  }
+
+  constexpr size_t kSize = 1 << 20;
+#if !defined(_WIN32)
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+#endif
+  for (long i = 0; i < iterations; i++) {
+    volatile char* p = static_cast<char*>((operator new)(kSize));
+    for (size_t off = 0; off < kSize; off += 4096) {
+      p[off] = 1;
+    }
+    (operator delete)(const_cast<char*>(p));
+    release_free_memory();
+  }
+#if !defined(_WIN32)
+  getrusage(RUSAGE_SELF, &after);
+  release_refault_result =
+    static_cast<double>(after.ru_minflt - before.ru_minflt) / iterations;
+#endif
+
+  set_numeric_property("tcmalloc.release_advice", old_advice);
+}
+
+// Minor page faults per allocated object taken by last run of
+// bench_cold_burst.
+static double cold_burst_faults_result;
+
+// Allocates bursts of kBurst objects of sizes evenly spread up to
+// param bytes, i.e. few objects of many size classes, writing first
+// word of each. After every burst everything is freed, thread cache
+// flushed and free memory released to the OS, so every burst starts
+// from a cold heap and has to grow its size classes from fresh
+// spans. Shows how much of fresh spans we touch up front. Has to run
+// before randomize_size_classes leaves partially used spans around.
+static void bench_cold_burst(long iterations,
+                             uintptr_t param)
+{
+  constexpr int kBurst = 64;
+  void* ptrs[kBurst];
+  int n = 0;
+
+#if !defined(_WIN32)
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+#endif
+  for (long i = 0; i < iterations; i++) {
+    void* p = (operator new)(param * (n + 1) / kBurst);
+    *static_cast<void* volatile*>(p) = nullptr;
+    ptrs[n++] = p;
+    if (n == kBurst) {
+      for (int k = 0; k < n; k++) {
+        (operator delete)(ptrs[k]);
+      }
+      n = 0;
+      mark_thread_idle();
+      release_free_memory();
+    }
+  }
+  for (int k = 0; k < n; k++) {
+    (operator delete)(ptrs[k]);
+  }
+#if !defined(_WIN32)
+  getrusage(RUSAGE_SELF, &after);
+  cold_burst_faults_result =
+    static_cast<double>(after.ru_minflt - before.ru_minflt) / iterations;
+#endif
+}
+
+// MiB copied by realloc per iteration in last run of
+// bench_realloc_growth, or -1 if its mremap threshold isn't supported.
+static double realloc_growth_copied_result;
+
+// Param is mremap threshold in MiB (see
+// "tcmalloc.mremap_threshold_bytes"), 0 disables mremap. Each
+// iteration grows a buffer from 1 MiB to 64 MiB in 1 MiB steps. Every
+// realloc that neither stayed in place nor was served by mremap had
+// to copy the old contents.
+static void bench_realloc_growth(long iterations,
+                                 uintptr_t param)
+{
+  realloc_growth_copied_result = -1;
+  size_t old_threshold;
+  if (!get_numeric_property("tcmalloc.mremap_threshold_bytes", &old_threshold)
+      || !set_numeric_property("tcmalloc.mremap_threshold_bytes", param << 20)) {
+    return;
+  }
+
+  constexpr size_t kStep = 1 << 20;
+  constexpr size_t kMax = 64 << 20;
+  uint64_t copied = 0;
+  for (long i = 0; i < iterations; i++) {
+    size_t size = kStep;
+    char* p = static_cast<char*>(malloc(size));
+    p[0] = 1;
+    for (; size < kMax; size += kStep) {
+      size_t remaps_before = 0, remaps_after = 0;
+      get_numeric_property("tcmalloc.pageheap_remap_count", &remaps_before);
+      char* q = static_cast<char*>(realloc(p, size + kStep));
+      get_numeric_property("tcmalloc.pageheap_remap_count", &remaps_after);
+      if (q != p && remaps_after == remaps_before) {
+        copied += size;
+      }
+      p = q;
+      p[size + kStep - 1] = 1;
+    }
+    free(p);
+  }
+  realloc_growth_copied_result =
+    static_cast<double>(copied) / iterations / kStep;
+
+  set_numeric_property("tcmalloc.mremap_threshold_bytes", old_threshold);
+}
+
+// Minor page faults per iteration and share of allocations served by
+// large span cache in last run of bench_large_churn, or -1 if large
+// span cache isn't supported.
+static double large_churn_faults_result;
+static double large_churn_hits_result;
+
+// Param is large span cache limit in MiB (see
+// "tcmalloc.large_span_cache_limit_bytes"), 0 disables the cache.
+// Each iteration allocates a buffer of 2 to 64 MiB, touches all its
+// pages and frees it. Without the cache, buffers come from (and go
+// back to) free spans that scavenging keeps releasing, so their pages
+// fault back in over and over.
+static void bench_large_churn(long iterations,
+                              uintptr_t param)
+{
+  large_churn_faults_result = -1;
+  size_t old_limit;
+  if (!get_numeric_property("tcmalloc.large_span_cache_limit_bytes", &old_limit)
+      || !set_numeric_property("tcmalloc.large_span_cache_limit_bytes",
+                               param << 20)) {
+    return;
+  }
+
+  size_t hits_before = 0, misses_before = 0, hits_after = 0, misses_after = 0;
+  get_numeric_property("tcmalloc.pageheap_large_span_cache_hits", &hits_before);
+  get_numeric_property("tcmalloc.pageheap_large_span_cache_misses", &misses_before);
+#if !defined(_WIN32)
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+#endif
+  for (long i = 0; i < iterations; i++) {
+    const size_t size = size_t{2 << 20} << (i % 6);
+    volatile char* p = static_cast<char*>((operator new)(size));
+    for (size_t off = 0; off < size; off += 4096) {
+      p[off] = 1;
+    }
+    (operator delete)(const_cast<char*>(p));
+  }
+#if !defined(_WIN32)
+  getrusage(RUSAGE_SELF, &after);
+  large_churn_faults_result =
+    static_cast<double>(after.ru_minflt - before.ru_minflt) / iterations;
+#endif
+  get_numeric_property("tcmalloc.pageheap_large_span_cache_hits", &hits_after);
+  get_numeric_property("tcmalloc.pageheap_large_span_cache_misses", &misses_after);
+  const size_t lookups = (hits_after - hits_before) + (misses_after - misses_before);
+  large_churn_hits_result =
+    lookups ? 100.0 * (hits_after - hits_before) / lookups : 0;
+
+  set_numeric_property("tcmalloc.large_span_cache_limit_bytes", old_limit);
+  // Drops whatever is still cached.
+  release_free_memory();
+}
+
+// One thread allocates batches of param objects of assorted small
+// sizes and hands them over to another thread, which frees them. Free
+// then works on objects allocated (and pages populated) by the other
+// thread, which is where looking up size class is least cache
+// friendly.
+static void bench_cross_thread_free(long iterations,
+                                    uintptr_t param)
+{
+  const long batch = std::max<long>(param, 1);
+  std::unique_ptr<void*[]> bufs[2] = {
+    std::make_unique<void*[]>(batch), std::make_unique<void*[]>(batch)};
+  std::atomic<void**> handoff{nullptr};
+  std::atomic<bool> done{false};
+
+  std::thread consumer([&] () {
+    for (;;) {
+      void** ptrs = handoff.load(std::memory_order_acquire);
+      if (ptrs == nullptr) {
+        if (done.load(std::memory_order_acquire)) {
+          return;
+        }
+        std::this_thread::yield();
+        continue;
+      }
+      for (long k = 0; k < batch; k++) {
+        (operator delete)(ptrs[k]);
+      }
+      handoff.store(nullptr, std::memory_order_release);
+    }
+  });
+
+  size_t sz = 32;
+  for (long i = iterations, n = 0; i > 0; i -= batch, n++) {
+    void** ptrs = bufs[n & 1].get();
+    for (long k = 0; k < batch; k++) {
+      ptrs[k] = (operator new)(sz);
+      sz = ((sz * 8191) & 2047) + 16;
+    }
+    while (handoff.load(std::memory_order_acquire) != nullptr) {
+      std::this_thread::yield();
+    }
+    handoff.store(ptrs, std::memory_order_release);
+  }
+  while (handoff.load(std::memory_order_acquire) != nullptr) {
+    std::this_thread::yield();
+  }
+  done.store(true, std::memory_order_release);
+  consumer.join();
+}
+
+// Keeps a pool of small objects whose pages are interleaved with
+// param GiB of large, never touched allocations, and then randomly
+// frees and reallocates pool's objects. Free then has to look up
+// size classes of pages spread over huge address range, which is
+// where page map lookups miss in both packed cache and cpu caches.
+// The pool persists between runs with the same param, so setup
+// isn't measured.
+static void bench_sparse_heap_free(long iterations,
+                                   uintptr_t param)
+{
+  static constexpr size_t kGapSize = size_t{256} << 20;
+  static constexpr long kPoolSize = 1 << 17;
+  static std::vector<void*> gaps;
+  static std::unique_ptr<void*[]> pool;
+  static uintptr_t pool_param = ~uintptr_t{0};
+
+  if (pool_param != param) {
+    for (long i = 0; pool && i < kPoolSize; i++) {
+      (operator delete)(pool[i]);
+    }
+    for (void* p : gaps) {
+      free(p);
+    }
+    gaps.clear();
+
+    pool = std::make_unique<void*[]>(kPoolSize);
+    const size_t num_gaps = (size_t{param} << 30) / kGapSize;
+    const long per_gap = kPoolSize / std::max<size_t>(num_gaps, 1);
+    size_t sz = 32;
+    for (long i = 0; i < kPoolSize; i++) {
+      if (i % per_gap == 0 && gaps.size() < num_gaps) {
+        gaps.push_back(malloc(kGapSize));
+      }
+      pool[i] = (operator new)(sz);
+      sz = ((sz * 8191) & 1023) + 16;
+    }
+    std::shuffle(pool.get(), pool.get() + kPoolSize, std::minstd_rand(1));
+    pool_param = param;
+  }
+
+  // Freed objects are immediately reused by the next new, so pool
+  // keeps its layout. What varies is which page every free hits.
+  size_t sz = 32;
+  uint32_t idx = 0;
+  for (; iterations > 0; iterations--) {
+    idx = (idx * 1103515245 + 12345) & (kPoolSize - 1);
+    (operator delete)(pool[idx]);
+    pool[idx] = (operator new)(sz);
+    sz = ((sz * 8191) & 1023) + 16;
+  }
+}
+
+// Allocates kCount objects of param bytes and frees them in shuffled
+// order, so most frees go past thread and transfer caches back to
+// spans. Time is per object. Compare runs with and without
+// TCMALLOC_BITMAP_SPANS=t.
+static void bench_tiny_central(long iterations,
+                               uintptr_t param)
+{
+  constexpr long kCount = 1 << 18;
+  static std::vector<uint32_t> order;
+  if (order.empty()) {
+    order.resize(kCount);
+    for (long i = 0; i < kCount; i++) {
+      order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::minstd_rand(1));
+  }
+  auto ptrs = std::make_unique<void*[]>(kCount);
+
+  for (long i = 0; i < iterations; i += kCount) {
+    for (long k = 0; k < kCount; k++) {
+      ptrs[k] = (operator new)(param);
+    }
+    for (long k = 0; k < kCount; k++) {
+      (operator delete)(ptrs[order[k]]);
+    }
+    release_free_memory();
+  }
+}
+
+// Leaves param distinct free spans bigger than 1 MiB of assorted
+// lengths, each fenced off by in-use neighbours so they don't
+// coalesce, and then allocates and frees buffers of assorted large
+// sizes. Every allocation is best fit search among those free
+// spans. The fences persist between runs with the same param, so
+// setup isn't measured.
+static void bench_many_large_spans(long iterations,
+                                   uintptr_t param)
+{
+  static std::vector<void*> fences;
+  static uintptr_t fences_param = ~uintptr_t{0};
+  constexpr size_t kStep = 8 << 10;
+  // Big enough to get span of its own.
+  constexpr size_t kFenceSize = 512 << 10;
+
+  if (fences_param != param) {
+    for (void* p : fences) {
+      (operator delete)(p);
+    }
+    fences.clear();
+
+    std::vector<void*> holes;
+    for (uintptr_t i = 0; i < param; i++) {
+      fences.push_back((operator new)(kFenceSize));
+      holes.push_back((operator new)((1 << 20) + kStep * ((i * 37) % 256 + 1)));
+    }
+    fences.push_back((operator new)(kFenceSize));
+    for (void* p : holes) {
+      (operator delete)(p);
+    }
+    fences_param = param;
+  }
+
+  uint32_t k = 0;
+  for (; iterations > 0; iterations--) {
+    k = (k * 1103515245 + 12345);
+    void* p = (operator new)((1 << 20) + kStep * ((k >> 16) % 256) + 1);
+    (operator delete)(p);
+  }
+}
+
 void randomize_one_size_class(size_t size) {
   size_t count = (100<<20) / size;
   auto randomize_buffer = std::make_unique<void*[]>(count);
@@ -274,6 +778,16 @@ int main(int argc, char **argv)
 {
   init_benchmark(&argc, &argv);
 
+  // Cold heap benchmarks go before freelists are randomized.
+  for (int size : {1024, 8192, 65536}) {
+    cold_burst_faults_result = -1;
+    report_benchmark("bench_cold_burst", bench_cold_burst, size);
+    if (cold_burst_faults_result >= 0) {
+      printf("bench_cold_burst(%d)\t: %.2f page faults per object\n",
+             size, cold_burst_faults_result);
+    }
+  }
+
   if (!benchmark_list_only) {
     printf("Trying to randomize freelists..."); fflush(stdout);
     randomize_size_classes();
@@ -304,11 +818,73 @@ int main(int argc, char **argv)
   report_benchmark("bench_fastpath_stack_simple", bench_fastpath_stack_simple, 8192);
   report_benchmark("bench_fastpath_stack_simple", bench_fastpath_stack_simple, 32768);
 
+  report_benchmark("bench_fastpath_stack_batch", bench_fastpath_stack_batch, 32);
+  report_benchmark("bench_fastpath_stack_batch", bench_fastpath_stack_batch, 8192);
+  report_benchmark("bench_fastpath_stack_batch", bench_fastpath_stack_batch, 32768);
+
   report_benchmark("bench_fastpath_rnd_dependent", bench_fastpath_rnd_dependent, 32);
   report_benchmark("bench_fastpath_rnd_dependent", bench_fastpath_rnd_dependent, 8192);
   report_benchmark("bench_fastpath_rnd_dependent", bench_fastpath_rnd_dependent, 32768);
 
   report_benchmark("bench_fastpath_rnd_dependent_8cores", bench_fastpath_rnd_dependent_8cores, 32768);
 
+  report_benchmark("bench_cross_thread_free", bench_cross_thread_free, 256);
+  report_benchmark("bench_cross_thread_free", bench_cross_thread_free, 65536);
+
+  report_benchmark("bench_sparse_heap_free", bench_sparse_heap_free, 0);
+  report_benchmark("bench_sparse_heap_free", bench_sparse_heap_free, 16);
+
+  for (int size : {8, 16, 32, 64}) {
+    report_benchmark("bench_tiny_central", bench_tiny_central, size);
+  }
+
+  for (int count : {16, 4096}) {
+    report_benchmark("bench_many_large_spans", bench_many_large_spans, count);
+  }
+
+  // Shows how much memory front-end caches hold as number of threads
+  // grows. Compare runs with and without TCMALLOC_PERCPU_CACHE=t.
+  for (int i = 1; i <= 64; i <<= 1) {
+    cached_bytes_threads_result = 0;
+    report_benchmark("bench_cached_bytes_threads", bench_cached_bytes_threads, i);
+    if (cached_bytes_threads_result != 0) {
+      printf("bench_cached_bytes_threads(%d)\t: %zu bytes cached\n",
+             i, cached_bytes_threads_result);
+    }
+  }
+
+  // Compares page faults taken when reusing released memory with
+  // MADV_DONTNEED (0) and MADV_FREE (1) release advice.
+  for (int advice = 0; advice <= 1; advice++) {
+    report_benchmark("bench_release_refault", bench_release_refault, advice);
+    if (release_refault_result >= 0) {
+      printf("bench_release_refault(%d)\t: %.1f page faults per iteration\n",
+             advice, release_refault_result);
+    }
+  }
+
+  // Compares copy volume of growing realloc without (0) and with
+  // mremap of buffers of at least 4 MiB.
+  for (int threshold : {0, 4}) {
+    report_benchmark("bench_realloc_growth", bench_realloc_growth, threshold);
+    if (realloc_growth_copied_result >= 0) {
+      printf("bench_realloc_growth(%d)\t: %.1f MiB copied per iteration\n",
+             threshold, realloc_growth_copied_result);
+    }
+  }
+
+  // Compares page faults of allocating and freeing big buffers
+  // without (0) and with 256 MiB large span cache. Difference is
+  // largest with TCMALLOC_AGGRESSIVE_DECOMMIT=t, where every free
+  // releases the buffer.
+  for (int limit : {0, 256}) {
+    report_benchmark("bench_large_churn", bench_large_churn, limit);
+    if (large_churn_faults_result >= 0) {
+      printf("bench_large_churn(%d)\t: %.1f page faults per iteration,"
+             " %.0f%% cache hits\n",
+             limit, large_churn_faults_result, large_churn_hits_result);
+    }
+  }
+
   return 0;
 }
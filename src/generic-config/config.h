@@ -46,6 +46,9 @@
 /* report large allocation */
 /* #undef ENABLE_LARGE_ALLOC_REPORT */
 
+/* enable per-cpu caches by default */
+/* #undef ENABLE_PERCPU_CACHE_BY_DEFAULT */
+
 /* Build sized deletion operators */
 /* #undef ENABLE_SIZED_DELETE */
 
@@ -189,6 +192,11 @@
 #define HAVE_SBRK 1
 #endif
 
+/* Define to 1 if you have the 'sched_getcpu' function. */
+#if __linux__
+#define HAVE_SCHED_GETCPU 1
+#endif
+
 /* Define to 1 if you have the <sched.h> header file. */
 #if defined __has_include
 #  if __has_include(<sched.h>)
@@ -204,6 +212,13 @@
 #  endif
 #endif
 
+/* Define to 1 if you have the <sys/rseq.h> header file. */
+#if defined __has_include
+#  if __has_include(<sys/rseq.h>)
+#    define HAVE_SYS_RSEQ_H 1
+#  endif
+#endif
+
 /* Define to 1 if you have the <sys/stat.h> header file. */
 #if defined __has_include
 #  if __has_include(<sys/stat.h>)
@@ -276,6 +291,9 @@
 /* Define 8 bytes of allocation alignment for tcmalloc */
 /* #undef TCMALLOC_ALIGN_8BYTES */
 
+/* Define number of pointer array slots of tcmalloc per-thread free lists */
+/* #undef TCMALLOC_FREELIST_SLOTS */
+
 /* Define internal page size for tcmalloc as number of left bitshift */
 /* #undef TCMALLOC_PAGE_SIZE_SHIFT */
 
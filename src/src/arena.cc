@@ -0,0 +1,113 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2026, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "arena.h"
+
+#include <algorithm>
+#include <new>
+
+#include "internal_logging.h"
+#include "page_heap.h"
+#include "static_vars.h"
+#include "thread_cache.h"
+
+namespace tcmalloc {
+
+Arena* Arena::Create() {
+  if (PREDICT_FALSE(!Static::IsInited())) ThreadCache::InitModule();
+  const Length n = kMinChunkPages;
+  Span* span = Static::pageheap()->NewArenaSpan(n);
+  if (span == nullptr) {
+    return nullptr;
+  }
+  const uintptr_t start = span->start << kPageShift;
+  Arena* arena = new (reinterpret_cast<void*>(start)) Arena;
+  span->next = nullptr;
+  arena->chunks_ = span;
+  arena->free_ = start + sizeof(Arena);
+  arena->limit_ = start + (n << kPageShift);
+  arena->next_chunk_pages_ = std::min(2 * n, kMaxChunkPages);
+  arena->reserved_pages_ = n;
+  arena->allocated_bytes_ = 0;
+  return arena;
+}
+
+Span* Arena::NewChunk(Length n) {
+  Span* span = Static::pageheap()->NewArenaSpan(n);
+  if (span == nullptr) {
+    return nullptr;
+  }
+  span->next = chunks_;
+  chunks_ = span;
+  reserved_pages_ += span->length;
+  return span;
+}
+
+void* Arena::AllocSlow(size_t size, size_t align) {
+  if (size + align < size) {
+    return nullptr;
+  }
+  // Spans are page aligned, so only larger alignments need padding.
+  const size_t padding = align > kPageSize ? align - kPageSize : 0;
+  const Length n = tcmalloc::pages(size + padding);
+  if (n == 0 || n > kMaxValidPages) {
+    return nullptr;
+  }
+
+  if (n > next_chunk_pages_ / 4) {
+    // Big objects get chunk of their own, so we keep bumping through
+    // current chunk.
+    Span* span = NewChunk(n);
+    if (span == nullptr) {
+      return nullptr;
+    }
+    const uintptr_t start = span->start << kPageShift;
+    allocated_bytes_ += size;
+    return reinterpret_cast<void*>((start + align - 1) & ~(uintptr_t{align} - 1));
+  }
+
+  Span* span = NewChunk(next_chunk_pages_);
+  if (span == nullptr) {
+    return nullptr;
+  }
+  next_chunk_pages_ = std::min(2 * next_chunk_pages_, kMaxChunkPages);
+  free_ = span->start << kPageShift;
+  limit_ = free_ + (span->length << kPageShift);
+  return Alloc(size, align);
+}
+
+void Arena::Destroy() {
+  // Arena is in one of the chunks, so grab the list first.
+  Static::pageheap()->DeleteArenaSpans(chunks_);
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,104 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2026, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TCMALLOC_ARENA_H_
+#define TCMALLOC_ARENA_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "span.h"
+
+// Arenas (see gperftools/arena.h) hand out memory by bumping a pointer
+// through chunks of pages taken from page heap, and give all chunks
+// back at once when destroyed. Chunk spans have "arena" bit set and
+// all of their pages are recorded in pagemap, so free() can tell
+// arena memory apart with the same span lookup it does for any
+// page-level allocation, and ignore it.
+//
+// Arena header itself lives at the start of its first chunk. Arenas
+// are not thread-safe.
+
+namespace tcmalloc {
+
+class Arena {
+ public:
+  // Returns new arena or nullptr if we're out of memory.
+  static Arena* Create();
+
+  // Returns size bytes aligned to align (a power of two) or nullptr
+  // if we're out of memory.
+  void* Alloc(size_t size, size_t align);
+
+  // Gives all arena memory (including arena itself) back to page heap.
+  void Destroy();
+
+  // Bytes handed out by Alloc so far.
+  size_t allocated_bytes() const { return allocated_bytes_; }
+  // Bytes of chunks taken from page heap.
+  size_t reserved_bytes() const { return reserved_pages_ << kPageShift; }
+
+ private:
+  static const Length kMinChunkPages =
+    (64 << 10) > kPageSize ? (64 << 10) >> kPageShift : 1;
+  static constexpr Length kMaxChunkPages = kMaxPages;
+
+  Arena() = default;
+
+  // Takes n pages from page heap and links them into our list.
+  Span* NewChunk(Length n);
+  void* AllocSlow(size_t size, size_t align);
+
+  uintptr_t free_;
+  uintptr_t limit_;
+  // All our chunks, linked through Span::next. Last one holds arena
+  // itself.
+  Span* chunks_;
+  Length next_chunk_pages_;
+  Length reserved_pages_;
+  size_t allocated_bytes_;
+};
+
+inline void* Arena::Alloc(size_t size, size_t align) {
+  ASSERT((align & (align - 1)) == 0);
+  const uintptr_t p = (free_ + align - 1) & ~(uintptr_t{align} - 1);
+  if (PREDICT_TRUE(p >= free_ && p <= limit_ && size <= limit_ - p)) {
+    free_ = p + size;
+    allocated_bytes_ += size;
+    return reinterpret_cast<void*>(p);
+  }
+  return AllocSlow(size, align);
+}
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_ARENA_H_
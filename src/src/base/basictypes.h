@@ -64,9 +64,11 @@
 #if defined(__GNUC__)
 #define PREDICT_TRUE(x) __builtin_expect(!!(x), 1)
 #define PREDICT_FALSE(x) __builtin_expect(!!(x), 0)
+#define PREFETCH(addr) __builtin_prefetch(addr)
 #else
 #define PREDICT_TRUE(x) (x)
 #define PREDICT_FALSE(x) (x)
+#define PREFETCH(addr) ((void)(addr))
 #endif
 
 // A macro to disallow the evil copy constructor and operator= functions
@@ -39,20 +39,34 @@
 #include "page_heap.h"         // for PageHeap
 #include "static_vars.h"       // for Static
 
-#if defined(__has_builtin)
-#if __has_builtin(__builtin_add_overflow)
-#define USE_ADD_OVERFLOW
-#endif
-#endif
-
 namespace tcmalloc {
 
-void CentralFreeList::Init(size_t cl) {
+bool CentralFreeList::bitmap_spans_;
+std::atomic<int64_t> CentralFreeList::unclaimed_bytes_;
+std::atomic<uint64_t> CentralFreeList::rebalanced_slots_;
+
+void CentralFreeList::Init(size_t cl, PageHeap* pageheap,
+                           CentralFreeList* siblings) {
   size_class_ = cl;
+  pageheap_ = pageheap;
+  siblings_ = siblings;
   tcmalloc::DLL_Init(&empty_);
-  tcmalloc::DLL_Init(&nonempty_);
+  for (int i = 0; i < kOccupancyBuckets; i++) {
+    tcmalloc::DLL_Init(&nonempty_[i]);
+  }
+  nonempty_mask_ = 0;
   num_spans_ = 0;
   counter_ = 0;
+  occupancy_mult_ = 0;
+  objs_per_span_ = 0;
+  bitmap_ = false;
+  first_object_ = 0;
+  bitmap_words_ = 0;
+  size_reciprocal_ = 0;
+  tc_insert_misses_ = 0;
+  tc_remove_misses_ = 0;
+  tc_prev_misses_ = 0;
+  tc_window_misses_ = 0;
 
   max_cache_size_ = kMaxNumTransferEntries;
 #ifdef TCMALLOC_SMALL_BUT_SLOW
@@ -76,7 +90,26 @@ void CentralFreeList::Init(size_t cl) {
     max_cache_size_ = std::min(max_cache_size_,
                                std::max(1, (1024 * 1024) / (bytes * objs_to_move)));
     cache_size_ = std::min(cache_size_, max_cache_size_);
+    slot_bytes_ = bytes * objs_to_move;
+
+    size_t objs_per_span =
+      (Static::sizemap()->class_to_pages(cl) << kPageShift) / bytes;
+    if (bitmap_spans_ && bytes <= kMaxBitmapObjectSize) {
+      // Space is reserved for bits of all slots, which is slightly
+      // more than needed, since bitmap's own slots don't need bits.
+      bitmap_ = true;
+      const size_t max_words = (objs_per_span + 63) / 64;
+      first_object_ = (max_words * sizeof(uint64_t) + bytes - 1) / bytes;
+      objs_per_span -= first_object_;
+      bitmap_words_ = (objs_per_span + 63) / 64;
+      size_reciprocal_ = ((uint64_t{1} << 32) / bytes) + 1;
+    }
+    // Both Span::refcount and Span::uncarved count objects in 16 bits.
+    ASSERT(objs_per_span <= 0xffff);
+    occupancy_mult_ = (kOccupancyBuckets << 16) / objs_per_span;
+    objs_per_span_ = objs_per_span;
   }
+  base_max_cache_size_ = max_cache_size_;
   used_slots_ = 0;
   ASSERT(cache_size_ <= max_cache_size_);
 }
@@ -84,6 +117,12 @@ void CentralFreeList::Init(size_t cl) {
 void CentralFreeList::ReleaseListToSpans(void* start) {
   while (start) {
     void *next = SLL_Next(start);
+    // Objects of the list are usually spread over many spans, so
+    // start looking up next one's span while we deal with this one.
+    if (next != nullptr) {
+      pageheap_->MaybePrefetchPageMap(
+        reinterpret_cast<uintptr_t>(next) >> kPageShift);
+    }
     ReleaseToSpans(start);
     start = next;
   }
@@ -91,18 +130,16 @@ void CentralFreeList::ReleaseListToSpans(void* start) {
 
 void CentralFreeList::ReleaseToSpans(void* object) {
   const PageID p = reinterpret_cast<uintptr_t>(object) >> kPageShift;
-  Span* span = Static::pageheap()->GetDescriptor(p);
+  Span* span = pageheap_->GetDescriptor(p);
   ASSERT(span != nullptr);
   ASSERT(span->refcount > 0);
 
-  // If span is empty, move it to non-empty list
-  if (span->objects == nullptr) {
-    tcmalloc::DLL_Remove(span);
-    tcmalloc::DLL_Prepend(&nonempty_, span);
-  }
+  // Span with no free objects is on empty_ list.
+  const bool was_empty = !HasFreeObjects(span);
+  const int old_bucket = was_empty ? -1 : OccupancyBucket(span);
 
   // The following check is expensive, so it is disabled by default
-  if (false) {
+  if (false && !bitmap_) {
     // Check that object does not occur in list
     int got = 0;
     for (void* p = span->objects; p != nullptr; p = *((void**) p)) {
@@ -110,26 +147,59 @@ void CentralFreeList::ReleaseToSpans(void* object) {
       got++;
     }
     (void)got;
-    ASSERT(got + span->refcount ==
-           (span->length<<kPageShift) /
-           Static::sizemap()->ByteSizeForClass(span->sizeclass));
+    ASSERT(got + span->refcount + span->uncarved == objs_per_span_);
   }
 
   counter_++;
   span->refcount--;
   if (span->refcount == 0) {
-    counter_ -= ((span->length<<kPageShift) /
-                 Static::sizemap()->ByteSizeForClass(span->sizeclass));
-    tcmalloc::DLL_Remove(span);
+    counter_ -= objs_per_span_;
+    if (was_empty) {
+      tcmalloc::DLL_Remove(span);
+    } else {
+      RemoveNonEmpty(span, old_bucket);
+    }
     --num_spans_;
 
     // Release central list lock while operating on pageheap
     lock_.Unlock();
-    Static::pageheap()->Delete(span);
+    pageheap_->Delete(span);
     lock_.Lock();
   } else {
-    *(reinterpret_cast<void**>(object)) = span->objects;
-    span->objects = object;
+    if (bitmap_) {
+      const uintptr_t offset =
+        reinterpret_cast<uintptr_t>(object) - (span->start << kPageShift);
+      const uint32_t idx =
+        ((uint64_t{offset} * size_reciprocal_) >> 32) - first_object_;
+      uint64_t* bitmap = reinterpret_cast<uint64_t*>(span->start << kPageShift);
+      ASSERT(idx < objs_per_span_);
+      ASSERT((bitmap[idx / 64] & (uint64_t{1} << (idx % 64))) == 0);
+      bitmap[idx / 64] |= uint64_t{1} << (idx % 64);
+    } else {
+      *(reinterpret_cast<void**>(object)) = span->objects;
+      span->objects = object;
+    }
+    if (was_empty) {
+      tcmalloc::DLL_Remove(span);
+      InsertNonEmpty(span);
+    } else if (OccupancyBucket(span) != old_bucket) {
+      RemoveNonEmpty(span, old_bucket);
+      InsertNonEmpty(span);
+    }
+  }
+}
+
+void CentralFreeList::InsertNonEmpty(Span* span) {
+  const int bucket = OccupancyBucket(span);
+  ASSERT(bucket < kOccupancyBuckets);
+  tcmalloc::DLL_Prepend(&nonempty_[bucket], span);
+  nonempty_mask_ |= 1u << bucket;
+}
+
+void CentralFreeList::RemoveNonEmpty(Span* span, int bucket) {
+  tcmalloc::DLL_Remove(span);
+  if (tcmalloc::DLL_IsEmpty(&nonempty_[bucket])) {
+    nonempty_mask_ &= ~(1u << bucket);
   }
 }
 
@@ -146,7 +216,7 @@ bool CentralFreeList::EvictRandomSizeClass(
   ASSERT(t >= 0);
   ASSERT(t < Static::num_size_classes());
   if (t == locked_size_class) return false;
-  return Static::central_cache()[t].ShrinkCache(locked_size_class, force);
+  return siblings_[t].ShrinkCache(locked_size_class, force);
 }
 
 bool CentralFreeList::MakeCacheSpace() {
@@ -154,6 +224,13 @@ bool CentralFreeList::MakeCacheSpace() {
   if (used_slots_ < cache_size_) return true;
   // Check if we can expand this cache?
   if (cache_size_ == max_cache_size_) return false;
+  // Capacity given up by rarely missing classes goes first. Only
+  // default heap's lists are rebalanced, so the pool is theirs.
+  if (siblings_ == Static::central_cache()
+      && TakeUnclaimedBytes(slot_bytes_)) {
+    cache_size_++;
+    return true;
+  }
   // Ok, we'll try to grab an entry from some other size class.
   if (EvictRandomSizeClass(size_class_, false) ||
       EvictRandomSizeClass(size_class_, true)) {
@@ -171,20 +248,23 @@ bool CentralFreeList::MakeCacheSpace() {
 }
 
 
-namespace {
-class LockInverter {
- private:
-  SpinLock *held_, *temp_;
- public:
-  inline explicit LockInverter(SpinLock* held, SpinLock *temp)
-    : held_(held), temp_(temp) { held_->Unlock(); temp_->Lock(); }
-  inline ~LockInverter() { temp_->Unlock(); held_->Lock();  }
-};
+void CentralFreeList::LockSpans() {
+  if (PREDICT_FALSE(!lock_.TryLock())) {
+    lock_.Lock();
+    lock_contentions_++;
+  }
+}
+
+void CentralFreeList::LockTransferCache() {
+  if (PREDICT_FALSE(!tc_lock_.TryLock())) {
+    tc_lock_.Lock();
+    tc_lock_contentions_++;
+  }
 }
 
-// This function is marked as NO_THREAD_SAFETY_ANALYSIS because it uses
-// LockInverter to release one lock and acquire another in scoped-lock
-// style, which our current annotation/analysis does not support.
+// This function is marked as NO_THREAD_SAFETY_ANALYSIS because it
+// releases and re-acquires lock of other size class, which our
+// current annotation/analysis does not support.
 bool CentralFreeList::ShrinkCache(int locked_size_class, bool force)
     NO_THREAD_SAFETY_ANALYSIS {
   // Start with a quick check without taking a lock.
@@ -192,56 +272,205 @@ bool CentralFreeList::ShrinkCache(int locked_size_class, bool force)
   // We don't evict from a full cache unless we are 'forcing'.
   if (force == false && used_slots_ == cache_size_) return false;
 
-  // Grab lock, but first release the other lock held by this thread.  We use
-  // the lock inverter to ensure that we never hold two size class locks
-  // concurrently.  That can create a deadlock because there is no well
-  // defined nesting order.
-  LockInverter li(&Static::central_cache()[locked_size_class].lock_, &lock_);
-  ASSERT(used_slots_ <= cache_size_);
-  ASSERT(0 <= cache_size_);
-  if (cache_size_ == 0) return false;
-  if (used_slots_ == cache_size_) {
-    if (force == false) return false;
-    // ReleaseListToSpans releases the lock, so we have to make all the
-    // updates to the central list before calling it.
-    cache_size_--;
-    used_slots_--;
-    ReleaseListToSpans(tc_slots_[used_slots_].head);
-    return true;
+  // Grab lock, but first release the other lock held by this thread.
+  // We never hold two size class locks concurrently.  That can create
+  // a deadlock because there is no well defined nesting order.
+  SpinLock* held = &siblings_[locked_size_class].tc_lock_;
+  held->Unlock();
+
+  bool result = ShrinkCacheUnlocked(force);
+
+  held->Lock();
+  return result;
+}
+
+bool CentralFreeList::ShrinkCacheUnlocked(bool force) {
+  bool result = false;
+  void* evicted = nullptr;
+  {
+    SpinLockHolder h(&tc_lock_);
+    ASSERT(used_slots_ <= cache_size_);
+    ASSERT(0 <= cache_size_);
+    if (cache_size_ > 0 && (force || used_slots_ < cache_size_)) {
+      if (used_slots_ == cache_size_) {
+        used_slots_--;
+        evicted = tc_slots_[used_slots_].head;
+      }
+      cache_size_--;
+      if (max_cache_size_ > base_max_cache_size_) {
+        max_cache_size_ = std::max(cache_size_, base_max_cache_size_);
+      }
+      result = true;
+    }
   }
-  cache_size_--;
-  return true;
+
+  if (evicted != nullptr) {
+    SpinLockHolder h(&lock_);
+    ReleaseListToSpans(evicted);
+  }
+  return result;
 }
 
-void CentralFreeList::InsertRange(void *start, void *end, int N) {
-  SpinLockHolder h(&lock_);
-  if (N == Static::sizemap()->num_objects_to_move(size_class_) &&
-    MakeCacheSpace()) {
-    int slot = used_slots_++;
-    ASSERT(slot >=0);
-    ASSERT(slot < max_cache_size_);
-    TCEntry *entry = &tc_slots_[slot];
-    entry->head = start;
-    entry->tail = end;
+int CentralFreeList::GrowCache(int n) {
+  SpinLockHolder h(&tc_lock_);
+  n = std::min(n, kMaxNumTransferEntries - cache_size_);
+  cache_size_ += n;
+  max_cache_size_ = std::max(max_cache_size_, cache_size_);
+  return n;
+}
+
+bool CentralFreeList::TakeUnclaimedBytes(int64_t bytes) {
+  int64_t n = unclaimed_bytes_.load(std::memory_order_relaxed);
+  while (n >= bytes) {
+    if (unclaimed_bytes_.compare_exchange_weak(n, n - bytes,
+                                               std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void CentralFreeList::RebalanceTransferCaches() {
+  if (kMaxNumTransferEntries == 0) {
+    return;
+  }
+  CentralFreeList* const caches = Static::central_cache();
+  const int num_classes = Static::num_size_classes();
+
+  uint64_t total_misses = 0;
+  for (int cl = 1; cl < num_classes; cl++) {
+    CentralFreeList* c = &caches[cl];
+    uint32_t misses;
+    {
+      SpinLockHolder h(&c->tc_lock_);
+      misses = c->tc_insert_misses_;
+    }
+    {
+      SpinLockHolder h(&c->lock_);
+      misses += c->tc_remove_misses_;
+    }
+    // Unsigned arithmetic takes care of wraparound.
+    c->tc_window_misses_ = misses - c->tc_prev_misses_;
+    c->tc_prev_misses_ = misses;
+    total_misses += c->tc_window_misses_;
+  }
+  if (total_misses == 0) {
     return;
   }
+  const uint64_t average = total_misses / (num_classes - 1);
+
+  // Capacity wanted by classes that missed more than average.
+  uint64_t high_misses = 0;
+  int64_t wanted = 0;
+  for (int cl = 1; cl < num_classes; cl++) {
+    CentralFreeList* c = &caches[cl];
+    if (c->tc_window_misses_ > average
+        && c->cache_size_ < kMaxNumTransferEntries) {
+      high_misses += c->tc_window_misses_;
+      wanted += int64_t{kMaxNumTransferEntries - c->cache_size_}
+        * c->slot_bytes_;
+    }
+  }
+  if (high_misses == 0) {
+    return;
+  }
+
+  // Classes that missed at most quarter of average give back 1/8th
+  // of their slots (but at least one), until we have what is
+  // wanted. Unused slots go first, but we evict cached batches back
+  // to spans if needed. If that turns out to be too much, they'll
+  // start missing and get their slots back.
+  for (int cl = 1; cl < num_classes; cl++) {
+    if (unclaimed_bytes_.load(std::memory_order_relaxed) >= wanted) {
+      break;
+    }
+    CentralFreeList* c = &caches[cl];
+    if (uint64_t{c->tc_window_misses_} * 4 > average) {
+      continue;
+    }
+    for (int take = std::max(1, c->cache_size_ / 8); take > 0; take--) {
+      if (!c->ShrinkCacheUnlocked(false) && !c->ShrinkCacheUnlocked(true)) {
+        break;
+      }
+      unclaimed_bytes_.fetch_add(c->slot_bytes_, std::memory_order_relaxed);
+    }
+  }
+
+  // Hand out unclaimed capacity to classes that missed more than
+  // average, in proportion to their misses. Each gets at least one
+  // slot, if there is enough capacity for it.
+  const int64_t pool = unclaimed_bytes_.load(std::memory_order_relaxed);
+  for (int cl = 1; cl < num_classes; cl++) {
+    CentralFreeList* c = &caches[cl];
+    if (c->tc_window_misses_ <= average) {
+      continue;
+    }
+    const int64_t share = pool * c->tc_window_misses_ / high_misses;
+    int slots = std::max<int64_t>(share / c->slot_bytes_, 1);
+    slots = std::min(slots, kMaxNumTransferEntries - c->cache_size_);
+    while (slots > 0
+           && !TakeUnclaimedBytes(int64_t{slots} * c->slot_bytes_)) {
+      slots--;
+    }
+    if (slots == 0) {
+      continue;
+    }
+    const int added = c->GrowCache(slots);
+    if (added < slots) {
+      unclaimed_bytes_.fetch_add(int64_t{slots - added} * c->slot_bytes_,
+                                 std::memory_order_relaxed);
+    }
+    rebalanced_slots_.fetch_add(added, std::memory_order_relaxed);
+  }
+}
+
+void CentralFreeList::InsertRange(void *start, void *end, int N) {
+  if (N == Static::sizemap()->num_objects_to_move(size_class_)) {
+    LockTransferCache();
+    if (MakeCacheSpace()) {
+      int slot = used_slots_++;
+      ASSERT(slot >=0);
+      ASSERT(slot < max_cache_size_);
+      TCEntry *entry = &tc_slots_[slot];
+      entry->head = start;
+      entry->tail = end;
+      tc_uses_++;
+      tc_lock_.Unlock();
+      return;
+    }
+    tc_insert_misses_++;
+    tc_lock_.Unlock();
+  }
+
+  LockSpans();
   ReleaseListToSpans(start);
+  lock_.Unlock();
 }
 
 int CentralFreeList::RemoveRange(void **start, void **end, int N) {
   ASSERT(N > 0);
-  lock_.Lock();
-  if (N == Static::sizemap()->num_objects_to_move(size_class_) &&
-      used_slots_ > 0) {
-    int slot = --used_slots_;
-    ASSERT(slot >= 0);
-    TCEntry *entry = &tc_slots_[slot];
-    *start = entry->head;
-    *end = entry->tail;
-    lock_.Unlock();
-    return N;
+  const bool full_batch =
+    (N == Static::sizemap()->num_objects_to_move(size_class_));
+  // Racy check of used_slots_ lets us skip transfer cache lock when
+  // the cache is (most likely) empty.
+  if (full_batch && used_slots_ > 0) {
+    LockTransferCache();
+    if (used_slots_ > 0) {
+      int slot = --used_slots_;
+      TCEntry *entry = &tc_slots_[slot];
+      *start = entry->head;
+      *end = entry->tail;
+      tc_uses_++;
+      tc_lock_.Unlock();
+      return N;
+    }
+    tc_lock_.Unlock();
   }
 
+  LockSpans();
+  if (full_batch) {
+    tc_remove_misses_++;
+  }
   int result = 0;
   *start = nullptr;
   *end = nullptr;
@@ -262,6 +491,68 @@ int CentralFreeList::RemoveRange(void **start, void **end, int N) {
   return result;
 }
 
+void CentralFreeList::InsertBatch(void** batch, int N) {
+  const int batch_size = Static::sizemap()->num_objects_to_move(size_class_);
+  while (N > 0) {
+    const int n = std::min(N, batch_size);
+    for (int i = 0; i < n - 1; i++) {
+      SLL_SetNext(batch[i], batch[i + 1]);
+    }
+    SLL_SetNext(batch[n - 1], nullptr);
+    InsertRange(batch[0], batch[n - 1], n);
+    batch += n;
+    N -= n;
+  }
+}
+
+int CentralFreeList::RemoveBatch(void** batch, int N) {
+  const int batch_size = Static::sizemap()->num_objects_to_move(size_class_);
+  int count = 0;
+  while (count < N) {
+    void *start, *end;
+    int n = RemoveRange(&start, &end, std::min(N - count, batch_size));
+    if (n == 0) {
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      batch[count++] = start;
+      start = SLL_Next(start);
+    }
+  }
+  return count;
+}
+
+int CentralFreeList::ReleaseIdleTransferCache() {
+  void* evicted = nullptr;
+  {
+    SpinLockHolder h(&tc_lock_);
+    const bool idle = (tc_uses_ == tc_uses_seen_);
+    tc_uses_seen_ = tc_uses_;
+    if (!idle || used_slots_ == 0) {
+      return 0;
+    }
+    evicted = tc_slots_[--used_slots_].head;
+  }
+
+  SpinLockHolder h(&lock_);
+  ReleaseListToSpans(evicted);
+  return Static::sizemap()->num_objects_to_move(size_class_);
+}
+
+void CentralFreeList::DrainTransferCache() {
+  for (;;) {
+    void* evicted;
+    {
+      SpinLockHolder h(&tc_lock_);
+      if (used_slots_ == 0) {
+        return;
+      }
+      evicted = tc_slots_[--used_slots_].head;
+    }
+    SpinLockHolder h(&lock_);
+    ReleaseListToSpans(evicted);
+  }
+}
 
 int CentralFreeList::FetchFromOneSpansSafe(int N, void **start, void **end) {
   int result = FetchFromOneSpans(N, start, end);
@@ -273,31 +564,101 @@ int CentralFreeList::FetchFromOneSpansSafe(int N, void **start, void **end) {
 }
 
 int CentralFreeList::FetchFromOneSpans(int N, void **start, void **end) {
-  if (tcmalloc::DLL_IsEmpty(&nonempty_)) return 0;
-  Span* span = nonempty_.next;
+  if (nonempty_mask_ == 0) return 0;
+  // Take objects from the fullest span.
+  int bucket = kOccupancyBuckets - 1;
+  while ((nonempty_mask_ & (1u << bucket)) == 0) {
+    bucket--;
+  }
+  Span* span = nonempty_[bucket].next;
 
-  ASSERT(span->objects != nullptr);
+  ASSERT(HasFreeObjects(span));
+
+  if (bitmap_) {
+    int result = FetchFromBitmap(span, N, start, end);
+    return FinishFetch(span, bucket, result, end);
+  }
 
+  // Objects that were freed back to the span go first.
   int result = 0;
-  void *prev, *curr;
-  curr = span->objects;
-  do {
+  void *prev = nullptr, *curr = span->objects;
+  while (result < N && curr != nullptr) {
     prev = curr;
-    curr = *(reinterpret_cast<void**>(curr));
-  } while (++result < N && curr != nullptr);
+    curr = SLL_Next(curr);
+    result++;
+  }
+  *start = span->objects;
+  span->objects = curr;
 
-  if (curr == nullptr) {
-    // Move to empty list
-    tcmalloc::DLL_Remove(span);
-    tcmalloc::DLL_Prepend(&empty_, span);
+  // Then we carve more from the never used tail of the span, so we
+  // only write to (and fault in) memory we're about to hand out.
+  if (result < N && span->uncarved > 0) {
+    const size_t size = Static::sizemap()->ByteSizeForClass(size_class_);
+    const int n = std::min<int>(N - result, span->uncarved);
+    uintptr_t ptr = (span->start << kPageShift)
+      + (objs_per_span_ - span->uncarved) * size;
+    for (int i = 0; i < n; i++, ptr += size) {
+      void* obj = reinterpret_cast<void*>(ptr);
+      if (prev != nullptr) {
+        SLL_SetNext(prev, obj);
+      } else {
+        *start = obj;
+      }
+      prev = obj;
+    }
+    span->uncarved -= n;
+    result += n;
   }
 
-  *start = span->objects;
   *end = prev;
-  span->objects = curr;
+  return FinishFetch(span, bucket, result, end);
+}
+
+int CentralFreeList::FinishFetch(Span* span, int bucket, int result,
+                                 void** end) {
   SLL_SetNext(*end, nullptr);
   span->refcount += result;
   counter_ -= result;
+
+  if (!HasFreeObjects(span)) {
+    // Move to empty list
+    RemoveNonEmpty(span, bucket);
+    tcmalloc::DLL_Prepend(&empty_, span);
+  } else if (OccupancyBucket(span) != bucket) {
+    RemoveNonEmpty(span, bucket);
+    InsertNonEmpty(span);
+  }
+  return result;
+}
+
+int CentralFreeList::FetchFromBitmap(Span* span, int N,
+                                     void **start, void **end) {
+  const size_t size = Static::sizemap()->ByteSizeForClass(size_class_);
+  uint64_t* bitmap = reinterpret_cast<uint64_t*>(span->start << kPageShift);
+  const uintptr_t base = (span->start << kPageShift) + first_object_ * size;
+
+  int result = 0;
+  void* prev = nullptr;
+  for (uint32_t w = 0; w < bitmap_words_ && result < N; w++) {
+    uint64_t bits = bitmap[w];
+    if (bits == 0) {
+      continue;
+    }
+    do {
+      const uint32_t idx = w * 64 + FindFirstSet(bits);
+      bits &= bits - 1;
+      void* obj = reinterpret_cast<void*>(base + idx * size);
+      if (prev != nullptr) {
+        SLL_SetNext(prev, obj);
+      } else {
+        *start = obj;
+      }
+      prev = obj;
+    } while (++result < N && bits != 0);
+    bitmap[w] = bits;
+  }
+  ASSERT(result > 0);
+  *end = prev;
   return result;
 }
 
@@ -307,7 +668,7 @@ void CentralFreeList::Populate() {
   lock_.Unlock();
   const size_t npages = Static::sizemap()->class_to_pages(size_class_);
 
-  Span* span = Static::pageheap()->NewWithSizeClass(npages, size_class_);
+  Span* span = pageheap_->NewWithSizeClass(npages, size_class_);
   if (span == nullptr) {
     Log(kLog, __FILE__, __LINE__,
         "tcmalloc: allocation failed", npages << kPageShift);
@@ -319,64 +680,58 @@ void CentralFreeList::Populate() {
   // (Instead of being eager, we could just replace any stale info
   // about this span, but that seems to be no better in practice.)
   for (int i = 0; i < npages; i++) {
-    Static::pageheap()->SetCachedSizeClass(span->start + i, size_class_);
+    pageheap_->SetCachedSizeClass(span->start + i, size_class_);
   }
 
-  // Split the block into pieces and add to the free-list
+  // We don't split the block into pieces here. Instead all objects
+  // are left uncarved and FetchFromOneSpans threads them a batch at
+  // a time. So that we don't touch every page of fresh span (and
+  // fault them all in) when only a batch of objects is needed.
   // TODO: coloring of objects to avoid cache conflicts?
-  void** tail = &span->objects;
-  char* ptr = reinterpret_cast<char*>(span->start << kPageShift);
-  char* limit = ptr + (npages << kPageShift);
-  const size_t size = Static::sizemap()->ByteSizeForClass(size_class_);
-  int num = 0;
-
-  // Note, when ptr is close to the top of address space, ptr + size
-  // might overflow the top of address space before we're able to
-  // detect that it exceeded limit. So we need to be careful. See
-  // https://github.com/gperftools/gperftools/issues/1323.
-  ASSERT(limit - size >= ptr);
-  for (;;) {
-
-#ifndef USE_ADD_OVERFLOW
-    auto nextptr = reinterpret_cast<char *>(reinterpret_cast<uintptr_t>(ptr) + size);
-    if (nextptr < ptr || nextptr > limit) {
-      break;
-    }
-#else
-    // Same as above, just helping compiler a bit to produce better code
-    uintptr_t nextaddr;
-    if (__builtin_add_overflow(reinterpret_cast<uintptr_t>(ptr), size, &nextaddr)) {
-      break;
-    }
-    char* nextptr = reinterpret_cast<char*>(nextaddr);
-    if (nextptr > limit) {
-      break;
+  const int num = objs_per_span_;
+  ASSERT(num > 0);
+  ASSERT(num * Static::sizemap()->ByteSizeForClass(size_class_)
+         <= (npages << kPageShift));
+  span->objects = nullptr;
+  span->refcount = 0; // No sub-object in use yet
+  if (bitmap_) {
+    // All objects are free. Only bitmap itself is written.
+    uint64_t* bitmap = reinterpret_cast<uint64_t*>(span->start << kPageShift);
+    for (uint32_t w = 0; w < bitmap_words_; w++) {
+      const int bits = std::min<int>(num - w * 64, 64);
+      bitmap[w] = (bits == 64) ? ~uint64_t{0} : (uint64_t{1} << bits) - 1;
     }
-#endif
-
-    // [ptr, ptr+size) bytes are all valid bytes, so append them
-    *tail = ptr;
-    tail = reinterpret_cast<void**>(ptr);
-    num++;
-    ptr = nextptr;
+    span->uncarved = 0;
+  } else {
+    span->uncarved = num;
   }
-  ASSERT(ptr <= limit);
-  ASSERT(ptr > limit - size); // same as ptr + size > limit but avoiding overflow
-  *tail = nullptr;
-  span->refcount = 0; // No sub-object in use yet
 
   // Add span to list of non-empty spans
   lock_.Lock();
-  tcmalloc::DLL_Prepend(&nonempty_, span);
+  InsertNonEmpty(span);
   ++num_spans_;
   counter_ += num;
 }
 
 int CentralFreeList::tc_length() {
-  SpinLockHolder h(&lock_);
+  SpinLockHolder h(&tc_lock_);
   return used_slots_ * Static::sizemap()->num_objects_to_move(size_class_);
 }
 
+void CentralFreeList::GetSpanOccupancy(int64_t histogram[kOccupancyBuckets + 1]) {
+  SpinLockHolder h(&lock_);
+  for (int i = 0; i < kOccupancyBuckets; i++) {
+    histogram[i] = 0;
+    for (Span* s = nonempty_[i].next; s != &nonempty_[i]; s = s->next) {
+      histogram[i]++;
+    }
+  }
+  histogram[kOccupancyBuckets] = 0;
+  for (Span* s = empty_.next; s != &empty_; s = s->next) {
+    histogram[kOccupancyBuckets]++;
+  }
+}
+
 size_t CentralFreeList::OverheadBytes() {
   SpinLockHolder h(&lock_);
   if (size_class_ == 0) {  // 0 holds the 0-sized allocations
@@ -385,7 +740,9 @@ size_t CentralFreeList::OverheadBytes() {
   const size_t pages_per_span = Static::sizemap()->class_to_pages(size_class_);
   const size_t object_size = Static::sizemap()->class_to_size(size_class_);
   ASSERT(object_size > 0);
-  const size_t overhead_per_span = (pages_per_span * kPageSize) % object_size;
+  // This includes space taken by bitmap of bitmap spans.
+  const size_t overhead_per_span =
+    pages_per_span * kPageSize - objs_per_span_ * object_size;
   return num_spans_ * overhead_per_span;
 }
 
@@ -37,6 +37,7 @@
 #include "config.h"
 #include <stddef.h>
 #include <stdint.h>
+#include <atomic>
 #include "base/spinlock.h"
 #include "base/thread_annotations.h"
 #include "common.h"
@@ -44,12 +45,36 @@
 
 namespace tcmalloc {
 
+class PageHeap;
+
 // Data kept per size-class in central cache.
 class CACHELINE_ALIGNED CentralFreeList {
  public:
+  // Spans that have free objects are kept in this many lists by the
+  // share of their objects in use, and we allocate from the fullest
+  // spans first. This gives mostly free spans a chance to drain
+  // completely and go back to page heap.
+  static const int kOccupancyBuckets = 8;
+
+  // Objects of at most this size may be tracked by span bitmaps
+  // (see SetBitmapSpans).
+  static const size_t kMaxBitmapObjectSize = 64;
+
   constexpr CentralFreeList() {}
 
-  void Init(size_t cl);
+  // Makes central free lists of classes up to kMaxBitmapObjectSize
+  // that are initialized afterwards keep track of free objects of
+  // their spans in a bitmap at the start of each span, instead of
+  // linking free objects together. Then returning objects to spans
+  // only writes the bitmap, and handing them out walks set bits
+  // rather than chasing pointers through cold objects. Costs a few
+  // objects worth of bitmap per span.
+  static void SetBitmapSpans(bool enabled) { bitmap_spans_ = enabled; }
+
+  // Sets up list of size class cl that takes spans from the given
+  // page heap. siblings is the array of all size classes' lists of
+  // that page heap, which share transfer cache capacity.
+  void Init(size_t cl, PageHeap* pageheap, CentralFreeList* siblings);
 
   // These methods all do internal locking.
 
@@ -60,6 +85,37 @@ class CACHELINE_ALIGNED CentralFreeList {
   // Returns the actual number of fetched elements and sets *start and *end.
   int RemoveRange(void **start, void **end, int N);
 
+  // Same as InsertRange/RemoveRange, but objects are passed in an
+  // array rather than linked list. Large batches are split into
+  // num_objects_to_move chunks, so that transfer cache is used.
+  // RemoveBatch returns number of objects stored, which is less than
+  // N only when we're out of memory.
+  void InsertBatch(void** batch, int N);
+  int RemoveBatch(void** batch, int N);
+
+  // If transfer cache wasn't used since previous call, moves one of
+  // its entries back to spans, so that fully free spans can go back
+  // to page heap. Returns number of objects moved. Called
+  // periodically by background actions.
+  int ReleaseIdleTransferCache();
+
+  // Moves all objects of transfer cache back to spans. Used to give
+  // free memory of heap partitions back to their page heaps.
+  void DrainTransferCache();
+
+  // Moves transfer cache capacity from size classes that rarely miss
+  // in their transfer caches to those that miss often, i.e. keep
+  // going to spans with full batches. Capacity is accounted in bytes,
+  // so busy classes may grow above the limit set by Init, as long as
+  // others give up as much. Called periodically by background
+  // actions, from single thread.
+  static void RebalanceTransferCaches();
+
+  // Total number of slots moved by RebalanceTransferCaches.
+  static uint64_t rebalanced_slots() {
+    return rebalanced_slots_.load(std::memory_order_relaxed);
+  }
+
   // Returns the number of free objects in cache.
   int length() {
     SpinLockHolder h(&lock_);
@@ -69,20 +125,45 @@ class CACHELINE_ALIGNED CentralFreeList {
   // Returns the number of free objects in the transfer cache.
   int tc_length();
 
+  // Current and maximal number of transfer cache slots, each holding
+  // one batch of num_objects_to_move objects. Read without locking.
+  int tc_slots() const { return cache_size_; }
+  int tc_max_slots() const { return max_cache_size_; }
+
+  // Returns how many times InsertRange/RemoveRange found span lock
+  // (respectively, transfer cache lock) held by someone else.
+  uint64_t lock_contentions() {
+    SpinLockHolder h(&lock_);
+    return lock_contentions_;
+  }
+  uint64_t tc_lock_contentions() {
+    SpinLockHolder h(&tc_lock_);
+    return tc_lock_contentions_;
+  }
+
+  // Fills histogram of spans by share of their objects in use:
+  // histogram[i] for i < kOccupancyBuckets is number of spans with at
+  // least i/kOccupancyBuckets (and less than (i+1)/kOccupancyBuckets)
+  // of objects in use. histogram[kOccupancyBuckets] is number of spans
+  // with all objects in use.
+  void GetSpanOccupancy(int64_t histogram[kOccupancyBuckets + 1]);
+
   // Returns the memory overhead (internal fragmentation) attributable
   // to the freelist.  This is memory lost when the size of elements
   // in a freelist doesn't exactly divide the page-size (an 8192-byte
   // page full of 5-byte objects would have 2 bytes memory overhead).
   size_t OverheadBytes();
 
-  // Lock/Unlock the internal SpinLock. Used on the pthread_atfork call
-  // to set the lock in a consistent state before the fork.
-  void Lock() EXCLUSIVE_LOCK_FUNCTION(lock_) {
+  // Lock/Unlock the internal SpinLocks. Used on the pthread_atfork call
+  // to set the locks in a consistent state before the fork.
+  void Lock() EXCLUSIVE_LOCK_FUNCTION(tc_lock_, lock_) {
+    tc_lock_.Lock();
     lock_.Lock();
   }
 
-  void Unlock() UNLOCK_FUNCTION(lock_) {
+  void Unlock() UNLOCK_FUNCTION(tc_lock_, lock_) {
     lock_.Unlock();
+    tc_lock_.Unlock();
   }
 
  private:
@@ -128,44 +209,152 @@ class CACHELINE_ALIGNED CentralFreeList {
   // May temporarily release lock_.
   void ReleaseToSpans(void* object) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
+  // Whether span has any free objects, carved or not (or, for
+  // bitmap spans, any bit set).
+  bool HasFreeObjects(const Span* span) const {
+    return span->refcount < objs_per_span_;
+  }
+
+  // REQUIRES: lock_ is held
+  // Terminates list of result objects fetched from span, which was
+  // in given bucket, at *end, and updates span's accounting and
+  // occupancy bucket. Returns result.
+  int FinishFetch(Span* span, int bucket, int result, void** end)
+    EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // REQUIRES: lock_ is held
+  // Takes up to N free objects of bitmap span and links them from
+  // *start to *end (not terminated). Returns number of objects taken.
+  int FetchFromBitmap(Span* span, int N, void **start, void **end)
+    EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Occupancy bucket of span with free objects. Avoids division, see
+  // occupancy_mult_.
+  int OccupancyBucket(const Span* span) const {
+    return (span->refcount * occupancy_mult_) >> 16;
+  }
+
+  // REQUIRES: lock_ is held
+  // Add span with free objects to the list of its occupancy bucket,
+  // or remove it from the list of given bucket.
+  void InsertNonEmpty(Span* span) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void RemoveNonEmpty(Span* span, int bucket) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
   // REQUIRES: lock_ is held
   // Populate cache by fetching from the page heap.
   // May temporarily release lock_.
   void Populate() EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
-  // REQUIRES: lock is held.
+  // Acquire lock_ or tc_lock_ respectively, counting contended
+  // acquisitions.
+  void LockSpans() EXCLUSIVE_LOCK_FUNCTION(lock_);
+  void LockTransferCache() EXCLUSIVE_LOCK_FUNCTION(tc_lock_);
+
+  // REQUIRES: tc_lock_ is held.
   // Tries to make room for a TCEntry.  If the cache is full it will try to
   // expand it at the cost of some other cache size.  Return false if there is
   // no space.
-  bool MakeCacheSpace() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // May temporarily release tc_lock_.
+  bool MakeCacheSpace() EXCLUSIVE_LOCKS_REQUIRED(tc_lock_);
 
-  // REQUIRES: lock_ for locked_size_class is held.
+  // REQUIRES: tc_lock_ for locked_size_class is held.
   // Picks a "random" size class to steal TCEntry slot from.  In reality it
   // just iterates over the sizeclasses but does so without taking a lock.
   // Returns true on success.
   // May temporarily lock a "random" size class.
-  static bool EvictRandomSizeClass(int locked_size_class, bool force);
+  bool EvictRandomSizeClass(int locked_size_class, bool force);
 
-  // REQUIRES: lock_ is *not* held.
+  // REQUIRES: tc_lock_ and lock_ are *not* held.
   // Tries to shrink the Cache.  If force is true it will relase objects to
   // spans if it allows it to shrink the cache.  Return false if it failed to
   // shrink the cache.  Decrements cache_size_ on succeess.
-  // May temporarily take lock_.  If it takes lock_, the locked_size_class
-  // lock is released to keep the thread from holding two size class locks
-  // concurrently which could lead to a deadlock.
-  bool ShrinkCache(int locked_size_class, bool force) LOCKS_EXCLUDED(lock_);
+  // Temporarily releases tc_lock_ of locked_size_class, so that the
+  // thread never holds two size class locks concurrently which could
+  // lead to a deadlock.
+  bool ShrinkCache(int locked_size_class, bool force) LOCKS_EXCLUDED(tc_lock_);
+
+  // REQUIRES: no size class locks are held.
+  // Same as ShrinkCache, but for the case when we don't hold any
+  // other size class's lock.
+  bool ShrinkCacheUnlocked(bool force) LOCKS_EXCLUDED(tc_lock_);
+
+  // Adds up to n slots to the cache, raising max_cache_size_ as
+  // needed, but not above kMaxNumTransferEntries. Returns number of
+  // slots added.
+  int GrowCache(int n) LOCKS_EXCLUDED(tc_lock_);
+
+  // Takes given number of bytes of transfer cache capacity given up
+  // by RebalanceTransferCaches. Returns false if there isn't as much.
+  static bool TakeUnclaimedBytes(int64_t bytes);
 
-  // This lock protects all the data members.  cached_entries and cache_size_
-  // may be looked at without holding the lock.
+  // This lock protects span lists and counter_. It is only taken when
+  // objects have to be moved to or from spans.
   SpinLock lock_;
 
-  // We keep linked lists of empty and non-empty spans.
+  // This lock protects transfer cache: tc_slots_, used_slots_ and
+  // cache_size_. Latter two may be looked at without holding the
+  // lock. We never hold both locks at the same time (except when
+  // forking), so that swapping a batch with transfer cache isn't
+  // blocked by someone walking spans.
+  SpinLock tc_lock_;
+
+  uint64_t lock_contentions_{};
+  uint64_t tc_lock_contentions_{};
+
+  // Number of transfer cache hits, and its value as of previous
+  // ReleaseIdleTransferCache call. Protected by tc_lock_.
+  uint32_t tc_uses_{};
+  uint32_t tc_uses_seen_{};
+
+  // Number of full batches that didn't fit into transfer cache
+  // (protected by tc_lock_), and number of full batches that had to
+  // be fetched from spans (protected by lock_).
+  uint32_t tc_insert_misses_{};
+  uint32_t tc_remove_misses_{};
+
+  // Sum of the above as of previous RebalanceTransferCaches call, and
+  // difference since then. Only used by RebalanceTransferCaches.
+  uint32_t tc_prev_misses_{};
+  uint32_t tc_window_misses_{};
+
+  // We keep linked lists of empty and non-empty spans. Non-empty
+  // ones are bucketed by occupancy, and bit i of nonempty_mask_ is
+  // set iff nonempty_[i] is not empty.
   size_t   size_class_{};   // My size class
+  PageHeap* pageheap_{};    // Where spans come from
+  CentralFreeList* siblings_{};  // Lists of all classes of pageheap_
   Span     empty_;          // Dummy header for list of empty spans
-  Span     nonempty_;       // Dummy header for list of non-empty spans
+  Span     nonempty_[kOccupancyBuckets];  // Dummy headers for lists of
+                                          // non-empty spans
+  uint32_t nonempty_mask_{};
   size_t   num_spans_{};    // Number of spans in empty_ plus nonempty_
   size_t   counter_{};      // Number of free objects in cache entry
 
+  // (kOccupancyBuckets << 16) / objects per span, rounded down. So
+  // that bucket of span with refcount < objects per span is always
+  // below kOccupancyBuckets.
+  uint32_t occupancy_mult_{};
+
+  uint32_t objs_per_span_{};
+
+  // Bitmap span format, see SetBitmapSpans. First first_object_
+  // object slots of each span are taken by bitmap_words_ 64-bit words
+  // of bitmap, with bit i set iff object i (counting after those
+  // slots) is free. size_reciprocal_ is 2^32 / object size rounded
+  // up, so that we compute object index without division.
+  bool     bitmap_{};
+  uint32_t first_object_{};
+  uint32_t bitmap_words_{};
+  uint32_t size_reciprocal_{};
+
+  static bool bitmap_spans_;
+
+  // Bytes of transfer cache capacity taken from size classes by
+  // RebalanceTransferCaches that weren't handed to other classes
+  // yet. MakeCacheSpace takes from here before evicting.
+  static std::atomic<int64_t> unclaimed_bytes_;
+  static std::atomic<uint64_t> rebalanced_slots_;
+
   // Here we reserve space for TCEntry cache slots.  Space is preallocated
   // for the largest possible number of entries than any one size class may
   // accumulate.  Not all size classes are allowed to accumulate
@@ -182,6 +371,12 @@ class CACHELINE_ALIGNED CentralFreeList {
   int32_t cache_size_{};
   // Maximum size of the cache for a given size class.
   int32_t max_cache_size_{};
+  // Maximum size as set by Init. RebalanceTransferCaches may raise
+  // max_cache_size_ above it for busy classes, and it goes back down
+  // as they lose slots.
+  int32_t base_max_cache_size_{};
+  // Bytes of objects held by one slot.
+  int32_t slot_bytes_{};
 };
 
 }  // namespace tcmalloc
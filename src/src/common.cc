@@ -66,22 +66,6 @@ static inline void InitTCMallocTransferNumObjects()
   }
 }
 
-// Note: the following only works for "n"s that fit in 32-bits, but
-// that is fine since we only use it for small sizes.
-static inline int LgFloor(size_t n) {
-  int log = 0;
-  for (int i = 4; i >= 0; --i) {
-    int shift = (1 << i);
-    size_t x = n >> shift;
-    if (x != 0) {
-      n = x;
-      log += shift;
-    }
-  }
-  ASSERT(n == 1);
-  return log;
-}
-
 static int AlignmentForSize(size_t size) {
   int alignment = kAlignment;
   if (size > kMaxSize) {
@@ -207,6 +191,7 @@ void SizeMap::Init() {
     sc++;
   }
   num_size_classes = sc;
+  num_base_size_classes = sc;
   if (sc > kClassSizesMax) {
     Log(kCrash, __FILE__, __LINE__,
         "too many size classes: (found vs. max)", sc, kClassSizesMax);
@@ -266,6 +251,23 @@ void SizeMap::Init() {
   }
 }
 
+bool SizeMap::ReplicateForNumaPartitions(int partitions) {
+  ASSERT(num_size_classes == num_base_size_classes);
+  const size_t stride = num_base_size_classes - 1;
+  if (1 + stride * partitions > kClassSizesMax) {
+    return false;
+  }
+  for (int p = 1; p < partitions; p++) {
+    for (size_t cl = 1; cl < num_base_size_classes; cl++) {
+      class_to_size_[cl + p * stride] = class_to_size_[cl];
+      class_to_pages_[cl + p * stride] = class_to_pages_[cl];
+      num_objects_to_move_[cl + p * stride] = num_objects_to_move_[cl];
+    }
+  }
+  num_size_classes = 1 + stride * partitions;
+  return true;
+}
+
 // Metadata allocator -- keeps stats about how many bytes allocated.
 static uint64_t metadata_system_bytes_ = 0;
 static const size_t kMetadataAllocChunkSize = 8*1024*1024;
@@ -319,6 +321,36 @@ void* MetaDataAlloc(size_t bytes) {
   return rv;
 }
 
+static char *metadata_huge_alloc_;
+static size_t metadata_huge_avail_;
+
+void* MetaDataAllocHugePages(size_t bytes) {
+  SpinLockHolder h(&metadata_alloc_lock);
+
+  bytes = (bytes + kMetadataAllignment - 1) & ~(kMetadataAllignment - 1);
+  if (metadata_huge_avail_ < bytes) {
+    const size_t chunk = std::max(
+      kMetadataAllocChunkSize, (bytes + kHugePageSize - 1) & ~(kHugePageSize - 1));
+    size_t real_size;
+    void *ptr = TCMalloc_SystemAlloc(chunk, &real_size, kHugePageSize);
+    if (ptr == nullptr) {
+      return nullptr;
+    }
+    TCMalloc_SystemHintHugePages(ptr, real_size);
+
+    // Rest of previous region is simply left unused. It is never
+    // touched, so it only costs address space.
+    metadata_huge_alloc_ = static_cast<char *>(ptr);
+    metadata_huge_avail_ = real_size;
+  }
+
+  void *rv = static_cast<void *>(metadata_huge_alloc_);
+  metadata_huge_alloc_ += bytes;
+  metadata_huge_avail_ -= bytes;
+  metadata_system_bytes_ += bytes;
+  return rv;
+}
+
 uint64_t metadata_system_bytes() { return metadata_system_bytes_; }
 
 }  // namespace tcmalloc
@@ -39,6 +39,9 @@
 #include "config.h"
 #include <stddef.h>                     // for size_t
 #include <stdint.h>                     // for uintptr_t, uint64_t
+#if defined(_MSC_VER)
+#include <intrin.h>                     // for _BitScanForward64, etc
+#endif
 #include "internal_logging.h"  // for ASSERT, etc
 #include "base/basictypes.h"   // for LIKELY, etc
 
@@ -76,7 +79,23 @@ static const size_t kPageShift  = TCMALLOC_PAGE_SIZE_SHIFT;
 static const size_t kPageShift  = 13;
 #endif
 
+// Number of partitions heap can be split into by NUMA node
+// (TCMALLOC_NUMA_AWARE); see numa_topology.h. Partitions are
+// compiled out unless
+// TCMALLOC_NUMA_PARTITIONS (up to 4, since Span::numa_partition is
+// two bits) is set at build time, because they double size of every
+// per size class array. Every partition gets its own copy of size
+// classes, and all copies together have to fit into kClassSizesMax
+// (and into 8 bits of Span::sizeclass). So with default 8 KiB pages
+// at most 3 partitions can be used, and fewer with larger pages.
+#if defined(TCMALLOC_NUMA_PARTITIONS) && TCMALLOC_NUMA_PARTITIONS > 1 \
+  && !defined(TCMALLOC_SMALL_BUT_SLOW) && defined(__linux__)
+static const int kNumaPartitions = TCMALLOC_NUMA_PARTITIONS;
+static const size_t kClassSizesMax = 256;
+#else
+static const int kNumaPartitions = 1;
 static const size_t kClassSizesMax = 128;
+#endif
 
 static const size_t kMaxThreadCacheSize = 4 << 20;
 
@@ -86,6 +105,13 @@ static const size_t kAlignment  = 8;
 // For all span-lengths <= kMaxPages we keep an exact-size list in PageHeap.
 static const size_t kMaxPages = 1 << (20 - kPageShift);
 
+// Size of transparent huge pages (as on x86-64, and on arm64 with 4K
+// base pages). Hugepage-aware page heap (see TCMALLOC_HUGEPAGE_AWARE)
+// tries to keep memory backed by those intact.
+static const size_t kHugePageShift = 21;
+static const size_t kHugePageSize = 1 << kHugePageShift;
+static const size_t kPagesPerHugePage = kHugePageSize >> kPageShift;
+
 // Default bound on the total amount of thread caches.
 #ifdef TCMALLOC_SMALL_BUT_SLOW
 // Make the overall thread cache no bigger than that of a single thread
@@ -114,6 +140,19 @@ static const int kMaxOverages = 3;
 // scavenging code will shrink it down when its contents are not in use.
 static const int kMaxDynamicFreeListLength = 8192;
 
+// Number of most recently freed objects each per-thread free list
+// keeps in a pointer array before spilling to the linked list that
+// is threaded through the objects themselves. Popping from the array
+// doesn't need to read the object, which saves malloc fast path a
+// dependent cache miss, at the price of kFreeListSlots pointers of
+// thread cache size per size class. 0 (default) keeps free lists
+// purely intrusive. Set by --with-tcmalloc-freelist-slots.
+#if defined(TCMALLOC_FREELIST_SLOTS)
+static const int kFreeListSlots = TCMALLOC_FREELIST_SLOTS;
+#else
+static const int kFreeListSlots = 0;
+#endif
+
 static const Length kMaxValidPages = (~static_cast<Length>(0)) >> kPageShift;
 
 #if (__aarch64__ || __x86_64__ || _M_AMD64 || _M_ARM64) && !__sun__
@@ -149,6 +188,44 @@ inline Length pages(size_t bytes) {
       ((bytes & (kPageSize - 1)) > 0 ? 1 : 0);
 }
 
+// Returns index of the lowest set bit of non-zero v.
+inline int FindFirstSet(uint64_t v) {
+  ASSERT(v != 0);
+#if defined(__GNUC__)
+  return __builtin_ctzll(v);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+  unsigned long rv;
+  _BitScanForward64(&rv, v);
+  return rv;
+#else
+  int rv = 0;
+  while ((v & 1) == 0) {
+    v >>= 1;
+    rv++;
+  }
+  return rv;
+#endif
+}
+
+// Returns index of the highest set bit of non-zero v, i.e. floor of
+// its base 2 logarithm.
+inline int LgFloor(uint64_t v) {
+  ASSERT(v != 0);
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll(v);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+  unsigned long rv;
+  _BitScanReverse64(&rv, v);
+  return rv;
+#else
+  int rv = 0;
+  while (v >>= 1) {
+    rv++;
+  }
+  return rv;
+#endif
+}
+
 // Size-class information + mapping
 class SizeMap {
  private:
@@ -234,6 +311,11 @@ class SizeMap {
 public:
   size_t num_size_classes;
 
+  // Number of size classes of a single NUMA partition (including
+  // class 0). Equals num_size_classes unless NUMA partitioning is
+  // active.
+  size_t num_base_size_classes;
+
   // Constructor should do nothing since we rely on explicit Init()
   // call, which may or may not be called before the constructor runs.
   SizeMap() { }
@@ -241,6 +323,12 @@ public:
   // Initialize the mapping arrays
   void Init();
 
+  // Makes "partitions" copies of every size class except class 0.
+  // Class cl of partition p is cl + p * (num_base_size_classes - 1).
+  // GetSizeClass and friends keep returning classes of partition
+  // 0. Returns false if we don't have room for that many classes.
+  bool ReplicateForNumaPartitions(int partitions);
+
   inline int SizeClass(size_t size) {
     return class_array_[ClassIndex(size)];
   }
@@ -293,6 +381,11 @@ public:
 // allocation fails.  Requires pageheap_lock is held.
 void* MetaDataAlloc(size_t bytes);
 
+// Like MetaDataAlloc, but carves memory out of hugepage aligned
+// regions which are hinted to be backed by hugepages. Used for page
+// map, which every free() may look at in random places.
+void* MetaDataAllocHugePages(size_t bytes);
+
 // Returns the total number of bytes allocated from the system.
 // Requires pageheap_lock is held.
 uint64_t metadata_system_bytes();
@@ -0,0 +1,558 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2026, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "cpu_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <new>
+
+#include "base/commandlineflags.h"
+#include "central_freelist.h"
+#include "getenv_safe.h"
+
+namespace tcmalloc {
+
+static const size_t kDefaultPerCpuCacheSize = 1 << 20;
+static const size_t kMinPerCpuCacheSize = 64 << 10;
+
+bool CpuCache::active_;
+bool CpuCache::use_rseq_;
+int CpuCache::num_cpus_;
+size_t CpuCache::max_per_cpu_size_ = kDefaultPerCpuCacheSize;
+char* CpuCache::slabs_;
+size_t CpuCache::stride_;
+uint32_t CpuCache::begin_[kClassSizesMax];
+uint32_t CpuCache::max_capacity_[kClassSizesMax];
+
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+// Kernel headers we're built against may predate these.
+static const int kMembarrierPrivateExpeditedRseq = 1 << 7;
+static const int kMembarrierRegisterPrivateExpeditedRseq = 1 << 8;
+static const int kMembarrierFlagCpu = 1 << 0;
+#endif
+
+// Returns number of possible cpus (i.e. max cpu id plus one), or 0 if
+// we cannot tell. We cannot use sysconf here, since glibc's
+// implementation allocates memory and we're called from inside
+// malloc initialization.
+static int CountPossibleCpus() {
+#if defined(HAVE_SCHED_GETCPU) && defined(__linux__)
+  int fd;
+  do {
+    fd = open("/sys/devices/system/cpu/possible", O_RDONLY | O_CLOEXEC);
+  } while (fd < 0 && errno == EINTR);
+  if (fd < 0) {
+    return 0;
+  }
+
+  char buf[256];
+  ssize_t len;
+  do {
+    len = read(fd, buf, sizeof(buf) - 1);
+  } while (len < 0 && errno == EINTR);
+  close(fd);
+  if (len <= 0) {
+    return 0;
+  }
+  buf[len] = 0;
+
+  // The format is list of ranges like "0-3,8-11\n". We only need the
+  // largest cpu id, which is the last number in the list.
+  int max_id = -1;
+  int current = -1;
+  for (const char* p = buf; *p; p++) {
+    if (*p >= '0' && *p <= '9') {
+      current = (current < 0 ? 0 : current * 10) + (*p - '0');
+    } else {
+      max_id = std::max(max_id, current);
+      current = -1;
+    }
+  }
+  max_id = std::max(max_id, current);
+  return max_id + 1;
+#else
+  return 0;
+#endif
+}
+
+
+static uint32_t SlabMaxLength(uint32_t cl, size_t max_per_cpu_size) {
+  const size_t size = Static::sizemap()->ByteSizeForClass(cl);
+  const size_t batch = Static::sizemap()->num_objects_to_move(cl);
+  // Let any single class occupy up to 1/8th of per-cpu budget, but
+  // always allow holding couple batches.
+  size_t rv = max_per_cpu_size / 8 / size;
+  rv = std::min<size_t>(rv, kMaxDynamicFreeListLength);
+  return std::max<size_t>(rv, 2 * batch);
+}
+
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+// Returns true if glibc has registered rseq area for us, and kernel
+// can restart critical sections of other cpus for us.
+static bool InitRseq() {
+  bool want = commandlineflags::StringToBool(
+    TCMallocGetenvSafe("TCMALLOC_PERCPU_RSEQ"), true);
+  if (!want) {
+    return false;
+  }
+  // Zero if glibc couldn't register it or was told not to
+  // (glibc.pthread.rseq=0 tunable).
+  if (__rseq_size < offsetof(struct rseq, rseq_cs) + sizeof(uint64_t)) {
+    return false;
+  }
+  return syscall(SYS_membarrier, kMembarrierRegisterPrivateExpeditedRseq,
+                 0, 0) == 0;
+}
+#endif
+
+void CpuCache::InitModule() {
+#if defined(ENABLE_PERCPU_CACHE_BY_DEFAULT)
+  const bool kDefaultPerCpuCache = true;
+#else
+  const bool kDefaultPerCpuCache = false;
+#endif
+
+  bool want = commandlineflags::StringToBool(
+    TCMallocGetenvSafe("TCMALLOC_PERCPU_CACHE"), kDefaultPerCpuCache);
+  if (!want) {
+    return;
+  }
+
+  const char* limit = TCMallocGetenvSafe("TCMALLOC_MAX_PER_CPU_CACHE_BYTES");
+  if (limit) {
+    max_per_cpu_size_ = std::max<size_t>(strtoll(limit, nullptr, 10),
+                                         kMinPerCpuCacheSize);
+  }
+
+#ifdef HAVE_SCHED_GETCPU
+  if (sched_getcpu() < 0) {
+    return;
+  }
+#endif
+  int count = CountPossibleCpus();
+  if (count <= 0) {
+    return;
+  }
+
+  // Every class gets a fixed range of slots that lets it use up to
+  // the limit SlabMaxLength gives for startup budget. Slots are only
+  // touched as they get granted, so most of this stays unbacked.
+  const uint32_t num_classes = Static::num_size_classes();
+  uint32_t total_slots = 0;
+  for (uint32_t cl = 1; cl < num_classes; cl++) {
+    begin_[cl] = total_slots;
+    max_capacity_[cl] = SlabMaxLength(cl, max_per_cpu_size_);
+    total_slots += max_capacity_[cl];
+  }
+  stride_ = sizeof(PerCpu) + total_slots * sizeof(void*);
+  stride_ = (stride_ + alignof(PerCpu) - 1) & ~(alignof(PerCpu) - 1);
+
+  // MetaDataAlloc only gives us pointer alignment, so we over-allocate
+  // a bit to make every PerCpu start at cache line boundary.
+  size_t bytes = stride_ * count + alignof(PerCpu);
+  void* mem = MetaDataAlloc(bytes);
+  if (mem == nullptr) {
+    return;
+  }
+  uintptr_t aligned = (reinterpret_cast<uintptr_t>(mem) + alignof(PerCpu) - 1)
+    & ~(uintptr_t{alignof(PerCpu)} - 1);
+  slabs_ = reinterpret_cast<char*>(aligned);
+
+  for (int i = 0; i < count; i++) {
+    PerCpu* c = new (GetCpu(i)) PerCpu;
+    c->stopped.store(0, std::memory_order_relaxed);
+    c->capacity = 0;
+    c->idle_check_size = 0;
+    for (uint32_t cl = 0; cl < kClassSizesMax; cl++) {
+      c->headers[cl].current.store(begin_[cl], std::memory_order_relaxed);
+      c->headers[cl].end.store(begin_[cl], std::memory_order_relaxed);
+    }
+  }
+
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+  static_assert(offsetof(PerCpu, stopped) == 0, "");
+  static_assert(offsetof(Header, end) == 4, "");
+  use_rseq_ = InitRseq();
+#endif
+
+  num_cpus_ = count;
+  active_ = true;
+}
+
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+bool CpuCache::RseqSetEnd(int cpu, uint32_t cl, uint32_t new_end) {
+  uint32_t ok;
+  uintptr_t c;
+  asm volatile(
+    TCMALLOC_RSEQ_START
+    "xorl %[ok], %[ok]\n"
+    "movl %%fs:4(%[rseq]), %k[c]\n"
+    "cmpl %[cpu], %k[c]\n"
+    "jne 5f\n"
+    "imulq %[stride], %[c]\n"
+    "addq %[slabs], %[c]\n"
+    "cmpl %[new_end], (%[c], %[hdr])\n"
+    "ja 5f\n"
+    "movl $1, %[ok]\n"
+    "movl %[new_end], 4(%[c], %[hdr])\n"
+    "5:\n"
+    : [ok] "=&r"(ok), [c] "=&r"(c)
+    : [rseq] "r"(__rseq_offset), [cpu] "r"(cpu),
+      [stride] "r"(stride_), [slabs] "r"(slabs_),
+      [hdr] "r"(offsetof(PerCpu, headers) + cl * sizeof(Header)),
+      [new_end] "r"(new_end)
+    : "cc", "memory");
+  return ok != 0;
+}
+#endif
+
+bool CpuCache::SetEnd(PerCpu* c, uint32_t cl, uint32_t new_end) {
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+  if (use_rseq_) {
+    const int cpu = (reinterpret_cast<char*>(c) - slabs_) / stride_;
+    return RseqSetEnd(cpu, cl, new_end);
+  }
+#endif
+  Header* hdr = &c->headers[cl];
+  if (hdr->current.load(std::memory_order_relaxed) > new_end) {
+    return false;
+  }
+  hdr->end.store(new_end, std::memory_order_relaxed);
+  return true;
+}
+
+void CpuCache::Stop(PerCpu* c) NO_THREAD_SAFETY_ANALYSIS {
+  c->lock.Lock();
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+  if (use_rseq_) {
+    c->stopped.store(1, std::memory_order_relaxed);
+    // Restarts critical section that may be running on that cpu,
+    // so it sees stopped set, like all later ones.
+    const int cpu = (reinterpret_cast<char*>(c) - slabs_) / stride_;
+    if (syscall(SYS_membarrier, kMembarrierPrivateExpeditedRseq,
+                kMembarrierFlagCpu, cpu) != 0) {
+      Log(kCrash, __FILE__, __LINE__, "membarrier failed", errno);
+    }
+  }
+#endif
+}
+
+void CpuCache::Start(PerCpu* c) NO_THREAD_SAFETY_ANALYSIS {
+  c->stopped.store(0, std::memory_order_release);
+  c->lock.Unlock();
+}
+
+void CpuCache::ShrinkUnused(PerCpu* c, uint32_t cl, size_t bytes) {
+  for (uint32_t i = 1; i < Static::num_size_classes() && bytes > 0; i++) {
+    if (i == cl) {
+      continue;
+    }
+    const uint32_t current = c->headers[i].current.load(
+      std::memory_order_relaxed);
+    const uint32_t end = c->headers[i].end.load(std::memory_order_relaxed);
+    if (current >= end) {
+      continue;
+    }
+    const size_t size = Static::sizemap()->ByteSizeForClass(i);
+    const uint32_t take = std::min<size_t>(end - current,
+                                           (bytes + size - 1) / size);
+    // May fail if some object was pushed meanwhile, or if we migrated
+    // to other cpu.
+    if (!SetEnd(c, i, end - take)) {
+      continue;
+    }
+    c->capacity -= take * size;
+    bytes -= std::min(bytes, take * size);
+  }
+}
+
+bool CpuCache::Grow(PerCpu* c, uint32_t cl, uint32_t n) {
+  const size_t size = Static::sizemap()->ByteSizeForClass(cl);
+  for (int attempt = 0; attempt < 2; attempt++) {
+    uint32_t victim = 0;
+    {
+      SpinLockHolder h(&c->lock);
+      const uint32_t end = c->headers[cl].end.load(std::memory_order_relaxed);
+      n = std::min(n, begin_[cl] + max_capacity_[cl] - end);
+      if (n == 0) {
+        return false;
+      }
+      const size_t max_size = max_per_cpu_size_;
+      if (c->capacity + n * size > max_size) {
+        ShrinkUnused(c, cl, c->capacity + n * size - max_size);
+      }
+      const size_t room = max_size > c->capacity ? max_size - c->capacity : 0;
+      const uint32_t grant = std::min<size_t>(n, room / size);
+      if (grant > 0) {
+        if (!SetEnd(c, cl, end + grant)) {
+          return false;
+        }
+        c->capacity += grant * size;
+        return true;
+      }
+      if (attempt > 0) {
+        return false;
+      }
+
+      // Every granted slot is in use. Like the previous version of
+      // this cache, evict from the class that caches most bytes.
+      size_t largest_bytes = 0;
+      for (uint32_t i = 1; i < Static::num_size_classes(); i++) {
+        const uint32_t used = c->headers[i].current.load(
+          std::memory_order_relaxed) - begin_[i];
+        const size_t bytes = size_t{used}
+          * Static::sizemap()->ByteSizeForClass(i);
+        if (bytes > largest_bytes) {
+          largest_bytes = bytes;
+          victim = i;
+        }
+      }
+      if (victim == 0 || victim == cl) {
+        return false;
+      }
+    }
+    // Evicted objects leave unused slots behind, which we take on
+    // next attempt.
+    Evict(victim, Static::sizemap()->num_objects_to_move(victim), nullptr);
+  }
+  return false;
+}
+
+// Slow paths move several objects at once. With spinlocks we take
+// the lock once for all of them, and stay on the cpu we started on.
+
+int CpuCache::PushList(uint32_t cl, void** head, int n)
+    NO_THREAD_SAFETY_ANALYSIS {
+  PerCpu* c = nullptr;
+  if (!use_rseq_) {
+    c = GetCurrent();
+    c->lock.Lock();
+  }
+  int i = 0;
+  for (; i < n; i++) {
+    void* obj = *head;
+    void* next = SLL_Next(obj);
+    if (!(c != nullptr ? PushOwned(c, cl, obj) : Push(cl, obj))) {
+      break;
+    }
+    *head = next;
+  }
+  if (c != nullptr) {
+    c->lock.Unlock();
+  }
+  return i;
+}
+
+void CpuCache::Evict(uint32_t cl, int n, void* extra)
+    NO_THREAD_SAFETY_ANALYSIS {
+  void* head = extra;
+  void* tail = extra;
+  int count = 0;
+  if (extra != nullptr) {
+    SLL_SetNext(extra, nullptr);
+    count++;
+  }
+  PerCpu* c = nullptr;
+  if (!use_rseq_) {
+    c = GetCurrent();
+    c->lock.Lock();
+  }
+  void* obj;
+  for (int i = 0; i < n; i++) {
+    if (!(c != nullptr ? PopOwned(c, cl, &obj) : Pop(cl, &obj))) {
+      break;
+    }
+    if (tail == nullptr) {
+      tail = obj;
+    }
+    SLL_Push(&head, obj);
+    count++;
+  }
+  if (c != nullptr) {
+    c->lock.Unlock();
+  }
+  if (count > 0) {
+    Static::central_cache()[cl].InsertRange(head, tail, count);
+  }
+}
+
+void* CpuCache::Refill(size_t size, uint32_t cl,
+                       void *(*oom_handler)(size_t size)) {
+  const int batch_size = Static::sizemap()->num_objects_to_move(cl);
+  Grow(GetCurrent(), cl, batch_size);
+
+  void *start, *end;
+  int fetch_count = Static::central_cache()[cl].RemoveRange(
+    &start, &end, batch_size);
+
+  if (fetch_count == 0) {
+    ASSERT(start == nullptr);
+    return oom_handler(size);
+  }
+
+  // We may have migrated since Grow, so pushes can fail. Whatever
+  // doesn't fit goes back.
+  void* rv = start;
+  void* obj = SLL_Next(start);
+  int left = fetch_count - 1;
+  if (left > 0) {
+    left -= PushList(cl, &obj, left);
+  }
+  if (left > 0) {
+    Static::central_cache()[cl].InsertRange(obj, end, left);
+  }
+  return rv;
+}
+
+void CpuCache::Overflow(void* ptr, uint32_t cl) {
+  const int batch_size = Static::sizemap()->num_objects_to_move(cl);
+  if (Grow(GetCurrent(), cl, batch_size) && Push(cl, ptr)) {
+    return;
+  }
+  // Class is at its limit. Move a batch of its objects out.
+  Evict(cl, batch_size - 1, ptr);
+}
+
+size_t CpuCache::CachedBytes(PerCpu* c, uint64_t* class_count) {
+  size_t total = 0;
+  for (uint32_t cl = 1; cl < Static::num_size_classes(); cl++) {
+    const uint32_t used = c->headers[cl].current.load(
+      std::memory_order_relaxed) - begin_[cl];
+    total += size_t{used} * Static::sizemap()->ByteSizeForClass(cl);
+    if (class_count) {
+      class_count[cl] += used;
+    }
+  }
+  return total;
+}
+
+void CpuCache::GetStats(uint64_t* total_bytes, uint64_t* class_count) {
+  for (int i = 0; i < num_cpus_; i++) {
+    *total_bytes += CachedBytes(GetCpu(i), class_count);
+  }
+}
+
+void CpuCache::FlushCpu(PerCpu* c) {
+  const uint32_t num_classes = Static::num_size_classes();
+  void* lists[kClassSizesMax];
+  int counts[kClassSizesMax];
+
+  Stop(c);
+  for (uint32_t cl = 1; cl < num_classes; cl++) {
+    lists[cl] = nullptr;
+    counts[cl] = 0;
+    void* obj;
+    while (PopOwned(c, cl, &obj)) {
+      SLL_Push(&lists[cl], obj);
+      counts[cl]++;
+    }
+    // Idle cpus shouldn't keep their slots either.
+    c->headers[cl].end.store(begin_[cl], std::memory_order_relaxed);
+  }
+  c->capacity = 0;
+  Start(c);
+
+  for (uint32_t cl = 1; cl < num_classes; cl++) {
+    const int batch_size = Static::sizemap()->num_objects_to_move(cl);
+    while (counts[cl] > 0) {
+      const int N = std::min(batch_size, counts[cl]);
+      void *start, *end;
+      SLL_PopRange(&lists[cl], N, &start, &end);
+      Static::central_cache()[cl].InsertRange(start, end, N);
+      counts[cl] -= N;
+    }
+  }
+}
+
+void CpuCache::Flush() {
+  for (int i = 0; i < num_cpus_; i++) {
+    FlushCpu(GetCpu(i));
+  }
+}
+
+void CpuCache::FlushIdle() {
+  for (int i = 0; i < num_cpus_; i++) {
+    PerCpu* c = GetCpu(i);
+    const size_t cached = CachedBytes(c, nullptr);
+    bool idle;
+    {
+      SpinLockHolder h(&c->lock);
+      // Like with thread caches, unchanged size is our sign of
+      // idleness. It saves us from counting uses on the fast path.
+      idle = (cached != 0 && cached == c->idle_check_size);
+      c->idle_check_size = cached;
+    }
+    if (idle) {
+      FlushCpu(c);
+    }
+  }
+}
+
+void CpuCache::set_max_per_cpu_size(size_t new_size) {
+  // Slots granted above the new limit are taken back lazily, as
+  // other classes grow or cpus go idle. Per-class limits stay as
+  // computed at startup.
+  max_per_cpu_size_ = std::max(new_size, kMinPerCpuCacheSize);
+}
+
+void CpuCache::LockAll() NO_THREAD_SAFETY_ANALYSIS {
+  for (int i = 0; i < num_cpus_; i++) {
+    PerCpu* c = GetCpu(i);
+    c->lock.Lock();
+    c->stopped.store(1, std::memory_order_relaxed);
+  }
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+  if (use_rseq_) {
+    syscall(SYS_membarrier, kMembarrierPrivateExpeditedRseq, 0, 0);
+  }
+#endif
+}
+
+void CpuCache::UnlockAll() NO_THREAD_SAFETY_ANALYSIS {
+  for (int i = 0; i < num_cpus_; i++) {
+    Start(GetCpu(i));
+  }
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,425 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2026, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TCMALLOC_CPU_CACHE_H_
+#define TCMALLOC_CPU_CACHE_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HAVE_SCHED_GETCPU
+#include <sched.h>
+#endif
+#ifdef HAVE_SYS_RSEQ_H
+#include <sys/rseq.h>
+#endif
+
+#include <atomic>
+
+#include "base/basictypes.h"
+#include "base/spinlock.h"
+#include "common.h"
+#include "internal_logging.h"
+#include "linked_list.h"
+#include "static_vars.h"
+
+// This module implements optional per-CPU front-end caches. When
+// enabled (TCMALLOC_PERCPU_CACHE=t or
+// --enable-percpu-cache-by-default), small objects are cached in
+// slabs owned by the CPU the calling thread currently runs on instead
+// of in per-thread freelists. This bounds the amount of idle cached
+// memory by the number of CPUs rather than by the number of threads,
+// which matters for processes with thousands of mostly-idle threads.
+//
+// Each CPU has an array of object slots, and every size class owns a
+// fixed range of it. Per-class header tracks how many slots of that
+// range are in use (current) and how many are currently granted to
+// the class (end). Slow paths move capacity between size classes so
+// that granted slots never exceed max_per_cpu_size() bytes.
+//
+// On x86-64 Linux with glibc that registers rseq areas (2.35+),
+// headers are updated by restartable sequences: the kernel restarts
+// a critical section that is preempted or migrated before its single
+// committing store, so malloc and free fast paths take no locks and
+// issue no atomic instructions. Threads that need to touch slabs of
+// some other cpu (flushes, fork) "stop" it: set its stopped word,
+// which every critical section checks, and run membarrier to abort
+// sections already in flight there. Elsewhere, or with
+// TCMALLOC_PERCPU_RSEQ=f, each slab is guarded by a spinlock taken
+// after sched_getcpu(). The lock is practically never contended, and
+// it is never held while calling into the rest of tcmalloc.
+//
+// Every thread still has its ThreadCache. It carries per-thread
+// state we need regardless of where objects are cached: sampler,
+// heap partition binding and emergency malloc flag. Its freelists
+// stay empty in this mode, so what a thread costs is the fixed size
+// of that structure, not cached objects. When the platform cannot
+// tell us current CPU, we silently keep using ThreadCache freelists.
+
+#if defined(HAVE_SYS_RSEQ_H) && defined(__linux__) && defined(__x86_64__) \
+  && defined(RSEQ_SIG)
+#define TCMALLOC_HAVE_PERCPU_RSEQ 1
+#endif
+
+namespace tcmalloc {
+
+class CpuCache {
+ public:
+  // Decides whether per-CPU caches are to be used and sets them
+  // up. Called from Static::InitStaticVars. Note that we cannot
+  // assert that pageheap_lock is held there, since constructing the
+  // page heap re-initializes that lock.
+  static void InitModule();
+
+  static bool Active() { return active_; }
+
+  // True if slabs are accessed with restartable sequences rather
+  // than under per-cpu spinlocks.
+  static bool UsesRseq() { return use_rseq_; }
+
+  static void* Allocate(size_t size, uint32_t cl,
+                        void *(*oom_handler)(size_t size));
+  static void Deallocate(void* ptr, uint32_t cl);
+
+  // Adds to *total_bytes the total number of bytes cached in all
+  // per-CPU slabs. If class_count is not nullptr, it must be an array
+  // of size kNumClasses, and this function will increment each
+  // element of class_count by the number of cached items of
+  // corresponding size class.
+  // REQUIRES: Static::pageheap_lock is not held.
+  static void GetStats(uint64_t* total_bytes, uint64_t* class_count);
+
+  // Returns all cached objects back to central free lists.
+  // REQUIRES: Static::pageheap_lock is not held.
+  static void Flush();
+
+  // Returns cached objects of per-CPU caches that were not used
+  // since the previous call back to central free lists.
+  // REQUIRES: Static::pageheap_lock is not held.
+  static void FlushIdle();
+
+  static int num_cpus() { return num_cpus_; }
+
+  static size_t max_per_cpu_size() { return max_per_cpu_size_; }
+  static void set_max_per_cpu_size(size_t new_size);
+
+  // Used by fork handlers.
+  static void LockAll();
+  static void UnlockAll();
+
+ private:
+  // Objects of class cl on some cpu occupy slots [begin_[cl], current)
+  // of that cpu, and slots [begin_[cl], end) are granted to cl.
+  // Restartable sequences below depend on this exact layout.
+  struct Header {
+    std::atomic<uint32_t> current;
+    std::atomic<uint32_t> end;
+  };
+
+  struct PerCpu {
+    // Non-zero while this cpu's slabs are owned by a thread that may
+    // run elsewhere (see Stop). Must be first.
+    std::atomic<uint32_t> stopped;
+    // Serializes capacity changes, and with spinlock-based access,
+    // all accesses.
+    SpinLock lock;
+    // Bytes of slots granted to size classes. Protected by lock.
+    size_t capacity;
+    // Cached bytes as seen by previous FlushIdle. Protected by lock.
+    size_t idle_check_size;
+    Header headers[kClassSizesMax];
+    // Followed by slots array.
+  } CACHELINE_ALIGNED;
+
+  static PerCpu* GetCpu(int cpu) {
+    return reinterpret_cast<PerCpu*>(slabs_ + cpu * stride_);
+  }
+  static void** Slots(PerCpu* c) {
+    return reinterpret_cast<void**>(c + 1);
+  }
+
+  static PerCpu* GetCurrent();
+
+  // Pop and push objects of class cl on slab of current cpu. Fail if
+  // slab is empty (full), or if it is stopped.
+  // REQUIRES: caller holds no PerCpu lock.
+  static bool Pop(uint32_t cl, void** rv);
+  static bool Push(uint32_t cl, void* ptr);
+
+  // Same as above, for callers that already own c (hold its lock
+  // when spinlocks are used, or stopped it).
+  static bool PopOwned(PerCpu* c, uint32_t cl, void** rv);
+  static bool PushOwned(PerCpu* c, uint32_t cl, void* ptr);
+
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+  static bool RseqPop(uint32_t cl, void** rv);
+  static bool RseqPush(uint32_t cl, void* ptr);
+  // Sets end of cl's slab on cpu to new_end, unless current cpu is
+  // not cpu, or more than new_end slots are in use.
+  static bool RseqSetEnd(int cpu, uint32_t cl, uint32_t new_end);
+#endif
+
+  // Sets end of cl's slab on c to new_end, unless more than new_end
+  // slots are in use or (with rseq) we don't run on c anymore.
+  // REQUIRES: c->lock is held.
+  static bool SetEnd(PerCpu* c, uint32_t cl, uint32_t new_end);
+
+  // Takes exclusive ownership of c's slabs, so that they can be
+  // accessed with PopOwned and PushOwned from any cpu.
+  static void Stop(PerCpu* c);
+  static void Start(PerCpu* c);
+
+  // Grants up to n more slots on c to class cl, taking unused slots
+  // of other classes, and if that is not enough, evicting objects of
+  // the class that caches most bytes. Returns false if nothing could
+  // be granted.
+  static bool Grow(PerCpu* c, uint32_t cl, uint32_t n);
+
+  // Takes at least bytes worth of unused slots away from classes
+  // other than cl, or as many as there are.
+  // REQUIRES: c->lock is held.
+  static void ShrinkUnused(PerCpu* c, uint32_t cl, size_t bytes);
+
+  // Moves up to n objects of list *head into current cpu's slab of
+  // class cl, advancing *head. Returns number of objects moved.
+  static int PushList(uint32_t cl, void** head, int n);
+
+  // Pops up to n objects of class cl from current cpu and returns
+  // them to the central cache. If extra is not nullptr, it is
+  // returned too.
+  static void Evict(uint32_t cl, int n, void* extra);
+
+  // Returns bytes cached on c. If class_count is not nullptr, adds
+  // per-class object counts to it. Doesn't need to own c.
+  static size_t CachedBytes(PerCpu* c, uint64_t* class_count);
+
+  // Returns all cached objects of c back to central free lists.
+  static void FlushCpu(PerCpu* c);
+
+  // Fetches a batch of objects from the central cache, returns one
+  // of them and keeps the rest in current cpu's slab.
+  static void* Refill(size_t size, uint32_t cl,
+                      void *(*oom_handler)(size_t size));
+  // Makes room for ptr in current cpu's slab, or moves a batch of
+  // objects of class cl including ptr to the central cache.
+  static void Overflow(void* ptr, uint32_t cl);
+
+  static bool active_;
+  static bool use_rseq_;
+  static int num_cpus_;
+  static size_t max_per_cpu_size_;
+  static char* slabs_;
+  // Bytes between PerCpu structs of consecutive cpus.
+  static size_t stride_;
+  static uint32_t begin_[kClassSizesMax];
+  static uint32_t max_capacity_[kClassSizesMax];
+};
+
+inline CpuCache::PerCpu* CpuCache::GetCurrent() {
+#ifdef HAVE_SCHED_GETCPU
+  int cpu = sched_getcpu();
+  if (PREDICT_FALSE(static_cast<unsigned>(cpu)
+                    >= static_cast<unsigned>(num_cpus_))) {
+    // Either sched_getcpu failed or we're seeing cpu hotplug
+    // after init. Either way any slab will do.
+    cpu = static_cast<unsigned>(cpu) % num_cpus_;
+  }
+  return GetCpu(cpu);
+#else
+  return GetCpu(0);
+#endif
+}
+
+inline bool CpuCache::PopOwned(PerCpu* c, uint32_t cl, void** rv) {
+  Header* hdr = &c->headers[cl];
+  uint32_t current = hdr->current.load(std::memory_order_relaxed);
+  if (current == begin_[cl]) {
+    return false;
+  }
+  current--;
+  *rv = Slots(c)[current];
+  hdr->current.store(current, std::memory_order_relaxed);
+  return true;
+}
+
+inline bool CpuCache::PushOwned(PerCpu* c, uint32_t cl, void* ptr) {
+  Header* hdr = &c->headers[cl];
+  uint32_t current = hdr->current.load(std::memory_order_relaxed);
+  if (current >= hdr->end.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  Slots(c)[current] = ptr;
+  hdr->current.store(current + 1, std::memory_order_relaxed);
+  return true;
+}
+
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+
+static_assert(RSEQ_SIG == 0x53053053, "unexpected rseq signature");
+
+// Starts restartable sequence: emits its descriptor (label 3) and
+// abort handler (label 6), which restarts it from label 4, and
+// registers the descriptor in our rseq area. The section ends with
+// label 5, right after its committing store. Abort handler is
+// preceded by the signature the kernel checks, encoded as ud1 like
+// in kernel's own rseq selftests.
+//
+// Descriptors live outside of function's section, so functions
+// containing these sequences must never be emitted as COMDAT: they
+// are ALWAYS_INLINE, and only used by non-inline functions or ones
+// with internal linkage.
+#define TCMALLOC_RSEQ_START                                 \
+  ".pushsection __rseq_cs, \"aw\"\n"                        \
+  ".balign 32\n"                                            \
+  "3:\n"                                                    \
+  ".long 0, 0\n"                                            \
+  ".quad 4f, 5f - 4f, 6f\n"                                 \
+  ".popsection\n"                                           \
+  ".pushsection .text.unlikely, \"ax\"\n"                   \
+  ".byte 0x0f, 0xb9, 0x3d\n"                                \
+  ".long 0x53053053\n"                                      \
+  "6:\n"                                                    \
+  "jmp 4f\n"                                                \
+  ".popsection\n"                                           \
+  "4:\n"                                                    \
+  "leaq 3b(%%rip), %[c]\n"                                  \
+  "movq %[c], %%fs:8(%[rseq])\n"
+
+ALWAYS_INLINE bool CpuCache::RseqPop(uint32_t cl, void** rv) {
+  void* result;
+  uintptr_t c;
+  uintptr_t current;
+  asm volatile(
+    TCMALLOC_RSEQ_START
+    "xorl %k[result], %k[result]\n"
+    "movl %%fs:4(%[rseq]), %k[c]\n"
+    "cmpl %[num_cpus], %k[c]\n"
+    "jae 5f\n"
+    "imulq %[stride], %[c]\n"
+    "addq %[slabs], %[c]\n"
+    "cmpl $0, (%[c])\n"
+    "jne 5f\n"
+    "movl (%[c], %[hdr]), %k[current]\n"
+    "cmpl %[begin], %k[current]\n"
+    "je 5f\n"
+    "subl $1, %k[current]\n"
+    "movq %c[slots](%[c], %[current], 8), %[result]\n"
+    "movl %k[current], (%[c], %[hdr])\n"
+    "5:\n"
+    : [result] "=&r"(result), [c] "=&r"(c), [current] "=&r"(current)
+    : [rseq] "r"(__rseq_offset), [num_cpus] "r"(num_cpus_),
+      [stride] "r"(stride_), [slabs] "r"(slabs_),
+      [hdr] "r"(offsetof(PerCpu, headers) + cl * sizeof(Header)),
+      [begin] "r"(begin_[cl]), [slots] "i"(sizeof(PerCpu))
+    : "cc", "memory");
+  *rv = result;
+  return result != nullptr;
+}
+
+ALWAYS_INLINE bool CpuCache::RseqPush(uint32_t cl, void* ptr) {
+  uint32_t ok;
+  uintptr_t c;
+  uintptr_t current;
+  asm volatile(
+    TCMALLOC_RSEQ_START
+    "xorl %[ok], %[ok]\n"
+    "movl %%fs:4(%[rseq]), %k[c]\n"
+    "cmpl %[num_cpus], %k[c]\n"
+    "jae 5f\n"
+    "imulq %[stride], %[c]\n"
+    "addq %[slabs], %[c]\n"
+    "cmpl $0, (%[c])\n"
+    "jne 5f\n"
+    "movl (%[c], %[hdr]), %k[current]\n"
+    "cmpl 4(%[c], %[hdr]), %k[current]\n"
+    "jae 5f\n"
+    "movq %[ptr], %c[slots](%[c], %[current], 8)\n"
+    "addl $1, %k[current]\n"
+    "movl $1, %[ok]\n"
+    "movl %k[current], (%[c], %[hdr])\n"
+    "5:\n"
+    : [ok] "=&r"(ok), [c] "=&r"(c), [current] "=&r"(current)
+    : [rseq] "r"(__rseq_offset), [num_cpus] "r"(num_cpus_),
+      [stride] "r"(stride_), [slabs] "r"(slabs_),
+      [hdr] "r"(offsetof(PerCpu, headers) + cl * sizeof(Header)),
+      [ptr] "r"(ptr), [slots] "i"(sizeof(PerCpu))
+    : "cc", "memory");
+  return ok != 0;
+}
+
+#endif  // TCMALLOC_HAVE_PERCPU_RSEQ
+
+ALWAYS_INLINE bool CpuCache::Pop(uint32_t cl, void** rv) {
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+  if (PREDICT_TRUE(use_rseq_)) {
+    return RseqPop(cl, rv);
+  }
+#endif
+  PerCpu* c = GetCurrent();
+  SpinLockHolder h(&c->lock);
+  return PopOwned(c, cl, rv);
+}
+
+ALWAYS_INLINE bool CpuCache::Push(uint32_t cl, void* ptr) {
+#ifdef TCMALLOC_HAVE_PERCPU_RSEQ
+  if (PREDICT_TRUE(use_rseq_)) {
+    return RseqPush(cl, ptr);
+  }
+#endif
+  PerCpu* c = GetCurrent();
+  SpinLockHolder h(&c->lock);
+  return PushOwned(c, cl, ptr);
+}
+
+ALWAYS_INLINE void* CpuCache::Allocate(size_t size, uint32_t cl,
+                                       void *(*oom_handler)(size_t size)) {
+  ASSERT(active_);
+  ASSERT(size == Static::sizemap()->ByteSizeForClass(cl));
+
+  void* rv;
+  if (PREDICT_TRUE(Pop(cl, &rv))) {
+    return rv;
+  }
+  return Refill(size, cl, oom_handler);
+}
+
+ALWAYS_INLINE void CpuCache::Deallocate(void* ptr, uint32_t cl) {
+  ASSERT(active_);
+
+  if (PREDICT_TRUE(Push(cl, ptr))) {
+    return;
+  }
+  Overflow(ptr, cl);
+}
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_CPU_CACHE_H_
@@ -1265,6 +1265,28 @@ extern "C" PERFTOOLS_DLL_DECL void tc_free_sized(void *ptr, size_t size) PERFTOO
   force_frame();
 }
 
+// Batch interface gains nothing under debug allocator, so we simply
+// handle objects one by one.
+extern "C" PERFTOOLS_DLL_DECL size_t tc_malloc_batch(size_t size, void** ptrs, size_t count) PERFTOOLS_NOTHROW {
+  size_t i = 0;
+  for (; i < count; i++) {
+    ptrs[i] = do_debug_malloc_or_debug_cpp_alloc(size);
+    if (ptrs[i] == nullptr) {
+      break;
+    }
+    tcmalloc::InvokeNewHook(ptrs[i], size);
+  }
+  return i;
+}
+
+extern "C" PERFTOOLS_DLL_DECL void tc_free_batch(size_t size, void** ptrs, size_t count) PERFTOOLS_NOTHROW {
+  for (size_t i = 0; i < count; i++) {
+    tcmalloc::InvokeDeleteHook(ptrs[i]);
+    DebugDeallocate(ptrs[i], MallocBlock::kMallocType, size);
+  }
+  force_frame();
+}
+
 extern "C" PERFTOOLS_DLL_DECL void tc_free_aligned_sized(void* ptr, size_t align, size_t size) PERFTOOLS_NOTHROW {
   tcmalloc::InvokeDeleteHook(ptr);
   DebugDeallocate(ptr, MallocBlock::kMallocType, 0);
@@ -1589,3 +1611,26 @@ extern "C" PERFTOOLS_DLL_DECL void* tc_malloc_skip_new_handler(size_t size) PERF
   tcmalloc::InvokeNewHook(result, size);
   return result;
 }
+
+// We report exactly the requested size, so that writes past it are
+// still caught.
+extern "C" PERFTOOLS_DLL_DECL tc_sized_ptr_t tc_malloc_at_least(size_t size) PERFTOOLS_NOTHROW {
+  void* ptr = do_debug_malloc_or_debug_cpp_alloc(size);
+  tcmalloc::InvokeNewHook(ptr, size);
+  return {ptr, ptr != nullptr ? size : 0};
+}
+
+// Debug realloc always moves memory, so that stale pointers are
+// caught. We keep it that way.
+extern "C" PERFTOOLS_DLL_DECL int tc_try_realloc_in_place(void* ptr, size_t new_size) PERFTOOLS_NOTHROW {
+  return 0;
+}
+
+extern "C" PERFTOOLS_DLL_DECL tc_sized_ptr_t tc_new_at_least(size_t size) {
+  void* ptr = debug_cpp_alloc(size, MallocBlock::kNewType, false);
+  tcmalloc::InvokeNewHook(ptr, size);
+  if (ptr == nullptr) {
+    RAW_LOG(FATAL, "Unable to allocate %zu bytes: new failed.", size);
+  }
+  return {ptr, size};
+}
@@ -0,0 +1,147 @@
+/* -*- Mode: C; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2026, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Region (arena) allocation.
+ *
+ * Arena hands out memory by bumping a pointer through big chunks of
+ * pages and gives all of it back at once when destroyed. This is much
+ * cheaper than malloc/free of every object for workloads like request
+ * handlers that allocate many small objects and drop them all at the
+ * end.
+ *
+ * Arenas are not thread-safe; use one per thread (or lock around
+ * them). free() of arena memory is harmless and does nothing: memory
+ * is only reclaimed by tc_arena_destroy. Arena memory must not be
+ * passed to realloc, malloc_usable_size or sized delete (the first two
+ * crash with a diagnostic). Arena allocations are not seen by
+ * MallocHook-s or heap profiler.
+ */
+
+#ifndef _GPERFTOOLS_ARENA_H_
+#define _GPERFTOOLS_ARENA_H_
+
+#include <stddef.h>
+
+#ifndef PERFTOOLS_DLL_DECL
+# ifdef _WIN32
+#  define PERFTOOLS_DLL_DECL  __declspec(dllimport)
+# else
+#  define PERFTOOLS_DLL_DECL
+# endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct tc_arena tc_arena_t;
+
+/* Returns new empty arena or NULL if out of memory. */
+PERFTOOLS_DLL_DECL tc_arena_t* tc_arena_create(void);
+
+/*
+ * Allocates size bytes from arena. Memory is aligned like malloc's
+ * (tc_arena_malloc) or to align, which must be a power of two
+ * (tc_arena_memalign). Returns NULL if out of memory.
+ */
+PERFTOOLS_DLL_DECL void* tc_arena_malloc(tc_arena_t* arena, size_t size);
+PERFTOOLS_DLL_DECL void* tc_arena_memalign(tc_arena_t* arena, size_t align,
+                                           size_t size);
+
+/* Frees arena itself and everything allocated from it. */
+PERFTOOLS_DLL_DECL void tc_arena_destroy(tc_arena_t* arena);
+
+/* Bytes allocated from arena so far. */
+PERFTOOLS_DLL_DECL size_t tc_arena_allocated_bytes(const tc_arena_t* arena);
+
+#ifdef __cplusplus
+}   /* extern "C" */
+#endif
+
+#if defined(__cplusplus) && __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#include <new>
+
+namespace tcmalloc {
+
+// std::pmr::memory_resource that allocates from its own tcmalloc
+// arena. Deallocation does nothing; everything is freed when resource
+// is destroyed or release()-d. I.e. it works like
+// std::pmr::monotonic_buffer_resource, but takes memory straight from
+// page heap.
+class ArenaResource : public std::pmr::memory_resource {
+ public:
+  ArenaResource() : arena_(nullptr) {}
+  ~ArenaResource() override { release(); }
+
+  ArenaResource(const ArenaResource&) = delete;
+  ArenaResource& operator=(const ArenaResource&) = delete;
+
+  // Frees everything allocated so far.
+  void release() {
+    if (arena_ != nullptr) {
+      tc_arena_destroy(arena_);
+      arena_ = nullptr;
+    }
+  }
+
+  size_t allocated_bytes() const {
+    return arena_ != nullptr ? tc_arena_allocated_bytes(arena_) : 0;
+  }
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    if (arena_ == nullptr && (arena_ = tc_arena_create()) == nullptr) {
+      throw std::bad_alloc();
+    }
+    void* rv = tc_arena_memalign(arena_, alignment, bytes);
+    if (rv == nullptr) {
+      throw std::bad_alloc();
+    }
+    return rv;
+  }
+
+  void do_deallocate(void*, size_t, size_t) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+
+ private:
+  tc_arena_t* arena_;
+};
+
+}  // namespace tcmalloc
+
+#endif  /* __has_include(<memory_resource>) */
+#endif  /* __cplusplus >= 201703L */
+
+#endif  /* _GPERFTOOLS_ARENA_H_ */
@@ -188,6 +188,16 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   //      Number of bytes used across all thread caches.
   //      This property is not writable.
   //
+  // "tcmalloc.thread_cache_min_budget_bytes"
+  // "tcmalloc.thread_cache_max_budget_bytes"
+  //      Smallest and largest size limit among thread caches.
+  //      These properties are not writable.
+  //
+  // "tcmalloc.thread_cache_rebalanced_bytes"
+  //      Total amount of thread cache size limit that
+  //      ProcessBackgroundActions() moved to threads that often miss
+  //      in their caches. This property is not writable.
+  //
   // "tcmalloc.central_cache_free_bytes"
   //      Number of free bytes in the central cache that have been
   //      assigned to size classes. They always count towards virtual
@@ -202,18 +212,54 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   //      is swapped out by the OS, they also count towards physical
   //      memory usage. This property is not writable.
   //
+  // "tcmalloc.central_cache_lock_contentions"
+  //      Number of times a thread had to wait for a central free list
+  //      lock in order to move objects to or from spans. This
+  //      property is not writable.
+  //
+  // "tcmalloc.transfer_cache_lock_contentions"
+  //      Number of times a thread had to wait for a transfer cache
+  //      lock in order to swap a batch of objects with the central
+  //      cache. This property is not writable.
+  //
+  // "tcmalloc.transfer_cache_rebalanced_slots"
+  //      Total number of transfer cache slots that
+  //      ProcessBackgroundActions() moved to size classes that often
+  //      miss in their transfer caches. This property is not writable.
+  //
   // "tcmalloc.thread_cache_free_bytes"
   //      Number of free bytes in thread caches. They always count
   //      towards virtual memory usage, and unless the underlying memory
   //      is swapped out by the OS, they also count towards physical
   //      memory usage. This property is not writable.
   //
+  // "tcmalloc.per_cpu_caches_active"
+  //      1 if small objects are cached per-CPU instead of per-thread
+  //      (see TCMALLOC_PERCPU_CACHE), 0 otherwise. This property is
+  //      not writable.
+  //
+  // "tcmalloc.max_per_cpu_cache_bytes"
+  //      Upper limit on number of bytes stored in each per-CPU cache.
+  //      Default: 1MB.
+  //
+  // "tcmalloc.numa_partitions"
+  //      Number of NUMA partitions the heap is split into (see
+  //      TCMALLOC_NUMA_AWARE). 1 if NUMA awareness is not active.
+  //      This property is not writable.
+  //
+  // "tcmalloc.cpu_cache_free_bytes"
+  //      Number of free bytes in per-CPU caches. They always count
+  //      towards virtual memory usage, and unless the underlying memory
+  //      is swapped out by the OS, they also count towards physical
+  //      memory usage. This property is not writable.
+  //
   // "tcmalloc.pageheap_free_bytes"
-  //      Number of bytes in free, mapped pages in page heap.  These
-  //      bytes can be used to fulfill allocation requests.  They
-  //      always count towards virtual memory usage, and unless the
-  //      underlying memory is swapped out by the OS, they also count
-  //      towards physical memory usage.  This property is not writable.
+  //      Number of bytes in free, mapped pages in page heap,
+  //      including large span cache.  These bytes can be used to
+  //      fulfill allocation requests.  They always count towards
+  //      virtual memory usage, and unless the underlying memory is
+  //      swapped out by the OS, they also count towards physical
+  //      memory usage.  This property is not writable.
   //
   // "tcmalloc.pageheap_unmapped_bytes"
   //        Number of bytes in free, unmapped pages in page heap.
@@ -224,6 +270,80 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   //        virtual memory usage, and depending on the OS, typically
   //        do not count towards physical memory usage.  This property
   //        is not writable.
+  //
+  // "tcmalloc.pageheap_lazily_freed_bytes"
+  //        Part of tcmalloc.pageheap_unmapped_bytes that was released
+  //        with MADV_FREE (see "tcmalloc.release_advice"). OS takes
+  //        such pages away only when it needs memory, so they may
+  //        still count towards physical memory usage. This property
+  //        is not writable.
+  //
+  // "tcmalloc.release_advice"
+  //        How free memory is released to the OS: 0 - right away
+  //        (MADV_DONTNEED), 1 - lazily (MADV_FREE), 2 - lazily for
+  //        periodic release at tcmalloc_release_rate and right away
+  //        otherwise. Writing a value that isn't supported on the
+  //        platform fails. Initial value comes from
+  //        TCMALLOC_RELEASE_ADVICE environment variable.
+  //
+  // "tcmalloc.mremap_threshold_bytes"
+  //        Page-level allocations of at least this many bytes get
+  //        memory mapping of their own, and realloc grows them with
+  //        mremap instead of copying. 0 (the default) disables
+  //        this. Only supported on Linux. Initial value comes from
+  //        TCMALLOC_MREMAP_THRESHOLD_BYTES environment variable.
+  //
+  // "tcmalloc.pageheap_dedicated_bytes"
+  //        Number of bytes in allocations that have memory mappings
+  //        of their own (see "tcmalloc.mremap_threshold_bytes").
+  //        Such memory is unmapped when freed. This property is not
+  //        writable.
+  //
+  // "tcmalloc.pageheap_remap_count"
+  //        Number of times such mappings were resized by realloc.
+  //        This property is not writable.
+  //
+  // "tcmalloc.large_span_cache_limit_bytes"
+  //        Freed page-level allocations are kept committed in large
+  //        span cache of up to this many bytes, and reused by
+  //        allocations of about the same size. 0 (the default)
+  //        disables this. Initial value comes from
+  //        TCMALLOC_LARGE_SPAN_CACHE_BYTES environment variable.
+  //
+  // "tcmalloc.pageheap_large_span_cache_bytes"
+  //        Number of bytes in large span cache. They are part of
+  //        "tcmalloc.pageheap_free_bytes". This property is not
+  //        writable.
+  //
+  // "tcmalloc.pageheap_large_span_cache_hits"
+  // "tcmalloc.pageheap_large_span_cache_misses"
+  //        Number of large allocations that were and weren't served
+  //        from large span cache. These properties are not writable.
+  //
+  // "tcmalloc.background_release"
+  //      1 if free memory is released to the system by
+  //      ProcessBackgroundActions() rather than by free() itself, 0
+  //      otherwise. This property is not writable.
+  //
+  // "tcmalloc.hugepage_aware"
+  //      1 if page heap is hugepage-aware (see TCMALLOC_HUGEPAGE_AWARE),
+  //      0 otherwise. This property is not writable.
+  //
+  // "tcmalloc.pageheap_intact_hugepage_bytes"
+  //      Number of committed bytes of page heap that are on hugepages
+  //      without any released pages, i.e. that can be backed by
+  //      transparent hugepages. Only known in hugepage-aware mode.
+  //      This property is not writable.
+  //
+  // "tcmalloc.pageheap_broken_hugepage_bytes"
+  //      Number of committed bytes of page heap that are on hugepages
+  //      with some of their pages released. Only known in
+  //      hugepage-aware mode. This property is not writable.
+  //
+  // "tcmalloc.pageheap_free_hugepages"
+  //      Number of entirely free (and not released) hugepages in page
+  //      heap. Only known in hugepage-aware mode. This property is
+  //      not writable.
   // -------------------------------------------------------------------
 
   // Get the named "property"'s value.  Returns true if the property
@@ -378,10 +498,23 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   // "tcmalloc.central" - tcmalloc's central free-list. One entry per
   //          size-class is returned. Never unmapped.
   //
+  // "tcmalloc.transfer" - tcmalloc's transfer cache. One entry per
+  //          size-class is returned. Never unmapped.
+  //
+  // "tcmalloc.transfer_slots", "tcmalloc.transfer_max_slots" -
+  //          current and maximal capacity of transfer cache of each
+  //          size-class, in bytes of objects its slots can hold. One
+  //          entry per size-class is returned. Here total_bytes_free
+  //          is capacity, not free memory, so skip these entries when
+  //          adding up free bytes.
+  //
   // "debug.free_queue" - free objects queued by the debug allocator
   //                      and not returned to tcmalloc.
   //
   // "tcmalloc.thread" - tcmalloc's per-thread caches. Never unmapped.
+  //
+  // "tcmalloc.cpu" - tcmalloc's per-CPU caches. Only reported when
+  //          per-CPU caches are active. Never unmapped.
   virtual void GetFreeListSizes(std::vector<FreeListInfo>* v);
 
   // Get a list of stack traces of sampled allocation points.  Returns
@@ -415,6 +548,69 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   // Note, as of gperftools 3.11 it is identical to
   // MarkThreadIdle. See github issue #880
   virtual void MarkThreadTemporarilyIdle();
+
+  // Runs allocator maintenance in a loop and never returns. It is
+  // meant to be called on a dedicated thread owned by the
+  // application. Once it runs, free memory is returned to the
+  // system (at the rate set by SetMemoryReleaseRate) by this thread
+  // rather than by free() and friends, idle thread caches give up
+  // their share of total cache size and idle transfer caches are
+  // emptied. Calling it when another thread already runs it, or with
+  // allocator that has no background work, returns immediately.
+  virtual void ProcessBackgroundActions();
+
+  // -------------------------------------------------------------------
+  // Heap partitions for tenants of the process. Partitions 1 to 255
+  // are created on first use; partition 0 is the default heap. Every
+  // partition has its own page heap, central free lists and transfer
+  // caches, with their own locks, so fragmentation and lock traffic
+  // of one tenant stay within its partition. Memory is freed into
+  // the partition it was allocated from, regardless of which thread
+  // frees it. Partitions take their memory from the default heap in
+  // big chunks and never give chunks back, but release free pages to
+  // the system like the default heap does. Threads that allocate from
+  // a partition bypass per-CPU caches, and sampled allocations always
+  // come from the default heap.
+
+  // Makes subsequent allocations of the calling thread come from the
+  // given partition, creating it if needed, and returns objects held
+  // by the calling thread's cache to their previous partition. New
+  // threads start in partition 0. Returns false if partition is out
+  // of range or cannot be created.
+  virtual bool SetThreadHeapPartition(int partition);
+
+  // Returns partition set by SetThreadHeapPartition, or 0.
+  virtual int GetThreadHeapPartition();
+
+  // Limits amount of memory given tenant partition (1 to 255) may
+  // hold (and not release back to the system), creating it if
+  // needed. 0 removes the limit. When the limit is reached, free
+  // memory of the partition is released first, and then allocations
+  // fail like they do when TCMALLOC_HEAP_LIMIT_MB is reached.
+  // Partitions are created with limit of
+  // TCMALLOC_HEAP_PARTITION_LIMIT_MB; this overrides it. The default
+  // heap is only limited by TCMALLOC_HEAP_LIMIT_MB, which covers
+  // memory of all partitions. Returns false if partition is out of
+  // range or cannot be created.
+  virtual bool SetHeapPartitionLimit(int partition, size_t limit_bytes);
+
+  // Like ReleaseFreeMemory, but only releases free page heap memory
+  // of the given tenant partition. Objects held by the calling
+  // thread's cache and by the partition's transfer caches are
+  // returned to the page heap first. Caches of other threads are not
+  // flushed, since only their owners may touch them.
+  virtual void ReleasePartitionFreeMemory(int partition);
+
+  struct HeapPartitionStats {
+    size_t system_bytes;    // Bytes taken from the system
+    size_t free_bytes;      // Bytes in page heap free lists
+    size_t unmapped_bytes;  // Bytes released back to the system
+    size_t limit_bytes;     // Limit set by SetHeapPartitionLimit, or 0
+  };
+  // Fills *stats for the given tenant partition (1 to 255). A
+  // partition not created yet reports no memory and the limit it
+  // would start with. Returns false if partition is out of range.
+  virtual bool GetHeapPartitionStats(int partition, HeapPartitionStats* stats);
 };
 
 namespace base {
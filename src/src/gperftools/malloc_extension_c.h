@@ -83,6 +83,29 @@ PERFTOOLS_DLL_DECL size_t MallocExtension_GetEstimatedAllocatedSize(size_t size)
 PERFTOOLS_DLL_DECL size_t MallocExtension_GetAllocatedSize(const void* p);
 PERFTOOLS_DLL_DECL size_t MallocExtension_GetThreadCacheSize(void);
 PERFTOOLS_DLL_DECL void MallocExtension_MarkThreadTemporarilyIdle(void);
+PERFTOOLS_DLL_DECL void MallocExtension_ProcessBackgroundActions(void);
+PERFTOOLS_DLL_DECL int MallocExtension_SetThreadHeapPartition(int partition);
+PERFTOOLS_DLL_DECL int MallocExtension_GetThreadHeapPartition(void);
+PERFTOOLS_DLL_DECL int MallocExtension_SetHeapPartitionLimit(int partition, size_t limit_bytes);
+PERFTOOLS_DLL_DECL void MallocExtension_ReleasePartitionFreeMemory(int partition);
+
+/*
+ * Batch allocation interface. tc_malloc_batch allocates up to "count"
+ * objects of "size" bytes each and stores them into ptrs[0..N). It
+ * returns N, which is less than count only when we run out of memory
+ * (errno is set to ENOMEM then). Each object can be individually
+ * freed by free() as usual.
+ *
+ * tc_free_batch frees "count" objects that were all allocated with the
+ * same requested size. Null pointers are skipped. Contents of ptrs
+ * array are unspecified after the call.
+ *
+ * Large batches are moved between central free lists and the caller's
+ * array directly, without passing through thread caches, which makes
+ * producer/consumer style workloads cheaper.
+ */
+PERFTOOLS_DLL_DECL size_t tc_malloc_batch(size_t size, void** ptrs, size_t count);
+PERFTOOLS_DLL_DECL void tc_free_batch(size_t size, void** ptrs, size_t count);
 
 /*
  * NOTE: These enum values MUST be kept in sync with the version in
@@ -30,6 +30,37 @@ PERFTOOLS_DLL_DECL size_t nallocx(size_t size, int flags);
 /* same as above but never weak */
 PERFTOOLS_DLL_DECL size_t tc_nallocx(size_t size, int flags);
 
+typedef struct tc_sized_ptr_t {
+  void* p;
+  size_t n;
+} tc_sized_ptr_t;
+
+/*
+ * Allocates at least size bytes like malloc does, and returns the
+ * pointer together with the usable size of the allocated block
+ * (which is what nallocx(size, 0) would return). Callers that grow
+ * buffers can use all of it without separate nallocx or
+ * malloc_usable_size lookup. Memory is to be freed by free. On
+ * failure p is NULL and n is 0.
+ */
+PERFTOOLS_DLL_DECL tc_sized_ptr_t tc_malloc_at_least(size_t size);
+
+/*
+ * Same as above, but with semantics of operator new (in the style of
+ * proposed __size_returning_new): throws std::bad_alloc on failure
+ * and memory is to be freed by operator delete.
+ */
+PERFTOOLS_DLL_DECL tc_sized_ptr_t tc_new_at_least(size_t size);
+
+/*
+ * Tries to resize block at ptr (allocated by malloc or operator new)
+ * to new_size bytes without moving it. Returns 1 if the block now has
+ * at least new_size usable bytes and 0 (leaving the block intact)
+ * otherwise. Large blocks can grow into free memory that immediately
+ * follows them and give back their tail when shrunk.
+ */
+PERFTOOLS_DLL_DECL int tc_try_realloc_in_place(void* ptr, size_t new_size);
+
 #ifdef __cplusplus
 }   /* extern "C" */
 #endif
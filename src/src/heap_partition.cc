@@ -0,0 +1,120 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2026, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "heap_partition.h"
+
+#include <new>
+
+#include "base/commandlineflags.h"
+#include "getenv_safe.h"
+#include "internal_logging.h"
+#include "static_vars.h"
+
+namespace tcmalloc {
+
+SpinLock HeapPartition::create_lock_;
+std::atomic<bool> HeapPartition::active_;
+std::atomic<HeapPartition*> HeapPartition::partitions_[kMaxHeapPartitions];
+
+HeapPartition::HeapPartition(int id)
+    : id_(id),
+      pageheap_(Static::sizemap()->min_span_size_in_pages()) {
+  span_allocator_.Init();
+
+  // We follow default heap's release settings. The rest of its
+  // features are not for partitions; see heap_partition.h.
+  PageHeap* parent = Static::pageheap();
+  pageheap_.SetParent(parent, id, &span_allocator_);
+  pageheap_.SetAggressiveDecommit(parent->GetAggressiveDecommit());
+  pageheap_.SetReleaseMinAge(parent->GetReleaseMinAge());
+  pageheap_.SetPagemapPrefetch(parent->GetPagemapPrefetch());
+  pageheap_.SetLimit(InitialLimit());
+
+  for (int cl = 0; cl < Static::num_size_classes(); cl++) {
+    central_cache_[cl].Init(cl, &pageheap_, central_cache_);
+  }
+}
+
+HeapPartition* HeapPartition::GetOrCreate(int id) {
+  ASSERT(id > 0 && id < kMaxHeapPartitions);
+  HeapPartition* p = Get(id);
+  if (p != nullptr) {
+    return p;
+  }
+
+  SpinLockHolder h(&create_lock_);
+  p = partitions_[id].load(std::memory_order_relaxed);
+  if (p != nullptr) {
+    return p;
+  }
+  void* mem = MetaDataAlloc(sizeof(HeapPartition));
+  if (mem == nullptr) {
+    return nullptr;
+  }
+  p = new (mem) HeapPartition(id);
+  partitions_[id].store(p, std::memory_order_release);
+  active_.store(true, std::memory_order_relaxed);
+  return p;
+}
+
+Length HeapPartition::InitialLimit() {
+  return (tcmalloc::commandlineflags::StringToLongLong(
+    TCMallocGetenvSafe("TCMALLOC_HEAP_PARTITION_LIMIT_MB"), 0) << 20) >> kPageShift;
+}
+
+void HeapPartition::DrainTransferCaches() {
+  for (int cl = 1; cl < Static::num_size_classes(); cl++) {
+    central_cache_[cl].DrainTransferCache();
+  }
+}
+
+void HeapPartition::LockAll() {
+  create_lock_.Lock();
+  ForEach([] (HeapPartition* p) {
+    p->pageheap_.pageheap_lock()->Lock();
+    for (int cl = 0; cl < Static::num_size_classes(); cl++) {
+      p->central_cache_[cl].Lock();
+    }
+  });
+}
+
+void HeapPartition::UnlockAll() {
+  ForEach([] (HeapPartition* p) {
+    for (int cl = 0; cl < Static::num_size_classes(); cl++) {
+      p->central_cache_[cl].Unlock();
+    }
+    p->pageheap_.pageheap_lock()->Unlock();
+  });
+  create_lock_.Unlock();
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,148 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2026, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TCMALLOC_HEAP_PARTITION_H_
+#define TCMALLOC_HEAP_PARTITION_H_
+#include "config.h"
+
+#include <atomic>
+
+#include "base/basictypes.h"
+#include "base/spinlock.h"
+#include "base/thread_annotations.h"
+#include "central_freelist.h"
+#include "common.h"
+#include "page_heap.h"
+#include "page_heap_allocator.h"
+#include "span.h"
+
+// Heap partitions keep memory of tenants of the process (say,
+// requests of different customers) apart. Every partition has a page
+// heap, central free lists and transfer caches of its own, each with
+// its own locks, so fragmentation or lock traffic of one tenant
+// doesn't affect others, and every partition can have its own limit
+// and be released separately.
+//
+// Threads pick their partition with SetThreadPartition, and their
+// thread caches then take objects from that partition's central free
+// lists. Per-CPU caches are shared by all threads, so threads bound to
+// a partition bypass them.
+//
+// Partition's page heap grows by taking chunks of the default page
+// heap (see PageHeap::NewChunk), which are never given back, but whose
+// pages partition releases to the system like default heap does. The
+// chunk's span in default page map tells free() which partition an
+// object belongs to. Chunks come from the NUMA partition of the
+// allocating CPU as usual, so both kinds of partitions can be
+// combined.
+//
+// Partition's page heap is always plain: it doesn't do hugepage-aware
+// packing, dedicated mappings or large span cache. Sampled
+// allocations are always served by the default heap.
+
+namespace tcmalloc {
+
+class HeapPartition {
+ public:
+  // Partition ids go from 1 to kMaxHeapPartitions - 1, and 0 stands
+  // for the default heap. Span::heap_partition is a byte.
+  static const int kMaxHeapPartitions = 256;
+
+  // True once any partition has been created.
+  static bool Active() { return active_.load(std::memory_order_relaxed); }
+
+  // Returns partition with the given id, or nullptr if it wasn't
+  // created yet.
+  static HeapPartition* Get(int id) {
+    return partitions_[id].load(std::memory_order_acquire);
+  }
+
+  // Like Get, but creates the partition if needed. Returns nullptr
+  // if we're out of memory for it.
+  static HeapPartition* GetOrCreate(int id);
+
+  // Calls body for every created partition.
+  template <typename Body>
+  static void ForEach(const Body& body) {
+    if (!Active()) {
+      return;
+    }
+    for (int id = 1; id < kMaxHeapPartitions; id++) {
+      if (HeapPartition* p = Get(id)) {
+        body(p);
+      }
+    }
+  }
+
+  // Partition the calling thread allocates from, or nullptr for the
+  // default heap.
+  static HeapPartition* ThreadPartition() { return thread_partition_; }
+  static void SetThreadPartition(HeapPartition* p) { thread_partition_ = p; }
+
+  // Limit newly created partitions start with
+  // (TCMALLOC_HEAP_PARTITION_LIMIT_MB, or 0 for no limit).
+  static Length InitialLimit();
+
+  int id() const { return id_; }
+  PageHeap* pageheap() { return &pageheap_; }
+  CentralFreeList* central_cache() { return central_cache_; }
+
+  // Moves objects held by transfer caches of the partition back to
+  // their spans, so that free spans go back to partition's page heap.
+  void DrainTransferCaches();
+
+  // Lock/Unlock all locks of all partitions, for pthread_atfork.
+  // They go before all default heap's locks.
+  static void LockAll() NO_THREAD_SAFETY_ANALYSIS;
+  static void UnlockAll() NO_THREAD_SAFETY_ANALYSIS;
+
+ private:
+  explicit HeapPartition(int id);
+
+  const int id_;
+
+  // Spans of pageheap_. Protected by pageheap_'s lock.
+  PageHeapAllocator<Span> span_allocator_;
+
+  PageHeap pageheap_;
+
+  CentralFreeList central_cache_[kClassSizesMax];
+
+  // Protects creation of partitions.
+  static SpinLock create_lock_;
+  static std::atomic<bool> active_;
+  static std::atomic<HeapPartition*> partitions_[kMaxHeapPartitions];
+
+  static inline thread_local HeapPartition* thread_partition_ ATTR_INITIAL_EXEC;
+};
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_HEAP_PARTITION_H_
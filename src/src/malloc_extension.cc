@@ -157,6 +157,31 @@ void MallocExtension::MarkThreadTemporarilyIdle() {
   // Default implementation does nothing
 }
 
+void MallocExtension::ProcessBackgroundActions() {
+  // Default implementation does nothing
+}
+
+bool MallocExtension::SetThreadHeapPartition(int partition) {
+  return false;
+}
+
+int MallocExtension::GetThreadHeapPartition() {
+  return 0;
+}
+
+bool MallocExtension::SetHeapPartitionLimit(int partition, size_t limit_bytes) {
+  return false;
+}
+
+void MallocExtension::ReleasePartitionFreeMemory(int partition) {
+  // Default implementation does nothing
+}
+
+bool MallocExtension::GetHeapPartitionStats(int partition,
+                                            HeapPartitionStats* stats) {
+  return false;
+}
+
 // The current malloc extension object.
 
 static std::atomic<MallocExtension*> current_instance;
@@ -325,6 +350,12 @@ C_SHIM(GetEstimatedAllocatedSize, size_t, (size_t size), (size));
 C_SHIM(GetAllocatedSize, size_t, (const void* p), (p));
 C_SHIM(GetThreadCacheSize, size_t, (void), ());
 C_SHIM(MarkThreadTemporarilyIdle, void, (void), ());
+C_SHIM(ProcessBackgroundActions, void, (void), ());
+C_SHIM(SetThreadHeapPartition, int, (int partition), (partition));
+C_SHIM(GetThreadHeapPartition, int, (void), ());
+C_SHIM(SetHeapPartitionLimit, int,
+       (int partition, size_t limit_bytes), (partition, limit_bytes));
+C_SHIM(ReleasePartitionFreeMemory, void, (int partition), (partition));
 
 // Can't use the shim here because of the need to translate the enums.
 extern "C"
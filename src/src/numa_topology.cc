@@ -0,0 +1,271 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2026, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "numa_topology.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+
+#include "base/commandlineflags.h"
+#include "getenv_safe.h"
+#include "internal_logging.h"
+#include "static_vars.h"
+
+#if defined(__linux__) && !defined(MPOL_PREFERRED)
+#define MPOL_PREFERRED 1
+#endif
+
+namespace tcmalloc {
+
+bool NumaTopology::active_;
+int NumaTopology::num_partitions_ = 1;
+uint32_t NumaTopology::class_stride_;
+volatile int NumaTopology::forced_partition_ = -1;
+int NumaTopology::num_cpus_;
+uint8_t* NumaTopology::cpu_partition_;
+int NumaTopology::partition_node_[kNumaPartitions];
+
+#if defined(HAVE_SCHED_GETCPU) && defined(__linux__)
+
+// Reads small sysfs file into buf. We cannot use stdio here, since
+// we're called from inside malloc initialization.
+static bool ReadSysfsFile(const char* path, char* buf, size_t size) {
+  int fd;
+  do {
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  } while (fd < 0 && errno == EINTR);
+  if (fd < 0) {
+    return false;
+  }
+
+  ssize_t len;
+  do {
+    len = read(fd, buf, size - 1);
+  } while (len < 0 && errno == EINTR);
+  close(fd);
+  if (len <= 0) {
+    return false;
+  }
+  buf[len] = 0;
+  return true;
+}
+
+// Parses list of ranges like "0-3,8-11\n" (kernel's cpulist format)
+// calling body for every id in the list.
+template <typename Body>
+static void ForEachInList(const char* list, const Body& body) {
+  const char* p = list;
+  while (*p >= '0' && *p <= '9') {
+    char* end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (*end == '-') {
+      last = strtol(end + 1, &end, 10);
+    }
+    for (long i = first; i <= last; i++) {
+      body(static_cast<int>(i));
+    }
+    if (*end != ',') {
+      break;
+    }
+    p = end + 1;
+  }
+}
+
+// Writes "/sys/devices/system/node/node<N>/cpulist" into buf.
+static void NodeCpuListPath(int node, char* buf) {
+  static const char kPrefix[] = "/sys/devices/system/node/node";
+  static const char kSuffix[] = "/cpulist";
+  memcpy(buf, kPrefix, sizeof(kPrefix) - 1);
+  buf += sizeof(kPrefix) - 1;
+
+  char digits[16];
+  int n = 0;
+  do {
+    digits[n++] = '0' + node % 10;
+    node /= 10;
+  } while (node > 0);
+  while (n > 0) {
+    *buf++ = digits[--n];
+  }
+  memcpy(buf, kSuffix, sizeof(kSuffix));
+}
+
+// Replicates size classes for as many partitions (up to wanted) as
+// fit. Returns number of partitions, or 0 if not even two fit.
+static int ReplicateSizeClasses(int wanted) {
+  SizeMap* sizemap = Static::sizemap();
+  for (int partitions = wanted; partitions >= 2; partitions--) {
+    if (sizemap->ReplicateForNumaPartitions(partitions)) {
+      return partitions;
+    }
+  }
+  Log(kLog, __FILE__, __LINE__,
+      "tcmalloc: too many size classes for NUMA partitions",
+      sizemap->num_size_classes);
+  return 0;
+}
+
+void NumaTopology::InitModule() {
+  ASSERT(Static::pageheap_lock()->IsHeld());
+
+  if (kNumaPartitions < 2) {
+    return;
+  }
+
+  const size_t base_classes = Static::sizemap()->num_size_classes;
+
+  bool want = commandlineflags::StringToBool(
+    TCMallocGetenvSafe("TCMALLOC_NUMA_AWARE"), false);
+  if (!want || sched_getcpu() < 0) {
+    return;
+  }
+
+  int fake_nodes = 0;
+  if (const char* fake = TCMallocGetenvSafe("TCMALLOC_NUMA_FAKE_NODES")) {
+    fake_nodes = std::max<long>(strtol(fake, nullptr, 10), 0);
+  }
+
+  char buf[4096];
+  if (!ReadSysfsFile("/sys/devices/system/cpu/possible", buf, sizeof(buf))) {
+    return;
+  }
+  int num_cpus = 0;
+  ForEachInList(buf, [&] (int cpu) { num_cpus = std::max(num_cpus, cpu + 1); });
+  if (num_cpus == 0) {
+    return;
+  }
+
+  int nodes[256];
+  int num_nodes = 0;
+  if (fake_nodes > 0) {
+    num_nodes = std::min(fake_nodes, 256);
+    for (int i = 0; i < num_nodes; i++) {
+      nodes[i] = i;
+    }
+  } else {
+    if (!ReadSysfsFile("/sys/devices/system/node/possible", buf, sizeof(buf))) {
+      return;
+    }
+    ForEachInList(buf, [&] (int node) {
+      if (num_nodes < 256) {
+        nodes[num_nodes++] = node;
+      }
+    });
+  }
+  if (num_nodes < 2) {
+    // Nothing to gain on single node machines.
+    return;
+  }
+
+  uint8_t* cpu_partition = static_cast<uint8_t*>(MetaDataAlloc(num_cpus));
+  if (cpu_partition == nullptr) {
+    return;
+  }
+
+  const int partitions = ReplicateSizeClasses(
+    std::min(num_nodes, kNumaPartitions));
+  if (partitions == 0) {
+    return;
+  }
+  memset(cpu_partition, 0, num_cpus);
+
+  int partition_node[kNumaPartitions];
+  std::fill(partition_node, partition_node + kNumaPartitions, -1);
+
+  if (fake_nodes > 0) {
+    // Fake topology doesn't bind memory anywhere.
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+      cpu_partition[cpu] = (cpu % fake_nodes) % partitions;
+    }
+  } else {
+    for (int i = 0; i < num_nodes; i++) {
+      const int node = nodes[i];
+      const int partition = node % partitions;
+      if (partition_node[partition] < 0) {
+        partition_node[partition] = node;
+      }
+      char path[64];
+      NodeCpuListPath(node, path);
+      if (!ReadSysfsFile(path, buf, sizeof(buf))) {
+        continue;
+      }
+      ForEachInList(buf, [&] (int cpu) {
+        if (cpu < num_cpus) {
+          cpu_partition[cpu] = partition;
+        }
+      });
+    }
+  }
+
+  class_stride_ = base_classes - 1;
+  num_partitions_ = partitions;
+  num_cpus_ = num_cpus;
+  cpu_partition_ = cpu_partition;
+  std::copy(partition_node, partition_node + kNumaPartitions, partition_node_);
+  active_ = true;
+}
+
+void NumaTopology::BindMemory(void* ptr, size_t size, int partition) {
+  if (!active_) {
+    return;
+  }
+  const int node = partition_node_[partition];
+  unsigned long mask;
+  if (node < 0 || node >= static_cast<int>(sizeof(mask) * 8)) {
+    return;
+  }
+  // Note, maxnode argument is off by one in the kernel (it wants
+  // number of bits plus one).
+  mask = 1UL << node;
+  syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+}
+
+#else  // !HAVE_SCHED_GETCPU || !__linux__
+
+void NumaTopology::InitModule() {}
+
+void NumaTopology::BindMemory(void* ptr, size_t size, int partition) {}
+
+#endif  // !HAVE_SCHED_GETCPU || !__linux__
+
+}  // namespace tcmalloc
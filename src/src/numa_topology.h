@@ -0,0 +1,153 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2026, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TCMALLOC_NUMA_TOPOLOGY_H_
+#define TCMALLOC_NUMA_TOPOLOGY_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HAVE_SCHED_GETCPU
+#include <sched.h>
+#endif
+
+#include "base/basictypes.h"
+#include "common.h"
+
+// This module implements optional NUMA awareness. When enabled
+// (TCMALLOC_NUMA_AWARE=t), the heap is split into kNumaPartitions
+// partitions, and NUMA node N belongs to partition N %
+// kNumaPartitions. Every partition has its own copy of each size
+// class, and therefore its own central free lists, transfer caches
+// and thread (or per-CPU) cache freelists. Page heap keeps separate
+// free lists per partition too, and fresh system memory is bound to
+// the partition's node with mbind.
+//
+// Allocations are served from the partition of the CPU the calling
+// thread currently runs on. Frees find size class (and thus the
+// partition) through the span, so objects always return to the
+// partition they came from. Sized deallocation cannot trust the size
+// hint for that reason, so it falls back to pagemap lookups.
+//
+// TCMALLOC_NUMA_FAKE_NODES=N pretends that cpu C is on node C % N
+// and doesn't bind any memory. It lets us exercise this code on
+// single node machines.
+//
+// This needs tcmalloc built with TCMALLOC_NUMA_PARTITIONS (see
+// common.h). Since every partition has its own copy of size classes
+// in 8-bit size class space, fewer partitions than nodes may fit.
+//
+// Heap partitions of tenants (see heap_partition.h) are a separate
+// thing and can be combined with these.
+
+namespace tcmalloc {
+
+class NumaTopology {
+ public:
+  // Decides whether NUMA awareness is to be used and replicates size
+  // classes for every partition.
+  // REQUIRES: Static::pageheap_lock is held and size map is
+  // initialized, but central free lists are not yet.
+  static void InitModule();
+
+  static bool Active() { return active_; }
+
+  // Number of partitions in use. It is between 2 and kNumaPartitions
+  // when active and 1 otherwise.
+  static int num_partitions() { return num_partitions_; }
+
+  // Returns partition of the CPU we're running on.
+  static int CurrentPartition();
+
+  // Maps size class found by SizeMap::GetSizeClass to the same size
+  // class of the current partition.
+  static uint32_t LocalSizeClass(uint32_t cl);
+
+  static int PartitionOfClass(uint32_t cl) {
+    if (!active_ || cl == 0) {
+      return 0;
+    }
+    return (cl - 1) / class_stride_;
+  }
+
+  // Asks the kernel to back [ptr, ptr + size) by memory of the given
+  // partition's node. Failures are ignored, since this is only a
+  // performance hint.
+  static void BindMemory(void* ptr, size_t size, int partition);
+
+  // Makes all allocations come from given partition rather than from
+  // current CPU's one. -1 restores normal behavior. Used by tests.
+  static void set_forced_partition(int partition) {
+    forced_partition_ = partition;
+  }
+
+ private:
+  static bool active_;
+  static int num_partitions_;
+  static uint32_t class_stride_;
+  static volatile int forced_partition_;
+
+  // Maps cpu id to partition. Built from sysfs.
+  static int num_cpus_;
+  static uint8_t* cpu_partition_;
+
+  // Node which memory of each partition is bound to, or -1.
+  static int partition_node_[kNumaPartitions];
+};
+
+inline int NumaTopology::CurrentPartition() {
+  if (PREDICT_TRUE(!active_)) {
+    return 0;
+  }
+  if (PREDICT_FALSE(forced_partition_ >= 0)) {
+    return forced_partition_;
+  }
+#ifdef HAVE_SCHED_GETCPU
+  unsigned cpu = sched_getcpu();
+  if (PREDICT_TRUE(cpu < static_cast<unsigned>(num_cpus_))) {
+    return cpu_partition_[cpu];
+  }
+#endif
+  // Either sched_getcpu failed or we're seeing cpu hotplug after
+  // init. Any partition will do.
+  return 0;
+}
+
+ALWAYS_INLINE uint32_t NumaTopology::LocalSizeClass(uint32_t cl) {
+  if (PREDICT_TRUE(!active_)) {
+    return cl;
+  }
+  return cl + CurrentPartition() * class_stride_;
+}
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_NUMA_TOPOLOGY_H_
@@ -143,9 +143,10 @@ class PackedCache {
 #else
   static const int kHashbits = 16;
 #endif
-  static const int kValuebits = 7;
+  // Size classes replicated for NUMA partitions need one extra bit.
+  static const int kValuebits = (kClassSizesMax > 128) ? 8 : 7;
   // one bit after value bits
-  static const int kInvalidMask = 0x80;
+  static const int kInvalidMask = 1 << kValuebits;
 
   explicit PackedCache() {
     static_assert(kKeybits + kValuebits + 1 <= 8 * sizeof(T));
@@ -172,8 +173,10 @@ class PackedCache {
   }
 
   void Clear() {
-    // sets 'invalid' bit in every byte, include value byte
-    memset(const_cast<T* >(array_), kInvalidMask, sizeof(array_));
+    // sets 'invalid' bit in every entry
+    for (size_t i = 0; i < (1 << kHashbits); i++) {
+      array_[i] = kInvalidMask;
+    }
   }
 
   void Put(K key, V value) {
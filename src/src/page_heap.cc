@@ -35,8 +35,10 @@
 
 #include <inttypes.h>                   // for PRIuPTR
 #include <errno.h>                      // for ENOMEM, errno
+#include <time.h>                       // for clock_gettime
 
 #include <algorithm>
+#include <chrono>
 #include <limits>
 
 #include "base/basictypes.h"
@@ -44,6 +46,7 @@
 #include "gperftools/malloc_extension.h"      // for MallocRange, etc
 #include "internal_logging.h"  // for ASSERT, TCMalloc_Printer, etc
 #include "malloc_backtrace.h"
+#include "numa_topology.h"    // for NumaTopology
 #include "page_heap_allocator.h"  // for PageHeapAllocator
 #include "static_vars.h"       // for Static
 #include "system-alloc.h"      // for TCMalloc_SystemAlloc, etc
@@ -66,6 +69,13 @@ DEFINE_int64(tcmalloc_heap_limit_mb,
 
 namespace tcmalloc {
 
+// Shift that turns page number into hugepage number.
+static const int kHugePageBits = kHugePageShift - kPageShift;
+
+// How many spans of the free list we look at when looking for the
+// fullest hugepage.
+static const int kMaxHugePageCandidates = 16;
+
 struct SCOPED_LOCKABLE PageHeap::LockingContext {
   PageHeap * const heap;
   size_t grown_by = 0;
@@ -79,45 +89,145 @@ struct SCOPED_LOCKABLE PageHeap::LockingContext {
   }
 };
 
+// Milliseconds of monotonic clock, for Span::free_time. We take it
+// on every free, and milliseconds are all we need, so where there is
+// a coarse clock (which is a plain read of time kept by the kernel)
+// we use that.
+static int64_t NowMs() {
+#ifdef CLOCK_MONOTONIC_COARSE
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0) {
+    return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+  }
+#endif
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Adds free span to the list of normal free spans, which we keep
+// ordered from youngest to oldest. Spans are usually added right
+// after being freed, so they go to the front. But parts of old spans
+// that are split off keep their free time, so we walk from the oldest
+// end to find their place. Those are usually among the oldest, so the
+// walk is short.
+static void PrependByAge(Span* list, Span* span) {
+  Span* pos = list;
+  if (!DLL_IsEmpty(list) && span->free_time < list->next->free_time) {
+    pos = list->prev;
+    while (pos->free_time < span->free_time) {
+      pos = pos->prev;
+    }
+  }
+  DLL_Prepend(pos, span);
+}
+
+// Returns whether span covers at least one whole hugepage.
+static bool HasWholeHugePage(const Span* s) {
+  const PageID start = (s->start + kPagesPerHugePage - 1) & ~(kPagesPerHugePage - 1);
+  return start + kPagesPerHugePage <= s->start + s->length;
+}
+
+// Helpers for lists of free spans linked through Span::age_link
+// (index 0 is next and 1 is prev). AgeListPrependByAge keeps order
+// like PrependByAge.
+static void AgeListInit(Span* list) {
+  list->age_link[0] = list->age_link[1] = list;
+}
+
+static void AgeListPrependByAge(Span* list, Span* span) {
+  Span* pos = list;
+  if (list->age_link[0] != list
+      && span->free_time < list->age_link[0]->free_time) {
+    pos = list->age_link[1];
+    while (pos->free_time < span->free_time) {
+      pos = pos->age_link[1];
+    }
+  }
+  span->age_link[0] = pos->age_link[0];
+  span->age_link[1] = pos;
+  pos->age_link[0]->age_link[1] = span;
+  pos->age_link[0] = span;
+}
+
+static void AgeListRemove(Span* span) {
+  span->age_link[1]->age_link[0] = span->age_link[0];
+  span->age_link[0]->age_link[1] = span->age_link[1];
+  span->age_link[0] = span->age_link[1] = nullptr;
+}
 
 PageHeap::PageHeap(Length smallest_span_size)
     : smallest_span_size_(smallest_span_size),
-      pagemap_(MetaDataAlloc),
+      pagemap_(MetaDataAllocHugePages),
+      hugepage_map_(MetaDataAlloc),
+      hugepage_stats_{},
+      limit_(0),
+      parent_(nullptr),
+      partition_id_(0),
+      chunk_unmapped_bytes_(0),
+      span_allocator_(Static::span_allocator()),
       scavenge_counter_(0),
-      // Start scavenging at kMaxPages list
-      release_index_(kMaxPages),
-      aggressive_decommit_(false) {
+      release_min_age_ms_(0),
+      aggressive_decommit_(false),
+      hugepage_aware_(false),
+      pagemap_prefetch_(false),
+      background_release_(false),
+      in_scavenge_(false),
+      expiring_large_cache_(false),
+      large_cache_limit_(0),
+      large_cache_expiry_ms_(0),
+      release_batch_(false),
+      release_batch_low_pressure_(false),
+      dedicated_threshold_(0) {
   static_assert(kClassSizesMax <= (1 << PageMapCache::kValuebits));
+  // Page map keeps size classes in bytes.
+  static_assert(kClassSizesMax <= 256);
+  // Span::numa_partition is two bits.
+  static_assert(kNumaPartitions <= 4);
   // smallest_span_size needs to be power of 2.
   CHECK_CONDITION((smallest_span_size_ & (smallest_span_size_-1)) == 0);
-  for (int i = 0; i < kMaxPages; i++) {
-    DLL_Init(&free_[i].normal);
-    DLL_Init(&free_[i].returned);
+  for (int p = 0; p < kNumaPartitions; p++) {
+    for (int i = 0; i < kMaxPages; i++) {
+      DLL_Init(&free_[p][i].normal);
+      DLL_Init(&free_[p][i].returned);
+    }
+    DLL_Init(&large_normal_by_age_[p]);
+    DLL_Init(&large_hugepage_by_age_[p]);
+    partition_stats_[p] = PartitionStats{};
+  }
+  AgeListInit(&small_normal_by_age_);
+  AgeListInit(&small_hugepage_by_age_);
+  DLL_Init(&large_cache_);
+  DLL_Init(&release_pending_);
+  for (int p = 0; p < kNumaPartitions; p++) {
+    release_pending_pages_[p] = 0;
   }
 }
 
-Span* PageHeap::SearchFreeAndLargeLists(Length n) {
+Span* PageHeap::SearchFreeAndLargeLists(Length n, int partition) {
   ASSERT(lock_.IsHeld());
   ASSERT(Check());
   ASSERT(n > 0);
 
   // Find first size >= n that has a non-empty list
   for (Length s = n; s <= kMaxPages; s++) {
-    Span* ll = &free_[s - 1].normal;
+    Span* ll = &free_[partition][s - 1].normal;
     // If we're lucky, ll is non-empty, meaning it has a suitable span.
     if (!DLL_IsEmpty(ll)) {
       ASSERT(ll->next->location == Span::ON_NORMAL_FREELIST);
+      if (hugepage_aware_) {
+        return Carve(PickFullestHugePage(ll), n);
+      }
       return Carve(ll->next, n);
     }
     // Alternatively, maybe there's a usable returned span.
-    ll = &free_[s - 1].returned;
+    ll = &free_[partition][s - 1].returned;
     if (!DLL_IsEmpty(ll)) {
       // We did not call EnsureLimit before, to avoid releasing the span
       // that will be taken immediately back.
       // Calling EnsureLimit here is not very expensive, as it fails only if
       // there is no more normal spans (and it fails efficiently)
       // or SystemRelease does not work (there is probably no returned spans).
-      if (EnsureLimit(n)) {
+      if (EnsureLimit(n, partition)) {
         // ll may have became empty due to coalescing
         if (!DLL_IsEmpty(ll)) {
           ASSERT(ll->next->location == Span::ON_RETURNED_FREELIST);
@@ -127,7 +237,7 @@ Span* PageHeap::SearchFreeAndLargeLists(Length n) {
     }
   }
   // No luck in free lists, our last chance is in a larger class.
-  return AllocLarge(n);  // May be nullptr
+  return AllocLarge(n, partition);  // May be nullptr
 }
 
 static const size_t kForcedCoalesceInterval = 128*1024*1024;
@@ -159,9 +269,25 @@ void PageHeap::HandleUnlock(LockingContext* context) {
 }
 
 Span* PageHeap::NewWithSizeClass(Length n, uint32_t sizeclass) {
+  // Spans for small objects come from partition of their size
+  // class, which is normally the current one anyways.
+  const int partition = (sizeclass != 0
+                         ? NumaTopology::PartitionOfClass(sizeclass)
+                         : NumaTopology::CurrentPartition());
+
   LockingContext context{this, &lock_};
 
-  Span* span = NewLocked(n, &context);
+  Span* span = nullptr;
+  if (sizeclass == 0 && large_cache_limit_ != 0) {
+    span = TakeCachedSpan(RoundUpSize(n), partition);
+  }
+  if (span == nullptr && sizeclass == 0 && dedicated_threshold_ != 0
+      && n >= dedicated_threshold_) {
+    span = NewDedicatedLocked(n, partition, &context);
+  }
+  if (span == nullptr) {
+    span = NewLocked(n, partition, &context);
+  }
   if (!span) {
     return span;
   }
@@ -172,12 +298,12 @@ Span* PageHeap::NewWithSizeClass(Length n, uint32_t sizeclass) {
   return span;
 }
 
-Span* PageHeap::NewLocked(Length n, LockingContext* context) {
+Span* PageHeap::NewLocked(Length n, int partition, LockingContext* context) {
   ASSERT(lock_.IsHeld());
   ASSERT(Check());
   n = RoundUpSize(n);
 
-  Span* result = SearchFreeAndLargeLists(n);
+  Span* result = SearchFreeAndLargeLists(n, partition);
   if (result != nullptr)
     return result;
 
@@ -209,12 +335,19 @@ Span* PageHeap::NewLocked(Length n, LockingContext* context) {
     // insufficiently big large spans back to OS. So in case of really
     // unlucky memory fragmentation we'll be consuming virtual address
     // space, but not real memory
-    result = SearchFreeAndLargeLists(n);
+    result = SearchFreeAndLargeLists(n, partition);
     if (result != nullptr) return result;
   }
 
   // Grow the heap and try again.
-  if (!GrowHeap(n, context)) {
+  if (!GrowHeap(n, partition, context)) {
+    // Remote memory is still better than no memory.
+    for (int p = 0; p < kNumaPartitions; p++) {
+      if (p != partition) {
+        result = SearchFreeAndLargeLists(n, p);
+        if (result != nullptr) return result;
+      }
+    }
     ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
     ASSERT(Check());
     // underlying SysAllocator likely set ENOMEM but we can get here
@@ -225,7 +358,7 @@ Span* PageHeap::NewLocked(Length n, LockingContext* context) {
     errno = ENOMEM;
     return nullptr;
   }
-  return SearchFreeAndLargeLists(n);
+  return SearchFreeAndLargeLists(n, partition);
 }
 
 Span* PageHeap::NewAligned(Length n, Length align_pages) {
@@ -241,9 +374,11 @@ Span* PageHeap::NewAligned(Length n, Length align_pages) {
     return nullptr;
   }
 
+  const int partition = NumaTopology::CurrentPartition();
+
   LockingContext context{this, &lock_};
 
-  Span* span = NewLocked(alloc, &context);
+  Span* span = NewLocked(alloc, partition, &context);
   if (PREDICT_FALSE(span == nullptr)) return nullptr;
 
   // Skip starting portion so that we end up aligned
@@ -268,32 +403,20 @@ Span* PageHeap::NewAligned(Length n, Length align_pages) {
   return span;
 }
 
-Span* PageHeap::AllocLarge(Length n) {
+Span* PageHeap::AllocLarge(Length n, int partition) {
   ASSERT(lock_.IsHeld());
-  Span *best = nullptr;
-  Span *best_normal = nullptr;
-
-  // Create a Span to use as an upper bound.
-  Span bound;
-  bound.start = 0;
-  bound.length = n;
-
   // First search the NORMAL spans..
-  SpanSetIter place = large_normal_.upper_bound(SpanPtrWithLength(&bound));
-  if (place != large_normal_.end()) {
-    best = place->span;
-    best_normal = best;
-    ASSERT(best->location == Span::ON_NORMAL_FREELIST);
-  }
+  Span *best_normal = large_normal_[partition].BestFit(n);
+  Span *best = best_normal;
+  ASSERT(best == nullptr || best->location == Span::ON_NORMAL_FREELIST);
 
   // Try to find better fit from RETURNED spans.
-  place = large_returned_.upper_bound(SpanPtrWithLength(&bound));
-  if (place != large_returned_.end()) {
-    Span *c = place->span;
+  Span *c = large_returned_[partition].BestFit(n);
+  if (c != nullptr) {
     ASSERT(c->location == Span::ON_RETURNED_FREELIST);
     if (best_normal == nullptr
         || c->length < best->length)
-      best = place->span;
+      best = c;
   }
 
   if (best == best_normal) {
@@ -302,15 +425,15 @@ Span* PageHeap::AllocLarge(Length n) {
 
   // best comes from RETURNED set.
 
-  if (EnsureLimit(n, false)) {
+  if (EnsureLimit(n, partition, false)) {
     return Carve(best, n);
   }
 
-  if (EnsureLimit(n, true)) {
+  if (EnsureLimit(n, partition, true)) {
     // best could have been destroyed by coalescing.
     // best_normal is not a best-fit, and it could be destroyed as well.
     // We retry, the limit is already ensured:
-    return AllocLarge(n);
+    return AllocLarge(n, partition);
   }
 
   // If best_normal existed, EnsureLimit would succeeded:
@@ -329,6 +452,8 @@ Span* PageHeap::Split(Span* span, Length n) {
   const int extra = span->length - n;
   Span* leftover = NewSpan(span->start + n, extra);
   ASSERT(leftover->location == Span::IN_USE);
+  leftover->numa_partition = span->numa_partition;
+  leftover->free_time = span->free_time;
   RecordSpan(leftover);
   pagemap_.set(span->start + n - 1, span); // Update map from pageid to span
   span->length = n;
@@ -336,6 +461,182 @@ Span* PageHeap::Split(Span* span, Length n) {
   return leftover;
 }
 
+bool PageHeap::ResizeInPlace(Span* span, Length n) {
+  ASSERT(n > 0);
+  SpinLockHolder h(&lock_);
+  ASSERT(span->location == Span::IN_USE);
+  ASSERT(span->sizeclass == 0);
+  n = RoundUpSize(n);
+
+  if (span->dedicated) {
+    return ResizeDedicatedLocked(span, n, false);
+  }
+
+  if (n < span->length) {
+    Span* tail = Split(span, n);
+    DeleteLocked(tail);
+    return true;
+  }
+  if (n == span->length) {
+    return true;
+  }
+
+  const Length extra = n - span->length;
+  auto usable_next = [this, span, extra] () -> Span* {
+    Span* next = GetDescriptor(span->start + span->length);
+    if (next == nullptr
+        || next->location == Span::IN_USE
+        || next->numa_partition != span->numa_partition
+        || next->length < extra) {
+      return nullptr;
+    }
+    return next;
+  };
+  Span* next = usable_next();
+  if (next == nullptr) {
+    return false;
+  }
+  // Like in AllocLarge, taking released pages back must respect heap
+  // limits.
+  if (next->location == Span::ON_RETURNED_FREELIST
+      && !EnsureLimit(extra, span->numa_partition, false)) {
+    if (!EnsureLimit(extra, span->numa_partition, true)) {
+      return false;
+    }
+    // next could have been coalesced with released neighbours.
+    next = usable_next();
+    if (next == nullptr) {
+      return false;
+    }
+  }
+
+  // Carve takes care of free lists, stats and recommitting released
+  // memory. Then we just absorb carved pages.
+  next = Carve(next, extra);
+  ASSERT(next->start == span->start + span->length);
+  DeleteSpan(next);
+  span->length = n;
+  RecordSpan(span);
+  ASSERT(Check());
+  return true;
+}
+
+bool PageHeap::RemapDedicated(Span* span, Length n) {
+  ASSERT(n > 0);
+  SpinLockHolder h(&lock_);
+  ASSERT(span->location == Span::IN_USE);
+  ASSERT(span->dedicated);
+  return ResizeDedicatedLocked(span, RoundUpSize(n), true);
+}
+
+Span* PageHeap::NewDedicatedLocked(Length n, int partition,
+                                   LockingContext* context) {
+  ASSERT(lock_.IsHeld());
+  n = RoundUpSize(n);
+  if (n > kMaxValidPages || !EnsureLimit(n, partition)) {
+    return nullptr;
+  }
+  void* ptr = TCMalloc_SystemMapDedicated(n << kPageShift);
+  if (ptr == nullptr) {
+    return nullptr;
+  }
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  if (!pagemap_.Ensure(p, n)) {
+    TCMalloc_SystemUnmapDedicated(ptr, n << kPageShift);
+    return nullptr;
+  }
+  context->grown_by += n << kPageShift;
+  NumaTopology::BindMemory(ptr, n << kPageShift, partition);
+  if (hugepage_aware_) {
+    TCMalloc_SystemHintHugePages(ptr, n << kPageShift);
+  }
+
+  Span* span = NewSpan(p, n);
+  ASSERT(span->location == Span::IN_USE);
+  span->numa_partition = partition;
+  span->dedicated = 1;
+  RecordSpan(span);
+
+  ++stats_.reserve_count;
+  ++stats_.commit_count;
+  stats_.total_reserve_bytes += n << kPageShift;
+  stats_.total_commit_bytes += n << kPageShift;
+  AccountDedicated(span, true);
+  return span;
+}
+
+void PageHeap::DeleteDedicatedLocked(Span* span) {
+  ASSERT(lock_.IsHeld());
+  ASSERT(span->dedicated);
+  // Once unmapped, the range can be reused by anyone, including us
+  // growing the heap. So pagemap must not point at this span.
+  pagemap_.set(span->start, nullptr);
+  pagemap_.set(span->start + span->length - 1, nullptr);
+  AccountDedicated(span, false);
+  TCMalloc_SystemUnmapDedicated(reinterpret_cast<void*>(span->start << kPageShift),
+                                span->length << kPageShift);
+  DeleteSpan(span);
+}
+
+bool PageHeap::ResizeDedicatedLocked(Span* span, Length n, bool may_move) {
+  ASSERT(lock_.IsHeld());
+  ASSERT(span->dedicated);
+  if (n == span->length) {
+    return true;
+  }
+  if (n > kMaxValidPages
+      || (n > span->length
+          && !EnsureLimit(n - span->length, span->numa_partition))) {
+    return false;
+  }
+  // When growing in place we need pagemap entries for the new end
+  // before we touch the mapping.
+  if (!may_move && !pagemap_.Ensure(span->start, n)) {
+    return false;
+  }
+
+  // We hold lock_ across mremap, so nobody else can grow the heap
+  // into the old range while pagemap still points at this span.
+  void* ptr = TCMalloc_SystemRemapDedicated(
+    reinterpret_cast<void*>(span->start << kPageShift),
+    span->length << kPageShift, n << kPageShift, may_move);
+  if (ptr == nullptr) {
+    return false;
+  }
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  if (!pagemap_.Ensure(p, n)) {
+    // Memory is already moved, and MetaDataAlloc failing is fatal
+    // elsewhere too.
+    Log(kCrash, __FILE__, __LINE__,
+        "tcmalloc: out of memory for pagemap of dedicated mapping", n);
+  }
+
+  AccountDedicated(span, false);
+  pagemap_.set(span->start, nullptr);
+  pagemap_.set(span->start + span->length - 1, nullptr);
+  span->start = p;
+  span->length = n;
+  RecordSpan(span);
+  AccountDedicated(span, true);
+  ++stats_.remap_count;
+  return true;
+}
+
+void PageHeap::AccountDedicated(Span* span, bool add) {
+  const uint64_t bytes = span->length << kPageShift;
+  if (add) {
+    stats_.system_bytes += bytes;
+    stats_.committed_bytes += bytes;
+    stats_.dedicated_bytes += bytes;
+    partition_stats_[span->numa_partition].system_bytes += bytes;
+  } else {
+    stats_.system_bytes -= bytes;
+    stats_.committed_bytes -= bytes;
+    stats_.dedicated_bytes -= bytes;
+    partition_stats_[span->numa_partition].system_bytes -= bytes;
+  }
+}
+
 void PageHeap::CommitSpan(Span* span) {
   ++stats_.commit_count;
 
@@ -348,16 +649,23 @@ void PageHeap::CommitSpan(Span* span) {
 bool PageHeap::DecommitSpan(Span* span) {
   ++stats_.decommit_count;
 
+  bool lazy;
   bool rv = TCMalloc_SystemRelease(reinterpret_cast<void*>(span->start << kPageShift),
-                                   static_cast<size_t>(span->length << kPageShift));
+                                   static_cast<size_t>(span->length << kPageShift),
+                                   in_scavenge_, &lazy);
   if (rv) {
-    stats_.committed_bytes -= span->length << kPageShift;
-    stats_.total_decommit_bytes += (span->length << kPageShift);
+    AccountDecommit(span, lazy);
   }
 
   return rv;
 }
 
+void PageHeap::AccountDecommit(Span* span, bool lazy) {
+  span->lazy_pages = lazy ? span->length : 0;
+  stats_.committed_bytes -= span->length << kPageShift;
+  stats_.total_decommit_bytes += (span->length << kPageShift);
+}
+
 Span* PageHeap::Carve(Span* span, Length n) {
   ASSERT(n > 0);
   ASSERT(span->location != Span::IN_USE);
@@ -370,18 +678,28 @@ Span* PageHeap::Carve(Span* span, Length n) {
   if (extra > 0) {
     Span* leftover = NewSpan(span->start + n, extra);
     leftover->location = old_location;
+    leftover->numa_partition = span->numa_partition;
+    if (old_location == Span::ON_RETURNED_FREELIST) {
+      // We don't know which pages were released lazily, so leftover
+      // gets as many of them as it can have.
+      leftover->lazy_pages = std::min<Length>(span->lazy_pages, extra);
+    } else {
+      leftover->free_time = span->free_time;
+    }
     RecordSpan(leftover);
 
     // The previous span of |leftover| was just splitted -- no need to
     // coalesce them. The next span of |leftover| was not previously coalesced
-    // with |span|, i.e. is nullptr or has got location other than |old_location|.
+    // with |span|, i.e. is nullptr or has got location other than |old_location|
+    // or belongs to other numa partition.
 #ifndef NDEBUG
     const PageID p = leftover->start;
     const Length len = leftover->length;
     Span* next = GetDescriptor(p+len);
     ASSERT (next == nullptr ||
             next->location == Span::IN_USE ||
-            next->location != leftover->location);
+            next->location != leftover->location ||
+            next->numa_partition != leftover->numa_partition);
 #endif
 
     PrependToFreeList(leftover);  // Skip coalescing - no candidates possible
@@ -401,20 +719,128 @@ Span* PageHeap::Carve(Span* span, Length n) {
 
 void PageHeap::Delete(Span* span) {
   SpinLockHolder h(&lock_);
-  DeleteLocked(span);
+  StartReleaseBatch();
+  if (!CacheLargeSpan(span)) {
+    DeleteLocked(span);
+  }
+  FinishReleaseBatch();
+}
+
+bool PageHeap::CacheLargeSpan(Span* span) {
+  ASSERT(lock_.IsHeld());
+  ASSERT(span->location == Span::IN_USE);
+  CHECK_CONDITION(!span->cached);
+  const uint64_t bytes = span->length << kPageShift;
+  if (span->length <= kMaxPages || span->sizeclass != 0 || span->arena
+      || bytes > large_cache_limit_) {
+    return false;
+  }
+  TrimLargeCache(large_cache_limit_ - bytes);
+
+  span->sample = 0;
+  span->cached = 1;
+  span->free_time = NowMs();
+  DLL_Prepend(&large_cache_, span);
+  stats_.large_cache_bytes += bytes;
+  return true;
+}
+
+Span* PageHeap::TakeCachedSpan(Length n, int partition) {
+  ASSERT(lock_.IsHeld());
+  if (n <= kMaxPages || (n << kPageShift) > large_cache_limit_) {
+    // We'd never cache span of this size.
+    return nullptr;
+  }
+  TrimLargeCache(large_cache_limit_);
+
+  // Span has to be what we'd allocate anyways: of same partition,
+  // and with own mapping only if allocation would get one.
+  const bool dedicated = (dedicated_threshold_ != 0
+                          && n >= dedicated_threshold_);
+  Span* best = nullptr;
+  for (Span* s = large_cache_.next; s != &large_cache_; s = s->next) {
+    if (s->numa_partition != partition || s->dedicated != dedicated
+        || s->length < n || s->length - n > (n >> kLargeCacheSlackShift)) {
+      continue;
+    }
+    if (best == nullptr || s->length < best->length) {
+      best = s;
+      if (s->length == n) {
+        break;
+      }
+    }
+  }
+  if (best == nullptr) {
+    ++stats_.large_cache_misses;
+    return nullptr;
+  }
+  ++stats_.large_cache_hits;
+
+  DLL_Remove(best);
+  best->cached = 0;
+  stats_.large_cache_bytes -= best->length << kPageShift;
+  if (best->length > n) {
+    if (best->dedicated) {
+      // If shrinking fails, span is just a bit longer than asked.
+      ResizeDedicatedLocked(best, n, false);
+    } else {
+      DeleteLocked(Split(best, n));
+    }
+  }
+  return best;
+}
+
+void PageHeap::TrimLargeCache(uint64_t limit) {
+  ASSERT(lock_.IsHeld());
+  if (DLL_IsEmpty(&large_cache_)) {
+    return;
+  }
+  const int64_t now = NowMs();
+  while (!DLL_IsEmpty(&large_cache_)) {
+    Span* oldest = large_cache_.prev;
+    if (stats_.large_cache_bytes <= limit
+        && now - oldest->free_time < large_cache_expiry_ms_) {
+      break;
+    }
+    DLL_Remove(oldest);
+    oldest->cached = 0;
+    stats_.large_cache_bytes -= oldest->length << kPageShift;
+    DeleteLocked(oldest);
+  }
+}
+
+void PageHeap::ExpireLargeCache() {
+  ASSERT(lock_.IsHeld());
+  ASSERT(!expiring_large_cache_);
+  // Spans we free here must not start another scavenge from
+  // IncrementalScavenge.
+  expiring_large_cache_ = true;
+  TrimLargeCache(large_cache_limit_);
+  expiring_large_cache_ = false;
 }
 
 void PageHeap::DeleteLocked(Span* span) {
   ASSERT(lock_.IsHeld());
   ASSERT(Check());
   ASSERT(span->location == Span::IN_USE);
+  ASSERT(!span->cached);
   ASSERT(span->length > 0);
   ASSERT(GetDescriptor(span->start) == span);
   ASSERT(GetDescriptor(span->start + span->length - 1) == span);
+  if (span->dedicated) {
+    DeleteDedicatedLocked(span);
+    return;
+  }
   const Length n = span->length;
+  if (span->sizeclass != 0) {
+    for (Length i = 0; i < n; i++) {
+      pagemap_.set_sizeclass(span->start + i, 0);
+    }
+  }
   span->sizeclass = 0;
   span->sample = 0;
   span->location = Span::ON_NORMAL_FREELIST;
+  span->free_time = NowMs();
   MergeIntoFreeList(span);  // Coalesces if possible
   IncrementalScavenge(n);
   ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
@@ -430,6 +856,10 @@ Span* PageHeap::CheckAndHandlePreMerge(Span* span, Span* other) {
   if (other == nullptr) {
     return other;
   }
+  // Spans of different NUMA partitions are never merged.
+  if (other->numa_partition != span->numa_partition) {
+    return nullptr;
+  }
   // if we're in aggressive decommit mode and span is decommitted,
   // then we try to decommit adjacent span.
   if (aggressive_decommit_ && other->location == Span::ON_NORMAL_FREELIST
@@ -446,6 +876,17 @@ Span* PageHeap::CheckAndHandlePreMerge(Span* span, Span* other) {
   return other;
 }
 
+// Updates what span we're about to free keeps in Span::free_time or
+// lazy_pages, when other span is merged into it.
+static void MergeAgeOrLazyPages(Span* span, Span* other) {
+  if (span->location == Span::ON_RETURNED_FREELIST) {
+    span->lazy_pages += other->lazy_pages;
+  } else {
+    // Merged span is as young as its youngest part.
+    span->free_time = std::max(span->free_time, other->free_time);
+  }
+}
+
 void PageHeap::MergeIntoFreeList(Span* span) {
   ASSERT(lock_.IsHeld());
   ASSERT(span->location != Span::IN_USE);
@@ -471,6 +912,11 @@ void PageHeap::MergeIntoFreeList(Span* span) {
   const Length n = span->length;
 
   if (aggressive_decommit_ && span->location == Span::ON_NORMAL_FREELIST) {
+    if (release_batch_) {
+      // Coalesced with its neighbors once released.
+      QueueRelease(span);
+      return;
+    }
     if (DecommitSpan(span)) {
       span->location = Span::ON_RETURNED_FREELIST;
     }
@@ -481,6 +927,7 @@ void PageHeap::MergeIntoFreeList(Span* span) {
     // Merge preceding span into this span
     ASSERT(prev->start + prev->length == p);
     const Length len = prev->length;
+    MergeAgeOrLazyPages(span, prev);
     DeleteSpan(prev);
     span->start -= len;
     span->length += len;
@@ -491,6 +938,7 @@ void PageHeap::MergeIntoFreeList(Span* span) {
     // Merge next span into this span
     ASSERT(next->start == p+n);
     const Length len = next->length;
+    MergeAgeOrLazyPages(span, next);
     DeleteSpan(next);
     span->length += len;
     pagemap_.set(span->start + span->length - 1, span);
@@ -502,25 +950,40 @@ void PageHeap::MergeIntoFreeList(Span* span) {
 void PageHeap::PrependToFreeList(Span* span) {
   ASSERT(lock_.IsHeld());
   ASSERT(span->location != Span::IN_USE);
-  if (span->location == Span::ON_NORMAL_FREELIST)
+  const int partition = span->numa_partition;
+  if (span->location == Span::ON_NORMAL_FREELIST) {
     stats_.free_bytes += (span->length << kPageShift);
-  else
+    partition_stats_[partition].free_bytes += (span->length << kPageShift);
+  } else {
     stats_.unmapped_bytes += (span->length << kPageShift);
+    partition_stats_[partition].unmapped_bytes += (span->length << kPageShift);
+    stats_.lazily_freed_bytes += (span->lazy_pages << kPageShift);
+    AccountChunkUnmapped(span, true);
+  }
+  if (hugepage_aware_) {
+    AccountHugePages(span, true);
+  }
 
   if (span->length > kMaxPages) {
-    SpanSet *set = &large_normal_;
-    if (span->location == Span::ON_RETURNED_FREELIST)
-      set = &large_returned_;
-    std::pair<SpanSetIter, bool> p =
-        set->insert(SpanPtrWithLength(span));
-    ASSERT(p.second); // We never have duplicates since span->start is unique.
-    span->SetSpanSetIterator(p.first);
+    if (span->location == Span::ON_RETURNED_FREELIST) {
+      large_returned_[partition].Insert(span);
+    } else {
+      large_normal_[partition].Insert(span);
+    }
+    if (span->location == Span::ON_NORMAL_FREELIST) {
+      PrependByAge((HasWholeHugePage(span)
+                    ? &large_hugepage_by_age_[partition]
+                    : &large_normal_by_age_[partition]), span);
+    }
     return;
   }
 
-  SpanList* list = &free_[span->length - 1];
+  SpanList* list = &free_[partition][span->length - 1];
   if (span->location == Span::ON_NORMAL_FREELIST) {
-    DLL_Prepend(&list->normal, span);
+    PrependByAge(&list->normal, span);
+    AgeListPrependByAge((HasWholeHugePage(span)
+                         ? &small_hugepage_by_age_ : &small_normal_by_age_),
+                        span);
   } else {
     DLL_Prepend(&list->returned, span);
   }
@@ -529,40 +992,160 @@ void PageHeap::PrependToFreeList(Span* span) {
 void PageHeap::RemoveFromFreeList(Span* span) {
   ASSERT(lock_.IsHeld());
   ASSERT(span->location != Span::IN_USE);
+  const int partition = span->numa_partition;
   if (span->location == Span::ON_NORMAL_FREELIST) {
     stats_.free_bytes -= (span->length << kPageShift);
+    partition_stats_[partition].free_bytes -= (span->length << kPageShift);
   } else {
     stats_.unmapped_bytes -= (span->length << kPageShift);
+    partition_stats_[partition].unmapped_bytes -= (span->length << kPageShift);
+    stats_.lazily_freed_bytes -= (span->lazy_pages << kPageShift);
+    AccountChunkUnmapped(span, false);
+  }
+  if (hugepage_aware_) {
+    AccountHugePages(span, false);
   }
   if (span->length > kMaxPages) {
-    SpanSet *set = &large_normal_;
-    if (span->location == Span::ON_RETURNED_FREELIST)
-      set = &large_returned_;
-    SpanSetIter iter = span->ExtractSpanSetIterator();
-    ASSERT(iter->span == span);
-    ASSERT(set->find(SpanPtrWithLength(span)) == iter);
-    set->erase(iter);
+    if (span->location == Span::ON_RETURNED_FREELIST) {
+      large_returned_[partition].Remove(span);
+    } else {
+      large_normal_[partition].Remove(span);
+    }
+    if (span->location == Span::ON_NORMAL_FREELIST) {
+      DLL_Remove(span);
+    }
   } else {
+    if (span->location == Span::ON_NORMAL_FREELIST) {
+      AgeListRemove(span);
+    }
     DLL_Remove(span);
   }
 }
 
+void PageHeap::AccountHugePages(Span* span, bool add) {
+  const bool released = (span->location == Span::ON_RETURNED_FREELIST);
+  const PageID end = span->start + span->length;
+  for (PageID p = span->start; p < end; ) {
+    const uintptr_t hugepage = p >> kHugePageBits;
+    const PageID next = std::min<PageID>(end, (hugepage + 1) << kHugePageBits);
+    const Length n = next - p;
+    UpdateHugePage(hugepage, n, released ? n : 0, add);
+    p = next;
+  }
+}
+
+void PageHeap::UpdateHugePage(uintptr_t hugepage, Length free, Length released,
+                              bool add) {
+  uintptr_t value = reinterpret_cast<uintptr_t>(hugepage_map_.get(hugepage));
+  Length old_free = value & 0xffff;
+  Length old_released = value >> 16;
+  Length new_free = add ? old_free + free : old_free - free;
+  Length new_released = add ? old_released + released : old_released - released;
+  ASSERT(new_free <= kPagesPerHugePage);
+  ASSERT(new_released <= new_free);
+
+  auto is_free = [] (Length f, Length r) {
+    return f == kPagesPerHugePage && r == 0;
+  };
+  auto is_broken = [] (Length f, Length r) {
+    return r > 0 && r < kPagesPerHugePage;
+  };
+  if (is_free(old_free, old_released)) {
+    hugepage_stats_.free_hugepages--;
+  }
+  if (is_broken(old_free, old_released)) {
+    hugepage_stats_.broken_hugepages--;
+    hugepage_stats_.broken_bytes -= (kPagesPerHugePage - old_released) << kPageShift;
+  }
+  if (is_free(new_free, new_released)) {
+    hugepage_stats_.free_hugepages++;
+  }
+  if (is_broken(new_free, new_released)) {
+    hugepage_stats_.broken_hugepages++;
+    hugepage_stats_.broken_bytes += (kPagesPerHugePage - new_released) << kPageShift;
+  }
+
+  value = new_free | (new_released << 16);
+  hugepage_map_.set(hugepage, reinterpret_cast<void*>(value));
+}
+
+Length PageHeap::HugePageFreePages(PageID p) const {
+  return reinterpret_cast<uintptr_t>(hugepage_map_.get(p >> kHugePageBits)) & 0xffff;
+}
+
+Span* PageHeap::PickFullestHugePage(Span* list) {
+  ASSERT(!DLL_IsEmpty(list));
+  Span* best = list->next;
+  Length best_free = HugePageFreePages(best->start);
+  int candidates = 1;
+  // Stop early if best candidate is the only free span in its hugepage.
+  for (Span* s = best->next;
+       s != list && candidates < kMaxHugePageCandidates && best_free > best->length;
+       s = s->next, candidates++) {
+    const Length free = HugePageFreePages(s->start);
+    if (free < best_free) {
+      best = s;
+      best_free = free;
+    }
+  }
+  return best;
+}
+
 void PageHeap::IncrementalScavenge(Length n) {
   ASSERT(lock_.IsHeld());
   // Fast path; not yet time to release memory
   scavenge_counter_ -= n;
   if (scavenge_counter_ >= 0) return;  // Not yet time to scavenge
 
+  // Freeing expired cached spans got us here. Whoever expires them
+  // decides whether to scavenge afterwards.
+  if (expiring_large_cache_) return;
+
+  // Background thread will pick it up in ScavengeIfDue.
+  if (background_release_) return;
+
+  // Inline scavenging expires cached spans too, so that programs
+  // that stopped allocating large spans get them back without
+  // background thread. We do it even if releasing is disabled.
+  ExpireLargeCache();
+  ScavengeLocked();
+}
+
+Length PageHeap::ScavengeIfDue() {
+  ASSERT(lock_.IsHeld());
+  // Periodic calls are also what expires cached spans of programs
+  // that stopped allocating large spans.
+  ExpireLargeCache();
+  if (scavenge_counter_ >= 0) return 0;
+
+  // Unlike inline scavenging, we may be called long after counter
+  // went negative. So we carry over the rest of the debt to keep
+  // releasing at the configured rate.
+  const int64_t debt = std::max<int64_t>(scavenge_counter_, -kMaxReleaseDelay);
+  const Length released_pages = ScavengeLocked();
+  if (released_pages != 0) {
+    scavenge_counter_ += debt;
+  }
+  return released_pages;
+}
+
+Length PageHeap::ScavengeLocked() {
   const double rate = FLAGS_tcmalloc_release_rate;
   if (rate <= 1e-6) {
     // Tiny release rate means that releasing is disabled.
     scavenge_counter_ = kDefaultReleaseDelay;
-    return;
+    return 0;
   }
 
   ++stats_.scavenge_count;
 
-  Length released_pages = ReleaseAtLeastNPages(1);
+  // We're not under memory pressure here, so in hugepage-aware mode
+  // we only release entirely free hugepages.
+  in_scavenge_ = true;
+  Length released_pages = (hugepage_aware_
+                           ? ReleaseHugePages(1)
+                           : ReleaseAtLeastNPages(1));
+  in_scavenge_ = false;
 
   if (released_pages == 0) {
     // Nothing to scavenge, delay for a while.
@@ -579,65 +1162,272 @@ void PageHeap::IncrementalScavenge(Length n) {
     }
     scavenge_counter_ = static_cast<int64_t>(wait);
   }
+  return released_pages;
 }
 
 Length PageHeap::ReleaseSpan(Span* s) {
   ASSERT(s->location == Span::ON_NORMAL_FREELIST);
+  const Length n = s->length;
+  RemoveFromFreeList(s);
+  return ReleaseAndMerge(s) ? n : 0;
+}
 
-  if (DecommitSpan(s)) {
-    RemoveFromFreeList(s);
-    const Length n = s->length;
-    s->location = Span::ON_RETURNED_FREELIST;
-    MergeIntoFreeList(s);  // Coalesces if possible.
-    return n;
+bool PageHeap::ReleaseAndMerge(Span* s) {
+  if (release_batch_) {
+    QueueRelease(s);
+    return true;
   }
+  const bool released = DecommitSpan(s);
+  s->location = (released
+                 ? Span::ON_RETURNED_FREELIST
+                 : Span::ON_NORMAL_FREELIST);
+  MergeIntoFreeList(s);  // Coalesces if possible.
+  return released;
+}
 
-  return 0;
+void PageHeap::QueueRelease(Span* s) {
+  ASSERT(release_batch_);
+  s->location = Span::IN_USE;
+  DLL_Prepend(&release_pending_, s);
+  release_pending_pages_[s->numa_partition] += s->length;
+  release_batch_low_pressure_ &= in_scavenge_;
+}
+
+void PageHeap::StartReleaseBatch() {
+  ASSERT(lock_.IsHeld());
+  ASSERT(!release_batch_);
+  ASSERT(DLL_IsEmpty(&release_pending_));
+  release_batch_ = true;
+  release_batch_low_pressure_ = true;
+}
+
+void PageHeap::FinishReleaseBatch() {
+  ASSERT(lock_.IsHeld());
+  ASSERT(release_batch_);
+  release_batch_ = false;
+
+  if (DLL_IsEmpty(&release_pending_)) {
+    return;
+  }
+  // Other threads may start and finish their own batches while we
+  // have the lock dropped, so we take our spans off the shared list.
+  Span batch;
+  batch.next = release_pending_.next;
+  batch.prev = release_pending_.prev;
+  batch.next->prev = &batch;
+  batch.prev->next = &batch;
+  DLL_Init(&release_pending_);
+  const bool low_pressure = release_batch_low_pressure_;
+
+  while (!DLL_IsEmpty(&batch)) {
+    // Sorted by address, so that contiguous spans are found easily.
+    Span* spans[kMaxReleaseBatch];
+    int num_spans = 0;
+    while (num_spans < kMaxReleaseBatch && !DLL_IsEmpty(&batch)) {
+      Span* s = batch.next;
+      DLL_Remove(s);
+      int i = num_spans++;
+      for (; i > 0 && spans[i - 1]->start > s->start; i--) {
+        spans[i] = spans[i - 1];
+      }
+      spans[i] = s;
+    }
+
+    TCMalloc_ReleaseRange ranges[kMaxReleaseBatch];
+    int range_of[kMaxReleaseBatch];
+    int num_ranges = 0;
+    for (int i = 0; i < num_spans; i++) {
+      const Span* s = spans[i];
+      if (i > 0 && spans[i - 1]->start + spans[i - 1]->length == s->start) {
+        ranges[num_ranges - 1].length += s->length << kPageShift;
+      } else {
+        ranges[num_ranges++] = TCMalloc_ReleaseRange{
+          reinterpret_cast<void*>(s->start << kPageShift),
+          static_cast<size_t>(s->length << kPageShift), false, false};
+      }
+      range_of[i] = num_ranges - 1;
+    }
+
+    lock_.Unlock();
+    TCMalloc_SystemReleaseRanges(ranges, num_ranges, low_pressure);
+    lock_.Lock();
+
+    stats_.decommit_count += num_ranges;
+    for (int i = 0; i < num_spans; i++) {
+      Span* s = spans[i];
+      release_pending_pages_[s->numa_partition] -= s->length;
+      if (ranges[range_of[i]].released) {
+        AccountDecommit(s, ranges[range_of[i]].lazy);
+        s->location = Span::ON_RETURNED_FREELIST;
+      } else {
+        s->location = Span::ON_NORMAL_FREELIST;
+      }
+      MergeIntoFreeList(s);
+    }
+  }
+}
+
+Length PageHeap::ReleaseSomeOfSpan(Span* s, Length n) {
+  ASSERT(s->location == Span::ON_NORMAL_FREELIST);
+  if (n < kMinPartialRelease) {
+    n = kMinPartialRelease;
+  }
+  // With aggressive decommit, merging released middle with its ends
+  // would decommit them too, so we may as well release the whole
+  // span.
+  if (aggressive_decommit_ || s->length <= kMaxPages || n > s->length / 4) {
+    return ReleaseSpan(s);
+  }
+
+  // Cut n pages out of the middle of s. Both ends stay committed:
+  // allocations carved from the span take its first pages, and spans
+  // freed next to it coalesce with its ends. Ends were not coalesced
+  // with their neighbors before, so they simply go back to normal
+  // free lists.
+  RemoveFromFreeList(s);
+  s->location = Span::IN_USE;
+  Span* middle = Split(s, (s->length - n) / 2);
+  Span* tail = Split(middle, n);
+  s->location = Span::ON_NORMAL_FREELIST;
+  PrependToFreeList(s);
+  tail->location = Span::ON_NORMAL_FREELIST;
+  PrependToFreeList(tail);
+
+  return ReleaseAndMerge(middle) ? n : 0;
+}
+
+Length PageHeap::ReleaseHugePagesOfSpan(Span* s) {
+  ASSERT(s->location == Span::ON_NORMAL_FREELIST);
+  const PageID start = (s->start + kPagesPerHugePage - 1) & ~(kPagesPerHugePage - 1);
+  const PageID end = (s->start + s->length) & ~(kPagesPerHugePage - 1);
+  ASSERT(start < end);
+
+  // Cut the hugepage-aligned part of s. Leftovers go back to normal
+  // free list. Their neighbors were not coalesced with s before, so
+  // there is no need to try coalescing them now.
+  RemoveFromFreeList(s);
+  s->location = Span::IN_USE;
+  if (s->start < start) {
+    Span* rest = Split(s, start - s->start);
+    s->location = Span::ON_NORMAL_FREELIST;
+    PrependToFreeList(s);
+    s = rest;
+  }
+  if (s->start + s->length > end) {
+    Span* tail = Split(s, end - start);
+    tail->location = Span::ON_NORMAL_FREELIST;
+    PrependToFreeList(tail);
+  }
+
+  const Length n = s->length;
+  return ReleaseAndMerge(s) ? n : 0;
+}
+
+Length PageHeap::ReleaseHugePages(Length num_pages) {
+  ASSERT(lock_.IsHeld());
+  Length released_pages = 0;
+
+  // Entirely free hugepage is always within single normal span, so
+  // we look for spans that cover at least one whole hugepage, oldest
+  // first. When scavenging, we skip spans that were freed recently.
+  const int64_t now = NowMs();
+  while (released_pages < num_pages && hugepage_stats_.free_hugepages > 0) {
+    Span* victim = FindOldestFreeSpan(true);
+    if (victim == nullptr
+        || (in_scavenge_ && now - victim->free_time < release_min_age_ms_)) {
+      break;
+    }
+    Length released_len = ReleaseHugePagesOfSpan(victim);
+    // Some systems do not support release
+    if (released_len == 0) break;
+    released_pages += released_len;
+  }
+  return released_pages;
 }
 
 Length PageHeap::ReleaseAtLeastNPages(Length num_pages) {
   ASSERT(lock_.IsHeld());
   Length released_pages = 0;
 
-  // Round robin through the lists of free spans, releasing a
-  // span from each list.  Stop after releasing at least num_pages
-  // or when there is nothing more to release.
+  // Memory is needed back, so cached spans become ordinary free
+  // spans, to be released like the rest.
+  if (!in_scavenge_) {
+    TrimLargeCache(0);
+  }
+
+  if (hugepage_aware_) {
+    released_pages = ReleaseHugePages(num_pages);
+  }
+
+  // Spans that have been free for longest go first: they are least
+  // likely to be needed again soon. When scavenging, spans freed less
+  // than release_min_age_ms_ ago are kept.
+  const int64_t now = NowMs();
   while (released_pages < num_pages && stats_.free_bytes > 0) {
-    for (int i = 0; i < kMaxPages+1 && released_pages < num_pages;
-         i++, release_index_++) {
-      Span *s;
-      if (release_index_ > kMaxPages) release_index_ = 0;
-
-      if (release_index_ == kMaxPages) {
-        if (large_normal_.empty()) {
-          continue;
-        }
-        s = (large_normal_.begin())->span;
-      } else {
-        SpanList* slist = &free_[release_index_];
-        if (DLL_IsEmpty(&slist->normal)) {
-          continue;
-        }
-        s = slist->normal.prev;
-      }
-      // TODO(todd) if the remaining number of pages to release
-      // is significantly smaller than s->length, and s is on the
-      // large freelist, should we carve s instead of releasing?
-      // the whole thing?
-      Length released_len = ReleaseSpan(s);
-      // Some systems do not support release
-      if (released_len == 0) return released_pages;
-      released_pages += released_len;
+    Span* s = FindOldestFreeSpan();
+    if (s == nullptr
+        || (in_scavenge_ && now - s->free_time < release_min_age_ms_)) {
+      break;
     }
+    Length released_len = ReleaseSomeOfSpan(s, num_pages - released_pages);
+    // Some systems do not support release
+    if (released_len == 0) break;
+    released_pages += released_len;
   }
   return released_pages;
 }
 
-bool PageHeap::EnsureLimit(Length n, bool withRelease) {
+Span* PageHeap::FindOldestFreeSpan(bool hugepages_only) {
+  Span* oldest = nullptr;
+  auto consider = [&oldest] (Span* s) {
+    if (oldest == nullptr || s->free_time < oldest->free_time) {
+      oldest = s;
+    }
+  };
+  if (small_hugepage_by_age_.age_link[1] != &small_hugepage_by_age_) {
+    consider(small_hugepage_by_age_.age_link[1]);
+  }
+  if (!hugepages_only
+      && small_normal_by_age_.age_link[1] != &small_normal_by_age_) {
+    consider(small_normal_by_age_.age_link[1]);
+  }
+  for (int p = 0; p < kNumaPartitions; p++) {
+    if (!DLL_IsEmpty(&large_hugepage_by_age_[p])) {
+      consider(large_hugepage_by_age_[p].prev);
+    }
+    if (!hugepages_only && !DLL_IsEmpty(&large_normal_by_age_[p])) {
+      consider(large_normal_by_age_[p].prev);
+    }
+  }
+  return oldest;
+}
+
+bool PageHeap::EnsureLimit(Length n, int partition, bool withRelease) {
   ASSERT(lock_.IsHeld());
+
+  if (limit_ != 0) {
+    Length taken = (stats_.system_bytes - stats_.unmapped_bytes) >> kPageShift;
+    for (int p = 0; p < kNumaPartitions; p++) {
+      taken -= std::min(taken, release_pending_pages_[p]);
+    }
+    if (taken + n > limit_ && withRelease) {
+      taken -= std::min(taken, ReleaseAtLeastNPages(taken + n - limit_));
+    }
+    if (taken + n > limit_) {
+      return false;
+    }
+  }
+
   Length limit = (FLAGS_tcmalloc_heap_limit_mb*1024*1024) >> kPageShift;
   if (limit == 0) return true; //there is no limit
 
+  if (parent_ != nullptr) {
+    // Heap-wide limit is about memory of the whole process, which
+    // parent keeps track of. Tenant heap's lock always comes first.
+    SpinLockHolder h(parent_->pageheap_lock());
+    return parent_->EnsureLimit(n, partition, withRelease);
+  }
+
   // We do not use stats_.system_bytes because it does not take
   // MetaDataAllocs into account.
   Length takenPages = TCMalloc_SystemTaken >> kPageShift;
@@ -649,6 +1439,12 @@ bool PageHeap::EnsureLimit(Length n, bool withRelease) {
 
   ASSERT(takenPages >= stats_.unmapped_bytes >> kPageShift);
   takenPages -= stats_.unmapped_bytes >> kPageShift;
+  takenPages -= std::min<Length>(takenPages, ChunkUnmappedBytes() >> kPageShift);
+  // Spans queued for release may be released by another thread with
+  // the lock dropped right now. They are as good as unmapped.
+  for (int p = 0; p < kNumaPartitions; p++) {
+    takenPages -= std::min(takenPages, release_pending_pages_[p]);
+  }
 
   if (takenPages + n > limit && withRelease) {
     takenPages -= ReleaseAtLeastNPages(takenPages + n - limit);
@@ -657,6 +1453,51 @@ bool PageHeap::EnsureLimit(Length n, bool withRelease) {
   return takenPages + n <= limit;
 }
 
+Span* PageHeap::NewArenaSpan(Length n) {
+  Span* span = NewWithSizeClass(n, 0);
+  if (span == nullptr) {
+    return nullptr;
+  }
+  SpinLockHolder h(&lock_);
+  span->arena = 1;
+  for (Length i = 0; i < span->length; i++) {
+    pagemap_.set(span->start + i, span);
+    // Any of the pages may have been in small object span, whose
+    // size class free() would otherwise find in the cache.
+    InvalidateCachedSizeClass(span->start + i);
+  }
+  return span;
+}
+
+Span* PageHeap::NewChunk(Length n, int partition, int id) {
+  ASSERT(id != 0);
+  LockingContext context{this, &lock_};
+  Span* span = NewLocked(n, partition, &context);
+  if (span == nullptr) {
+    return nullptr;
+  }
+  span->heap_partition = id;
+  for (Length i = 0; i < span->length; i++) {
+    pagemap_.set(span->start + i, span);
+    InvalidateCachedSizeClass(span->start + i);
+  }
+  return span;
+}
+
+void PageHeap::DeleteArenaSpans(Span* list) {
+  SpinLockHolder h(&lock_);
+  StartReleaseBatch();
+  while (list != nullptr) {
+    Span* span = list;
+    list = span->next;
+    ASSERT(span->arena);
+    span->arena = 0;
+    span->next = nullptr;
+    DeleteLocked(span);
+  }
+  FinishReleaseBatch();
+}
+
 void PageHeap::RegisterSizeClass(Span* span, uint32_t sc) {
   // Associate span object with all interior pages as well
   ASSERT(span->location == Span::IN_USE);
@@ -666,13 +1507,51 @@ void PageHeap::RegisterSizeClass(Span* span, uint32_t sc) {
   for (Length i = 1; i < span->length-1; i++) {
     pagemap_.set(span->start+i, span);
   }
+  for (Length i = 0; i < span->length; i++) {
+    pagemap_.set_sizeclass(span->start+i, sc);
+  }
+}
+
+void PageHeap::GetFreeAgeHistogramLocked(Length histogram[kFreeAgeBuckets]) {
+  ASSERT(lock_.IsHeld());
+  static const int64_t kBucketLimitsMs[kFreeAgeBuckets - 1] = {
+    1000, 10 * 1000, 60 * 1000, 10 * 60 * 1000, 60 * 60 * 1000
+  };
+  const int64_t now = NowMs();
+  auto add = [&] (Span* s) {
+    const int64_t age = now - s->free_time;
+    int b = 0;
+    while (b < kFreeAgeBuckets - 1 && age >= kBucketLimitsMs[b]) {
+      b++;
+    }
+    histogram[b] += s->length;
+  };
+  for (int b = 0; b < kFreeAgeBuckets; b++) {
+    histogram[b] = 0;
+  }
+  for (Span* list : {&small_normal_by_age_, &small_hugepage_by_age_}) {
+    for (Span* s = list->age_link[0]; s != list; s = s->age_link[0]) {
+      add(s);
+    }
+  }
+  for (int p = 0; p < kNumaPartitions; p++) {
+    for (Span* list : {&large_normal_by_age_[p], &large_hugepage_by_age_[p]}) {
+      for (Span* s = list->next; s != list; s = s->next) {
+        add(s);
+      }
+    }
+  }
 }
 
 void PageHeap::GetSmallSpanStatsLocked(SmallSpanStats* result) {
   ASSERT(lock_.IsHeld());
   for (int i = 0; i < kMaxPages; i++) {
-    result->normal_length[i] = DLL_Length(&free_[i].normal);
-    result->returned_length[i] = DLL_Length(&free_[i].returned);
+    result->normal_length[i] = 0;
+    result->returned_length[i] = 0;
+    for (int p = 0; p < kNumaPartitions; p++) {
+      result->normal_length[i] += DLL_Length(&free_[p][i].normal);
+      result->returned_length[i] += DLL_Length(&free_[p][i].returned);
+    }
   }
 }
 
@@ -681,13 +1560,17 @@ void PageHeap::GetLargeSpanStatsLocked(LargeSpanStats* result) {
   result->spans = 0;
   result->normal_pages = 0;
   result->returned_pages = 0;
-  for (SpanSetIter it = large_normal_.begin(); it != large_normal_.end(); ++it) {
-    result->normal_pages += it->length;
-    result->spans++;
-  }
-  for (SpanSetIter it = large_returned_.begin(); it != large_returned_.end(); ++it) {
-    result->returned_pages += it->length;
-    result->spans++;
+  for (int p = 0; p < kNumaPartitions; p++) {
+    large_normal_[p].ForEach([result] (Span* s) {
+      result->normal_pages += s->length;
+      result->spans++;
+      return false;
+    });
+    large_returned_[p].ForEach([result] (Span* s) {
+      result->returned_pages += s->length;
+      result->spans++;
+      return false;
+    });
   }
 }
 
@@ -702,6 +1585,10 @@ bool PageHeap::GetNextRange(PageID start, base::MallocRange* r) {
   r->fraction = 0;
   switch (span->location) {
     case Span::IN_USE:
+      if (span->cached) {
+        r->type = base::MallocRange::FREE;
+        break;
+      }
       r->type = base::MallocRange::INUSE;
       r->fraction = 1;
       if (span->sizeclass > 0) {
@@ -723,28 +1610,46 @@ bool PageHeap::GetNextRange(PageID start, base::MallocRange* r) {
   return true;
 }
 
-bool PageHeap::GrowHeap(Length n, LockingContext* context) {
+bool PageHeap::GrowHeap(Length n, int partition, LockingContext* context) {
   ASSERT(lock_.IsHeld());
   ASSERT(kMaxPages >= kMinSystemAlloc);
   if (n > kMaxValidPages) return false;
   Length ask = (n>kMinSystemAlloc) ? n : static_cast<Length>(kMinSystemAlloc);
+  size_t alignment = kPageSize;
+  if (hugepage_aware_) {
+    // Grow by whole aligned hugepages. Any extra space is used for
+    // smaller spans, which packs them into the same hugepages.
+    n = (n + kPagesPerHugePage - 1) & ~(kPagesPerHugePage - 1);
+    ask = (ask + kPagesPerHugePage - 1) & ~(kPagesPerHugePage - 1);
+    alignment = kHugePageSize;
+    if (n > kMaxValidPages) return false;
+  }
   size_t actual_size;
   void* ptr = nullptr;
-  if (EnsureLimit(ask)) {
-      ptr = TCMalloc_SystemAlloc(ask << kPageShift, &actual_size, kPageSize);
+  if (EnsureLimit(ask, partition)) {
+    ptr = AllocFromSystemOrParent(ask, partition, alignment, &actual_size);
   }
   if (ptr == nullptr) {
     if (n < ask) {
       // Try growing just "n" pages
       ask = n;
-      if (EnsureLimit(ask)) {
-        ptr = TCMalloc_SystemAlloc(ask << kPageShift, &actual_size, kPageSize);
+      if (EnsureLimit(ask, partition)) {
+        ptr = AllocFromSystemOrParent(ask, partition, alignment, &actual_size);
       }
     }
     if (ptr == nullptr) return false;
   }
   ask = actual_size >> kPageShift;
-  context->grown_by += ask << kPageShift;
+
+  if (parent_ == nullptr) {
+    // Parent did all of this for its chunk.
+    context->grown_by += ask << kPageShift;
+    if (hugepage_aware_) {
+      TCMalloc_SystemHintHugePages(ptr, ask << kPageShift);
+    }
+    NumaTopology::BindMemory(ptr, ask << kPageShift, partition);
+  }
+  partition_stats_[partition].system_bytes += (ask << kPageShift);
 
   ++stats_.reserve_count;
   ++stats_.commit_count;
@@ -771,12 +1676,25 @@ bool PageHeap::GrowHeap(Length n, LockingContext* context) {
   // Make sure pagemap_ has entries for all of the new pages.
   // Plus ensure one before and one after so coalescing code
   // does not need bounds-checking.
-  if (pagemap_.Ensure(p-1, ask+2)) {
-    // Pretend the new area is allocated and then Delete() it to cause
-    // any necessary coalescing to occur.
+  const bool hugepage_map_ok = (!hugepage_aware_
+                                || hugepage_map_.Ensure(p >> kHugePageBits,
+                                                        ((p + ask - 1) >> kHugePageBits)
+                                                        - (p >> kHugePageBits) + 1));
+  if (pagemap_.Ensure(p-1, ask+2) && hugepage_map_ok) {
+    // New pages count towards scavenging like freed ones, but we
+    // scavenge before they hit the free lists: the caller is about to
+    // allocate from them, and releasing (part of) them now would only
+    // defeat that.
+    IncrementalScavenge(ask);
+
+    // Put the new area on the free list, coalescing it with its
+    // neighbors if possible.
     Span* span = NewSpan(p, ask);
+    span->numa_partition = partition;
     RecordSpan(span);
-    DeleteLocked(span);
+    span->location = Span::ON_NORMAL_FREELIST;
+    span->free_time = NowMs();
+    MergeIntoFreeList(span);
     ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
     ASSERT(Check());
     return true;
@@ -787,6 +1705,19 @@ bool PageHeap::GrowHeap(Length n, LockingContext* context) {
   }
 }
 
+void* PageHeap::AllocFromSystemOrParent(Length n, int partition,
+                                        size_t alignment, size_t* actual_size) {
+  if (parent_ == nullptr) {
+    return TCMalloc_SystemAlloc(n << kPageShift, actual_size, alignment);
+  }
+  Span* chunk = parent_->NewChunk(n, partition, partition_id_);
+  if (chunk == nullptr) {
+    return nullptr;
+  }
+  *actual_size = chunk->length << kPageShift;
+  return reinterpret_cast<void*>(chunk->start << kPageShift);
+}
+
 bool PageHeap::Check() {
   ASSERT(lock_.IsHeld());
   return true;
@@ -794,11 +1725,35 @@ bool PageHeap::Check() {
 
 bool PageHeap::CheckExpensive() {
   bool result = Check();
-  CheckSet(&large_normal_, kMaxPages + 1, Span::ON_NORMAL_FREELIST);
-  CheckSet(&large_returned_, kMaxPages + 1, Span::ON_RETURNED_FREELIST);
-  for (int s = 1; s <= kMaxPages; s++) {
-    CheckList(&free_[s - 1].normal, s, s, Span::ON_NORMAL_FREELIST);
-    CheckList(&free_[s - 1].returned, s, s, Span::ON_RETURNED_FREELIST);
+  for (int p = 0; p < kNumaPartitions; p++) {
+    CheckIndex(&large_normal_[p], kMaxPages + 1, Span::ON_NORMAL_FREELIST);
+    CheckList(&large_normal_by_age_[p], kMaxPages + 1,
+              std::numeric_limits<Length>::max(), Span::ON_NORMAL_FREELIST);
+    CheckList(&large_hugepage_by_age_[p], kMaxPages + 1,
+              std::numeric_limits<Length>::max(), Span::ON_NORMAL_FREELIST);
+    for (Span* list : {&large_normal_by_age_[p], &large_hugepage_by_age_[p]}) {
+      for (Span* s = list->next; s != list; s = s->next) {
+        CHECK_CONDITION(HasWholeHugePage(s)
+                        == (list == &large_hugepage_by_age_[p]));
+        CHECK_CONDITION(s->next == list
+                        || s->next->free_time <= s->free_time);
+      }
+    }
+    CheckIndex(&large_returned_[p], kMaxPages + 1, Span::ON_RETURNED_FREELIST);
+    for (int s = 1; s <= kMaxPages; s++) {
+      CheckList(&free_[p][s - 1].normal, s, s, Span::ON_NORMAL_FREELIST);
+      CheckList(&free_[p][s - 1].returned, s, s, Span::ON_RETURNED_FREELIST);
+    }
+  }
+  for (Span* list : {&small_normal_by_age_, &small_hugepage_by_age_}) {
+    for (Span* s = list->age_link[0]; s != list; s = s->age_link[0]) {
+      CHECK_CONDITION(s->location == Span::ON_NORMAL_FREELIST);
+      CHECK_CONDITION(s->length <= kMaxPages);
+      CHECK_CONDITION(s->age_link[0]->age_link[1] == s);
+      CHECK_CONDITION(HasWholeHugePage(s) == (list == &small_hugepage_by_age_));
+      CHECK_CONDITION(s->age_link[0] == list
+                      || s->age_link[0]->free_time <= s->free_time);
+    }
   }
   return result;
 }
@@ -809,21 +1764,28 @@ bool PageHeap::CheckList(Span* list, Length min_pages, Length max_pages,
     CHECK_CONDITION(s->location == freelist);  // NORMAL or RETURNED
     CHECK_CONDITION(s->length >= min_pages);
     CHECK_CONDITION(s->length <= max_pages);
+    CHECK_CONDITION(freelist != Span::ON_RETURNED_FREELIST
+                    || s->lazy_pages <= s->length);
     CHECK_CONDITION(GetDescriptor(s->start) == s);
     CHECK_CONDITION(GetDescriptor(s->start+s->length-1) == s);
   }
   return true;
 }
 
-bool PageHeap::CheckSet(SpanSet* spanset, Length min_pages,int freelist) {
-  for (SpanSetIter it = spanset->begin(); it != spanset->end(); ++it) {
-    Span* s = it->span;
-    CHECK_CONDITION(s->length == it->length);
+bool PageHeap::CheckIndex(const LargeSpanIndex* index, Length min_pages,
+                          int freelist) {
+  index->ForEach([&] (Span* s) {
     CHECK_CONDITION(s->location == freelist);  // NORMAL or RETURNED
     CHECK_CONDITION(s->length >= min_pages);
+    CHECK_CONDITION(freelist != Span::ON_RETURNED_FREELIST
+                    || s->lazy_pages <= s->length);
     CHECK_CONDITION(GetDescriptor(s->start) == s);
     CHECK_CONDITION(GetDescriptor(s->start+s->length-1) == s);
-  }
+    // Every span must be found by search for its length.
+    Span* fit = index->BestFit(s->length);
+    CHECK_CONDITION(fit != nullptr && fit->length == s->length);
+    return false;
+  });
   return true;
 }
 
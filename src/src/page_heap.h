@@ -37,11 +37,13 @@
 #include <config.h>
 #include <stddef.h>                     // for size_t
 #include <stdint.h>                     // for uint64_t, int64_t, uint16_t
+#include <atomic>
 #include "base/basictypes.h"
 #include "base/spinlock.h"
 #include "base/thread_annotations.h"
 #include "common.h"
 #include "packed-cache-inl.h"
+#include "page_heap_allocator.h"
 #include "pagemap.h"
 #include "span.h"
 
@@ -65,7 +67,9 @@ namespace tcmalloc {
 
 // We use PageMap2<> for 32-bit and PageMap3<> for 64-bit machines.
 // We also use a simple one-level cache for hot PageID-to-sizeclass mappings,
-// because sometimes the sizeclass is all the information we need.
+// because sometimes the sizeclass is all the information we need. When
+// it misses, size class byte that page map keeps for every page still
+// saves us from looking at the Span.
 
 // Selector class -- general selector uses 3-level map
 template <int BITS> class MapSelector {
@@ -124,7 +128,8 @@ class PageHeap {
   // lock, like New above.
   Span* NewAligned(Length n, Length align_pages);
 
-  // Delete the span "[p, p+n-1]".
+  // Delete the span "[p, p+n-1]". Large spans may be kept in large
+  // span cache instead (see SetLargeCacheLimit).
   // REQUIRES: span was returned by earlier call to New() and
   //           has not yet been deleted.
   void Delete(Span* span);
@@ -133,7 +138,45 @@ class PageHeap {
   void PrepareAndDelete(Span* span, const Body& body) LOCKS_EXCLUDED(lock_) {
     SpinLockHolder h(&lock_);
     body();
-    DeleteLocked(span);
+    StartReleaseBatch();
+    if (!CacheLargeSpan(span)) {
+      DeleteLocked(span);
+    }
+    FinishReleaseBatch();
+  }
+
+  // Allocates span of n pages for tcmalloc::Arena. Unlike with New,
+  // all pages of the span are mapped to it, so any pointer into arena
+  // memory finds its span. Returns nullptr if out of memory.
+  Span* NewArenaSpan(Length n);
+
+  // Deletes arena spans linked through their next fields, all under
+  // single lock acquisition.
+  void DeleteArenaSpans(Span* list) LOCKS_EXCLUDED(lock_);
+
+  // Makes this heap one of tenant heap partitions (see
+  // heap_partition.h) with the given id. Instead of taking memory from
+  // the system, it grows by taking chunks from parent with NewChunk.
+  // Spans are allocated with span_allocator, which has to be protected
+  // by our lock. REQUIRES: heap has not grown yet.
+  void SetParent(PageHeap* parent, int id,
+                 PageHeapAllocator<Span>* span_allocator) {
+    ASSERT(stats_.system_bytes == 0);
+    parent_ = parent;
+    partition_id_ = id;
+    span_allocator_ = span_allocator;
+  }
+
+  // Allocates span of n pages that tenant heap partition id manages
+  // on its own from now on. Like with NewArenaSpan, all its pages are
+  // mapped to it, so free() finds chunk (and partition) of any object.
+  // Chunks are never given back. Returns nullptr if out of memory.
+  Span* NewChunk(Length n, int partition, int id) LOCKS_EXCLUDED(lock_);
+
+  // Bytes of chunks given to tenant heap partitions that their heaps
+  // have released to the system. Heap-wide limit doesn't count them.
+  uint64_t ChunkUnmappedBytes() const {
+    return chunk_unmapped_bytes_.load(std::memory_order_relaxed);
   }
 
   // Mark an allocated span as being used for small objects of the
@@ -142,6 +185,21 @@ class PageHeap {
   //           and has not yet been deleted.
   void RegisterSizeClass(Span* span, uint32_t sc);
 
+  // Resizes in-use span of a large allocation to "n" pages (rounded
+  // up like in New) without moving it. Shrinking returns the tail to
+  // free lists. Growing takes the beginning of the free span that
+  // immediately follows "span", so it fails (returning false) unless
+  // there is such span and it is long enough.
+  // REQUIRES: span->location == IN_USE
+  // REQUIRES: span->sizeclass == 0
+  bool ResizeInPlace(Span* span, Length n) LOCKS_EXCLUDED(lock_);
+
+  // Resizes span that has its own mapping to "n" pages. Unlike
+  // ResizeInPlace it may move the span (updating span->start), which
+  // for big spans is much cheaper than copying them.
+  // REQUIRES: span->dedicated
+  bool RemapDedicated(Span* span, Length n) LOCKS_EXCLUDED(lock_);
+
   Span* SplitForTest(Span* span, Length n) {
     SpinLockHolder l(&lock_);
     return Split(span, n);
@@ -161,13 +219,22 @@ class PageHeap {
   // Page heap statistics
   struct Stats {
     Stats() : system_bytes(0), free_bytes(0), unmapped_bytes(0), committed_bytes(0),
-        scavenge_count(0), commit_count(0), total_commit_bytes(0),
-        decommit_count(0), total_decommit_bytes(0),
-        reserve_count(0), total_reserve_bytes(0) {}
+        lazily_freed_bytes(0), dedicated_bytes(0), scavenge_count(0), commit_count(0),
+        total_commit_bytes(0), decommit_count(0), total_decommit_bytes(0),
+        reserve_count(0), total_reserve_bytes(0), remap_count(0),
+        large_cache_bytes(0), large_cache_hits(0), large_cache_misses(0) {}
     uint64_t system_bytes;    // Total bytes allocated from system
     uint64_t free_bytes;      // Total bytes on normal freelists
     uint64_t unmapped_bytes;  // Total bytes on returned freelists
     uint64_t committed_bytes;  // Bytes committed, always <= system_bytes_.
+    // Part of unmapped_bytes that was released lazily (MADV_FREE),
+    // so the OS may not have reclaimed it yet and it may still count
+    // towards RSS.
+    uint64_t lazily_freed_bytes;
+    // Bytes of spans that have their own mappings. Such memory is
+    // counted in system_bytes while it is in use, and given back to
+    // the system right away when freed.
+    uint64_t dedicated_bytes;
 
     uint64_t scavenge_count;   // Number of times scavagened flush pages
 
@@ -178,6 +245,17 @@ class PageHeap {
 
     uint64_t reserve_count;         // Number of virtual memory reserves
     uint64_t total_reserve_bytes;   // Bytes reserved in lifetime of process
+
+    uint64_t remap_count;           // Number of resizes of dedicated mappings
+
+    // Bytes of spans in large span cache. Like dedicated_bytes, they
+    // are counted in system_bytes and committed_bytes, but not in
+    // free_bytes.
+    uint64_t large_cache_bytes;
+    // Large allocations that were (or could have been, but weren't)
+    // served from large span cache.
+    uint64_t large_cache_hits;
+    uint64_t large_cache_misses;
   };
   inline Stats StatsLocked() const { return stats_; }
 
@@ -199,12 +277,38 @@ class PageHeap {
   };
   void GetLargeSpanStatsLocked(LargeSpanStats* result);
 
+  // Share of system, free and unmapped bytes that belongs to given
+  // NUMA partition. Only partition 0 is used unless NUMA awareness is
+  // active.
+  struct PartitionStats {
+    uint64_t system_bytes;
+    uint64_t free_bytes;
+    uint64_t unmapped_bytes;
+  };
+  PartitionStats PartitionStatsLocked(int partition) const {
+    return partition_stats_[partition];
+  }
+
+  // Hugepage statistics. Only maintained in hugepage-aware mode.
+  struct HugePageStats {
+    uint64_t free_hugepages;    // Entirely free (and not released) hugepages
+    uint64_t broken_hugepages;  // Hugepages with only some pages released
+    uint64_t broken_bytes;      // Not released bytes in broken hugepages
+  };
+  HugePageStats HugePageStatsLocked() const { return hugepage_stats_; }
+
+  // Free (not released) pages by time since they were freed: less
+  // than 1 second, 10 seconds, 1 minute, 10 minutes, 1 hour, and
+  // older.
+  static const int kFreeAgeBuckets = 6;
+  void GetFreeAgeHistogramLocked(Length histogram[kFreeAgeBuckets]);
+
   bool Check();
   // Like Check() but does some more comprehensive checking.
   bool CheckExpensive();
   bool CheckList(Span* list, Length min_pages, Length max_pages,
                  int freelist);  // ON_NORMAL_FREELIST or ON_RETURNED_FREELIST
-  bool CheckSet(SpanSet *s, Length min_pages, int freelist);
+  bool CheckIndex(const LargeSpanIndex* index, Length min_pages, int freelist);
 
   // Try to release at least num_pages for reuse by the OS.  Returns
   // the actual number of pages released, which may be less than
@@ -212,8 +316,32 @@ class PageHeap {
   // may also be larger than num_pages since page_heap might decide to
   // release one large range instead of fragmenting it into two
   // smaller released and unreleased ranges.
+  //
+  // In hugepage-aware mode entirely free hugepages are released
+  // first, and other free spans only if that wasn't enough. Spans
+  // that have been free for longest are released first. Large spans
+  // that have many more pages than we need are released partially.
   Length ReleaseAtLeastNPages(Length num_pages);
 
+  // Between StartReleaseBatch and FinishReleaseBatch, spans that are
+  // released (by ReleaseAtLeastNPages, scavenging or aggressive
+  // decommit) are only taken off free lists. FinishReleaseBatch then
+  // drops the lock while telling the system about them, releasing
+  // contiguous spans as a single range, and puts them on returned
+  // free lists. Released page counts assume that release succeeds.
+  //
+  // REQUIRES: lock_ is held, and is not dropped in between.
+  void StartReleaseBatch() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void FinishReleaseBatch() NO_THREAD_SAFETY_ANALYSIS;
+
+  // Maximal number of pages (0 means no limit) this heap may have
+  // taken from the system (or, for tenant heaps, from parent) and not
+  // released. It is enforced on top of the heap-wide
+  // FLAGS_tcmalloc_heap_limit_mb limit, and free spans are released
+  // when it is reached.
+  Length GetLimit() const { return limit_; }
+  void SetLimit(Length pages) { limit_ = pages; }
+
   // Reads and writes to pagemap_cache_ do not require locking.
   bool TryGetSizeClass(PageID p, uint32_t* out) const {
     return pagemap_cache_.TryGet(p, out);
@@ -223,6 +351,30 @@ class PageHeap {
     pagemap_cache_.Put(p, cl);
   }
   void InvalidateCachedSizeClass(PageID p) { pagemap_cache_.Invalidate(p); }
+
+  // Returns size class of the small objects span that page p belongs
+  // to, or 0 if p is not in such span (i.e. it is free, holds
+  // page-level allocation or isn't ours). Doesn't require locking
+  // for pages of objects caller owns.
+  ALWAYS_INLINE
+  uint32_t GetPageSizeClass(PageID p) const {
+    return pagemap_.get_sizeclass(p);
+  }
+
+  // Starts loading page map entries of page p (which caller is about
+  // to look up) into CPU cache, if pagemap prefetching is enabled.
+  ALWAYS_INLINE
+  void MaybePrefetchPageMap(PageID p) const {
+    if (PREDICT_FALSE(pagemap_prefetch_)) {
+      pagemap_.Prefetch(p);
+    }
+  }
+
+  // Prefetching costs a little on every free(), which only pays off
+  // when page map lookups miss CPU caches, i.e. in programs with
+  // large and sparse heaps.
+  bool GetPagemapPrefetch() const { return pagemap_prefetch_; }
+  void SetPagemapPrefetch(bool prefetch) { pagemap_prefetch_ = prefetch; }
   uint32_t GetSizeClassOrZero(PageID p) const {
     uint32_t cached_value;
     if (!TryGetSizeClass(p, &cached_value)) {
@@ -236,6 +388,65 @@ class PageHeap {
     aggressive_decommit_ = aggressive_decommit;
   }
 
+  // In hugepage-aware mode heap grows by whole hugepages, small spans
+  // are preferably carved from the fullest hugepages, and scavenging
+  // only releases entirely free hugepages.
+  // REQUIRES: heap has not grown yet.
+  bool GetHugePageAware() const { return hugepage_aware_; }
+  void SetHugePageAware(bool hugepage_aware) {
+    ASSERT(stats_.system_bytes == 0);
+    hugepage_aware_ = hugepage_aware;
+  }
+
+  // Spans of at least this many pages (0 means none) that aren't
+  // for small objects get their own system mapping, so that realloc
+  // can grow them with mremap rather than by copying. Such memory is
+  // unmapped when freed instead of being kept in free lists.
+  Length GetDedicatedThreshold() const { return dedicated_threshold_; }
+  // Thresholds below kMaxPages are raised to it: mapping of its own
+  // is not worth it for smaller spans.
+  void SetDedicatedThreshold(Length pages) {
+    dedicated_threshold_ = (pages == 0 || pages >= kMaxPages) ? pages : kMaxPages;
+  }
+
+  // In background release mode Delete() only counts freed pages, and
+  // memory is returned to the system by ScavengeIfDue(), which is
+  // called periodically by MallocExtension::ProcessBackgroundActions.
+  bool GetBackgroundRelease() const { return background_release_; }
+  void SetBackgroundRelease(bool background_release) {
+    background_release_ = background_release;
+  }
+
+  // Free spans younger than this many milliseconds are not released
+  // by scavenging, i.e. at tcmalloc_release_rate (but they still are
+  // when heap limit is reached or all free memory is released
+  // explicitly). Spans that are freed and reused over and over again
+  // are then kept instead of being released and faulted in back.
+  int64_t GetReleaseMinAge() const { return release_min_age_ms_; }
+  void SetReleaseMinAge(int64_t ms) { release_min_age_ms_ = ms; }
+
+  // Large spans (longer than kMaxPages) freed by Delete are kept
+  // whole and committed in a cache of up to this many bytes (0
+  // disables it), and handed out again to allocations of about their
+  // size. Programs that keep allocating and freeing big buffers then
+  // neither grow the heap nor fault released pages back in every
+  // time. Cached spans are freed for real, oldest first, when the
+  // cache needs room, when they've been cached for longer than
+  // GetLargeCacheExpiry() milliseconds, and when free memory is
+  // released explicitly or to stay under heap limit. Lowered limit
+  // takes effect lazily, on next large allocation or free.
+  size_t GetLargeCacheLimit() const { return large_cache_limit_; }
+  void SetLargeCacheLimit(size_t bytes) { large_cache_limit_ = bytes; }
+  int64_t GetLargeCacheExpiry() const { return large_cache_expiry_ms_; }
+  void SetLargeCacheExpiry(int64_t ms) { large_cache_expiry_ms_ = ms; }
+
+  // If enough pages were freed since last release to warrant
+  // releasing memory at current tcmalloc_release_rate, releases some
+  // memory and returns number of pages released. Caller is supposed
+  // to repeat the call while it returns non-zero, which lets it drop
+  // the lock between releases.
+  Length ScavengeIfDue();
+
  private:
   struct LockingContext;
 
@@ -263,6 +474,16 @@ class PageHeap {
   // scavenging again.  With 4K pages, this comes to 1GB of memory.
   static const int kDefaultReleaseDelay = 1 << 18;
 
+  // Large spans are released partially only when at least this many
+  // pages are released, so that scavenging, which asks for a single
+  // page, doesn't chop them into many small releases.
+  static const Length kMinPartialRelease = kMaxPages;
+
+  // Cached large spans are handed out to allocations that are at
+  // most 1/2^kLargeCacheSlackShift shorter. Extra pages are split off,
+  // or unmapped for dedicated spans.
+  static const int kLargeCacheSlackShift = 3;
+
   const Length smallest_span_size_;
 
   SpinLock lock_;
@@ -273,6 +494,13 @@ class PageHeap {
   mutable PageMapCache pagemap_cache_;
   PageMap pagemap_;
 
+  // In hugepage-aware mode we count free and released pages of every
+  // hugepage we manage. Values are (free | released << 16) and keys
+  // are hugepage numbers.
+  typedef TCMalloc_PageMap3<kAddressBits - kHugePageShift> HugePageMap;
+  HugePageMap hugepage_map_;
+  HugePageStats hugepage_stats_;
+
   // We segregate spans of a given size into two circular linked
   // lists: one for normal spans, and one for spans whose memory
   // has been returned to the system.
@@ -281,22 +509,83 @@ class PageHeap {
     Span        returned;
   };
 
-  // Sets of spans with length > kMaxPages.
+  // Indexes of spans with length > kMaxPages.
+  //
+  // Rather than using a linked list, we use indexes here for
+  // efficient best-fit search.
   //
-  // Rather than using a linked list, we use sets here for efficient
-  // best-fit search.
-  SpanSet large_normal_;
-  SpanSet large_returned_;
+  // All free lists are kept separately for every NUMA partition, so
+  // that we never hand out memory of one node to other node's
+  // allocations unless we run out of memory.
+  LargeSpanIndex large_normal_[kNumaPartitions];
+  LargeSpanIndex large_returned_[kNumaPartitions];
+
+  // Spans of large_normal_ are also linked (through Span::next and
+  // prev, which indexes don't use) into these lists, in order they were
+  // added, so that the oldest one is at the end.
+  Span large_normal_by_age_[kNumaPartitions];
 
   // Array mapping from span length to a doubly linked list of free spans
   //
   // NOTE: index 'i' stores spans of length 'i + 1'.
-  SpanList free_[kMaxPages];
+  SpanList free_[kNumaPartitions][kMaxPages];
+
+  // Spans of free_[*][*].normal of all partitions are also linked
+  // (through Span::age_link) into this list, by age like
+  // large_normal_by_age_. So oldest free span is always one of
+  // few list tails.
+  Span small_normal_by_age_;
+
+  // Free spans that cover at least one whole hugepage go into these
+  // lists instead of large_normal_by_age_ and small_normal_by_age_, so
+  // that ReleaseHugePages finds them without looking at other spans.
+  Span large_hugepage_by_age_[kNumaPartitions];
+  Span small_hugepage_by_age_;
 
   // Statistics on system, free, and unmapped bytes
   Stats stats_;
+  PartitionStats partition_stats_[kNumaPartitions];
+
+  // See GetLimit.
+  Length limit_;
+
+  // Set for tenant heap partitions, see SetParent.
+  PageHeap* parent_;
+  int partition_id_;
+
+  // See ChunkUnmappedBytes. Updated by tenant heaps under their own
+  // locks.
+  std::atomic<uint64_t> chunk_unmapped_bytes_;
+
+  PageHeapAllocator<Span>* span_allocator_;
+
+  Span* NewSpan(PageID p, Length len) {
+    Span* result = new (span_allocator_->New()) Span;
+    result->start = p;
+    result->length = len;
+    return result;
+  }
+  void DeleteSpan(Span* span) { span_allocator_->Delete(span); }
+
+  // Takes n pages (or more) for GrowHeap from the system or from
+  // parent. Returns nullptr on failure, and sets *actual_size otherwise.
+  void* AllocFromSystemOrParent(Length n, int partition, size_t alignment,
+                                size_t* actual_size) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Adds (or removes) bytes of tenant heap's free list span that is
+  // released to parent's ChunkUnmappedBytes.
+  void AccountChunkUnmapped(const Span* span, bool add) {
+    if (parent_ != nullptr) {
+      const uint64_t bytes = span->length << kPageShift;
+      if (add) {
+        parent_->chunk_unmapped_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+      } else {
+        parent_->chunk_unmapped_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+      }
+    }
+  }
 
-  Span* NewLocked(Length n, LockingContext* context) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  Span* NewLocked(Length n, int partition, LockingContext* context) EXCLUSIVE_LOCKS_REQUIRED(lock_);
   void DeleteLocked(Span* span) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
   // Split an allocated span into two spans: one of length "n" pages
@@ -309,9 +598,16 @@ class PageHeap {
   // REQUIRES: span->sizeclass == 0
   Span* Split(Span* span, Length n);
 
-  Span* SearchFreeAndLargeLists(Length n);
+  Span* SearchFreeAndLargeLists(Length n, int partition);
+
+  bool GrowHeap(Length n, int partition, LockingContext* context) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
-  bool GrowHeap(Length n, LockingContext* context) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // Maps span of n pages of its own or returns nullptr.
+  Span* NewDedicatedLocked(Length n, int partition, LockingContext* context) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void DeleteDedicatedLocked(Span* span) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  bool ResizeDedicatedLocked(Span* span, Length n, bool may_move) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // Adds (or removes) dedicated span's memory to heap stats.
+  void AccountDedicated(Span* span, bool add) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
   // REQUIRES: span->length >= n
   // REQUIRES: span->location != IN_USE
@@ -331,7 +627,7 @@ class PageHeap {
 
   // Allocate a large span of length == n.  If successful, returns a
   // span of exactly the specified length.  Else, returns nullptr.
-  Span* AllocLarge(Length n);
+  Span* AllocLarge(Length n, int partition);
 
   // Coalesce span with neighboring spans if possible, prepend to
   // appropriate free list, and adjust stats.
@@ -342,6 +638,31 @@ class PageHeap {
 
   // Decommit the span.
   bool DecommitSpan(Span* span);
+  // Updates stats for span that was just released.
+  void AccountDecommit(Span* span, bool lazy);
+
+  // Releases span that was just taken off free lists, and puts it
+  // back on returned (or, if release failed, normal) free lists.
+  // Inside release batch, it is only queued. Returns whether span is
+  // released.
+  bool ReleaseAndMerge(Span* s);
+  // Queues span that is not on free lists for release by
+  // FinishReleaseBatch.
+  void QueueRelease(Span* s);
+
+  // Puts span that is being freed into large span cache, if it is
+  // enabled and span is eligible. Returns false if span is to be
+  // deleted as usual.
+  bool CacheLargeSpan(Span* span);
+  // Takes span of n pages, or few more if it can't be trimmed, of
+  // given partition out of large span cache. Returns nullptr and
+  // counts a miss if there is no such span.
+  Span* TakeCachedSpan(Length n, int partition);
+  // Deletes cached spans, oldest first, until cache holds at most
+  // limit bytes and none of its spans are expired.
+  void TrimLargeCache(uint64_t limit);
+  // Deletes expired cached spans on behalf of scavenging.
+  void ExpireLargeCache();
 
   // Prepends span to appropriate free list, and adjusts stats.
   void PrependToFreeList(Span* span);
@@ -352,6 +673,17 @@ class PageHeap {
   // Incrementally release some memory to the system.
   // IncrementalScavenge(n) is called whenever n pages are freed.
   void IncrementalScavenge(Length n);
+  // Does one round of release for IncrementalScavenge or
+  // ScavengeIfDue. Sets scavenge_counter_ to the number of pages to
+  // free before the next round and returns number of pages released.
+  Length ScavengeLocked();
+
+  // Returns oldest (by free_time) span on normal free lists, or
+  // nullptr if there are none. Only last spans of age lists are
+  // looked at, which are almost always the oldest of their lists.
+  // With hugepages_only, only spans that cover at least one whole
+  // hugepage are considered.
+  Span* FindOldestFreeSpan(bool hugepages_only = false);
 
   // Attempts to decommit 's' and move it to the returned freelist.
   //
@@ -360,20 +692,79 @@ class PageHeap {
   // REQUIRES: 's' must be on the NORMAL freelist.
   Length ReleaseSpan(Span *s);
 
-  // Checks if we are allowed to take more memory from the system.
-  // If limit is reached and allowRelease is true, tries to release
-  // some unused spans.
-  bool EnsureLimit(Length n, bool allowRelease = true);
+  // Releases at least n pages of 's'. Large spans with at least four
+  // times as many pages (n rounded up to kMinPartialRelease) only get
+  // n pages in their middle released, other spans are released
+  // whole. Returns number of pages released.
+  //
+  // REQUIRES: 's' must be on the NORMAL freelist.
+  Length ReleaseSomeOfSpan(Span *s, Length n);
+
+  // Checks if we are allowed to take more memory from the system
+  // for the given partition. If either heap-wide limit or our own
+  // limit is reached and allowRelease is true, tries to release some
+  // unused spans.
+  bool EnsureLimit(Length n, int partition, bool allowRelease = true);
 
   Span* CheckAndHandlePreMerge(Span *span, Span *other);
 
+  // Adds (or removes) free span to the counts of hugepages it covers.
+  void AccountHugePages(Span* span, bool add);
+  void UpdateHugePage(uintptr_t hugepage, Length free, Length released,
+                      bool add);
+  // Returns number of free pages in the hugepage page p belongs to.
+  Length HugePageFreePages(PageID p) const;
+  // Returns span of the given free list, which belongs to fullest
+  // hugepage among first few spans of the list.
+  Span* PickFullestHugePage(Span* list);
+  // Releases entirely free hugepages until at least num_pages are
+  // released. Returns number of pages released.
+  Length ReleaseHugePages(Length num_pages);
+  // Releases all the whole hugepages in span s, which is on normal
+  // free list. Parts of s outside of those stay on normal free
+  // lists.
+  Length ReleaseHugePagesOfSpan(Span* s);
+
   // Number of pages to deallocate before doing more scavenging
   int64_t scavenge_counter_;
 
-  // Index of last free list where we released memory to the OS.
-  int release_index_;
+  // See SetReleaseMinAge.
+  int64_t release_min_age_ms_;
 
   bool aggressive_decommit_;
+
+  bool hugepage_aware_;
+
+  bool pagemap_prefetch_;
+
+  bool background_release_;
+
+  // True while ScavengeLocked runs. Such releases are done under low
+  // memory pressure, so hybrid release advice may do them lazily.
+  bool in_scavenge_;
+
+  // True while ExpireLargeCache runs.
+  bool expiring_large_cache_;
+
+  // Large span cache, most recently freed spans first; see
+  // SetLargeCacheLimit. Spans there are IN_USE with cached bit set,
+  // and free_time is when they were cached.
+  Span large_cache_;
+  size_t large_cache_limit_;
+  int64_t large_cache_expiry_ms_;
+
+  // Release batch state; see StartReleaseBatch. Queued spans are
+  // marked IN_USE, so that nothing allocates or coalesces them.
+  static const int kMaxReleaseBatch = 64;
+  bool release_batch_;
+  bool release_batch_low_pressure_;
+  Span release_pending_;
+  // Pages of queued spans of each partition, including those that
+  // FinishReleaseBatch is releasing with the lock dropped. EnsureLimit
+  // counts them as unmapped, since they are about to be.
+  Length release_pending_pages_[kNumaPartitions];
+
+  Length dedicated_threshold_;
 };
 
 }  // namespace tcmalloc
@@ -42,6 +42,12 @@
 // The BITS parameter should be the number of bits required to hold
 // a page number.  E.g., with 32 bit pointers and 4K pages (i.e.,
 // page offset fits in lower 12 bits), BITS == 20.
+//
+// Next to every value the maps also keep one byte of "size class",
+// which is allocated together with values (so it is as lazy as
+// values are), but is kept in its own array. That lets free() find
+// size class of small object with a single byte load, without
+// touching the value (i.e. Span) at all.
 
 #ifndef TCMALLOC_PAGEMAP_H_
 #define TCMALLOC_PAGEMAP_H_
@@ -62,6 +68,7 @@ class TCMalloc_PageMap1 {
   static const int LENGTH = 1 << BITS;
 
   void** array_;
+  uint8_t* sizeclass_;
 
  public:
   typedef uintptr_t Number;
@@ -69,6 +76,8 @@ class TCMalloc_PageMap1 {
   explicit TCMalloc_PageMap1(void* (*allocator)(size_t)) {
     array_ = reinterpret_cast<void**>((*allocator)(sizeof(void*) << BITS));
     memset(array_, 0, sizeof(void*) << BITS);
+    sizeclass_ = reinterpret_cast<uint8_t*>((*allocator)(LENGTH));
+    memset(sizeclass_, 0, LENGTH);
   }
 
   // Ensure that the map contains initialized entries "x .. x+n-1".
@@ -101,6 +110,32 @@ class TCMalloc_PageMap1 {
     array_[k] = v;
   }
 
+  // Return the current size class for KEY, or 0 if it is not set or
+  // k is out of range.
+  ALWAYS_INLINE
+  uint8_t get_sizeclass(Number k) const {
+    if ((k >> BITS) > 0) {
+      return 0;
+    }
+    return sizeclass_[k];
+  }
+
+  // REQUIRES "k" has been ensured before.
+  void set_sizeclass(Number k, uint8_t cl) {
+    sizeclass_[k] = cl;
+  }
+
+  // Hints CPU to start loading value and size class of KEY, which
+  // we're going to need soon.
+  ALWAYS_INLINE
+  void Prefetch(Number k) const {
+    if ((k >> BITS) > 0) {
+      return;
+    }
+    PREFETCH(&array_[k]);
+    PREFETCH(&sizeclass_[k]);
+  }
+
   // Return the first non-nullptr pointer found in this map for a page
   // number >= k.  Returns nullptr if no such number is found.
   void* Next(Number k) const {
@@ -125,6 +160,7 @@ class TCMalloc_PageMap2 {
   // Leaf node
   struct Leaf {
     void* values[LEAF_LENGTH];
+    uint8_t sizeclass[LEAF_LENGTH];
   };
 
   Leaf* root_[ROOT_LENGTH];             // Pointers to child nodes
@@ -155,6 +191,34 @@ class TCMalloc_PageMap2 {
     root_[i1]->values[i2] = v;
   }
 
+  ALWAYS_INLINE
+  uint8_t get_sizeclass(Number k) const {
+    const Number i1 = k >> LEAF_BITS;
+    const Number i2 = k & (LEAF_LENGTH-1);
+    if ((k >> BITS) > 0 || root_[i1] == nullptr) {
+      return 0;
+    }
+    return root_[i1]->sizeclass[i2];
+  }
+
+  void set_sizeclass(Number k, uint8_t cl) {
+    const Number i1 = k >> LEAF_BITS;
+    const Number i2 = k & (LEAF_LENGTH-1);
+    ASSERT(i1 < ROOT_LENGTH);
+    root_[i1]->sizeclass[i2] = cl;
+  }
+
+  ALWAYS_INLINE
+  void Prefetch(Number k) const {
+    const Number i1 = k >> LEAF_BITS;
+    const Number i2 = k & (LEAF_LENGTH-1);
+    if ((k >> BITS) > 0 || root_[i1] == nullptr) {
+      return;
+    }
+    PREFETCH(&root_[i1]->values[i2]);
+    PREFETCH(&root_[i1]->sizeclass[i2]);
+  }
+
   bool Ensure(Number start, size_t n) {
     for (Number key = start; key <= start + n - 1; ) {
       const Number i1 = key >> LEAF_BITS;
@@ -223,6 +287,7 @@ class TCMalloc_PageMap3 {
   // Leaf node
   struct Leaf {
     void* values[LEAF_LENGTH];
+    uint8_t sizeclass[LEAF_LENGTH];
   };
 
   Node  root_;                          // Root of radix tree
@@ -264,6 +329,40 @@ class TCMalloc_PageMap3 {
     reinterpret_cast<Leaf*>(root_.ptrs[i1]->ptrs[i2])->values[i3] = v;
   }
 
+  ALWAYS_INLINE
+  uint8_t get_sizeclass(Number k) const {
+    const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+    const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH-1);
+    const Number i3 = k & (LEAF_LENGTH-1);
+    if ((k >> BITS) > 0 ||
+        root_.ptrs[i1] == nullptr || root_.ptrs[i1]->ptrs[i2] == nullptr) {
+      return 0;
+    }
+    return reinterpret_cast<Leaf*>(root_.ptrs[i1]->ptrs[i2])->sizeclass[i3];
+  }
+
+  void set_sizeclass(Number k, uint8_t cl) {
+    ASSERT(k >> BITS == 0);
+    const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+    const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH-1);
+    const Number i3 = k & (LEAF_LENGTH-1);
+    reinterpret_cast<Leaf*>(root_.ptrs[i1]->ptrs[i2])->sizeclass[i3] = cl;
+  }
+
+  ALWAYS_INLINE
+  void Prefetch(Number k) const {
+    const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+    const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH-1);
+    const Number i3 = k & (LEAF_LENGTH-1);
+    if ((k >> BITS) > 0 ||
+        root_.ptrs[i1] == nullptr || root_.ptrs[i1]->ptrs[i2] == nullptr) {
+      return;
+    }
+    Leaf* leaf = reinterpret_cast<Leaf*>(root_.ptrs[i1]->ptrs[i2]);
+    PREFETCH(&leaf->values[i3]);
+    PREFETCH(&leaf->sizeclass[i3]);
+  }
+
   bool Ensure(Number start, size_t n) {
     for (Number key = start; key <= start + n - 1; ) {
       const Number i1 = key >> (LEAF_BITS + INTERIOR_BITS);
@@ -37,21 +37,158 @@
 #include <string.h>            // for memset
 
 #include "internal_logging.h"  // for ASSERT
-#include "page_heap_allocator.h"  // for PageHeapAllocator
-#include "static_vars.h"       // for Static
 
 namespace tcmalloc {
 
-Span* NewSpan(PageID p, Length len) {
-  Span* result = new (Static::span_allocator()->New()) Span;
+int LargeSpanIndex::KeyBit(Length length, PageID start, int bin, int depth) {
+  // Top bit of length is same for whole bin, so we start below it.
+  if (depth < bin) {
+    return (length >> (bin - 1 - depth)) & 1;
+  }
+  depth -= bin;
+  ASSERT(depth < kStartBits);
+  return (start >> depth) & 1;
+}
 
-  result->start = p;
-  result->length = len;
-  return result;
+bool LargeSpanIndex::KeyLess(const Span* a, const Span* b) {
+  if (a->length != b->length) {
+    return a->length < b->length;
+  }
+  // Lowest differing bit of start decides, as in KeyBit.
+  const PageID diff = a->start ^ b->start;
+  return (a->start & diff & -diff) == 0 && diff != 0;
+}
+
+void LargeSpanIndex::Insert(Span* span) {
+  ASSERT(span->length > kMaxPages);
+  ASSERT(!span->indexed);
+  span->indexed = 1;
+  span->index_child[0] = span->index_child[1] = nullptr;
+
+  const int bin = LgFloor(span->length);
+  Span** slot = &roots_[bin];
+  for (int depth = 0; *slot != nullptr; depth++) {
+    slot = &(*slot)->index_child[KeyBit(span->length, span->start, bin, depth)];
+  }
+  *slot = span;
+  nonempty_ |= uint64_t{1} << bin;
+}
+
+void LargeSpanIndex::Remove(Span* span) {
+  ASSERT(span->indexed);
+  span->indexed = 0;
+
+  const int bin = LgFloor(span->length);
+  Span** slot = &roots_[bin];
+  for (int depth = 0; *slot != span; depth++) {
+    ASSERT(*slot != nullptr);
+    slot = &(*slot)->index_child[KeyBit(span->length, span->start, bin, depth)];
+  }
+
+  // Any leaf below span shares the key bits that lead to span's
+  // place, so it can take that place.
+  Span* replacement = nullptr;
+  Span** leaf = (span->index_child[1] != nullptr
+                 ? &span->index_child[1] : &span->index_child[0]);
+  if (*leaf != nullptr) {
+    for (;;) {
+      Span* t = *leaf;
+      if (t->index_child[1] != nullptr) {
+        leaf = &t->index_child[1];
+      } else if (t->index_child[0] != nullptr) {
+        leaf = &t->index_child[0];
+      } else {
+        break;
+      }
+    }
+    replacement = *leaf;
+    *leaf = nullptr;
+    replacement->index_child[0] = span->index_child[0];
+    replacement->index_child[1] = span->index_child[1];
+  }
+  *slot = replacement;
+  span->index_child[0] = span->index_child[1] = nullptr;
+
+  if (roots_[bin] == nullptr) {
+    nonempty_ &= ~(uint64_t{1} << bin);
+  }
 }
 
-void DeleteSpan(Span* span) {
-  Static::span_allocator()->Delete(span);
+Span* LargeSpanIndex::BestFit(Length n) const {
+  ASSERT(n > 0);
+  const int bin = LgFloor(n);
+  Span* best = nullptr;
+  auto consider = [&best] (Span* t) {
+    if (best == nullptr || KeyLess(t, best)) {
+      best = t;
+    }
+  };
+  // Smallest key of subtree is either its root or in the subtree of
+  // its left child (or of right one, if there is no left). Spans at
+  // depth tbin and below share all length bits with their place, so
+  // they only differ from what we've seen by start.
+  auto consider_subtree = [&consider] (Span* t, int depth, int tbin) {
+    for (; t != nullptr && depth <= tbin;
+         t = (t->index_child[0] != nullptr
+              ? t->index_child[0] : t->index_child[1]), depth++) {
+      consider(t);
+    }
+  };
+
+  if (nonempty_ & (uint64_t{1} << bin)) {
+    // We follow the path of key (n, 0). Spans that fit are either on
+    // the path, or in subtrees to the right of it, of which the
+    // deepest one has smallest keys.
+    Span* right = nullptr;
+    int right_depth = 0;
+    Span* t = roots_[bin];
+    for (int depth = 0; t != nullptr && depth <= bin; depth++) {
+      if (t->length == n) {
+        return t;  // Can't do better than exact fit.
+      }
+      if (t->length > n) {
+        consider(t);
+      }
+      const int bit = KeyBit(n, 0, bin, depth);
+      if (bit == 0 && t->index_child[1] != nullptr) {
+        right = t->index_child[1];
+        right_depth = depth + 1;
+      }
+      t = t->index_child[bit];
+    }
+    consider_subtree(right, right_depth, bin);
+    if (best != nullptr) {
+      return best;
+    }
+  }
+
+  // All spans of higher bins fit.
+  const uint64_t higher = (bin + 1 < kNumBins
+                           ? nonempty_ & (~uint64_t{0} << (bin + 1))
+                           : 0);
+  if (higher != 0) {
+    const int hbin = FindFirstSet(higher);
+    consider_subtree(roots_[hbin], 0, hbin);
+  }
+  return best;
+}
+
+static bool ForEachInTrie(Span* t, FunctionRef<bool(Span*)> f) {
+  if (t == nullptr) {
+    return false;
+  }
+  return (f(t)
+          || ForEachInTrie(t->index_child[0], f)
+          || ForEachInTrie(t->index_child[1], f));
+}
+
+bool LargeSpanIndex::ForEach(FunctionRef<bool(Span*)> f) const {
+  for (uint64_t bins = nonempty_; bins != 0; bins &= bins - 1) {
+    if (ForEachInTrie(roots_[FindFirstSet(bins)], f)) {
+      return true;
+    }
+  }
+  return false;
 }
 
 void DLL_Init(Span* list) {
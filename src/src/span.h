@@ -37,8 +37,9 @@
 #define TCMALLOC_SPAN_H_
 
 #include <config.h>
-#include <set>
+#include <stdint.h>
 #include "common.h"
+#include "base/function_ref.h"
 #include "base/logging.h"
 #include "page_heap_allocator.h"
 
@@ -46,25 +47,6 @@ namespace tcmalloc {
 
 struct Span;
 
-// Store a pointer to a span along with a cached copy of its length.
-// These are used as set elements to improve the performance of
-// comparisons during tree traversal: the lengths are inline with the
-// tree nodes and thus avoid expensive cache misses to dereference
-// the actual Span objects in most cases.
-struct SpanPtrWithLength {
-  explicit SpanPtrWithLength(Span* s);
-
-  Span* span;
-  Length length;
-};
-// Comparator for best-fit search, with address order as a tie-breaker.
-struct SpanBestFitLess {
-  bool operator()(SpanPtrWithLength a, SpanPtrWithLength b) const;
-};
-
-using SpanSet = std::set<SpanPtrWithLength, SpanBestFitLess, STLPageHeapAllocator<SpanPtrWithLength, void>>;
-using SpanSetIter = SpanSet::iterator;
-
 // Information kept for a span (a contiguous run of pages).
 struct Span {
   PageID        start;          // Starting page number
@@ -73,67 +55,88 @@ struct Span {
   Span*         prev;           // Used when in link list
   union {
     void* objects;              // Linked list of free objects
-
-    // Span may contain iterator pointing back at SpanSet entry of
-    // this span into set of large spans. It is used to quickly delete
-    // spans from those sets. span_iter_space is space for such
-    // iterator which lifetime is controlled explicitly.
-    alignas(SpanSetIter) char span_iter_space[sizeof(SpanSetIter)];
+    Span* index_child[2];       // Children in LargeSpanIndex trie
+    Span* age_link[2];          // Next and prev in PageHeap's age list
+                                // of free spans up to kMaxPages long
   };
   unsigned int  refcount : 16;  // Number of non-free objects
   unsigned int  sizeclass : 8;  // Size-class for small objects (or 0)
   unsigned int  location : 2;   // Is the span on a freelist, and if so, which?
   unsigned int  sample : 1;     // Sampled object?
-  bool          has_span_iter : 1; // Iff span_iter_space has valid
-                                   // iterator. Only for debug builds.
+  unsigned int  numa_partition : 2; // Heap partition span's memory belongs to
+  unsigned int  dedicated : 1;  // Has its own system mapping (see
+                                // PageHeap::SetDedicatedThreshold)
+  unsigned int  arena : 1;      // Is a chunk of tcmalloc::Arena
+  bool          indexed : 1;    // Is in LargeSpanIndex. Only for
+                                // debug builds.
+  bool          cached : 1;     // Is in large span cache (see
+                                // PageHeap::SetLargeCacheLimit)
+  uint8_t       heap_partition; // Tenant heap partition this chunk of
+                                // default page heap is lent to, or 0
+                                // (see PageHeap::NewChunk)
+  uint16_t      uncarved;       // Number of free objects at the end of
+                                // small object span that were never
+                                // put on objects list (see
+                                // CentralFreeList::Populate)
+  union {
+    int64_t free_time;          // When span was last freed, in
+                                // milliseconds of monotonic clock. For
+                                // normal free spans and cached ones.
+    Length lazy_pages;          // How many pages of released span were
+                                // released with MADV_FREE (so may still
+                                // be resident).
+  };
 
   constexpr Span()
-    : start{}, length{}, next{}, prev{}, objects{}, refcount{}, sizeclass{}, location{}, sample{}, has_span_iter{} {}
-
-  // Sets iterator stored in span_iter_space.
-  // Requires has_span_iter == 0.
-  void SetSpanSetIterator(const SpanSetIter& iter);
-  // Copies out and destroys iterator stored in span_iter_space.
-  SpanSetIter ExtractSpanSetIterator();
+    : start{}, length{}, next{}, prev{}, objects{}, refcount{}, sizeclass{}, location{}, sample{}, numa_partition{}, dedicated{}, arena{}, indexed{}, cached{}, heap_partition{}, uncarved{}, free_time{} {}
 
   // What freelist the span is on: IN_USE if on none, or normal or returned
   enum { IN_USE, ON_NORMAL_FREELIST, ON_RETURNED_FREELIST };
 };
 
-inline SpanPtrWithLength::SpanPtrWithLength(Span* s)
-    : span(s),
-      length(s->length) {
-}
-
-inline bool SpanBestFitLess::operator()(SpanPtrWithLength a, SpanPtrWithLength b) const {
-  if (a.length < b.length)
-    return true;
-  if (a.length > b.length)
-    return false;
-  return a.span->start < b.span->start;
-}
-
-inline void Span::SetSpanSetIterator(const SpanSetIter& iter) {
-  ASSERT(!has_span_iter);
-  has_span_iter = 1;
-
-  new (span_iter_space) SpanSetIter(iter);
-}
-
-inline SpanSetIter Span::ExtractSpanSetIterator() {
-  ASSERT(has_span_iter);
-  has_span_iter = 0;
-
-  SpanSetIter* this_iter =
-    reinterpret_cast<SpanSetIter*>(span_iter_space);
-  SpanSetIter retval = *this_iter;
-  this_iter->~SpanSetIter();
-  return retval;
-}
-
-// Allocator/deallocator for spans
-Span* NewSpan(PageID p, Length len);
-void DeleteSpan(Span* span);
+// Index of free spans longer than kMaxPages for best-fit search.
+//
+// Spans are binned by power of two of their length, and every bin is
+// a bitwise trie keyed on length and then start page, built of spans
+// themselves (linked through Span::index_child), much like dlmalloc's
+// tree bins. Unlike std::set, which we used before, the index never
+// allocates memory and doesn't rebalance: insert and remove walk a
+// single path, which is about as long as the number of bits that tell
+// spans of a bin apart. Start pages are looked at from the lowest
+// bit, so that spans of equal length branch out right away.
+class LargeSpanIndex {
+ public:
+  constexpr LargeSpanIndex() : nonempty_{}, roots_{} {}
+
+  bool empty() const { return nonempty_ == 0; }
+
+  // REQUIRES: span->length > kMaxPages, and span is not in any index.
+  void Insert(Span* span);
+  // REQUIRES: span is in this index.
+  void Remove(Span* span);
+
+  // Returns shortest span of at least n pages, or nullptr if there
+  // is none. Among equally long spans, any one can be returned.
+  Span* BestFit(Length n) const;
+
+  // Calls f for indexed spans, bin by bin starting with the shortest
+  // spans, until it returns true. Returns whether it did.
+  bool ForEach(FunctionRef<bool(Span*)> f) const;
+
+ private:
+  static constexpr int kNumBins = 8 * sizeof(Length);
+  // Number of bits of start page that tell spans apart.
+  static constexpr int kStartBits = kAddressBits - kPageShift;
+
+  // Returns bit of (length, start) key at the given depth of trie
+  // of the given bin.
+  static int KeyBit(Length length, PageID start, int bin, int depth);
+  // Returns whether span a goes before span b in key order.
+  static bool KeyLess(const Span* a, const Span* b);
+
+  uint64_t nonempty_;  // Bit per bin with non-empty trie.
+  Span* roots_[kNumBins];
+};
 
 // -------------------------------------------------------------------------
 // Doubly linked list of spans.
@@ -44,6 +44,9 @@
 #include "getenv_safe.h"       // TCMallocGetenvSafe
 #include "base/googleinit.h"
 
+#include "cpu_cache.h"
+#include "heap_partition.h"
+#include "numa_topology.h"
 #include "thread_cache_ptr.h"
 #include "system-alloc.h"
 
@@ -65,8 +68,15 @@ void Static::InitStaticVars() {
   span_allocator_.New(); // Reduce cache conflicts
   stacktrace_allocator_.Init();
 
+  // Must come before central free lists are set up, since it may
+  // replicate size classes.
+  NumaTopology::InitModule();
+
+  CentralFreeList::SetBitmapSpans(
+    tcmalloc::commandlineflags::StringToBool(
+      TCMallocGetenvSafe("TCMALLOC_BITMAP_SPANS"), false));
   for (int i = 0; i < num_size_classes(); ++i) {
-    central_cache_[i].Init(i);
+    central_cache_[i].Init(i, pageheap(), central_cache_);
   }
 
   new (pageheap()) PageHeap(sizemap_.min_span_size_in_pages());
@@ -85,6 +95,31 @@ void Static::InitStaticVars() {
 
   pageheap()->SetAggressiveDecommit(aggressive_decommit);
 
+  pageheap()->SetHugePageAware(
+    tcmalloc::commandlineflags::StringToBool(
+      TCMallocGetenvSafe("TCMALLOC_HUGEPAGE_AWARE"), false));
+
+  pageheap()->SetReleaseMinAge(
+    tcmalloc::commandlineflags::StringToLongLong(
+      TCMallocGetenvSafe("TCMALLOC_RELEASE_MIN_AGE_MS"), 0));
+
+  pageheap()->SetLargeCacheLimit(
+    tcmalloc::commandlineflags::StringToLongLong(
+      TCMallocGetenvSafe("TCMALLOC_LARGE_SPAN_CACHE_BYTES"), 0));
+  pageheap()->SetLargeCacheExpiry(
+    tcmalloc::commandlineflags::StringToLongLong(
+      TCMallocGetenvSafe("TCMALLOC_LARGE_SPAN_CACHE_EXPIRY_MS"), 1000));
+
+  pageheap()->SetPagemapPrefetch(
+    tcmalloc::commandlineflags::StringToBool(
+      TCMallocGetenvSafe("TCMALLOC_PAGEMAP_PREFETCH"), false));
+
+  pageheap()->SetDedicatedThreshold(
+    tcmalloc::pages(tcmalloc::commandlineflags::StringToLongLong(
+      TCMallocGetenvSafe("TCMALLOC_MREMAP_THRESHOLD_BYTES"), 0)));
+
+  CpuCache::InitModule();
+
   inited_ = true;
 
   DLL_Init(&sampled_objects_);
@@ -97,6 +132,8 @@ void Static::InitStaticVars() {
 
 void CentralCacheLockAll() NO_THREAD_SAFETY_ANALYSIS
 {
+  CpuCache::LockAll();
+  HeapPartition::LockAll();
   Static::pageheap_lock()->Lock();
   for (int i = 0; i < Static::num_size_classes(); ++i)
     Static::central_cache()[i].Lock();
@@ -111,6 +148,8 @@ void CentralCacheUnlockAll() NO_THREAD_SAFETY_ANALYSIS
   for (int i = 0; i < Static::num_size_classes(); ++i)
     Static::central_cache()[i].Unlock();
   Static::pageheap_lock()->Unlock();
+  HeapPartition::UnlockAll();
+  CpuCache::UnlockAll();
 }
 
 void Static::InitLateMaybeRecursive() {
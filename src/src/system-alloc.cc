@@ -36,12 +36,18 @@
 #include <fcntl.h>                      // for open, O_RDWR
 #include <stddef.h>                     // for size_t, ptrdiff_t
 #include <stdint.h>                     // for uintptr_t, intptr_t
+#include <string.h>                     // for strcmp
 #ifdef HAVE_MMAP
 #include <sys/mman.h>                   // for munmap, mmap, MADV_DONTNEED, etc
 #endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>                     // for sbrk, getpagesize, off_t
 #endif
+#if defined(__linux__)
+#include <sys/syscall.h>                // for SYS_process_madvise
+#include <sys/uio.h>                    // for iovec
+#endif
+#include <atomic>
 #include <new>                          // for operator new
 #include <gperftools/malloc_extension.h>
 #include "base/basictypes.h"
@@ -49,7 +55,9 @@
 #include "base/spinlock.h"              // for SpinLockHolder, SpinLock, etc
 #include "base/static_storage.h"
 #include "common.h"
+#include "getenv_safe.h"
 #include "internal_logging.h"
+#include "system-alloc.h"
 
 // On systems (like freebsd) that don't define MAP_ANONYMOUS, use the old
 // form of the name instead.
@@ -57,20 +65,33 @@
 # define MAP_ANONYMOUS MAP_ANON
 #endif
 
-// Linux added support for MADV_FREE in 4.5 but we aren't ready to use it
-// yet. Among other things, using compile-time detection leads to poor
-// results when compiling on a system with MADV_FREE and running on a
-// system without it. See https://github.com/gperftools/gperftools/issues/780.
-#if defined(__linux__) && defined(MADV_FREE) && !defined(TCMALLOC_USE_MADV_FREE)
-# undef MADV_FREE
+// Linux added support for MADV_FREE in 4.5. Whether we use it is
+// decided at runtime (see TCMALLOC_RELEASE_ADVICE), and we fall back
+// to MADV_DONTNEED when running on older kernels. So we don't depend
+// on system headers knowing about it. See
+// https://github.com/gperftools/gperftools/issues/780.
+#if defined(__linux__) && defined(MADV_DONTNEED) && !defined(MADV_FREE)
+# define MADV_FREE 8
 #endif
 
-// MADV_FREE is specifically designed for use by malloc(), but only
-// FreeBSD supports it; in linux we fall back to the somewhat inferior
-// MADV_DONTNEED.
+// MADV_FREE is specifically designed for use by malloc(). Where only
+// one of MADV_FREE and MADV_DONTNEED exists, we use it for both kinds
+// of advice.
 #if !defined(MADV_FREE) && defined(MADV_DONTNEED)
 # define MADV_FREE  MADV_DONTNEED
 #endif
+#if !defined(MADV_DONTNEED) && defined(MADV_FREE)
+# define MADV_DONTNEED  MADV_FREE
+#endif
+
+// Linux users have to opt in to MADV_FREE, since it makes RSS look
+// bigger than our heap stats say. Elsewhere we keep using it like we
+// always did.
+#if defined(__linux__) && !defined(TCMALLOC_USE_MADV_FREE)
+static const TCMalloc_ReleaseAdvice kDefaultReleaseAdvice = TCMALLOC_RELEASE_DONTNEED;
+#else
+static const TCMalloc_ReleaseAdvice kDefaultReleaseAdvice = TCMALLOC_RELEASE_FREE;
+#endif
 
 // Set kDebugMode mode so that we can have use C++ conditionals
 // instead of preprocessor conditionals.
@@ -99,8 +120,18 @@ static_assert(kAddressBits <= 8 * sizeof(void*),
 static SpinLock spinlock;
 
 #if defined(HAVE_MMAP) || defined(MADV_FREE)
-// Page size is initialized on demand (only needed for mmap-based allocators)
-static size_t pagesize = 0;
+// Page size is initialized on demand (only needed for mmap-based
+// allocators). Releases run without any lock held, so it is atomic.
+static std::atomic<size_t> system_pagesize{0};
+
+static size_t SystemPageSize() {
+  size_t rv = system_pagesize.load(std::memory_order_relaxed);
+  if (rv == 0) {
+    rv = getpagesize();
+    system_pagesize.store(rv, std::memory_order_relaxed);
+  }
+  return rv;
+}
 #endif
 
 // The current system allocator
@@ -139,6 +170,21 @@ private:
 };
 static tcmalloc::StaticStorage<MmapSysAllocator> mmap_space;
 
+// Gives every allocation its own mapping, which can later be resized
+// with mremap and given back with munmap. Used for very large
+// allocations only (see TCMalloc_SystemMapDedicated), and never as a
+// child of DefaultSysAllocator, since the rest of the heap doesn't
+// expect its memory to ever go away.
+class MremapSysAllocator : public SysAllocator {
+public:
+  MremapSysAllocator() : SysAllocator() {
+  }
+  void* Alloc(size_t size, size_t *actual_size, size_t alignment);
+  void* Remap(void* ptr, size_t old_size, size_t new_size, bool may_move);
+  void Free(void* ptr, size_t size);
+};
+static tcmalloc::StaticStorage<MremapSysAllocator> mremap_space;
+
 class DefaultSysAllocator : public SysAllocator {
  public:
   DefaultSysAllocator() : SysAllocator() {
@@ -255,7 +301,7 @@ void* MmapSysAllocator::Alloc(size_t size, size_t *actual_size,
   }
 
   // Enforce page alignment
-  if (pagesize == 0) pagesize = getpagesize();
+  const size_t pagesize = SystemPageSize();
   if (alignment < pagesize) alignment = pagesize;
   size_t aligned_size = ((size + alignment - 1) / alignment) * alignment;
   if (aligned_size < size) {
@@ -331,6 +377,56 @@ void* MmapSysAllocator::Alloc(size_t size, size_t *actual_size,
 #endif  // HAVE_MMAP
 }
 
+#if defined(HAVE_MMAP) && defined(__linux__) && defined(MREMAP_MAYMOVE)
+#define HAVE_MREMAP_SYS_ALLOCATOR 1
+#endif
+
+void* MremapSysAllocator::Alloc(size_t size, size_t *actual_size,
+                                size_t alignment) {
+#ifndef HAVE_MREMAP_SYS_ALLOCATOR
+  return nullptr;
+#else
+  if (FLAGS_malloc_skip_mmap) {
+    return nullptr;
+  }
+  // Nobody needs more than page alignment here. And mremap wouldn't
+  // preserve larger one anyways.
+  const size_t pagesize = SystemPageSize();
+  if (alignment > pagesize || (size & (pagesize - 1)) != 0) {
+    return nullptr;
+  }
+  if (actual_size) {
+    *actual_size = size;
+  }
+  void* result = mmap(nullptr, size, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (result == MAP_FAILED) {
+    return nullptr;
+  }
+  return result;
+#endif  // HAVE_MREMAP_SYS_ALLOCATOR
+}
+
+void* MremapSysAllocator::Remap(void* ptr, size_t old_size, size_t new_size,
+                                bool may_move) {
+#ifndef HAVE_MREMAP_SYS_ALLOCATOR
+  return nullptr;
+#else
+  void* result = mremap(ptr, old_size, new_size,
+                        may_move ? MREMAP_MAYMOVE : 0);
+  if (result == MAP_FAILED) {
+    return nullptr;
+  }
+  return result;
+#endif  // HAVE_MREMAP_SYS_ALLOCATOR
+}
+
+void MremapSysAllocator::Free(void* ptr, size_t size) {
+#ifdef HAVE_MREMAP_SYS_ALLOCATOR
+  munmap(ptr, size);
+#endif
+}
+
 void* DefaultSysAllocator::Alloc(size_t size, size_t *actual_size,
                                  size_t alignment) {
   for (int i = 0; i < kMaxAllocators; i++) {
@@ -360,6 +456,7 @@ static bool system_alloc_inited = false;
 void InitSystemAllocators(void) {
   MmapSysAllocator *mmap = mmap_space.Construct();
   SbrkSysAllocator *sbrk = sbrk_space.Construct();
+  mremap_space.Construct();
 
   // In 64-bit debug mode, place the mmap allocator first since it
   // allocates pointers that do not fit in 32 bits and therefore gives
@@ -410,10 +507,106 @@ void* TCMalloc_SystemAlloc(size_t size, size_t *actual_size,
   return result;
 }
 
+void* TCMalloc_SystemMapDedicated(size_t size) {
+  SpinLockHolder lock_holder(&spinlock);
+
+  if (!system_alloc_inited) {
+    InitSystemAllocators();
+    system_alloc_inited = true;
+  }
+
+  // When somebody has installed their own system allocator, all the
+  // memory must come from it.
+  if (tcmalloc_sys_alloc != default_space.get()) {
+    return nullptr;
+  }
+
+  void* result = mremap_space.get()->Alloc(size, nullptr, 0);
+  if (result == nullptr) {
+    return nullptr;
+  }
+  CHECK_CONDITION(
+    CheckAddressBits(reinterpret_cast<uintptr_t>(result) + size - 1));
+  TCMalloc_SystemTaken += size;
+  return result;
+}
+
+void* TCMalloc_SystemRemapDedicated(void* start, size_t old_size,
+                                    size_t new_size, bool may_move) {
+  SpinLockHolder lock_holder(&spinlock);
+  ASSERT(system_alloc_inited);
+
+  void* result = mremap_space.get()->Remap(start, old_size, new_size,
+                                           may_move);
+  if (result == nullptr) {
+    return nullptr;
+  }
+  CHECK_CONDITION(
+    CheckAddressBits(reinterpret_cast<uintptr_t>(result) + new_size - 1));
+  TCMalloc_SystemTaken += new_size;
+  TCMalloc_SystemTaken -= old_size;
+  return result;
+}
+
+void TCMalloc_SystemUnmapDedicated(void* start, size_t size) {
+  SpinLockHolder lock_holder(&spinlock);
+  ASSERT(system_alloc_inited);
+  mremap_space.get()->Free(start, size);
+  TCMalloc_SystemTaken -= size;
+}
+
+// Current release advice, or -1 until we've looked at environment.
+// Releases run without any lock held (see
+// PageHeap::FinishReleaseBatch), so it is atomic. Racing first calls
+// just parse environment twice.
+static std::atomic<int> release_advice{-1};
+
+TCMalloc_ReleaseAdvice TCMalloc_GetReleaseAdvice() {
+  int advice = release_advice.load(std::memory_order_relaxed);
+  if (advice < 0) {
+    advice = kDefaultReleaseAdvice;
+    const char* env = TCMallocGetenvSafe("TCMALLOC_RELEASE_ADVICE");
+    if (env == nullptr) {
+      // Keep default
+    } else if (!strcmp(env, "dontneed")) {
+      advice = TCMALLOC_RELEASE_DONTNEED;
+    } else if (!strcmp(env, "free")) {
+      advice = TCMALLOC_RELEASE_FREE;
+    } else if (!strcmp(env, "hybrid")) {
+      advice = TCMALLOC_RELEASE_HYBRID;
+    } else {
+      Log(kLog, __FILE__, __LINE__,
+          "Unknown TCMALLOC_RELEASE_ADVICE (expected dontneed, free or hybrid)",
+          env);
+    }
+    release_advice.store(advice, std::memory_order_relaxed);
+  }
+  return static_cast<TCMalloc_ReleaseAdvice>(advice);
+}
+
+bool TCMalloc_SetReleaseAdvice(int advice) {
+  switch (advice) {
+  case TCMALLOC_RELEASE_DONTNEED:
+  case TCMALLOC_RELEASE_FREE:
+  case TCMALLOC_RELEASE_HYBRID:
+    release_advice.store(advice, std::memory_order_relaxed);
+    return true;
+  default:
+    return false;
+  }
+}
+
 bool TCMalloc_SystemRelease(void* start, size_t length) {
+  bool lazy;
+  return TCMalloc_SystemRelease(start, length, false, &lazy);
+}
+
+bool TCMalloc_SystemRelease(void* start, size_t length, bool low_pressure,
+                            bool* lazy) {
+  *lazy = false;
 #if defined(FREE_MMAP_PROT_NONE) && defined(HAVE_MMAP) || defined(MADV_FREE)
   if (FLAGS_malloc_disable_memory_release) return false;
-  if (pagesize == 0) pagesize = getpagesize();
+  const size_t pagesize = SystemPageSize();
   const size_t pagemask = pagesize - 1;
 
   size_t new_start = reinterpret_cast<size_t>(start);
@@ -442,8 +635,22 @@ bool TCMalloc_SystemRelease(void* start, size_t length) {
 
       result = ret != MAP_FAILED;
 #else
+      const TCMalloc_ReleaseAdvice advice = TCMalloc_GetReleaseAdvice();
+      const bool want_lazy = (advice == TCMALLOC_RELEASE_FREE ||
+                              (advice == TCMALLOC_RELEASE_HYBRID && low_pressure));
       int ret = madvise(reinterpret_cast<char*>(new_start),
-          new_end - new_start, MADV_FREE);
+          new_end - new_start, want_lazy ? MADV_FREE : MADV_DONTNEED);
+      if (ret == -1 && want_lazy && errno == EINVAL) {
+        // Kernel doesn't know MADV_FREE. Don't bother asking again.
+        Log(kLog, __FILE__, __LINE__,
+            "MADV_FREE is not supported, switching to MADV_DONTNEED");
+        release_advice.store(TCMALLOC_RELEASE_DONTNEED,
+                             std::memory_order_relaxed);
+        ret = madvise(reinterpret_cast<char*>(new_start),
+                      new_end - new_start, MADV_DONTNEED);
+      } else if (ret != -1) {
+        *lazy = want_lazy && (MADV_FREE != MADV_DONTNEED);
+      }
 
       result = ret != -1;
 #endif
@@ -456,6 +663,91 @@ bool TCMalloc_SystemRelease(void* start, size_t length) {
   return false;
 }
 
+#if defined(__linux__) && defined(SYS_process_madvise) && defined(MADV_DONTNEED) \
+  && !(defined(FREE_MMAP_PROT_NONE) && defined(HAVE_MMAP))
+#define HAVE_PROCESS_MADVISE 1
+
+// Refers to the calling process in pidfd-taking system calls. Kernels
+// that know it (6.13+) also allow process_madvise on ourselves with
+// any advice, which is what we need.
+static const int kPidfdSelf = -10000;
+
+// Cleared once process_madvise fails, so that we don't keep trying
+// it on kernels that don't support it.
+static std::atomic<bool> process_madvise_works{true};
+
+// Releases ranges[0..n) with a single process_madvise call (per 64
+// ranges). Sets released field of ranges that were fully released.
+static void ProcessMadviseRanges(TCMalloc_ReleaseRange* ranges, int n,
+                                 int advice) {
+  static const int kMaxIov = 64;
+  const size_t pagemask = SystemPageSize() - 1;
+  while (n > 0) {
+    struct iovec iov[kMaxIov];
+    int index[kMaxIov];
+    int count = 0;
+    int i = 0;
+    for (; i < n && count < kMaxIov; i++) {
+      const uintptr_t start = reinterpret_cast<uintptr_t>(ranges[i].start);
+      const uintptr_t new_start = (start + pagemask) & ~pagemask;
+      const uintptr_t new_end = (start + ranges[i].length) & ~pagemask;
+      // Ranges smaller than a page are not released, like with
+      // TCMalloc_SystemRelease.
+      if (new_end > new_start) {
+        iov[count].iov_base = reinterpret_cast<void*>(new_start);
+        iov[count].iov_len = new_end - new_start;
+        index[count++] = i;
+      }
+    }
+
+    ssize_t done;
+    do {
+      done = syscall(SYS_process_madvise, kPidfdSelf, iov, count, advice, 0);
+    } while (done < 0 && errno == EAGAIN);
+    if (done < 0) {
+      process_madvise_works = false;
+      return;
+    }
+    // Kernel may stop part way through, in which case the rest is
+    // done by the caller with plain madvise.
+    for (int j = 0; j < count && done >= static_cast<ssize_t>(iov[j].iov_len); j++) {
+      ranges[index[j]].released = true;
+      done -= iov[j].iov_len;
+    }
+    ranges += i;
+    n -= i;
+  }
+}
+#endif  // HAVE_PROCESS_MADVISE
+
+void TCMalloc_SystemReleaseRanges(TCMalloc_ReleaseRange* ranges, int n,
+                                  bool low_pressure) {
+  for (int i = 0; i < n; i++) {
+    ranges[i].released = false;
+    ranges[i].lazy = false;
+  }
+
+#ifdef HAVE_PROCESS_MADVISE
+  if (!FLAGS_malloc_disable_memory_release && n > 1 && process_madvise_works) {
+    const TCMalloc_ReleaseAdvice advice = TCMalloc_GetReleaseAdvice();
+    const bool want_lazy = (advice == TCMALLOC_RELEASE_FREE ||
+                            (advice == TCMALLOC_RELEASE_HYBRID && low_pressure));
+    ProcessMadviseRanges(ranges, n, want_lazy ? MADV_FREE : MADV_DONTNEED);
+    for (int i = 0; i < n; i++) {
+      ranges[i].lazy = (ranges[i].released && want_lazy
+                        && (MADV_FREE != MADV_DONTNEED));
+    }
+  }
+#endif
+
+  for (int i = 0; i < n; i++) {
+    if (!ranges[i].released) {
+      ranges[i].released = TCMalloc_SystemRelease(ranges[i].start, ranges[i].length,
+                                                  low_pressure, &ranges[i].lazy);
+    }
+  }
+}
+
 void TCMalloc_SystemCommit(void* start, size_t length) {
 #if defined(FREE_MMAP_PROT_NONE) && defined(HAVE_MMAP)
   // remaping as MAP_FIXED to same address assuming span size did not change 
@@ -469,6 +761,14 @@ void TCMalloc_SystemCommit(void* start, size_t length) {
 #endif
 }
 
+void TCMalloc_SystemHintHugePages(void* start, size_t length) {
+#if defined(HAVE_MMAP) && defined(MADV_HUGEPAGE)
+  // Failures are fine. I.e. transparent hugepages may be disabled or
+  // unsupported by kernel.
+  madvise(start, length, MADV_HUGEPAGE);
+#endif
+}
+
 SpinLock* GetSysAllocLock() {
   return &spinlock;
 }
@@ -79,6 +79,53 @@ void* TCMalloc_SystemAlloc(size_t bytes, size_t *actual_bytes,
 extern PERFTOOLS_DLL_DECL
 bool TCMalloc_SystemRelease(void* start, size_t length);
 
+// How TCMalloc_SystemRelease gives memory back to the system. Chosen
+// by TCMALLOC_RELEASE_ADVICE environment variable and can be changed
+// at runtime.
+enum TCMalloc_ReleaseAdvice {
+  // Pages are dropped right away (MADV_DONTNEED). Touching them again
+  // page faults.
+  TCMALLOC_RELEASE_DONTNEED = 0,
+  // Pages are reclaimed by the OS only when it needs memory
+  // (MADV_FREE). Until then they stay resident and can be reused
+  // without page faults.
+  TCMALLOC_RELEASE_FREE = 1,
+  // MADV_FREE for releases under low memory pressure (i.e. periodic
+  // release at tcmalloc_release_rate), MADV_DONTNEED for everything
+  // else (explicit ReleaseToSystem calls, heap limit).
+  TCMALLOC_RELEASE_HYBRID = 2,
+};
+
+extern PERFTOOLS_DLL_DECL TCMalloc_ReleaseAdvice TCMalloc_GetReleaseAdvice();
+// Returns false if advice is unknown or not supported here.
+extern PERFTOOLS_DLL_DECL bool TCMalloc_SetReleaseAdvice(int advice);
+
+// Same as above, but lets caller tell if memory pressure is low, and
+// sets *lazy if pages were released lazily (i.e. may still be
+// resident).
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemRelease(void* start, size_t length, bool low_pressure,
+                            bool* lazy);
+
+// Range of memory for TCMalloc_SystemReleaseRanges.
+struct TCMalloc_ReleaseRange {
+  void* start;
+  size_t length;
+  // Set by TCMalloc_SystemReleaseRanges.
+  bool released;
+  bool lazy;  // See TCMalloc_SystemRelease.
+};
+
+// Same as calling TCMalloc_SystemRelease for each of n ranges, but
+// releases all of them with a single system call (process_madvise)
+// where the kernel supports it. Sets released and lazy fields of
+// every range. Advice may change part way through (i.e. when kernel
+// turns out not to support MADV_FREE), so lazy may differ between
+// ranges.
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemReleaseRanges(TCMalloc_ReleaseRange* ranges, int n,
+                                  bool low_pressure);
+
 // Called to ressurect memory which has been previously released
 // to the system via TCMalloc_SystemRelease.  An attempt to
 // commit a page that is already committed does not cause this
@@ -86,6 +133,31 @@ bool TCMalloc_SystemRelease(void* start, size_t length);
 extern PERFTOOLS_DLL_DECL
 void TCMalloc_SystemCommit(void* start, size_t length);
 
+// Hints the operating system that the specified range of memory is
+// better backed by huge pages. Does nothing where this isn't
+// supported.
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemHintHugePages(void* start, size_t length);
+
+// Maps "bytes" (multiple of system page size) of zeroed memory as
+// its own mapping, bypassing regular system allocator chain, so that
+// it can be resized or unmapped independently of any other memory.
+// Returns nullptr if that is not supported on this platform or if
+// user has installed their own system allocator.
+extern PERFTOOLS_DLL_DECL
+void* TCMalloc_SystemMapDedicated(size_t bytes);
+
+// Resizes mapping made by TCMalloc_SystemMapDedicated (mremap on
+// Linux). Returns its new start, which is same as old one unless
+// may_move is true, or nullptr (leaving mapping intact) on failure.
+extern PERFTOOLS_DLL_DECL
+void* TCMalloc_SystemRemapDedicated(void* start, size_t old_bytes,
+                                    size_t new_bytes, bool may_move);
+
+// Unmaps mapping made by TCMalloc_SystemMapDedicated.
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemUnmapDedicated(void* start, size_t bytes);
+
 // The current system allocator.
 extern PERFTOOLS_DLL_DECL SysAllocator* tcmalloc_sys_alloc;
 
@@ -65,6 +65,10 @@
 // in Populate() for pages with sizeclass > 0 objects, and in do_malloc() and
 // do_memalign() for all other relevant pages.
 //
+// When the cache misses, page map itself has exact sizeclass of every
+// page of small objects span (and 0 for all other pages), so Span is
+// only looked at when freeing page-level objects.
+//
 // PAGEMAP
 // -------
 // Page map contains a mapping from page id to Span.
@@ -97,23 +101,31 @@
 #include <stddef.h>                     // for size_t
 #include <stdlib.h>                     // for getenv
 #include <string.h>                     // for strcmp, memset, strlen, etc
+#include <time.h>                       // for nanosleep
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>                     // for getpagesize, write, etc
 #endif
 #include <algorithm>                    // for max, min
+#include <atomic>
 #include <limits>                       // for numeric_limits
 #include <new>                          // for nothrow_t (ptr only), etc
 #include <vector>                       // for vector
 
 #include <gperftools/malloc_extension.h>
+#include <gperftools/malloc_extension_c.h>
 #include <gperftools/malloc_hook.h>         // for MallocHook
 #include <gperftools/nallocx.h>
+#include <gperftools/arena.h>
+#include "arena.h"                      // for tcmalloc::Arena
 #include "base/basictypes.h"            // for int64
 #include "base/commandlineflags.h"      // for RegisterFlagValidator, etc
 #include "base/dynamic_annotations.h"   // for RunningOnValgrind
 #include "base/spinlock.h"              // for SpinLockHolder
 #include "central_freelist.h"
 #include "common.h"            // for StackTrace, kPageShift, etc
+#include "cpu_cache.h"         // for CpuCache
+#include "heap_partition.h"    // for HeapPartition
+#include "numa_topology.h"     // for NumaTopology
 #include "internal_logging.h"  // for ASSERT, TCMalloc_Printer, etc
 #include "linked_list.h"       // for SLL_SetNext
 #include "malloc_hook-inl.h"       // for tcmalloc::InvokeNewHook, etc
@@ -140,9 +152,12 @@
 
 #include "libc_override.h"
 
+using tcmalloc::CpuCache;
+using tcmalloc::HeapPartition;
 using tcmalloc::kLog;
 using tcmalloc::kCrash;
 using tcmalloc::Log;
+using tcmalloc::NumaTopology;
 using tcmalloc::PageHeap;
 using tcmalloc::PageHeapAllocator;
 using tcmalloc::SizeMap;
@@ -238,6 +253,10 @@ extern "C" {
   //    glibc: malloc_usable_size()
   //    Windows: _msize()
   ATTRIBUTE_NOINLINE size_t tc_malloc_size(void* p) PERFTOOLS_NOTHROW;
+
+  ATTRIBUTE_NOINLINE tc_sized_ptr_t tc_malloc_at_least(size_t size) PERFTOOLS_NOTHROW;
+  ATTRIBUTE_NOINLINE tc_sized_ptr_t tc_new_at_least(size_t size);
+  ATTRIBUTE_NOINLINE int tc_try_realloc_in_place(void* ptr, size_t new_size) PERFTOOLS_NOTHROW;
 }  // extern "C"
 
 // ----------------------- IMPLEMENTATION -------------------------------
@@ -269,18 +288,52 @@ size_t InvalidGetAllocatedSize(const void* ptr) {
 
 }  // unnamed namespace
 
+// Returns span that page p belongs to, or nullptr if p isn't ours.
+// Looks into chunks lent to tenant heap partitions, and if pageheap
+// is not nullptr, sets *pageheap to page heap the span belongs to.
+static Span* LookupSpan(PageID p, PageHeap** pageheap = nullptr) {
+  PageHeap* heap = Static::pageheap();
+  Span* span = heap->GetDescriptor(p);
+  if (span != nullptr && PREDICT_FALSE(span->heap_partition != 0)) {
+    heap = HeapPartition::Get(span->heap_partition)->pageheap();
+    span = heap->GetDescriptor(p);
+  }
+  if (pageheap != nullptr) {
+    *pageheap = heap;
+  }
+  return span;
+}
+
 // Extract interesting stats
 struct TCMallocStats {
   uint64_t thread_bytes;      // Bytes in thread caches
+  uint64_t cpu_bytes;         // Bytes in per-CPU caches
   uint64_t central_bytes;     // Bytes in central cache
   uint64_t transfer_bytes;    // Bytes in central transfer cache
   uint64_t metadata_bytes;    // Bytes alloced for metadata
   PageHeap::Stats pageheap;   // Stats from page heap
+  PageHeap::HugePageStats hugepages;  // Hugepage stats from page heap
 };
 
+// Returns sums of free, unmapped and lazily freed bytes of page heaps
+// of tenant heap partitions. They live in chunks of the default page
+// heap, which counts chunks as in use, so its stats need these added.
+// REQUIRES: Static::pageheap_lock is not held (tenant locks go first).
+static PageHeap::Stats TenantPageHeapStats() {
+  PageHeap::Stats result;
+  HeapPartition::ForEach([&] (HeapPartition* hp) {
+    SpinLockHolder h(hp->pageheap()->pageheap_lock());
+    const PageHeap::Stats stats = hp->pageheap()->StatsLocked();
+    result.free_bytes += stats.free_bytes;
+    result.unmapped_bytes += stats.unmapped_bytes;
+    result.lazily_freed_bytes += stats.lazily_freed_bytes;
+  });
+  return result;
+}
+
 // Get stats into "r".  Also, if class_count != nullptr, class_count[k]
 // will be set to the total number of objects of size class k in the
-// central cache, transfer cache, and per-thread caches. If small_spans
+// central cache, transfer cache, per-thread and per-CPU caches. If small_spans
 // is non-nullptr, it is filled.  Same for large_spans.
 static void ExtractStats(TCMallocStats* r, uint64_t* class_count,
                          PageHeap::SmallSpanStats* small_spans,
@@ -303,6 +356,28 @@ static void ExtractStats(TCMallocStats* r, uint64_t* class_count,
 
   }
 
+  // Caches of tenant heap partitions.
+  HeapPartition::ForEach([&] (HeapPartition* hp) {
+    tcmalloc::CentralFreeList* central = hp->central_cache();
+    for (int cl = 1; cl < Static::num_size_classes(); ++cl) {
+      const int length = central[cl].length();
+      const int tc_length = central[cl].tc_length();
+      const size_t size = Static::sizemap()->ByteSizeForClass(cl);
+      r->central_bytes += (size * length) + central[cl].OverheadBytes();
+      r->transfer_bytes += (size * tc_length);
+      if (class_count) {
+        class_count[cl] += length + tc_length;
+      }
+    }
+  });
+
+  // Add stats from per-CPU caches. Note, this must be done without
+  // holding pageheap_lock.
+  r->cpu_bytes = 0;
+  CpuCache::GetStats(&r->cpu_bytes, class_count);
+
+  const PageHeap::Stats tenants = TenantPageHeapStats();
+
   // Add stats from per-thread heaps
   r->thread_bytes = 0;
   { // scope
@@ -310,6 +385,11 @@ static void ExtractStats(TCMallocStats* r, uint64_t* class_count,
     ThreadCache::GetThreadStats(&r->thread_bytes, class_count);
     r->metadata_bytes = tcmalloc::metadata_system_bytes();
     r->pageheap = Static::pageheap()->StatsLocked();
+    r->pageheap.free_bytes += tenants.free_bytes;
+    r->pageheap.unmapped_bytes += tenants.unmapped_bytes;
+    r->pageheap.committed_bytes -= tenants.unmapped_bytes;
+    r->pageheap.lazily_freed_bytes += tenants.lazily_freed_bytes;
+    r->hugepages = Static::pageheap()->HugePageStatsLocked();
     if (small_spans != nullptr) {
       Static::pageheap()->GetSmallSpanStatsLocked(small_spans);
     }
@@ -323,6 +403,69 @@ static double PagesToMiB(uint64_t pages) {
   return (pages << kPageShift) / 1048576.0;
 }
 
+// WRITE per NUMA partition breakdown to "out".
+// class_count is as filled by ExtractStats.
+static void DumpNumaStats(TCMalloc_Printer* out, const uint64_t* class_count) {
+  static const double MiB = 1048576.0;
+  const int num_partitions = NumaTopology::num_partitions();
+
+  PageHeap::PartitionStats partitions[kNumaPartitions];
+  {
+    SpinLockHolder h(Static::pageheap_lock());
+    for (int p = 0; p < num_partitions; p++) {
+      partitions[p] = Static::pageheap()->PartitionStatsLocked(p);
+    }
+  }
+  uint64_t cached_bytes[kNumaPartitions] = {};
+  for (uint32_t cl = 1; cl < Static::num_size_classes(); ++cl) {
+    cached_bytes[NumaTopology::PartitionOfClass(cl)] +=
+        class_count[cl] * Static::sizemap()->ByteSizeForClass(cl);
+  }
+
+  out->printf("------------------------------------------------\n");
+  out->printf("NUMA partitions: system, page heap free, unmapped and\n");
+  out->printf("cached (in all front-end and central caches) bytes\n");
+  out->printf("------------------------------------------------\n");
+  for (int p = 0; p < num_partitions; p++) {
+    out->printf("partition %d: %8.1f MiB system; %8.1f MiB free; "
+                "%8.1f MiB unmapped; %8.1f MiB cached\n",
+                p,
+                partitions[p].system_bytes / MiB,
+                partitions[p].free_bytes / MiB,
+                partitions[p].unmapped_bytes / MiB,
+                cached_bytes[p] / MiB);
+  }
+}
+
+// WRITE per tenant heap partition breakdown to "out".
+static void DumpTenantStats(TCMalloc_Printer* out) {
+  static const double MiB = 1048576.0;
+
+  out->printf("------------------------------------------------\n");
+  out->printf("Tenant heap partitions: system, page heap free and\n");
+  out->printf("unmapped bytes\n");
+  out->printf("------------------------------------------------\n");
+  HeapPartition::ForEach([&] (HeapPartition* hp) {
+    PageHeap::Stats stats;
+    Length limit;
+    {
+      SpinLockHolder h(hp->pageheap()->pageheap_lock());
+      stats = hp->pageheap()->StatsLocked();
+      limit = hp->pageheap()->GetLimit();
+    }
+    out->printf("partition %d: %8.1f MiB system; %8.1f MiB free; "
+                "%8.1f MiB unmapped",
+                hp->id(),
+                stats.system_bytes / MiB,
+                stats.free_bytes / MiB,
+                stats.unmapped_bytes / MiB);
+    if (limit != 0) {
+      out->printf("; %8.1f MiB limit", PagesToMiB(limit));
+    }
+    out->printf("\n");
+  });
+}
+
 // WRITE stats to "out"
 static void DumpStats(TCMalloc_Printer* out, int level) {
   TCMallocStats stats;
@@ -331,6 +474,8 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
   PageHeap::LargeSpanStats large;
   if (level >= 2) {
     ExtractStats(&stats, class_count, &small, &large);
+  } else if (NumaTopology::Active()) {
+    ExtractStats(&stats, class_count, nullptr, nullptr);
   } else {
     ExtractStats(&stats, nullptr, nullptr, nullptr);
   }
@@ -341,12 +486,16 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
                                         + stats.metadata_bytes);
   const uint64_t physical_memory_used = (virtual_memory_used
                                          - stats.pageheap.unmapped_bytes);
+  // Spans in large span cache are shown as page heap free memory.
+  const uint64_t pageheap_free_bytes = (stats.pageheap.free_bytes
+                                        + stats.pageheap.large_cache_bytes);
   const uint64_t bytes_in_use_by_app = (physical_memory_used
                                         - stats.metadata_bytes
-                                        - stats.pageheap.free_bytes
+                                        - pageheap_free_bytes
                                         - stats.central_bytes
                                         - stats.transfer_bytes
-                                        - stats.thread_bytes);
+                                        - stats.thread_bytes
+                                        - stats.cpu_bytes);
 
 #ifdef TCMALLOC_SMALL_BUT_SLOW
   out->printf(
@@ -359,6 +508,7 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
       "MALLOC: + %12" PRIu64 " (%7.1f MiB) Bytes in central cache freelist\n"
       "MALLOC: + %12" PRIu64 " (%7.1f MiB) Bytes in transfer cache freelist\n"
       "MALLOC: + %12" PRIu64 " (%7.1f MiB) Bytes in thread cache freelists\n"
+      "MALLOC: + %12" PRIu64 " (%7.1f MiB) Bytes in per-CPU cache freelists\n"
       "MALLOC: + %12" PRIu64 " (%7.1f MiB) Bytes in malloc metadata\n"
       "MALLOC:   ------------\n"
       "MALLOC: = %12" PRIu64 " (%7.1f MiB) Actual memory used (physical + swap)\n"
@@ -375,10 +525,11 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
       "Bytes released to the OS take up virtual address space"
       " but no physical memory.\n",
       bytes_in_use_by_app, bytes_in_use_by_app / MiB,
-      stats.pageheap.free_bytes, stats.pageheap.free_bytes / MiB,
+      pageheap_free_bytes, pageheap_free_bytes / MiB,
       stats.central_bytes, stats.central_bytes / MiB,
       stats.transfer_bytes, stats.transfer_bytes / MiB,
       stats.thread_bytes, stats.thread_bytes / MiB,
+      stats.cpu_bytes, stats.cpu_bytes / MiB,
       stats.metadata_bytes, stats.metadata_bytes / MiB,
       physical_memory_used, physical_memory_used / MiB,
       stats.pageheap.unmapped_bytes, stats.pageheap.unmapped_bytes / MiB,
@@ -387,9 +538,67 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
       uint64_t(ThreadCache::HeapsInUse()),
       uint64_t(kPageSize));
 
+  if (CpuCache::Active()) {
+    out->printf(
+      "MALLOC:   %12d              CPUs with per-CPU caches (%s)\n",
+      CpuCache::num_cpus(),
+      CpuCache::UsesRseq() ? "rseq" : "spinlocks");
+  }
+
+  if (stats.pageheap.lazily_freed_bytes != 0) {
+    out->printf(
+      "MALLOC:   %12" PRIu64 " (%7.1f MiB) Unmapped bytes released lazily"
+      " (MADV_FREE), may still be resident\n",
+      stats.pageheap.lazily_freed_bytes,
+      stats.pageheap.lazily_freed_bytes / MiB);
+  }
+
+  if (stats.pageheap.dedicated_bytes != 0) {
+    out->printf(
+      "MALLOC:   %12" PRIu64 " (%7.1f MiB) Bytes in dedicated mappings"
+      " (%" PRIu64 " remaps)\n",
+      stats.pageheap.dedicated_bytes,
+      stats.pageheap.dedicated_bytes / MiB,
+      stats.pageheap.remap_count);
+  }
+
+  if (stats.pageheap.large_cache_hits + stats.pageheap.large_cache_misses != 0) {
+    out->printf(
+      "MALLOC:   %12" PRIu64 " (%7.1f MiB) Bytes of page heap freelist"
+      " in large span cache (%" PRIu64 " hits, %" PRIu64 " misses)\n",
+      stats.pageheap.large_cache_bytes,
+      stats.pageheap.large_cache_bytes / MiB,
+      stats.pageheap.large_cache_hits,
+      stats.pageheap.large_cache_misses);
+  }
+
+  if (NumaTopology::Active()) {
+    DumpNumaStats(out, class_count);
+  }
+
+  if (HeapPartition::Active()) {
+    DumpTenantStats(out);
+  }
+
+  if (Static::pageheap()->GetHugePageAware()) {
+    const uint64_t committed = stats.pageheap.committed_bytes;
+    const uint64_t intact = committed - stats.hugepages.broken_bytes;
+    out->printf("------------------------------------------------\n");
+    out->printf("HugePages: %5.1f%% of committed memory is on intact %zu KiB hugepages\n",
+                committed ? 100.0 * intact / committed : 100.0,
+                kHugePageSize >> 10);
+    out->printf("HugePages: %12" PRIu64 " (%7.1f MiB) on intact hugepages\n",
+                intact, intact / MiB);
+    out->printf("HugePages: %12" PRIu64 " (%7.1f MiB) on %" PRIu64 " broken hugepages\n",
+                stats.hugepages.broken_bytes, stats.hugepages.broken_bytes / MiB,
+                stats.hugepages.broken_hugepages);
+    out->printf("HugePages: %12" PRIu64 "              Entirely free hugepages\n",
+                stats.hugepages.free_hugepages);
+  }
+
   if (level >= 2) {
     out->printf("------------------------------------------------\n");
-    out->printf("Total size of freelists for per-thread caches,\n");
+    out->printf("Total size of freelists for per-thread and per-CPU caches,\n");
     out->printf("transfer cache, and central cache, by size class\n");
     out->printf("------------------------------------------------\n");
     uint64_t cumulative_bytes = 0;
@@ -414,6 +623,55 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
       }
     }
 
+    out->printf("------------------------------------------------\n");
+    out->printf("Central cache spans by size class and share of objects in use\n");
+    out->printf("------------------------------------------------\n");
+    out->printf("class      <1/8  <2/8  <3/8  <4/8  <5/8  <6/8  <7/8  <8/8   full\n");
+    for (uint32_t cl = 1; cl < Static::num_size_classes(); ++cl) {
+      int64_t hist[tcmalloc::CentralFreeList::kOccupancyBuckets + 1];
+      Static::central_cache()[cl].GetSpanOccupancy(hist);
+      int64_t total = 0;
+      for (int64_t n : hist) {
+        total += n;
+      }
+      if (total == 0) {
+        continue;
+      }
+      out->printf("class %3d", cl);
+      for (int i = 0; i < tcmalloc::CentralFreeList::kOccupancyBuckets; i++) {
+        out->printf(" %5" PRId64, hist[i]);
+      }
+      out->printf(" %6" PRId64 "\n", hist[tcmalloc::CentralFreeList::kOccupancyBuckets]);
+    }
+
+    out->printf("------------------------------------------------\n");
+    out->printf("Transfer cache slots by size class (one batch of objects each)\n");
+    out->printf("------------------------------------------------\n");
+    for (uint32_t cl = 1; cl < Static::num_size_classes(); ++cl) {
+      const tcmalloc::CentralFreeList& central = Static::central_cache()[cl];
+      if (central.tc_max_slots() == 0) {
+        continue;
+      }
+      const size_t batch_bytes = Static::sizemap()->num_objects_to_move(cl)
+        * Static::sizemap()->ByteSizeForClass(cl);
+      out->printf("class %3d [ %8zu bytes/batch ] : %4d slots; %4d max slots\n",
+                  cl, batch_bytes, central.tc_slots(), central.tc_max_slots());
+    }
+
+    Length age_histogram[PageHeap::kFreeAgeBuckets];
+    {
+      SpinLockHolder h(Static::pageheap_lock());
+      Static::pageheap()->GetFreeAgeHistogramLocked(age_histogram);
+    }
+    out->printf("------------------------------------------------\n");
+    out->printf("PageHeap: free (not released) MiB by time since freed\n");
+    out->printf("------------------------------------------------\n");
+    out->printf("     <1s     <10s    <1min   <10min      <1h     >=1h\n");
+    for (int i = 0; i < PageHeap::kFreeAgeBuckets; i++) {
+      out->printf(" %8.1f", (age_histogram[i] << kPageShift) / MiB);
+    }
+    out->printf("\n");
+
     // append page heap info
     int nonempty_sizes = 0;
     for (int s = 0; s < kMaxPages; s++) {
@@ -553,6 +811,28 @@ public:
     ThreadCachePtr::WithStacktraceScope(ref.fn, ref.data);
   }
 
+  bool ForceNumaPartition(int partition) override {
+    if (!NumaTopology::Active()) {
+      return false;
+    }
+    NumaTopology::set_forced_partition(partition);
+    return true;
+  }
+
+  int GetNumaPartition(void* ptr) override {
+    const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+    Span* span = LookupSpan(p);
+    CHECK(span != nullptr);
+    return span->numa_partition;
+  }
+
+  int GetHeapPartition(void* ptr) override {
+    const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+    Span* span = Static::pageheap()->GetDescriptor(p);
+    CHECK(span != nullptr);
+    return span->heap_partition;
+  }
+
   static TestingPortalImpl* Get() {
     static TestingPortalImpl* ptr = ([] () {
       static StaticStorage<TestingPortalImpl> storage;
@@ -566,6 +846,53 @@ public:
 
 using tcmalloc::TestingPortalImpl;
 
+// Period of background actions, and bound on number of page heap
+// releases in a single pass (we drop the lock between releases).
+static const int kBackgroundActionsIntervalMs = 1000;
+static const int kMaxBackgroundReleasesPerPass = 64;
+
+static std::atomic<bool> background_actions_running;
+
+// Does one pass of work on behalf of ProcessBackgroundActions: gives
+// back memory cached by idle caches and releases free memory to the
+// system at tcmalloc_release_rate.
+static void BackgroundActionsPass() {
+  if (CpuCache::Active()) {
+    CpuCache::FlushIdle();
+  }
+
+  for (uint32_t cl = 1; cl < Static::num_size_classes(); cl++) {
+    Static::central_cache()[cl].ReleaseIdleTransferCache();
+  }
+  tcmalloc::CentralFreeList::RebalanceTransferCaches();
+
+  HeapPartition::ForEach([] (HeapPartition* hp) {
+    for (uint32_t cl = 1; cl < Static::num_size_classes(); cl++) {
+      hp->central_cache()[cl].ReleaseIdleTransferCache();
+    }
+    SpinLockHolder h(hp->pageheap()->pageheap_lock());
+    hp->pageheap()->StartReleaseBatch();
+    hp->pageheap()->ScavengeIfDue();
+    hp->pageheap()->FinishReleaseBatch();
+  });
+
+  {
+    SpinLockHolder h(Static::pageheap_lock());
+    ThreadCache::ReclaimIdleCacheSpace();
+    ThreadCache::RebalanceCacheSpace();
+  }
+
+  for (int i = 0; i < kMaxBackgroundReleasesPerPass; i++) {
+    SpinLockHolder h(Static::pageheap_lock());
+    Static::pageheap()->StartReleaseBatch();
+    const Length released = Static::pageheap()->ScavengeIfDue();
+    Static::pageheap()->FinishReleaseBatch();
+    if (released == 0) {
+      break;
+    }
+  }
+}
+
 // TCMalloc's support for extra malloc interfaces
 class TCMallocImplementation : public MallocExtension {
  private:
@@ -655,9 +982,11 @@ class TCMallocImplementation : public MallocExtension {
       ExtractStats(&stats, nullptr, nullptr, nullptr);
       *value = stats.pageheap.system_bytes
                - stats.thread_bytes
+               - stats.cpu_bytes
                - stats.central_bytes
                - stats.transfer_bytes
                - stats.pageheap.free_bytes
+               - stats.pageheap.large_cache_bytes
                - stats.pageheap.unmapped_bytes;
       return true;
     }
@@ -680,9 +1009,12 @@ class TCMallocImplementation : public MallocExtension {
     if (strcmp(name, "tcmalloc.slack_bytes") == 0) {
       // Kept for backwards compatibility.  Now defined externally as:
       //    pageheap_free_bytes + pageheap_unmapped_bytes.
+      const PageHeap::Stats tenants = TenantPageHeapStats();
       SpinLockHolder l(Static::pageheap_lock());
       PageHeap::Stats stats = Static::pageheap()->StatsLocked();
-      *value = stats.free_bytes + stats.unmapped_bytes;
+      *value = (stats.free_bytes + stats.large_cache_bytes
+                + stats.unmapped_bytes
+                + tenants.free_bytes + tenants.unmapped_bytes);
       return true;
     }
 
@@ -700,6 +1032,44 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.central_cache_lock_contentions") == 0) {
+      *value = 0;
+      for (int cl = 0; cl < Static::num_size_classes(); ++cl) {
+        *value += Static::central_cache()[cl].lock_contentions();
+      }
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.transfer_cache_lock_contentions") == 0) {
+      *value = 0;
+      for (int cl = 0; cl < Static::num_size_classes(); ++cl) {
+        *value += Static::central_cache()[cl].tc_lock_contentions();
+      }
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.transfer_cache_min_capacity_bytes") == 0 ||
+        strcmp(name, "tcmalloc.transfer_cache_max_capacity_bytes") == 0) {
+      const bool want_min =
+        (strcmp(name, "tcmalloc.transfer_cache_min_capacity_bytes") == 0);
+      size_t min_capacity = std::numeric_limits<size_t>::max();
+      size_t max_capacity = 0;
+      for (int cl = 1; cl < Static::num_size_classes(); ++cl) {
+        const size_t capacity = Static::central_cache()[cl].tc_slots()
+          * Static::sizemap()->num_objects_to_move(cl)
+          * Static::sizemap()->ByteSizeForClass(cl);
+        min_capacity = std::min(min_capacity, capacity);
+        max_capacity = std::max(max_capacity, capacity);
+      }
+      *value = want_min ? min_capacity : max_capacity;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.transfer_cache_rebalanced_slots") == 0) {
+      *value = tcmalloc::CentralFreeList::rebalanced_slots();
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.thread_cache_free_bytes") == 0) {
       TCMallocStats stats;
       ExtractStats(&stats, nullptr, nullptr, nullptr);
@@ -707,15 +1077,122 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.cpu_cache_free_bytes") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, nullptr, nullptr, nullptr);
+      *value = stats.cpu_bytes;
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.pageheap_free_bytes") == 0) {
+      const PageHeap::Stats tenants = TenantPageHeapStats();
       SpinLockHolder l(Static::pageheap_lock());
-      *value = Static::pageheap()->StatsLocked().free_bytes;
+      // Cached large spans count as free, same as in GetStats.
+      PageHeap::Stats stats = Static::pageheap()->StatsLocked();
+      *value = stats.free_bytes + stats.large_cache_bytes + tenants.free_bytes;
       return true;
     }
 
     if (strcmp(name, "tcmalloc.pageheap_unmapped_bytes") == 0) {
+      const PageHeap::Stats tenants = TenantPageHeapStats();
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = (Static::pageheap()->StatsLocked().unmapped_bytes
+                + tenants.unmapped_bytes);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_lazily_freed_bytes") == 0) {
+      const PageHeap::Stats tenants = TenantPageHeapStats();
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = (Static::pageheap()->StatsLocked().lazily_freed_bytes
+                + tenants.lazily_freed_bytes);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.release_advice") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = TCMalloc_GetReleaseAdvice();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.mremap_threshold_bytes") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->GetDedicatedThreshold() << kPageShift;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_dedicated_bytes") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->StatsLocked().dedicated_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_remap_count") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->StatsLocked().remap_count;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.large_span_cache_limit_bytes") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->GetLargeCacheLimit();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_large_span_cache_bytes") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->StatsLocked().large_cache_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_large_span_cache_hits") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->StatsLocked().large_cache_hits;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_large_span_cache_misses") == 0) {
       SpinLockHolder l(Static::pageheap_lock());
-      *value = Static::pageheap()->StatsLocked().unmapped_bytes;
+      *value = Static::pageheap()->StatsLocked().large_cache_misses;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.hugepage_aware") == 0) {
+      *value = Static::pageheap()->GetHugePageAware();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.background_release") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->GetBackgroundRelease();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_intact_hugepage_bytes") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      if (!Static::pageheap()->GetHugePageAware()) {
+        return false;
+      }
+      *value = (Static::pageheap()->StatsLocked().committed_bytes
+                - Static::pageheap()->HugePageStatsLocked().broken_bytes);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_broken_hugepage_bytes") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      if (!Static::pageheap()->GetHugePageAware()) {
+        return false;
+      }
+      *value = Static::pageheap()->HugePageStatsLocked().broken_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_free_hugepages") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      if (!Static::pageheap()->GetHugePageAware()) {
+        return false;
+      }
+      *value = Static::pageheap()->HugePageStatsLocked().free_hugepages;
       return true;
     }
 
@@ -778,6 +1255,25 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.thread_cache_min_budget_bytes") == 0 ||
+        strcmp(name, "tcmalloc.thread_cache_max_budget_bytes") == 0 ||
+        strcmp(name, "tcmalloc.thread_cache_rebalanced_bytes") == 0) {
+      size_t min_budget, max_budget;
+      uint64_t rebalanced_bytes;
+      {
+        SpinLockHolder l(Static::pageheap_lock());
+        ThreadCache::GetBudgetStats(&min_budget, &max_budget, &rebalanced_bytes);
+      }
+      if (strcmp(name, "tcmalloc.thread_cache_min_budget_bytes") == 0) {
+        *value = min_budget;
+      } else if (strcmp(name, "tcmalloc.thread_cache_max_budget_bytes") == 0) {
+        *value = max_budget;
+      } else {
+        *value = rebalanced_bytes;
+      }
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.current_total_thread_cache_bytes") == 0) {
       TCMallocStats stats;
       ExtractStats(&stats, nullptr, nullptr, nullptr);
@@ -785,6 +1281,21 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.per_cpu_caches_active") == 0) {
+      *value = CpuCache::Active();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.max_per_cpu_cache_bytes") == 0) {
+      *value = CpuCache::max_per_cpu_size();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.numa_partitions") == 0) {
+      *value = NumaTopology::num_partitions();
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.aggressive_memory_decommit") == 0) {
       SpinLockHolder l(Static::pageheap_lock());
       *value = size_t(Static::pageheap()->GetAggressiveDecommit());
@@ -831,6 +1342,11 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.max_per_cpu_cache_bytes") == 0) {
+      CpuCache::set_max_per_cpu_size(value);
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.aggressive_memory_decommit") == 0) {
       SpinLockHolder l(Static::pageheap_lock());
       Static::pageheap()->SetAggressiveDecommit(value != 0);
@@ -843,6 +1359,23 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.release_advice") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      return TCMalloc_SetReleaseAdvice(value);
+    }
+
+    if (strcmp(name, "tcmalloc.mremap_threshold_bytes") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      Static::pageheap()->SetDedicatedThreshold(tcmalloc::pages(value));
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.large_span_cache_limit_bytes") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      Static::pageheap()->SetLargeCacheLimit(value);
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.sample_parameter") == 0) {
       FLAGS_tcmalloc_sample_parameter = value;
       // By clearing current thread's cache we force next allocations
@@ -900,8 +1433,12 @@ class TCMallocImplementation : public MallocExtension {
     // ReleaseAtLeastNPages, it won't do anything, so we release a whole
     // page now and let extra_bytes_released_ smooth it out over time.
     Length num_pages = std::max<Length>(num_bytes >> kPageShift, 1);
+    // Whatever we release is only told to the system after dropping
+    // the lock, with contiguous spans merged.
+    Static::pageheap()->StartReleaseBatch();
     size_t bytes_released = Static::pageheap()->ReleaseAtLeastNPages(
         num_pages) << kPageShift;
+    Static::pageheap()->FinishReleaseBatch();
     if (bytes_released > num_bytes) {
       extra_bytes_released_ = bytes_released - num_bytes;
     } else {
@@ -919,6 +1456,110 @@ class TCMallocImplementation : public MallocExtension {
   virtual double GetMemoryReleaseRate() {
     return FLAGS_tcmalloc_release_rate;
   }
+
+  virtual void ProcessBackgroundActions() {
+    if (background_actions_running.exchange(true)) {
+      // Somebody is already doing it.
+      return;
+    }
+    {
+      SpinLockHolder h(Static::pageheap_lock());
+      Static::pageheap()->SetBackgroundRelease(true);
+    }
+    for (;;) {
+      BackgroundActionsPass();
+
+      struct timespec ts;
+      ts.tv_sec = kBackgroundActionsIntervalMs / 1000;
+      ts.tv_nsec = (kBackgroundActionsIntervalMs % 1000) * 1000000;
+      nanosleep(&ts, nullptr);
+    }
+  }
+
+  static bool IsTenantPartition(int partition) {
+    return partition > 0 && partition < HeapPartition::kMaxHeapPartitions;
+  }
+
+  bool SetThreadHeapPartition(int partition) override {
+    HeapPartition* hp = nullptr;
+    if (partition != 0) {
+      if (!IsTenantPartition(partition)) {
+        return false;
+      }
+      hp = HeapPartition::GetOrCreate(partition);
+      if (hp == nullptr) {
+        return false;
+      }
+    }
+    HeapPartition::SetThreadPartition(hp);
+    if (ThreadCache* heap = ThreadCachePtr::GetIfPresent()) {
+      heap->SetPartition(hp);
+    }
+    return true;
+  }
+
+  int GetThreadHeapPartition() override {
+    HeapPartition* hp = HeapPartition::ThreadPartition();
+    return hp != nullptr ? hp->id() : 0;
+  }
+
+  bool SetHeapPartitionLimit(int partition, size_t limit_bytes) override {
+    if (!IsTenantPartition(partition)) {
+      return false;
+    }
+    HeapPartition* hp = HeapPartition::GetOrCreate(partition);
+    if (hp == nullptr) {
+      return false;
+    }
+    SpinLockHolder h(hp->pageheap()->pageheap_lock());
+    hp->pageheap()->SetLimit(limit_bytes >> kPageShift);
+    return true;
+  }
+
+  void ReleasePartitionFreeMemory(int partition) override {
+    if (!IsTenantPartition(partition)) {
+      return;
+    }
+    HeapPartition* hp = HeapPartition::Get(partition);
+    if (hp == nullptr) {
+      return;
+    }
+    // Objects cached above the page heap keep their spans, and so
+    // their pages, from being released. We flush what we can reach:
+    // our own thread cache and the partition's transfer caches.
+    if (ThreadCache* heap = ThreadCachePtr::GetIfPresent();
+        heap != nullptr && heap->partition() == hp) {
+      heap->ReleaseAll();
+    }
+    hp->DrainTransferCaches();
+
+    SpinLockHolder h(hp->pageheap()->pageheap_lock());
+    hp->pageheap()->StartReleaseBatch();
+    hp->pageheap()->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff));
+    hp->pageheap()->FinishReleaseBatch();
+  }
+
+  bool GetHeapPartitionStats(int partition, HeapPartitionStats* stats) override {
+    if (!IsTenantPartition(partition)) {
+      return false;
+    }
+    HeapPartition* hp = HeapPartition::Get(partition);
+    if (hp == nullptr) {
+      // Not created yet, so it has no memory, but this is the limit
+      // it is going to start with.
+      *stats = HeapPartitionStats{};
+      stats->limit_bytes = HeapPartition::InitialLimit() << kPageShift;
+      return true;
+    }
+    SpinLockHolder h(hp->pageheap()->pageheap_lock());
+    const PageHeap::Stats ps = hp->pageheap()->StatsLocked();
+    stats->system_bytes = ps.system_bytes;
+    stats->free_bytes = ps.free_bytes;
+    stats->unmapped_bytes = ps.unmapped_bytes;
+    stats->limit_bytes = hp->pageheap()->GetLimit() << kPageShift;
+    return true;
+  }
+
   virtual size_t GetEstimatedAllocatedSize(size_t size);
 
   // This just calls GetSizeWithCallback, but because that's in an
@@ -938,7 +1579,8 @@ class TCMallocImplementation : public MallocExtension {
       return kNotOwned;
     }
     uint32_t cl;
-    if (Static::pageheap()->TryGetSizeClass(p, &cl)) {
+    if (Static::pageheap()->TryGetSizeClass(p, &cl)
+        || Static::pageheap()->GetPageSizeClass(p) != 0) {
       return kOwned;
     }
     const Span *span = Static::pageheap()->GetDescriptor(p);
@@ -951,7 +1593,10 @@ class TCMallocImplementation : public MallocExtension {
   virtual void GetFreeListSizes(std::vector<MallocExtension::FreeListInfo>* v) {
     static const char kCentralCacheType[] = "tcmalloc.central";
     static const char kTransferCacheType[] = "tcmalloc.transfer";
+    static const char kTransferSlotsType[] = "tcmalloc.transfer_slots";
+    static const char kTransferMaxSlotsType[] = "tcmalloc.transfer_max_slots";
     static const char kThreadCacheType[] = "tcmalloc.thread";
+    static const char kCpuCacheType[] = "tcmalloc.cpu";
     static const char kPageHeapType[] = "tcmalloc.page";
     static const char kPageHeapUnmappedType[] = "tcmalloc.page_unmapped";
     static const char kLargeSpanType[] = "tcmalloc.large";
@@ -977,6 +1622,17 @@ class TCMallocImplementation : public MallocExtension {
       i.type = kTransferCacheType;
       v->push_back(i);
 
+      // transfer cache capacity
+      const size_t batch_bytes =
+          Static::sizemap()->num_objects_to_move(cl) * class_size;
+      i.total_bytes_free = Static::central_cache()[cl].tc_slots() * batch_bytes;
+      i.type = kTransferSlotsType;
+      v->push_back(i);
+      i.total_bytes_free =
+          Static::central_cache()[cl].tc_max_slots() * batch_bytes;
+      i.type = kTransferMaxSlotsType;
+      v->push_back(i);
+
       prev_class_size = Static::sizemap()->ByteSizeForClass(cl);
     }
 
@@ -1002,21 +1658,44 @@ class TCMallocImplementation : public MallocExtension {
       prev_class_size = Static::sizemap()->ByteSizeForClass(cl);
     }
 
+    // Add stats from per-CPU caches
+    if (CpuCache::Active()) {
+      memset(class_count, 0, sizeof(class_count));
+      uint64_t cpu_bytes = 0;
+      CpuCache::GetStats(&cpu_bytes, class_count);
+
+      prev_class_size = 0;
+      for (int cl = 1; cl < Static::num_size_classes(); ++cl) {
+        MallocExtension::FreeListInfo i;
+        i.min_object_size = prev_class_size + 1;
+        i.max_object_size = Static::sizemap()->ByteSizeForClass(cl);
+        i.total_bytes_free =
+            class_count[cl] * Static::sizemap()->ByteSizeForClass(cl);
+        i.type = kCpuCacheType;
+        v->push_back(i);
+
+        prev_class_size = Static::sizemap()->ByteSizeForClass(cl);
+      }
+    }
+
     // append page heap info
     PageHeap::SmallSpanStats small;
     PageHeap::LargeSpanStats large;
+    uint64_t large_cache_bytes;
     {
       SpinLockHolder h(Static::pageheap_lock());
       Static::pageheap()->GetSmallSpanStatsLocked(&small);
       Static::pageheap()->GetLargeSpanStatsLocked(&large);
+      large_cache_bytes = Static::pageheap()->StatsLocked().large_cache_bytes;
     }
 
-    // large spans: mapped
+    // large spans: mapped, including large span cache
     MallocExtension::FreeListInfo span_info;
     span_info.type = kLargeSpanType;
     span_info.max_object_size = (std::numeric_limits<size_t>::max)();
     span_info.min_object_size = kMaxPages << kPageShift;
-    span_info.total_bytes_free = large.normal_pages << kPageShift;
+    span_info.total_bytes_free = ((large.normal_pages << kPageShift)
+                                  + large_cache_bytes);
     v->push_back(span_info);
 
     // large spans: unmapped
@@ -1179,11 +1858,16 @@ void SetupMallocExtension() {
 
 static ATTRIBUTE_UNUSED bool CheckCachedSizeClass(void *ptr) {
   PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  PageHeap* pageheap;
+  const uint32_t sizeclass = LookupSpan(p, &pageheap)->sizeclass;
+  if (pageheap->GetPageSizeClass(p) != sizeclass) {
+    return false;
+  }
   uint32_t cached_value;
-  if (!Static::pageheap()->TryGetSizeClass(p, &cached_value)) {
+  if (!pageheap->TryGetSizeClass(p, &cached_value)) {
     return true;
   }
-  return cached_value == Static::pageheap()->GetDescriptor(p)->sizeclass;
+  return cached_value == sizeclass;
 }
 
 static ALWAYS_INLINE void* CheckedMallocResult(void *result) {
@@ -1386,6 +2070,13 @@ static bool should_report_large(Length num_pages) {
   return false;
 }
 
+// Returns page heap of the heap partition calling thread allocates
+// from.
+static PageHeap* ThreadPageHeap() {
+  HeapPartition* partition = HeapPartition::ThreadPartition();
+  return partition != nullptr ? partition->pageheap() : Static::pageheap();
+}
+
 // Helper for do_malloc().
 static void* do_malloc_pages(ThreadCache* heap, size_t size) {
   void* result;
@@ -1401,7 +2092,7 @@ static void* do_malloc_pages(ThreadCache* heap, size_t size) {
   if (heap->SampleAllocation(size)) {
     result = DoSampledAllocation(size);
   } else {
-    Span* span = Static::pageheap()->New(num_pages);
+    Span* span = ThreadPageHeap()->New(num_pages);
     result = (PREDICT_FALSE(span == nullptr) ? nullptr : SpanToMallocResult(span));
   }
 
@@ -1430,12 +2121,18 @@ ALWAYS_INLINE void* do_malloc(size_t size) {
   if (PREDICT_FALSE(!Static::sizemap()->GetSizeClass(size, &cl))) {
     return do_malloc_pages(cache_ptr.get(), size);
   }
+  cl = NumaTopology::LocalSizeClass(cl);
 
   size_t allocated_size = Static::sizemap()->class_to_size(cl);
   if (PREDICT_FALSE(cache_ptr->SampleAllocation(allocated_size))) {
     return DoSampledAllocation(size);
   }
 
+  if (CpuCache::Active() && cache_ptr->partition() == nullptr) {
+    return CheckedMallocResult(
+      CpuCache::Allocate(allocated_size, cl, nop_oom_handler));
+  }
+
   // The common case, and also the simplest.  This just pops the
   // size-appropriate freelist, after replenishing it if it's empty.
   return CheckedMallocResult(
@@ -1486,7 +2183,8 @@ inline void free_null_or_invalid(void* ptr, void (*invalid_free_fn)(void*)) {
   }
 }
 
-static ATTRIBUTE_NOINLINE void do_free_pages(Span* span, void* ptr) {
+static ATTRIBUTE_NOINLINE void do_free_pages(PageHeap* pageheap, Span* span,
+                                              void* ptr) {
   // Check to see if the object is in use.
   CHECK_CONDITION_PRINT(span->location == Span::IN_USE,
                         "Object was not in-use");
@@ -1494,7 +2192,7 @@ static ATTRIBUTE_NOINLINE void do_free_pages(Span* span, void* ptr) {
       span->start << kPageShift == reinterpret_cast<uintptr_t>(ptr),
       "Pointer is not pointing to the start of a span");
 
-  Static::pageheap()->PrepareAndDelete(span, [&] () {
+  pageheap->PrepareAndDelete(span, [&] () {
     if (span->sample) {
       StackTrace* st = reinterpret_cast<StackTrace*>(span->objects);
       tcmalloc::DLL_Remove(span);
@@ -1504,6 +2202,35 @@ static ATTRIBUTE_NOINLINE void do_free_pages(Span* span, void* ptr) {
   });
 }
 
+// Helper for do_free_with_callback. Frees ptr that was allocated from
+// tenant heap partition, which lent chunk from the default page heap.
+static ATTRIBUTE_NOINLINE void do_free_tenant(ThreadCache* heap, Span* chunk,
+                                              void* ptr) {
+  HeapPartition* partition = HeapPartition::Get(chunk->heap_partition);
+  PageHeap* pageheap = partition->pageheap();
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  uint32_t cl;
+  if (!pageheap->TryGetSizeClass(p, &cl)) {
+    cl = pageheap->GetPageSizeClass(p);
+    if (cl == 0) {
+      Span* span = pageheap->GetDescriptor(p);
+      ASSERT(span != nullptr && span->start == p);
+      do_free_pages(pageheap, span, ptr);
+      return;
+    }
+    pageheap->SetCachedSizeClass(p, cl);
+  }
+
+  // Only thread caches of threads that allocate from the partition
+  // may keep its objects.
+  if (heap != nullptr && heap->partition() == partition) {
+    heap->Deallocate(ptr, cl);
+    return;
+  }
+  tcmalloc::SLL_SetNext(ptr, nullptr);
+  partition->central_cache()[cl].InsertRange(ptr, ptr, 1);
+}
+
 #ifndef NDEBUG
 // note, with sized deletions we have no means to support win32
 // behavior where we detect "not ours" points and delegate them native
@@ -1512,10 +2239,13 @@ static ATTRIBUTE_NOINLINE void do_free_pages(Span* span, void* ptr) {
 // also assume that sized delete is always used with "our" pointers.
 bool ValidateSizeHint(void* ptr, size_t size_hint) {
   const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
-  Span* span  = Static::pageheap()->GetDescriptor(p);
+  Span* span  = LookupSpan(p);
   uint32_t cl = 0;
   Static::sizemap()->GetSizeClass(size_hint, &cl);
-  return (span->sizeclass == cl);
+  // With NUMA partitions there are several size classes of the same
+  // size.
+  return (Static::sizemap()->class_to_size(span->sizeclass)
+          == Static::sizemap()->class_to_size(cl));
 }
 #endif
 
@@ -1536,28 +2266,42 @@ void do_free_with_callback(void* ptr,
 
   ASSERT(!use_hint || ValidateSizeHint(ptr, size_hint));
 
+  // Size hint doesn't tell us which partition object belongs to.
+  use_hint = use_hint && !NumaTopology::Active() && !HeapPartition::Active();
+
   if (!use_hint || PREDICT_FALSE(!Static::sizemap()->GetSizeClass(size_hint, &cl))) {
     // if we're in sized delete, but size is too large, no need to
     // probe size cache
     bool cache_hit = !use_hint && Static::pageheap()->TryGetSizeClass(p, &cl);
     if (PREDICT_FALSE(!cache_hit)) {
-      Span* span  = Static::pageheap()->GetDescriptor(p);
-      if (PREDICT_FALSE(!span)) {
-        // span can be nullptr because the pointer passed in is nullptr or invalid
-        // (not something returned by malloc or friends), or because the
-        // pointer was allocated with some other allocator besides
-        // tcmalloc.  The latter can happen if tcmalloc is linked in via
-        // a dynamic library, but is not listed last on the link line.
-        // In that case, libraries after it on the link line will
-        // allocate with libc malloc, but free with tcmalloc's free.
-        free_null_or_invalid(ptr, invalid_free_fn);
-        return;
-      }
-      cl = span->sizeclass;
+      // Page map knows size classes of small objects, so we only need
+      // to look at span of page-level ones.
+      cl = Static::pageheap()->GetPageSizeClass(p);
       if (PREDICT_FALSE(cl == 0)) {
+        Span* span  = Static::pageheap()->GetDescriptor(p);
+        if (PREDICT_FALSE(!span)) {
+          // span can be nullptr because the pointer passed in is nullptr or invalid
+          // (not something returned by malloc or friends), or because the
+          // pointer was allocated with some other allocator besides
+          // tcmalloc.  The latter can happen if tcmalloc is linked in via
+          // a dynamic library, but is not listed last on the link line.
+          // In that case, libraries after it on the link line will
+          // allocate with libc malloc, but free with tcmalloc's free.
+          free_null_or_invalid(ptr, invalid_free_fn);
+          return;
+        }
+        ASSERT(span->sizeclass == 0);
+        if (span->heap_partition != 0) {
+          do_free_tenant(heap, span, ptr);
+          return;
+        }
+        if (span->arena) {
+          // Arena memory only goes back when its arena is destroyed.
+          return;
+        }
         ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
         ASSERT(span != nullptr && span->start == p);
-        do_free_pages(span, ptr);
+        do_free_pages(Static::pageheap(), span, ptr);
         return;
       }
       if (!use_hint) {
@@ -1566,7 +2310,12 @@ void do_free_with_callback(void* ptr,
     }
   }
 
-  if (PREDICT_TRUE(heap != nullptr)) {
+  if (CpuCache::Active()) {
+    CpuCache::Deallocate(ptr, cl);
+    return;
+  }
+
+  if (PREDICT_TRUE(heap != nullptr && heap->partition() == nullptr)) {
     ASSERT(Static::IsInited());
     // If we've hit initialized thread cache, so we're done.
     heap->Deallocate(ptr, cl);
@@ -1594,6 +2343,146 @@ ALWAYS_INLINE void do_free(void* ptr) {
   return do_free_with_callback(ptr, &InvalidFree, false, 0);
 }
 
+#ifndef TCMALLOC_USING_DEBUGALLOCATION  // debugallocation.cc has its own batch API
+
+// Central free list batch routines take int counts. We feed them
+// arbitrarily large batches in chunks of this size.
+static constexpr size_t kMaxCentralBatch = 1 << 20;
+
+// Helper for tc_malloc_batch. Allocates "count" objects of "size"
+// bytes into ptrs. Returns number of objects allocated, which is
+// less than count only when we're out of memory.
+static size_t do_malloc_batch(size_t size, void** ptrs, size_t count) {
+  // note: it will force initialization of malloc if necessary
+  ThreadCachePtr cache_ptr = ThreadCachePtr::Grab();
+
+  uint32_t cl;
+  if (PREDICT_FALSE(cache_ptr.IsEmergencyMallocEnabled()
+                    || !Static::sizemap()->GetSizeClass(size, &cl))) {
+    // Page-level and emergency allocations gain nothing from
+    // batching.
+    size_t i = 0;
+    for (; i < count; i++) {
+      ptrs[i] = do_malloc_or_cpp_alloc(size);
+      if (ptrs[i] == nullptr) {
+        break;
+      }
+    }
+    return i;
+  }
+  cl = NumaTopology::LocalSizeClass(cl);
+
+  ThreadCache* heap = cache_ptr.get();
+  const size_t allocated_size = Static::sizemap()->class_to_size(cl);
+
+  // Make sampling decisions first. Sampled objects are allocated
+  // separately after the rest of the batch is filled.
+  size_t sampled = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (PREDICT_FALSE(heap->SampleAllocation(allocated_size))) {
+      sampled++;
+    }
+  }
+  const size_t regular = count - sampled;
+
+  size_t filled = 0;
+  if (regular >= static_cast<size_t>(Static::sizemap()->num_objects_to_move(cl))) {
+    // Large batches bypass front-end caches entirely and go straight
+    // to the central free list (and its transfer cache).
+    while (filled < regular) {
+      const int n = std::min(regular - filled, kMaxCentralBatch);
+      const int got = heap->central_cache()[cl].RemoveBatch(ptrs + filled, n);
+      filled += got;
+      if (got < n) {
+        break;
+      }
+    }
+  } else if (CpuCache::Active() && heap->partition() == nullptr) {
+    for (; filled < regular; filled++) {
+      ptrs[filled] = CpuCache::Allocate(allocated_size, cl, nop_oom_handler);
+      if (ptrs[filled] == nullptr) {
+        break;
+      }
+    }
+  } else if (regular > 0) {
+    filled = heap->AllocateBatch(cl, ptrs, regular);
+  }
+
+  if (filled == regular) {
+    for (; sampled > 0; sampled--) {
+      void* ptr = DoSampledAllocation(size);
+      if (ptr == nullptr) {
+        break;
+      }
+      ptrs[filled++] = ptr;
+    }
+  }
+
+  if (PREDICT_FALSE(filled < count)) {
+    errno = ENOMEM;
+  }
+  return filled;
+}
+
+// Helper for tc_free_batch. Frees "count" objects that were all
+// allocated with the same "size". Contents of ptrs are clobbered.
+static void do_free_batch(size_t size, void** ptrs, size_t count) {
+  uint32_t cl;
+  // With NUMA partitions we cannot know size class from size alone,
+  // and with heap partitions we cannot know which heap objects belong
+  // to.
+  if (PREDICT_FALSE(!Static::sizemap()->GetSizeClass(size, &cl)
+                    || !Static::IsInited()
+                    || NumaTopology::Active()
+                    || HeapPartition::Active())) {
+    for (size_t i = 0; i < count; i++) {
+      do_free(ptrs[i]);
+    }
+    return;
+  }
+
+  // Move pointers that can take batched path to the front of the
+  // array. Like in tc_free_sized, kPageSize-aligned objects could be
+  // sampled allocations, so we don't trust size hint for them.
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    void* ptr = ptrs[i];
+#ifndef NO_TCMALLOC_SAMPLES
+    if (PREDICT_FALSE((reinterpret_cast<uintptr_t>(ptr) & (kPageSize-1)) == 0)) {
+      do_free(ptr);
+      continue;
+    }
+#else
+    if (ptr == nullptr) {
+      continue;
+    }
+#endif
+    ASSERT(ValidateSizeHint(ptr, size));
+    ptrs[n++] = ptr;
+  }
+  if (n == 0) {
+    return;
+  }
+
+  ThreadCache* heap = ThreadCachePtr::GetIfPresent();
+  const size_t batch_size = Static::sizemap()->num_objects_to_move(cl);
+  if (n >= batch_size || (heap == nullptr && !CpuCache::Active())) {
+    for (size_t done = 0; done < n; ) {
+      const int chunk = std::min(n - done, kMaxCentralBatch);
+      Static::central_cache()[cl].InsertBatch(ptrs + done, chunk);
+      done += chunk;
+    }
+  } else if (CpuCache::Active()) {
+    for (size_t i = 0; i < n; i++) {
+      CpuCache::Deallocate(ptrs[i], cl);
+    }
+  } else {
+    heap->DeallocateBatch(cl, ptrs, n);
+  }
+}
+
+#endif  // TCMALLOC_USING_DEBUGALLOCATION
+
 // NOTE: some logic here is duplicated in GetOwnership (above), for
 // speed.  If you change this function, look at that one too.
 inline size_t GetSizeWithCallback(const void* ptr,
@@ -1605,8 +2494,12 @@ inline size_t GetSizeWithCallback(const void* ptr,
   if (Static::pageheap()->TryGetSizeClass(p, &cl)) {
     return Static::sizemap()->ByteSizeForClass(cl);
   }
+  cl = Static::pageheap()->GetPageSizeClass(p);
+  if (cl != 0) {
+    return Static::sizemap()->ByteSizeForClass(cl);
+  }
 
-  const Span *span = Static::pageheap()->GetDescriptor(p);
+  const Span *span = LookupSpan(p);
   if (PREDICT_FALSE(span == nullptr)) {  // means we do not own this memory
     return (*invalid_getsize_fn)(ptr);
   }
@@ -1620,9 +2513,53 @@ inline size_t GetSizeWithCallback(const void* ptr,
     return tc_nallocx(orig_size, 0);
   }
 
+  if (PREDICT_FALSE(span->arena)) {
+    // We don't track sizes of arena objects, so we cannot realloc
+    // them either.
+    Log(kCrash, __FILE__, __LINE__,
+        "Attempt to get size of arena memory", ptr);
+  }
+
   return span->length << kPageShift;
 }
 
+// Resizes page-level (i.e. not sampled and not of any size class)
+// allocation to new_size bytes without moving it. Returns false if
+// ptr is not such allocation or if it cannot grow because pages
+// after it are not free.
+static bool ResizePagesInPlace(void* ptr, size_t new_size) {
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  PageHeap* pageheap;
+  Span* span = LookupSpan(p, &pageheap);
+  if (span == nullptr || span->start != p
+      || span->location != Span::IN_USE
+      || span->sizeclass != 0 || span->sample) {
+    return false;
+  }
+  return pageheap->ResizeInPlace(
+    span, std::max<Length>(tcmalloc::pages(new_size), 1));
+}
+
+// Resizes page-level allocation that has a mapping of its own (see
+// "tcmalloc.mremap_threshold_bytes") by remapping it, so the kernel
+// moves page tables instead of us copying bytes. Returns new
+// location of the allocation or nullptr if ptr is not such allocation
+// or remapping failed.
+static void* RemapPages(void* ptr, size_t new_size) {
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  // Tenant heap partitions have no dedicated mappings.
+  Span* span = Static::pageheap()->GetDescriptor(p);
+  if (span == nullptr || span->start != p
+      || span->location != Span::IN_USE
+      || !span->dedicated || span->sample) {
+    return nullptr;
+  }
+  if (!Static::pageheap()->RemapDedicated(span, tcmalloc::pages(new_size))) {
+    return nullptr;
+  }
+  return reinterpret_cast<void*>(span->start << kPageShift);
+}
+
 // This lets you call back to a given function pointer if ptr is invalid.
 // It is used primarily by windows code which wants a specialized callback.
 ALWAYS_INLINE void* do_realloc_with_callback(
@@ -1643,6 +2580,24 @@ ALWAYS_INLINE void* do_realloc_with_callback(
   const size_t lower_bound_to_grow = old_size + min_growth;
   const size_t upper_bound_to_shrink = old_size / 2ul;
   if ((new_size > old_size) || (new_size < upper_bound_to_shrink)) {
+    // Page-level allocations that stay page-level can often be
+    // resized without copying by growing into free pages that
+    // follow them or by giving back their tail.
+    if (old_size > kMaxSize && new_size > kMaxSize
+        && ResizePagesInPlace(old_ptr, new_size)) {
+      tcmalloc::InvokeDeleteHook(old_ptr);
+      tcmalloc::InvokeNewHook(old_ptr, new_size);
+      return old_ptr;
+    }
+    if (old_size > kMaxSize && new_size > kMaxSize) {
+      void* new_ptr = RemapPages(old_ptr, new_size);
+      if (new_ptr != nullptr) {
+        tcmalloc::InvokeDeleteHook(old_ptr);
+        tcmalloc::InvokeNewHook(new_ptr, new_size);
+        return new_ptr;
+      }
+    }
+
     // Need to reallocate.
     void* new_ptr = nullptr;
 
@@ -1684,8 +2639,8 @@ void* do_memalign_pages(size_t align, size_t size) {
   if (size == 0) size = 1;
 
   // We will allocate directly from the page heap
-  Span* span = Static::pageheap()->NewAligned(tcmalloc::pages(size),
-                                              tcmalloc::pages(align));
+  Span* span = ThreadPageHeap()->NewAligned(tcmalloc::pages(size),
+                                            tcmalloc::pages(align));
   if (span == nullptr) {
     // errno was set inside page heap as necessary.
     return nullptr;
@@ -1724,12 +2679,14 @@ inline Mallinfo do_mallinfo() {
                                       + stats.central_bytes
                                       + stats.transfer_bytes);
   info.fordblks  = static_cast<inttp>(stats.pageheap.free_bytes +
+                                      stats.pageheap.large_cache_bytes +
                                       stats.pageheap.unmapped_bytes);
   info.uordblks  = static_cast<inttp>(stats.pageheap.system_bytes
                                       - stats.thread_bytes
                                       - stats.central_bytes
                                       - stats.transfer_bytes
                                       - stats.pageheap.free_bytes
+                                      - stats.pageheap.large_cache_bytes
                                       - stats.pageheap.unmapped_bytes);
 
   return info;
@@ -1913,9 +2870,13 @@ void* memalign_pages(size_t align, size_t size,
 // produced code is short enough to enable effort-less human
 // comprehension. Which itself led to elimination of various checks
 // that were not necessary for fast-path.
+//
+// If usable_size is given, fast-path stores the size of the
+// allocated object there. Callers pass constant nullptr or not, so
+// this costs nothing to regular malloc.
 template <void* OOMHandler(size_t)>
 ALWAYS_INLINE
-static void * malloc_fast_path(size_t size) {
+static void * malloc_fast_path(size_t size, size_t* usable_size = nullptr) {
   if (PREDICT_FALSE(!base::internal::new_hooks_.empty())) {
     return tcmalloc::dispatch_allocate_full<OOMHandler>(size);
   }
@@ -1930,6 +2891,7 @@ static void * malloc_fast_path(size_t size) {
   if (PREDICT_FALSE(!Static::sizemap()->GetSizeClass(size, &cl))) {
     return tcmalloc::dispatch_allocate_full<OOMHandler>(size);
   }
+  cl = NumaTopology::LocalSizeClass(cl);
 
   size_t allocated_size = Static::sizemap()->ByteSizeForClass(cl);
 
@@ -1937,6 +2899,16 @@ static void * malloc_fast_path(size_t size) {
     return tcmalloc::dispatch_allocate_full<OOMHandler>(size);
   }
 
+  if (usable_size != nullptr) {
+    *usable_size = allocated_size;
+  }
+
+  // Per-CPU caches hold objects of the default heap only.
+  if (CpuCache::Active() && cache->partition() == nullptr) {
+    return CheckedMallocResult(
+      CpuCache::Allocate(allocated_size, cl, OOMHandler));
+  }
+
   return CheckedMallocResult(cache->Allocate(allocated_size, cl, OOMHandler));
 }
 
@@ -1965,8 +2937,35 @@ void* tc_malloc(size_t size) PERFTOOLS_NOTHROW {
   return malloc_fast_path<tcmalloc::malloc_oom>(size);
 }
 
+// Size class that fast-path has already looked up gives us the
+// usable size for free. Slow-path (sampling, large allocations,
+// hooks) doesn't tell us, so we ask the page map afterwards.
+template <void* OOMHandler(size_t)>
+ALWAYS_INLINE
+static tc_sized_ptr_t sized_malloc_fast_path(size_t size) {
+  size_t usable_size = 0;
+  void* p = malloc_fast_path<OOMHandler>(size, &usable_size);
+  if (PREDICT_FALSE(p == nullptr)) {
+    return {nullptr, 0};
+  }
+  if (PREDICT_FALSE(usable_size == 0)) {
+    usable_size = GetSizeWithCallback(p, &InvalidGetAllocatedSize);
+  }
+  return {p, usable_size};
+}
+
+extern "C" PERFTOOLS_DLL_DECL CACHELINE_ALIGNED_FN
+tc_sized_ptr_t tc_malloc_at_least(size_t size) PERFTOOLS_NOTHROW {
+  return sized_malloc_fast_path<tcmalloc::malloc_oom>(size);
+}
+
 static ALWAYS_INLINE
 void free_fast_path(void *ptr) {
+  // Page map is only consulted when size class cache misses, but
+  // when it does, it is likely a cache miss too. Let it overlap with
+  // the rest of free.
+  Static::pageheap()->MaybePrefetchPageMap(
+    reinterpret_cast<uintptr_t>(ptr) >> kPageShift);
   if (PREDICT_FALSE(!base::internal::delete_hooks_.empty())) {
     tcmalloc::invoke_hooks_and_free(ptr);
     return;
@@ -2001,6 +3000,27 @@ void tc_free_sized(void *ptr, size_t size) PERFTOOLS_NOTHROW {
   do_free_with_callback(ptr, &InvalidFree, true, size);
 }
 
+extern "C" PERFTOOLS_DLL_DECL
+size_t tc_malloc_batch(size_t size, void** ptrs, size_t count) PERFTOOLS_NOTHROW {
+  size_t result = do_malloc_batch(size, ptrs, count);
+  if (PREDICT_FALSE(!base::internal::new_hooks_.empty())) {
+    for (size_t i = 0; i < result; i++) {
+      tcmalloc::InvokeNewHook(ptrs[i], size);
+    }
+  }
+  return result;
+}
+
+extern "C" PERFTOOLS_DLL_DECL
+void tc_free_batch(size_t size, void** ptrs, size_t count) PERFTOOLS_NOTHROW {
+  if (PREDICT_FALSE(!base::internal::delete_hooks_.empty())) {
+    for (size_t i = 0; i < count; i++) {
+      tcmalloc::InvokeDeleteHook(ptrs[i]);
+    }
+  }
+  do_free_batch(size, ptrs, count);
+}
+
 #ifdef TC_ALIAS
 
 extern "C" PERFTOOLS_DLL_DECL void tc_delete_sized(void *p, size_t size) PERFTOOLS_NOTHROW
@@ -2065,6 +3085,11 @@ void* tc_new(size_t size) {
   return malloc_fast_path<tcmalloc::cpp_throw_oom>(size);
 }
 
+extern "C" PERFTOOLS_DLL_DECL CACHELINE_ALIGNED_FN
+tc_sized_ptr_t tc_new_at_least(size_t size) {
+  return sized_malloc_fast_path<tcmalloc::cpp_throw_oom>(size);
+}
+
 extern "C" PERFTOOLS_DLL_DECL CACHELINE_ALIGNED_FN
 void* tc_new_nothrow(size_t size, const std::nothrow_t&) PERFTOOLS_NOTHROW {
   return malloc_fast_path<tcmalloc::cpp_nothrow_oom>(size);
@@ -2275,4 +3300,55 @@ extern "C" PERFTOOLS_DLL_DECL void* tc_malloc_skip_new_handler(size_t size)  PER
   return result;
 }
 
+extern "C" PERFTOOLS_DLL_DECL int tc_try_realloc_in_place(void* ptr, size_t new_size) PERFTOOLS_NOTHROW {
+  if (ptr == nullptr) {
+    return 0;
+  }
+  const size_t old_size = GetSizeWithCallback(ptr, &InvalidGetAllocatedSize);
+  bool ok;
+  if (new_size <= old_size) {
+    // Always fits, but page-level allocation may give back its tail.
+    if (old_size > kMaxSize) {
+      ResizePagesInPlace(ptr, new_size);
+    }
+    ok = true;
+  } else {
+    ok = (old_size > kMaxSize && ResizePagesInPlace(ptr, new_size));
+  }
+  if (ok) {
+    tcmalloc::InvokeDeleteHook(ptr);
+    tcmalloc::InvokeNewHook(ptr, new_size);
+  }
+  return ok;
+}
+
 #endif  // TCMALLOC_USING_DEBUGALLOCATION
+
+// Arenas bypass debug allocator too: their memory is never freed
+// object by object anyways. tc_arena_t is opaque alias of
+// tcmalloc::Arena.
+static tcmalloc::Arena* AsArena(tc_arena_t* arena) {
+  return reinterpret_cast<tcmalloc::Arena*>(arena);
+}
+
+extern "C" PERFTOOLS_DLL_DECL tc_arena_t* tc_arena_create(void) PERFTOOLS_NOTHROW {
+  return reinterpret_cast<tc_arena_t*>(tcmalloc::Arena::Create());
+}
+
+extern "C" PERFTOOLS_DLL_DECL void* tc_arena_malloc(tc_arena_t* arena, size_t size) PERFTOOLS_NOTHROW {
+  return AsArena(arena)->Alloc(size, kMinAlign);
+}
+
+extern "C" PERFTOOLS_DLL_DECL void* tc_arena_memalign(tc_arena_t* arena, size_t align,
+                                                      size_t size) PERFTOOLS_NOTHROW {
+  ASSERT(align != 0 && (align & (align - 1)) == 0);
+  return AsArena(arena)->Alloc(size, align);
+}
+
+extern "C" PERFTOOLS_DLL_DECL void tc_arena_destroy(tc_arena_t* arena) PERFTOOLS_NOTHROW {
+  AsArena(arena)->Destroy();
+}
+
+extern "C" PERFTOOLS_DLL_DECL size_t tc_arena_allocated_bytes(const tc_arena_t* arena) PERFTOOLS_NOTHROW {
+  return reinterpret_cast<const tcmalloc::Arena*>(arena)->allocated_bytes();
+}
@@ -80,6 +80,16 @@ public:
   virtual bool IsEmergencyPtr(void* ptr) = 0;
   virtual void WithEmergencyMallocEnabled(FunctionRef<void()> body) = 0;
 
+  // Makes subsequent allocations come from given NUMA partition (or
+  // from current CPU's one if partition is -1). Returns false if NUMA
+  // awareness is not active.
+  virtual bool ForceNumaPartition(int partition) = 0;
+  // Returns NUMA partition of page heap memory backing ptr.
+  virtual int GetNumaPartition(void* ptr) = 0;
+  // Returns tenant heap partition ptr was allocated from, or 0 for
+  // the default heap.
+  virtual int GetHeapPartition(void* ptr) = 0;
+
 protected:
   virtual ~TestingPortal();
 };
@@ -0,0 +1,210 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2026, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// MallocExtension::ProcessBackgroundActions() testing. It never
+// returns, so it gets its own test binary.
+#include "config_for_unittests.h"
+
+#include <gperftools/malloc_extension.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+static size_t GetProperty(const char* name) {
+  size_t result = 0;
+  EXPECT_TRUE(MallocExtension::instance()->GetNumericProperty(name, &result));
+  return result;
+}
+
+// Polls until predicate is true, for at most 10 seconds.
+template <typename Pred>
+static bool WaitFor(Pred pred) {
+  for (int i = 0; i < 1000; i++) {
+    if (pred()) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return pred();
+}
+
+TEST(BackgroundActionsTest, ReleasesMemory) {
+  ASSERT_EQ(GetProperty("tcmalloc.background_release"), 0);
+
+  MallocExtension::instance()->SetMemoryReleaseRate(10);
+  std::thread([] () {
+    MallocExtension::instance()->ProcessBackgroundActions();
+  }).detach();
+  ASSERT_TRUE(WaitFor([] () {
+    return GetProperty("tcmalloc.background_release") == 1;
+  }));
+
+  // Another caller returns right away.
+  std::thread t([] () {
+    MallocExtension::instance()->ProcessBackgroundActions();
+  });
+  t.join();
+
+  // Page heap may have decided to wait for up to a couple gigs of
+  // frees before releasing anything. So we keep freeing until
+  // background thread releases something.
+  static const int kNum = 16;
+  static const size_t kSize = 4 << 20;
+  const size_t unmapped_before =
+    GetProperty("tcmalloc.pageheap_unmapped_bytes");
+  EXPECT_TRUE(WaitFor([unmapped_before] () {
+    std::vector<void*> ptrs;
+    for (int i = 0; i < kNum; i++) {
+      ptrs.push_back((::operator new)(kSize));
+    }
+    for (void* p : ptrs) {
+      (::operator delete)(p);
+    }
+    return GetProperty("tcmalloc.pageheap_unmapped_bytes") > unmapped_before;
+  }));
+
+  printf("unmapped bytes: %zu -> %zu\n", unmapped_before,
+         GetProperty("tcmalloc.pageheap_unmapped_bytes"));
+}
+
+TEST(BackgroundActionsTest, RebalancesThreadCaches) {
+  // Might be already running after previous test, then it returns
+  // right away.
+  std::thread([] () {
+    MallocExtension::instance()->ProcessBackgroundActions();
+  }).detach();
+
+  const size_t rebalanced_before =
+    GetProperty("tcmalloc.thread_cache_rebalanced_bytes");
+
+  // Busy thread churns through more objects than its cache can hold,
+  // so it keeps going to the central cache.
+  std::atomic<bool> stop{false};
+  std::thread busy([&stop] () {
+    std::vector<void*> ptrs;
+    while (!stop.load(std::memory_order_relaxed)) {
+      for (int i = 0; i < 4096; i++) {
+        ptrs.push_back(::operator new(64 + (i % 16) * 64));
+      }
+      for (void* p : ptrs) {
+        ::operator delete(p);
+      }
+      ptrs.clear();
+    }
+  });
+
+  EXPECT_TRUE(WaitFor([rebalanced_before] () {
+    return GetProperty("tcmalloc.thread_cache_rebalanced_bytes")
+      > rebalanced_before;
+  }));
+  stop = true;
+  busy.join();
+
+  const size_t min_budget = GetProperty("tcmalloc.thread_cache_min_budget_bytes");
+  const size_t max_budget = GetProperty("tcmalloc.thread_cache_max_budget_bytes");
+  printf("thread cache budgets: %zu .. %zu, rebalanced %zu bytes\n",
+         min_budget, max_budget,
+         GetProperty("tcmalloc.thread_cache_rebalanced_bytes"));
+  EXPECT_LE(min_budget, max_budget);
+}
+
+TEST(BackgroundActionsTest, RebalancesTransferCaches) {
+  std::thread([] () {
+    MallocExtension::instance()->ProcessBackgroundActions();
+  }).detach();
+
+  const size_t rebalanced_before =
+    GetProperty("tcmalloc.transfer_cache_rebalanced_slots");
+
+  // Freeing and allocating lots of objects of single size class
+  // overflows and drains its transfer cache, while other classes
+  // stay idle. Size is picked so that the class starts with less
+  // than the maximal number of slots.
+  static const size_t kSize = 4096;
+  std::atomic<bool> stop{false};
+  std::thread busy([&stop] () {
+    std::vector<void*> ptrs;
+    while (!stop.load(std::memory_order_relaxed)) {
+      for (int i = 0; i < 8192; i++) {
+        ptrs.push_back(::operator new(kSize));
+      }
+      for (void* p : ptrs) {
+        ::operator delete(p);
+      }
+      ptrs.clear();
+    }
+  });
+
+  // No class starts with more than 1 MiB, so the busy one has to grow
+  // past that.
+  EXPECT_TRUE(WaitFor([rebalanced_before] () {
+    return (GetProperty("tcmalloc.transfer_cache_rebalanced_slots")
+            > rebalanced_before
+            && GetProperty("tcmalloc.transfer_cache_max_capacity_bytes")
+            > (1 << 20));
+  }));
+  stop = true;
+  busy.join();
+
+  const size_t min_capacity =
+    GetProperty("tcmalloc.transfer_cache_min_capacity_bytes");
+  const size_t max_capacity =
+    GetProperty("tcmalloc.transfer_cache_max_capacity_bytes");
+  printf("transfer cache capacities: %zu .. %zu bytes, "
+         "rebalanced %zu slots\n", min_capacity, max_capacity,
+         GetProperty("tcmalloc.transfer_cache_rebalanced_slots"));
+  EXPECT_LE(min_capacity, max_capacity);
+
+  // Busy class has slots, and no more than its limit.
+  std::vector<MallocExtension::FreeListInfo> info;
+  MallocExtension::instance()->GetFreeListSizes(&info);
+  size_t slots = 0, max_slots = 0;
+  for (const auto& i : info) {
+    if (i.min_object_size > kSize || i.max_object_size < kSize) {
+      continue;
+    }
+    if (strcmp(i.type, "tcmalloc.transfer_slots") == 0) {
+      slots = i.total_bytes_free;
+    } else if (strcmp(i.type, "tcmalloc.transfer_max_slots") == 0) {
+      max_slots = i.total_bytes_free;
+    }
+  }
+  printf("transfer cache of %zu byte objects: %zu of %zu bytes\n",
+         kSize, slots, max_slots);
+  EXPECT_GT(slots, 0);
+  EXPECT_LE(slots, max_slots);
+}
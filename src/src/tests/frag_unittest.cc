@@ -39,10 +39,12 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #include <memory>
 #include <optional>
+#include <string>
 #include <vector>
 
 #include "testing_portal.h"
@@ -125,3 +127,86 @@ TEST(FragTest, Slack) {
             (end-start) * 1e9 / kIterations);
   }
 }
+
+static std::string GetStats() {
+  std::string stats(1 << 20, '\0');
+  MallocExtension::instance()->GetStats(stats.data(), stats.size());
+  stats.resize(strlen(stats.c_str()));
+  return stats;
+}
+
+// Returns size class of objects of given size, as listed in stats, or
+// -1 if there is none.
+static int FindSizeClass(const std::string& stats, size_t size) {
+  for (const char* p = strstr(stats.c_str(), "\nclass "); p != nullptr;
+       p = strstr(p + 1, "\nclass ")) {
+    int cl;
+    size_t bytes;
+    if (sscanf(p, "\nclass %d [ %zu bytes ]", &cl, &bytes) == 2
+        && bytes == size) {
+      return cl;
+    }
+  }
+  return -1;
+}
+
+// Returns row of central cache span occupancy table for given size
+// class, or all zeros if there is none.
+static std::vector<int64_t> GetOccupancyRow(const std::string& stats, int cl) {
+  std::vector<int64_t> row(9, 0);
+  const char* section = strstr(stats.c_str(), "share of objects in use");
+  if (section == nullptr) {
+    return row;
+  }
+  for (const char* p = strstr(section, "\nclass "); p != nullptr;
+       p = strstr(p + 1, "\nclass ")) {
+    int row_cl;
+    long long n[9];
+    if (sscanf(p, "\nclass %d %lld %lld %lld %lld %lld %lld %lld %lld %lld",
+               &row_cl, &n[0], &n[1], &n[2], &n[3], &n[4], &n[5], &n[6],
+               &n[7], &n[8]) == 10 && row_cl == cl) {
+      row.assign(n, n + 9);
+      break;
+    }
+  }
+  return row;
+}
+
+TEST(FragTest, SpanOccupancy) {
+  // Keep every 8th object out of a few thousand so that central cache
+  // ends up with plenty of spans that have 1/8 of their objects in
+  // use.
+  static constexpr int kObjects = 8 << 10;
+  static constexpr size_t kSize = 256;
+  std::vector<std::unique_ptr<char[]>> saved;
+  saved.reserve(kObjects);
+  for (int i = 0; i < kObjects; i++) {
+    saved.emplace_back(noopt(new char[kSize]));
+  }
+  for (int i = 0; i < kObjects; i++) {
+    if (i % 8 != 0) {
+      saved[i].reset();
+    }
+  }
+  MallocExtension::instance()->MarkThreadIdle();
+
+  std::string stats = GetStats();
+  const int cl = FindSizeClass(stats, kSize);
+  ASSERT_GT(cl, 0) << stats;
+  const std::vector<int64_t> row = GetOccupancyRow(stats, cl);
+  int64_t total = 0;
+  for (int64_t n : row) {
+    total += n;
+  }
+  // Objects freed to transfer cache still count as in use, so some
+  // spans look fuller than they are, but most are in 1/8..2/8 bucket.
+  EXPECT_GE(total, kObjects / 64) << stats;
+  EXPECT_GT(row[1], total / 2) << stats;
+
+  // Once we free the rest, spans that had 1/8 of objects in use are
+  // empty and go back to page heap.
+  saved.clear();
+  MallocExtension::instance()->MarkThreadIdle();
+  stats = GetStats();
+  EXPECT_LT(GetOccupancyRow(stats, cl)[1], row[1] / 4) << stats;
+}
@@ -9,8 +9,13 @@
 
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <limits>
 #include <memory>
+#include <random>
+#include <thread>
 #include <vector>
 
 #include "page_heap.h"
@@ -21,6 +26,7 @@
 
 #include "gtest/gtest.h"
 
+DECLARE_double(tcmalloc_release_rate);
 DECLARE_int64(tcmalloc_heap_limit_mb);
 
 // TODO: add testing from >1 min_span_size setting.
@@ -83,6 +89,173 @@ TEST(PageHeapTest, Stats) {
   CheckStats(ph.get(), 256, 128, 128);
 }
 
+TEST(PageHeapTest, ResizeInPlace) {
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+
+  tcmalloc::Span* s = ph->New(256);
+  const PageID start = s->start;
+  CheckStats(ph.get(), 256, 0, 0);
+
+  // Shrink gives back the tail.
+  ASSERT_TRUE(ph->ResizeInPlace(s, 64));
+  ASSERT_EQ(s->length, 64);
+  CheckStats(ph.get(), 256, 192, 0);
+
+  // Grow takes it back.
+  ASSERT_TRUE(ph->ResizeInPlace(s, 200));
+  ASSERT_EQ(s->length, 200);
+  ASSERT_EQ(ph->GetDescriptor(start + 199), s);
+  CheckStats(ph.get(), 256, 56, 0);
+
+  // Including released pages.
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(1);
+  }
+  CheckStats(ph.get(), 256, 0, 56);
+  ASSERT_TRUE(ph->ResizeInPlace(s, 256));
+  CheckStats(ph.get(), 256, 0, 0);
+
+  // But nothing past what we have.
+  ASSERT_FALSE(ph->ResizeInPlace(s, 257));
+  ASSERT_EQ(s->length, 256);
+  ASSERT_EQ(s->start, start);
+
+  ph->Delete(s);
+  CheckStats(ph.get(), 256, 256, 0);
+}
+
+TEST(PageHeapTest, ResizeInPlaceLimit) {
+  if (!HaveSystemRelease()) {
+    return;
+  }
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+
+  tcmalloc::Span* s = ph->New(256);
+  const PageID start = s->start;
+  ASSERT_TRUE(ph->ResizeInPlace(s, 64));
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff));
+  }
+  CheckStats(ph.get(), 256, 0, 192);
+
+  // Growing into released pages past the heap's limit fails.
+  ph->SetLimit(128);
+  ASSERT_FALSE(ph->ResizeInPlace(s, 200));
+  ASSERT_EQ(s->length, 64);
+  CheckStats(ph.get(), 256, 0, 192);
+
+  // Up to the limit it works.
+  ASSERT_TRUE(ph->ResizeInPlace(s, 128));
+  ASSERT_EQ(s->length, 128);
+  ASSERT_EQ(ph->GetDescriptor(start + 127), s);
+  CheckStats(ph.get(), 256, 0, 128);
+
+  ph->SetLimit(0);
+  ph->Delete(s);
+}
+
+TEST(PageHeapTest, Chunks) {
+  std::unique_ptr<tcmalloc::PageHeap> parent(new tcmalloc::PageHeap());
+  std::unique_ptr<tcmalloc::PageHeap> child(new tcmalloc::PageHeap());
+  tcmalloc::PageHeapAllocator<tcmalloc::Span> spans;
+  spans.Init();
+  child->SetParent(parent.get(), 1, &spans);
+
+  // Child grows by taking a chunk from parent, which counts it as in
+  // use.
+  tcmalloc::Span* s = child->New(16);
+  ASSERT_NE(s, nullptr);
+  CheckStats(child.get(), kMaxPages, kMaxPages - 16, 0);
+  CheckStats(parent.get(), kMaxPages, 0, 0);
+
+  tcmalloc::Span* chunk = parent->GetDescriptor(s->start + 15);
+  ASSERT_NE(chunk, s);
+  ASSERT_EQ(chunk->heap_partition, 1);
+  ASSERT_EQ(chunk->location, tcmalloc::Span::IN_USE);
+  ASSERT_EQ(chunk->length, kMaxPages);
+  ASSERT_EQ(child->GetDescriptor(s->start), s);
+
+  // Child releases pages of its chunk on its own, and parent knows
+  // how much of its in use memory that is.
+  child->Delete(s);
+  {
+    SpinLockHolder l(child->pageheap_lock());
+    child->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff));
+  }
+  CheckStats(child.get(), kMaxPages, 0, kMaxPages);
+  CheckStats(parent.get(), kMaxPages, 0, 0);
+  if (HaveSystemRelease()) {
+    ASSERT_EQ(parent->ChunkUnmappedBytes(), kMaxPages << kPageShift);
+  }
+
+  // Reusing released pages takes them back.
+  s = child->New(kMaxPages);
+  ASSERT_NE(s, nullptr);
+  ASSERT_EQ(parent->ChunkUnmappedBytes(), 0);
+  child->Delete(s);
+}
+
+TEST(PageHeapTest, Dedicated) {
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetDedicatedThreshold(1);
+  ASSERT_EQ(ph->GetDedicatedThreshold(), kMaxPages);
+
+  // Small spans still come from the heap.
+  tcmalloc::Span* small = ph->New(kMaxPages - 1);
+  ASSERT_FALSE(small->dedicated);
+
+  tcmalloc::Span* s = ph->New(kMaxPages);
+  if (!s->dedicated) {
+    // No mremap on this platform.
+    ph->Delete(s);
+    ph->Delete(small);
+    return;
+  }
+  // Dedicated span adds to system bytes, but never to free ones.
+  const tcmalloc::PageHeap::Stats before = ph->StatsLocked();
+  ASSERT_EQ(ph->StatsLocked().dedicated_bytes >> kPageShift, kMaxPages);
+
+  char* p = reinterpret_cast<char*>(s->start << kPageShift);
+  for (size_t i = 0; i < (kMaxPages << kPageShift); i++) {
+    p[i] = static_cast<char>(i * 7);
+  }
+
+  // Growing may move the span. Contents move with it and pagemap
+  // follows.
+  ASSERT_TRUE(ph->RemapDedicated(s, 16 * kMaxPages));
+  ASSERT_EQ(s->length, 16 * kMaxPages);
+  ASSERT_EQ(ph->GetDescriptor(s->start), s);
+  ASSERT_EQ(ph->GetDescriptor(s->start + s->length - 1), s);
+  p = reinterpret_cast<char*>(s->start << kPageShift);
+  for (size_t i = 0; i < (kMaxPages << kPageShift); i++) {
+    ASSERT_EQ(p[i], static_cast<char>(i * 7));
+  }
+  ASSERT_EQ(ph->StatsLocked().system_bytes,
+            before.system_bytes + ((15 * kMaxPages) << kPageShift));
+  ASSERT_EQ(ph->StatsLocked().free_bytes, before.free_bytes);
+  ASSERT_EQ(ph->StatsLocked().dedicated_bytes >> kPageShift, 16 * kMaxPages);
+
+  // Shrinking in place always works.
+  const PageID start = s->start;
+  ASSERT_TRUE(ph->ResizeInPlace(s, 2 * kMaxPages));
+  ASSERT_EQ(s->start, start);
+  ASSERT_EQ(ph->GetDescriptor(start + 2 * kMaxPages - 1), s);
+  ASSERT_EQ(ph->StatsLocked().remap_count, 2);
+
+  // Delete unmaps it rather than keeping it free.
+  ph->Delete(s);
+  ASSERT_EQ(ph->GetDescriptor(start), nullptr);
+  ASSERT_EQ(ph->StatsLocked().system_bytes,
+            before.system_bytes - (kMaxPages << kPageShift));
+  ASSERT_EQ(ph->StatsLocked().free_bytes, before.free_bytes);
+  ASSERT_EQ(ph->StatsLocked().unmapped_bytes, before.unmapped_bytes);
+  ASSERT_EQ(ph->StatsLocked().dedicated_bytes, 0);
+
+  ph->Delete(small);
+}
+
 TEST(PageHeapTest, Decommit) {
   if (!HaveSystemRelease()) {
       return;
@@ -128,6 +301,563 @@ TEST(PageHeapTest, Decommit) {
   }
 }
 
+TEST(PageHeapTest, HugePageAware) {
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetHugePageAware(true);
+
+  auto hugepage_of = [] (tcmalloc::Span* s) {
+    return s->start / kPagesPerHugePage;
+  };
+
+  // Heap grows by whole aligned hugepages.
+  tcmalloc::Span* h1 = ph->New(kPagesPerHugePage);
+  tcmalloc::Span* h2 = ph->New(kPagesPerHugePage);
+  ASSERT_EQ(h1->start % kPagesPerHugePage, 0);
+  ASSERT_EQ(h2->start % kPagesPerHugePage, 0);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_EQ(ph->StatsLocked().system_bytes % kHugePageSize, 0);
+  }
+
+  // Leave 2 free pages in h1's hugepage, and 4 free pages (as two
+  // 2-page spans) in h2's hugepage.
+  tcmalloc::Span* h1_free = ph->SplitForTest(h1, kPagesPerHugePage - 2);
+  tcmalloc::Span* h2_free1 = ph->SplitForTest(h2, kPagesPerHugePage - 5);
+  tcmalloc::Span* h2_used = ph->SplitForTest(h2_free1, 2);
+  tcmalloc::Span* h2_free2 = ph->SplitForTest(h2_used, 1);
+  ph->Delete(h1_free);
+  ph->Delete(h2_free1);
+  ph->Delete(h2_free2);
+
+  // All three free spans are on the same free list, and h1's is
+  // last. But we prefer fuller hugepage.
+  tcmalloc::Span* s = ph->New(2);
+  EXPECT_EQ(hugepage_of(s), hugepage_of(h1));
+
+  ph->Delete(s);
+  ph->Delete(h1);
+  ph->Delete(h2);
+  ph->Delete(h2_used);
+
+  if (!HaveSystemRelease()) {
+    return;
+  }
+
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_EQ(ph->HugePageStatsLocked().free_hugepages, 2);
+    EXPECT_TRUE(ph->CheckExpensive());
+    // Whole free hugepages are released first (both, if they were
+    // coalesced into single span).
+    Length released = ph->ReleaseAtLeastNPages(1);
+    EXPECT_GT(released, 0);
+    EXPECT_EQ(released % kPagesPerHugePage, 0);
+    EXPECT_EQ(ph->HugePageStatsLocked().free_hugepages,
+              2 - released / kPagesPerHugePage);
+    EXPECT_EQ(ph->HugePageStatsLocked().broken_hugepages, 0);
+    EXPECT_TRUE(ph->CheckExpensive());
+  }
+
+  // Under pressure we do release parts of hugepages.
+  tcmalloc::Span* small = ph->New(1);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff));
+    EXPECT_EQ(ph->HugePageStatsLocked().free_hugepages, 0);
+    EXPECT_EQ(ph->HugePageStatsLocked().broken_hugepages, 1);
+    EXPECT_EQ(ph->HugePageStatsLocked().broken_bytes, kPageSize);
+  }
+  ph->PrepareAndDelete(small, [&] () {
+    EXPECT_TRUE(ph->CheckExpensive());
+  });
+}
+
+TEST(PageHeapTest, ReleaseByAge) {
+  if (!HaveSystemRelease()) {
+    return;
+  }
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  // We release explicitly below.
+  ph->SetBackgroundRelease(true);
+
+  // Used spans in between keep free ones from coalescing.
+  tcmalloc::Span* small = ph->New(10);
+  tcmalloc::Span* used1 = ph->New(1);
+  tcmalloc::Span* large = ph->New(kMaxPages * 2);
+  tcmalloc::Span* used2 = ph->New(1);
+  tcmalloc::Span* old_span = ph->New(10);
+  tcmalloc::Span* used3 = ph->New(1);
+  tcmalloc::Span* young = ph->New(10);
+  tcmalloc::Span* used4 = ph->New(1);
+
+  ph->Delete(small);
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  ph->Delete(large);
+
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    // Spans that were free for longer (including what's left of
+    // memory we got from the system) go first.
+    while (small->location != tcmalloc::Span::ON_RETURNED_FREELIST) {
+      ASSERT_GT(ph->ReleaseAtLeastNPages(1), 0);
+      EXPECT_EQ(large->location, tcmalloc::Span::ON_NORMAL_FREELIST);
+    }
+
+    Length histogram[tcmalloc::PageHeap::kFreeAgeBuckets];
+    ph->GetFreeAgeHistogramLocked(histogram);
+    EXPECT_EQ(histogram[0], ph->StatsLocked().free_bytes >> kPageShift);
+    EXPECT_GE(histogram[0], kMaxPages * 2);
+    for (int i = 1; i < tcmalloc::PageHeap::kFreeAgeBuckets; i++) {
+      EXPECT_EQ(histogram[i], 0);
+    }
+
+    while (large->location != tcmalloc::Span::ON_RETURNED_FREELIST) {
+      ASSERT_GT(ph->ReleaseAtLeastNPages(1), 0);
+    }
+  }
+
+  // Scavenging releases spans that have been free for long enough,
+  // but keeps young ones. High release rate makes every scavenge
+  // due right away.
+  tcmalloc::Cleanup restore_release_rate{
+    [rate = FLAGS_tcmalloc_release_rate] () {
+      FLAGS_tcmalloc_release_rate = rate;
+    }};
+  FLAGS_tcmalloc_release_rate = 1e6;
+  ph->Delete(old_span);
+  std::this_thread::sleep_for(std::chrono::milliseconds(1200));
+  ph->Delete(young);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    // Generous margin, so that young span stays young on busy machines.
+    ph->SetReleaseMinAge(1000);
+    EXPECT_EQ(ph->ScavengeIfDue(), 10);
+    EXPECT_EQ(old_span->location, tcmalloc::Span::ON_RETURNED_FREELIST);
+    EXPECT_EQ(young->location, tcmalloc::Span::ON_NORMAL_FREELIST);
+  }
+  // Sits between released spans, so it stays on its own.
+  ph->Delete(used1);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_EQ(ph->ScavengeIfDue(), 0);
+    EXPECT_EQ(young->location, tcmalloc::Span::ON_NORMAL_FREELIST);
+
+    // Explicit release doesn't look at age.
+    ASSERT_EQ(ph->ReleaseAtLeastNPages(1), 10);
+    EXPECT_EQ(young->location, tcmalloc::Span::ON_RETURNED_FREELIST);
+  }
+
+  ph->Delete(used2);
+  ph->Delete(used3);
+  ph->Delete(used4);
+}
+
+TEST(PageHeapTest, ReleaseByAgeAfterSplit) {
+  if (!HaveSystemRelease()) {
+    return;
+  }
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  // We release explicitly below.
+  ph->SetBackgroundRelease(true);
+
+  // Used spans in between keep free ones from coalescing.
+  tcmalloc::Span* oldest = ph->New(3);
+  tcmalloc::Span* used1 = ph->New(1);
+  tcmalloc::Span* old_span = ph->New(10);
+  tcmalloc::Span* used2 = ph->New(1);
+  tcmalloc::Span* young = ph->New(2);
+  tcmalloc::Span* used3 = ph->New(1);
+  const PageID old_start = old_span->start;
+
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    // Release what's left of memory we got from the system.
+    while (ph->ReleaseAtLeastNPages(1) > 0) {
+    }
+  }
+
+  tcmalloc::Cleanup restore_release_rate{
+    [rate = FLAGS_tcmalloc_release_rate] () {
+      FLAGS_tcmalloc_release_rate = rate;
+    }};
+  FLAGS_tcmalloc_release_rate = 1e6;
+  ph->Delete(oldest);
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  ph->Delete(old_span);
+  std::this_thread::sleep_for(std::chrono::milliseconds(1200));
+  ph->Delete(young);
+
+  // What's left of old span after the split keeps its free time, which
+  // falls between the youngest and the oldest free span.
+  tcmalloc::Span* split = ph->New(4);
+  ASSERT_EQ(split->start, old_start);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_TRUE(ph->CheckExpensive());
+    // Generous margin, so that young span stays young on busy machines.
+    ph->SetReleaseMinAge(1000);
+    EXPECT_EQ(ph->ScavengeIfDue(), 3);
+    EXPECT_EQ(ph->ScavengeIfDue(), 6);
+    EXPECT_EQ(ph->ScavengeIfDue(), 0);
+    EXPECT_EQ(young->location, tcmalloc::Span::ON_NORMAL_FREELIST);
+  }
+
+  ph->Delete(split);
+  ph->Delete(used1);
+  ph->Delete(used2);
+  ph->Delete(used3);
+}
+
+TEST(PageHeapTest, PartialRelease) {
+  if (!HaveSystemRelease()) {
+    return;
+  }
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetBackgroundRelease(true);
+
+  const Length kBig = kMaxPages * 16;
+  ph->Delete(ph->New(kBig));
+
+  // Make our big span the only committed free span. Its neighbors
+  // are returned, so it doesn't coalesce with anything when freed.
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff));
+  }
+  tcmalloc::Span* s = ph->New(kBig);
+  const PageID start = s->start;
+  ph->Delete(s);
+
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    const uint64_t unmapped = ph->StatsLocked().unmapped_bytes;
+
+    // Only kMaxPages in the middle of the span are released.
+    EXPECT_EQ(ph->ReleaseAtLeastNPages(1), kMaxPages);
+    EXPECT_EQ(ph->StatsLocked().unmapped_bytes,
+              unmapped + (kMaxPages << kPageShift));
+    EXPECT_EQ(ph->StatsLocked().free_bytes, (kBig - kMaxPages) << kPageShift);
+    tcmalloc::Span* head = ph->GetDescriptor(start);
+    EXPECT_EQ(head->location, tcmalloc::Span::ON_NORMAL_FREELIST);
+    tcmalloc::Span* middle = ph->GetDescriptor(head->start + head->length);
+    EXPECT_EQ(middle->location, tcmalloc::Span::ON_RETURNED_FREELIST);
+    EXPECT_EQ(middle->length, kMaxPages);
+    tcmalloc::Span* tail = ph->GetDescriptor(start + kBig - 1);
+    EXPECT_EQ(tail->location, tcmalloc::Span::ON_NORMAL_FREELIST);
+    EXPECT_EQ(tail->start, middle->start + middle->length);
+
+    // Asking for most of it releases the whole of what remains, and
+    // released pieces coalesce back.
+    EXPECT_EQ(ph->ReleaseAtLeastNPages(kBig), kBig - kMaxPages);
+    EXPECT_EQ(ph->StatsLocked().free_bytes, 0);
+    tcmalloc::Span* merged = ph->GetDescriptor(start);
+    EXPECT_EQ(merged->location, tcmalloc::Span::ON_RETURNED_FREELIST);
+    EXPECT_GE(merged->start + merged->length, start + kBig);
+  }
+}
+
+TEST(PageHeapTest, PartialReleaseAggressiveDecommit) {
+  if (!HaveSystemRelease()) {
+    return;
+  }
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetBackgroundRelease(true);
+
+  const Length kBig = kMaxPages * 16;
+  ph->Delete(ph->New(kBig));
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff));
+  }
+  tcmalloc::Span* s = ph->New(kBig);
+  const PageID start = s->start;
+  ph->Delete(s);
+
+  // Free span stays committed until we switch to aggressive
+  // decommit. Then release can't keep ends of the span committed,
+  // since they'd be decommitted when middle coalesces with them, so
+  // whole span is released and reported.
+  ph->SetAggressiveDecommit(true);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_EQ(ph->StatsLocked().free_bytes, kBig << kPageShift);
+    EXPECT_EQ(ph->ReleaseAtLeastNPages(1), kBig);
+    EXPECT_EQ(ph->StatsLocked().free_bytes, 0);
+    tcmalloc::Span* merged = ph->GetDescriptor(start);
+    EXPECT_EQ(merged->location, tcmalloc::Span::ON_RETURNED_FREELIST);
+    EXPECT_GE(merged->start + merged->length, start + kBig);
+    EXPECT_TRUE(ph->CheckExpensive());
+  }
+  ph->SetAggressiveDecommit(false);
+}
+
+TEST(PageHeapTest, LazyReleaseMerge) {
+  if (!HaveSystemRelease()) {
+    return;
+  }
+  const TCMalloc_ReleaseAdvice advice = TCMalloc_GetReleaseAdvice();
+  tcmalloc::Cleanup restore_advice{[advice] () {
+    TCMalloc_SetReleaseAdvice(advice);
+  }};
+  if (!TCMalloc_SetReleaseAdvice(TCMALLOC_RELEASE_FREE)) {
+    return;
+  }
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetBackgroundRelease(true);
+
+  tcmalloc::Span* lazy = ph->New(10);
+  tcmalloc::Span* eager = ph->New(10);
+  tcmalloc::Span* used = ph->New(1);
+  const PageID start = lazy->start;
+
+  ph->Delete(lazy);
+  uint64_t lazily_freed;
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff));
+    lazily_freed = ph->StatsLocked().lazily_freed_bytes;
+  }
+  if (lazily_freed == 0) {
+    // MADV_FREE turned out to be unsupported.
+    return;
+  }
+  EXPECT_GE(lazily_freed, 10 << kPageShift);
+
+  // Span released right away coalesces with lazily released one, and
+  // only pages of the latter still count as lazily freed.
+  ASSERT_TRUE(TCMalloc_SetReleaseAdvice(TCMALLOC_RELEASE_DONTNEED));
+  ph->Delete(eager);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff));
+    tcmalloc::Span* merged = ph->GetDescriptor(start);
+    EXPECT_EQ(merged->location, tcmalloc::Span::ON_RETURNED_FREELIST);
+    EXPECT_EQ(merged->length, 20);
+    EXPECT_EQ(merged->lazy_pages, 10);
+    EXPECT_EQ(ph->StatsLocked().lazily_freed_bytes, lazily_freed);
+    EXPECT_TRUE(ph->CheckExpensive());
+  }
+
+  ph->Delete(used);
+}
+
+TEST(PageHeapTest, BatchedRelease) {
+  if (!HaveSystemRelease()) {
+    return;
+  }
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetBackgroundRelease(true);
+
+  // Used span in between keeps free ones from coalescing.
+  tcmalloc::Span* a = ph->New(kMaxPages * 2);
+  tcmalloc::Span* used = ph->New(kMaxPages);
+  tcmalloc::Span* b = ph->New(kMaxPages * 2);
+  ph->Delete(a);
+  ph->Delete(b);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    // Spans are taken off free lists, but only released by
+    // FinishReleaseBatch.
+    ph->StartReleaseBatch();
+    EXPECT_EQ(ph->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff)),
+              kMaxPages * 4);
+    CheckStats(ph.get(), kMaxPages * 5, 0, 0);
+    ph->FinishReleaseBatch();
+    CheckStats(ph.get(), kMaxPages * 5, 0, kMaxPages * 4);
+    EXPECT_EQ(a->location, tcmalloc::Span::ON_RETURNED_FREELIST);
+    EXPECT_EQ(b->location, tcmalloc::Span::ON_RETURNED_FREELIST);
+  }
+
+  // Spans freed in aggressive decommit mode are released together,
+  // contiguous ones by a single release.
+  ph->SetAggressiveDecommit(true);
+  tcmalloc::Span* list = nullptr;
+  PageID start = std::numeric_limits<PageID>::max();
+  for (int i = 0; i < 8; i++) {
+    tcmalloc::Span* s = ph->NewArenaSpan(4);
+    ASSERT_NE(s, nullptr);
+    start = std::min(start, s->start);
+    s->next = list;
+    list = s;
+  }
+  uint64_t decommits;
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    decommits = ph->StatsLocked().decommit_count;
+  }
+  ph->DeleteArenaSpans(list);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_EQ(ph->StatsLocked().decommit_count, decommits + 1);
+    EXPECT_EQ(ph->StatsLocked().free_bytes, 0);
+    tcmalloc::Span* merged = ph->GetDescriptor(start);
+    EXPECT_EQ(merged->location, tcmalloc::Span::ON_RETURNED_FREELIST);
+    EXPECT_GE(merged->start + merged->length, start + 8 * 4);
+    EXPECT_TRUE(ph->CheckExpensive());
+  }
+
+  ph->Delete(used);
+}
+
+TEST(PageHeapTest, LargeSpanCache) {
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetBackgroundRelease(true);
+
+  const Length kBig = kMaxPages * 4;
+  ph->SetLargeCacheLimit((kBig * 2) << kPageShift);
+  ph->SetLargeCacheExpiry(60 * 1000);
+
+  tcmalloc::Span* a = ph->New(kBig);
+  tcmalloc::Span* b = ph->New(kBig);
+  const PageID a_start = a->start;
+
+  // Freed span stays whole and committed, but isn't free memory.
+  ph->Delete(a);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    CheckStats(ph.get(), kBig * 2, 0, 0);
+    EXPECT_EQ(ph->StatsLocked().large_cache_bytes, kBig << kPageShift);
+  }
+
+  // Slightly shorter allocation takes it, and the rest is freed.
+  a = ph->New(kBig - 8);
+  EXPECT_EQ(a->start, a_start);
+  EXPECT_EQ(a->length, kBig - 8);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    CheckStats(ph.get(), kBig * 2, 8, 0);
+    EXPECT_EQ(ph->StatsLocked().large_cache_bytes, 0);
+    EXPECT_EQ(ph->StatsLocked().large_cache_hits, 1);
+  }
+
+  // Much shorter allocation doesn't.
+  ph->Delete(a);
+  tcmalloc::Span* c = ph->New(kBig / 2);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    // Allocations of a and b missed too.
+    EXPECT_EQ(ph->StatsLocked().large_cache_misses, 3);
+    EXPECT_EQ(ph->StatsLocked().large_cache_bytes, (kBig - 8) << kPageShift);
+  }
+
+  // Over the limit, oldest span is freed for real.
+  ph->Delete(b);
+  ph->Delete(c);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    CheckStats(ph.get(), kBig * 5 / 2, kBig, 0);
+    EXPECT_EQ(ph->StatsLocked().large_cache_bytes,
+              (kBig + kBig / 2) << kPageShift);
+    EXPECT_TRUE(ph->CheckExpensive());
+
+    // Expired spans are freed by periodic calls.
+    ph->SetLargeCacheExpiry(0);
+    ph->ScavengeIfDue();
+    tcmalloc::PageHeap::Stats stats = ph->StatsLocked();
+    EXPECT_EQ(stats.large_cache_bytes, 0);
+    EXPECT_EQ(stats.free_bytes + stats.unmapped_bytes,
+              (kBig * 5 / 2) << kPageShift);
+    ph->SetLargeCacheExpiry(60 * 1000);
+  }
+
+  // Explicit release empties the cache.
+  ph->Delete(ph->New(kBig));
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_EQ(ph->StatsLocked().large_cache_bytes, kBig << kPageShift);
+    ph->ReleaseAtLeastNPages(1);
+    EXPECT_EQ(ph->StatsLocked().large_cache_bytes, 0);
+    EXPECT_TRUE(ph->CheckExpensive());
+  }
+}
+
+TEST(PageHeapTest, LargeSpanIndex) {
+  constexpr int kCount = 4096;
+  std::vector<tcmalloc::Span> spans(kCount);
+  std::minstd_rand rng(1);
+  tcmalloc::LargeSpanIndex index;
+
+  // Brute-force best fit over spans still in the index.
+  auto expected = [&] (Length n) {
+    Length best = 0;
+    for (const tcmalloc::Span& s : spans) {
+      if (s.indexed && s.length >= n && (best == 0 || s.length < best)) {
+        best = s.length;
+      }
+    }
+    return best;
+  };
+  auto check = [&] (Length n) {
+    tcmalloc::Span* fit = index.BestFit(n);
+    Length want = expected(n);
+    if (want == 0) {
+      EXPECT_EQ(fit, nullptr);
+    } else {
+      ASSERT_NE(fit, nullptr);
+      EXPECT_TRUE(fit->indexed);
+      EXPECT_EQ(fit->length, want) << "n = " << n;
+    }
+  };
+
+  // Mix of many equal lengths and lengths spread over several bins.
+  PageID start = 1 << 20;
+  for (int i = 0; i < kCount; i++) {
+    Length len = (i % 4 == 0) ? kMaxPages + 1 + (rng() % 4)
+                              : kMaxPages + 1 + (rng() % (kMaxPages << (rng() % 6)));
+    spans[i].start = start;
+    spans[i].length = len;
+    start += len + 1;
+    index.Insert(&spans[i]);
+  }
+  EXPECT_FALSE(index.empty());
+
+  for (int i = 0; i < 200; i++) {
+    check(kMaxPages + 1 + (rng() % (kMaxPages << 5)));
+  }
+  check(1);
+  check(std::numeric_limits<Length>::max() / 2);
+
+  int visited = 0;
+  index.ForEach([&] (tcmalloc::Span* s) {
+    EXPECT_TRUE(s->indexed);
+    visited++;
+    return false;
+  });
+  EXPECT_EQ(visited, kCount);
+
+  // Remove in random order, including whatever BestFit returns, and
+  // re-check the rest as we go.
+  std::vector<int> order(kCount);
+  for (int i = 0; i < kCount; i++) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), rng);
+  for (int i = 0; i < kCount; i++) {
+    tcmalloc::Span* s = &spans[order[i]];
+    if (!s->indexed) {
+      continue;
+    }
+    index.Remove(s);
+    EXPECT_FALSE(s->indexed);
+    if (i % 16 == 0) {
+      tcmalloc::Span* fit = index.BestFit(s->length);
+      if (fit != nullptr) {
+        index.Remove(fit);
+      }
+      check(s->length);
+      check(kMaxPages + 1);
+    }
+  }
+  EXPECT_TRUE(index.empty());
+  EXPECT_EQ(index.BestFit(kMaxPages + 1), nullptr);
+}
+
 // The number of kMaxPages-sized Spans we will allocate and free during the
 // tests.
 // We will also do twice this many kMaxPages/2-sized ones.
@@ -176,6 +906,15 @@ TEST(PageHeapTest, Limit) {
 
   ASSERT_EQ(kMaxPages, 1 << (20 - kPageShift));
 
+  // Growing the heap for the first time allocates its page map leaf,
+  // which counts towards the limit too. Get that out of the way
+  // before detecting the limit, leaving no free pages behind.
+  if (HaveSystemRelease()) {
+    ph->Delete(ph->New(kMaxPages));
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff));
+  }
+
   // We do not know much is taken from the system for other purposes,
   // so we detect the proper limit:
   {
@@ -261,3 +1000,71 @@ TEST(PageHeapTest, Limit) {
     }
   }
 }
+
+TEST(PageHeapTest, LimitWithConcurrentRelease) {
+  if (!HaveSystemRelease()) {
+    return;
+  }
+
+  tcmalloc::Cleanup restore_heap_limit_flag{[] () {
+    FLAGS_tcmalloc_heap_limit_mb = 0;
+  }};
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetBackgroundRelease(true);
+
+  // Get page map leaf allocation out of the way, as in Limit test.
+  ph->Delete(ph->New(kMaxPages));
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff));
+  }
+  FLAGS_tcmalloc_heap_limit_mb = (TCMalloc_SystemTaken >> 20) + 32;
+
+  std::vector<tcmalloc::Span*> used;
+  for (int iter = 0; iter < 20; iter++) {
+    // Fill the heap up to the limit, and free every other span, so
+    // that only their release makes room for more.
+    while (tcmalloc::Span* s = ph->New(kMaxPages)) {
+      used.push_back(s);
+    }
+    ASSERT_GE(used.size(), 2);
+    std::vector<tcmalloc::Span*> kept;
+    for (size_t i = 0; i < used.size(); i++) {
+      if (i % 2 == 0) {
+        ph->Delete(used[i]);
+      } else {
+        kept.push_back(used[i]);
+      }
+    }
+    used.swap(kept);
+
+    std::atomic<bool> go{false};
+    tcmalloc::Span* got = nullptr;
+    std::thread allocator([&] () {
+      while (!go.load()) {
+        std::this_thread::yield();
+      }
+      got = ph->New(kMaxPages);
+    });
+    {
+      SpinLockHolder l(ph->pageheap_lock());
+      ph->StartReleaseBatch();
+      ph->ReleaseAtLeastNPages(static_cast<Length>(0x7fffffff));
+      go = true;
+      // Give allocator time to wait for the lock, so that it likely
+      // gets it while FinishReleaseBatch has it dropped.
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      ph->FinishReleaseBatch();
+    }
+    allocator.join();
+    // Queued spans are as good as released, so there is room whether
+    // allocation ran during release or after it.
+    ASSERT_NE(got, nullptr);
+    used.push_back(got);
+  }
+
+  for (tcmalloc::Span* s : used) {
+    ph->Delete(s);
+  }
+}
@@ -145,6 +145,37 @@ void TestNext(const char* name) {
   ASSERT_EQ(map.Next(103), nullptr);
 }
 
+// REQUIRES: BITS==10
+template <class Type>
+void TestSizeClass(const char* name) {
+  printf("Running SizeClassTest %s\n", name);
+  Type map(malloc);
+
+  // Nothing is known about pages that were never ensured, including
+  // out of range ones.
+  ASSERT_EQ(map.get_sizeclass(0), 0);
+  ASSERT_EQ(map.get_sizeclass(1 << 10), 0);
+  ASSERT_EQ(map.get_sizeclass(1 << 30), 0);
+
+  map.Ensure(100, 8);
+  for (int i = 100; i < 108; i++) {
+    ASSERT_EQ(map.get_sizeclass(i), 0);
+    map.set_sizeclass(i, i);
+  }
+  map.set(100, &map);
+  for (int i = 100; i < 108; i++) {
+    ASSERT_EQ(map.get_sizeclass(i), i);
+  }
+  // Size classes and values don't step on each other.
+  ASSERT_EQ(map.get(100), &map);
+  ASSERT_EQ(map.get(101), nullptr);
+  ASSERT_EQ(map.Next(101), nullptr);
+
+  map.set_sizeclass(103, 0);
+  ASSERT_EQ(map.get_sizeclass(103), 0);
+  ASSERT_EQ(map.get_sizeclass(104), 104);
+}
+
 TEST(PageMapTest, Everything) {
   ASSERT_NO_FATAL_FAILURE(TestMap<TCMalloc_PageMap1<10>>(100, true));
   ASSERT_NO_FATAL_FAILURE(TestMap<TCMalloc_PageMap1<10>>(1 << 10, false));
@@ -156,4 +187,8 @@ TEST(PageMapTest, Everything) {
   ASSERT_NO_FATAL_FAILURE(TestNext<TCMalloc_PageMap1<10>>("PageMap1"));
   ASSERT_NO_FATAL_FAILURE(TestNext<TCMalloc_PageMap2<10>>("PageMap2"));
   ASSERT_NO_FATAL_FAILURE(TestNext<TCMalloc_PageMap3<10>>("PageMap3"));
+
+  ASSERT_NO_FATAL_FAILURE(TestSizeClass<TCMalloc_PageMap1<10>>("PageMap1"));
+  ASSERT_NO_FATAL_FAILURE(TestSizeClass<TCMalloc_PageMap2<10>>("PageMap2"));
+  ASSERT_NO_FATAL_FAILURE(TestSizeClass<TCMalloc_PageMap3<10>>("PageMap3"));
 }
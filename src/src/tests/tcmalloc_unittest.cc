@@ -80,6 +80,7 @@
 #include <algorithm>
 #include <array>
 #include <functional>
+#include <memory_resource>
 #include <mutex>
 #include <new>
 #include <sstream>
@@ -100,8 +101,10 @@
 #define HAVE_FORK_TESTING_SUPPORT
 #endif // __linux__ && __x86_64__
 
+#include "gperftools/arena.h"
 #include "gperftools/malloc_hook.h"
 #include "gperftools/malloc_extension.h"
+#include "gperftools/malloc_extension_c.h"
 #include "gperftools/nallocx.h"
 #include "gperftools/tcmalloc.h"
 
@@ -993,6 +996,13 @@ TEST(TCMallocTest, ReleaseToSystem) {
 
   if(!TestingPortal::Get()->HaveSystemRelease()) return;
 
+  // Hugepage-aware page heap grows heap by whole hugepages, so exact
+  // span layouts this test relies on don't hold.
+  size_t hugepage_aware = 0;
+  MallocExtension::instance()->GetNumericProperty("tcmalloc.hugepage_aware",
+                                                  &hugepage_aware);
+  if (hugepage_aware) return;
+
   tcmalloc::Cleanup restore_release_rate = ([] () {
     auto ex = MallocExtension::instance();
     double old = ex->GetMemoryReleaseRate();
@@ -1129,6 +1139,49 @@ TEST(TCMallocTest, AggressiveDecommit) {
   printf("Done testing aggressive de-commit\n");
 }
 
+TEST(TCMallocTest, LazyRelease) {
+  if(TestingPortal::Get()->IsDebuggingMalloc() || !TestingPortal::Get()->HaveSystemRelease()) {
+    return;
+  }
+
+  static constexpr char kAdvice[] = "tcmalloc.release_advice";
+  auto ex = MallocExtension::instance();
+  size_t old_advice;
+  ASSERT_TRUE(ex->GetNumericProperty(kAdvice, &old_advice));
+  // Platforms without madvise only support "dontneed" advice.
+  if (!ex->SetNumericProperty(kAdvice, 1)) {
+    return;
+  }
+  tcmalloc::Cleanup restore_advice{[ex, old_advice] () {
+    ex->SetNumericProperty(kAdvice, old_advice);
+  }};
+  tcmalloc::Cleanup decommit_cleanup = kAggressiveDecommit.Override(0);
+
+  auto get_lazily_freed = [ex] () {
+    size_t bytes;
+    CHECK(ex->GetNumericProperty("tcmalloc.pageheap_lazily_freed_bytes", &bytes));
+    return bytes;
+  };
+
+  static const int MB = 1048576;
+  void* a = noopt(malloc(MB));
+  memset(a, 1, MB);
+  ex->ReleaseFreeMemory();
+  const size_t starting_bytes = get_lazily_freed();
+
+  free(a);
+  ex->ReleaseFreeMemory();
+
+  size_t advice;
+  ASSERT_TRUE(ex->GetNumericProperty(kAdvice, &advice));
+  if (advice != 1) {
+    // Kernel doesn't support MADV_FREE, and we fell back to dontneed.
+    return;
+  }
+  EXPECT_GE(get_lazily_freed(), starting_bytes + MB);
+  EXPECT_LE(get_lazily_freed(), GetUnmappedBytes());
+}
+
 // On MSVC10, in release mode, the optimizer convinces itself
 // g_no_memory is never changed (I guess it doesn't realize OnNoMemory
 // might be called).  Work around this by setting the var volatile.
@@ -1271,6 +1324,353 @@ TEST(TCMallocTest, NAllocXAlignment) {
   }
 }
 
+TEST(TCMallocTest, MallocAtLeast) {
+  const bool debugging = TestingPortal::Get()->IsDebuggingMalloc();
+  for (size_t size = 0; size <= (1 << 20); size = GrowNallocxTestSize(size)) {
+    tc_sized_ptr_t r = tc_malloc_at_least(size);
+    ASSERT_NE(r.p, nullptr);
+    ASSERT_GE(r.n, size);
+    ASSERT_EQ(r.n, MallocExtension::instance()->GetAllocatedSize(r.p));
+    if (!debugging) {
+      ASSERT_EQ(r.n, nallocx(size, 0));
+    }
+    // Whole usable size is ours.
+    memset(r.p, 0x5a, r.n);
+    free(r.p);
+
+    r = tc_new_at_least(size);
+    ASSERT_NE(r.p, nullptr);
+    ASSERT_EQ(r.n, MallocExtension::instance()->GetAllocatedSize(r.p));
+    memset(r.p, 0x5a, r.n);
+    (::operator delete)(r.p);
+  }
+
+  tc_sized_ptr_t r = tc_malloc_at_least(kTooBig);
+  ASSERT_EQ(r.p, nullptr);
+  ASSERT_EQ(r.n, 0);
+  ASSERT_THROW(tc_new_at_least(kTooBig), std::bad_alloc);
+}
+
+TEST(TCMallocTest, ReallocInPlace) {
+  if (TestingPortal::Get()->IsDebuggingMalloc()) {
+    // Debug realloc always moves.
+    char* p = static_cast<char*>(malloc(100));
+    ASSERT_EQ(tc_try_realloc_in_place(p, 200), 0);
+    free(p);
+    return;
+  }
+
+  // Small objects only "resize" within their size class.
+  char* p = static_cast<char*>(malloc(10));
+  ASSERT_EQ(tc_try_realloc_in_place(p, 8), 1);
+  ASSERT_EQ(tc_try_realloc_in_place(p, nallocx(10, 0)), 1);
+  ASSERT_EQ(tc_try_realloc_in_place(p, 1 << 20), 0);
+  free(p);
+
+  // Shrinking large allocation gives back its tail, which makes room
+  // to grow again.
+  const size_t kLarge = 4 << 20;
+  p = static_cast<char*>(malloc(kLarge));
+  memset(p, 0x5a, kLarge);
+  ASSERT_EQ(tc_try_realloc_in_place(p, kLarge / 4), 1);
+  ASSERT_EQ(MallocExtension::instance()->GetAllocatedSize(p), nallocx(kLarge / 4, 0));
+  ASSERT_EQ(tc_try_realloc_in_place(p, kLarge / 2), 1);
+  ASSERT_EQ(MallocExtension::instance()->GetAllocatedSize(p), nallocx(kLarge / 2, 0));
+
+  // And realloc grows it in place too.
+  char* q = static_cast<char*>(noopt(realloc(p, kLarge)));
+  ASSERT_EQ(q, p);
+  ASSERT_EQ(MallocExtension::instance()->GetAllocatedSize(q), nallocx(kLarge, 0));
+  // Only the part that was never given back is preserved.
+  for (size_t i = 0; i < kLarge / 4; i++) {
+    ASSERT_EQ(q[i], 0x5a);
+  }
+  memset(q, 0x5b, kLarge);
+
+  // Memory past some other allocation is not free.
+  char* blocker = static_cast<char*>(malloc(kLarge));
+  p = static_cast<char*>(malloc(kLarge));
+  char* after = static_cast<char*>(malloc(kLarge));
+  if (after == p + nallocx(kLarge, 0)) {
+    ASSERT_EQ(tc_try_realloc_in_place(p, 2 * kLarge), 0);
+    ASSERT_EQ(MallocExtension::instance()->GetAllocatedSize(p), nallocx(kLarge, 0));
+  }
+  free(after);
+  free(p);
+  free(blocker);
+  free(q);
+}
+
+TEST(TCMallocTest, MallocBatch) {
+  // Small counts go through thread cache, larger ones (above any
+  // size class batch size) go straight to central free lists, and
+  // last size is above kMaxSize.
+  for (size_t size : {8, 48, 1000, 8192, 300 << 10}) {
+    for (size_t count : {0, 1, 7, 100, 1000}) {
+      std::vector<void*> ptrs(count);
+      ASSERT_EQ(tc_malloc_batch(size, ptrs.data(), count), count);
+
+      std::vector<void*> sorted(ptrs);
+      std::sort(sorted.begin(), sorted.end());
+      ASSERT_EQ(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+      for (size_t i = 0; i < count; i++) {
+        ASSERT_NE(ptrs[i], nullptr);
+        if (!TestingPortal::Get()->IsDebuggingMalloc()) {
+          ASSERT_GE(MallocExtension::instance()->GetAllocatedSize(ptrs[i]), size);
+        }
+        memset(ptrs[i], 0x5a, size);
+      }
+
+      // Mix in nulls and objects freed by regular free.
+      if (count > 2) {
+        free(ptrs[0]);
+        ptrs[0] = nullptr;
+      }
+      tc_free_batch(size, ptrs.data(), count);
+    }
+  }
+
+  SetNewHook();
+  SetDeleteHook();
+  tcmalloc::Cleanup unhook{[] () {
+    ResetNewHook();
+    ResetDeleteHook();
+  }};
+
+  void* ptrs[64];
+  ASSERT_EQ(tc_malloc_batch(32, ptrs, 64), 64);
+  ASSERT_EQ(g_NewHook_calls, 64);
+  VerifyNewHookWasCalled();
+  tc_free_batch(32, ptrs, 64);
+  ASSERT_EQ(g_DeleteHook_calls, 64);
+  VerifyDeleteHookWasCalled();
+}
+
+TEST(TCMallocTest, Arena) {
+  tc_arena_t* arena = tc_arena_create();
+  ASSERT_NE(arena, nullptr);
+  ASSERT_EQ(tc_arena_allocated_bytes(arena), 0);
+
+  // Enough small objects to take several chunks, and some big ones
+  // that get chunks of their own.
+  std::vector<std::pair<char*, size_t>> objects;
+  size_t total = 0;
+  for (int i = 0; i < 20000; i++) {
+    size_t size = (i % 1000 == 999) ? (1 << 20) + i : 1 + i % 200;
+    char* p = static_cast<char*>(tc_arena_malloc(arena, size));
+    ASSERT_NE(p, nullptr);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(p) % 8, 0);
+    memset(p, i & 0xff, size);
+    objects.emplace_back(p, size);
+    total += size;
+  }
+  for (size_t align : {64, 4096, 1 << 20}) {
+    void* p = tc_arena_memalign(arena, align, 100);
+    ASSERT_NE(p, nullptr);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(p) % align, 0);
+    total += 100;
+  }
+  ASSERT_EQ(tc_arena_allocated_bytes(arena), total);
+
+  // Nothing overlaps.
+  for (size_t i = 0; i < objects.size(); i++) {
+    for (size_t j = 0; j < objects[i].second; j++) {
+      ASSERT_EQ(objects[i].first[j], static_cast<char>(i & 0xff));
+    }
+  }
+
+  // free() of arena memory is ignored. Debug allocator cannot tell
+  // it apart from corrupted chunk.
+  if (!TestingPortal::Get()->IsDebuggingMalloc()) {
+    free(objects[5].first);
+    free(objects[999].first);
+    ASSERT_EQ(objects[5].first[0], 5);
+  }
+
+  tc_arena_destroy(arena);
+}
+
+TEST(TCMallocTest, ArenaResource) {
+  tcmalloc::ArenaResource resource;
+  {
+    std::pmr::vector<std::pmr::string> strings(&resource);
+    for (int i = 0; i < 10000; i++) {
+      strings.emplace_back(std::to_string(i) + std::string(50, 'x'));
+    }
+    for (int i = 0; i < 10000; i++) {
+      ASSERT_EQ(std::string(strings[i]), std::to_string(i) + std::string(50, 'x'));
+    }
+  }
+  ASSERT_GT(resource.allocated_bytes(), 10000 * 50);
+
+  resource.release();
+  ASSERT_EQ(resource.allocated_bytes(), 0);
+
+  // Resource is reusable after release.
+  std::pmr::vector<int> ints(1000, 7, &resource);
+  ASSERT_EQ(ints[999], 7);
+}
+
+TEST(TCMallocTest, NumaPartitions) {
+  TestingPortal* portal = TestingPortal::Get();
+  if (!portal->ForceNumaPartition(-1)) {
+    puts("NUMA awareness is not active. Skipping.");
+    return;
+  }
+  tcmalloc::Cleanup unforce{[portal] () {
+    portal->ForceNumaPartition(-1);
+  }};
+
+  for (int partition : {1, 0}) {
+    ASSERT_TRUE(portal->ForceNumaPartition(partition));
+    std::vector<void*> ptrs;
+    // Small objects, and page-level allocations both below and above
+    // kMaxPages.
+    for (size_t size : {8, 1000, 64 << 10, 2 << 20}) {
+      for (int i = 0; i < 16; i++) {
+        void* ptr = noopt(malloc(size));
+        ASSERT_NE(ptr, nullptr);
+        memset(ptr, 0x5a, size);
+        ASSERT_EQ(portal->GetNumaPartition(ptr), partition) << "size " << size;
+        ptrs.push_back(ptr);
+      }
+    }
+    for (void* ptr : ptrs) {
+      free(ptr);
+    }
+  }
+
+  // Stats must show per partition breakdown.
+  std::string stats(1 << 16, '\0');
+  MallocExtension::instance()->GetStats(stats.data(), stats.size());
+  ASSERT_NE(strstr(stats.c_str(), "partition 1:"), nullptr);
+}
+
+TEST(TCMallocTest, HeapPartitions) {
+  MallocExtension* ext = MallocExtension::instance();
+  TestingPortal* portal = TestingPortal::Get();
+  // Sampled allocations always come from the default heap.
+  tcmalloc::Cleanup sampling_cleanup = SetFlag(&portal->GetSampleParameter(), 0);
+  tcmalloc::Cleanup restore{[ext] () {
+    ext->SetThreadHeapPartition(0);
+    ext->SetHeapPartitionLimit(1, 0);
+  }};
+
+  ASSERT_FALSE(ext->SetThreadHeapPartition(256));
+  ASSERT_FALSE(ext->SetThreadHeapPartition(-1));
+  ASSERT_FALSE(ext->SetHeapPartitionLimit(0, 1 << 20));
+  ASSERT_EQ(ext->GetThreadHeapPartition(), 0);
+
+  // Allocations follow partition of the thread, and other threads
+  // keep using the default heap. Objects can be freed by any thread.
+  ASSERT_TRUE(ext->SetThreadHeapPartition(1));
+  ASSERT_EQ(ext->GetThreadHeapPartition(), 1);
+  std::vector<void*> ptrs;
+  for (size_t size : {8, 1000, 64 << 10, 2 << 20}) {
+    for (int i = 0; i < 64; i++) {
+      void* ptr = noopt(malloc(size));
+      ASSERT_NE(ptr, nullptr);
+      memset(ptr, 0x5a, size);
+      ASSERT_EQ(portal->GetHeapPartition(ptr), 1) << "size " << size;
+      ASSERT_GE(ext->GetAllocatedSize(ptr), size);
+      ptrs.push_back(ptr);
+    }
+    std::thread([size] () {
+      ASSERT_EQ(MallocExtension::instance()->GetThreadHeapPartition(), 0);
+      void* other = noopt(malloc(size));
+      ASSERT_EQ(TestingPortal::Get()->GetHeapPartition(other), 0) << "size " << size;
+      free(other);
+    }).join();
+  }
+  std::thread([&ptrs] () {
+    for (size_t i = 0; i < ptrs.size(); i += 2) {
+      free(ptrs[i]);
+    }
+  }).join();
+  for (size_t i = 1; i < ptrs.size(); i += 2) {
+    free(ptrs[i]);
+  }
+
+  // Page-level allocations stay in partition when resized or aligned.
+  void* grown = noopt(realloc(noopt(malloc(1 << 20)), 4 << 20));
+  ASSERT_EQ(portal->GetHeapPartition(grown), 1);
+  free(grown);
+  void* aligned = nullptr;
+  ASSERT_EQ(posix_memalign(&aligned, 64 << 10, 100 << 10), 0);
+  ASSERT_EQ(portal->GetHeapPartition(aligned), 1);
+  free(aligned);
+
+  // Partitions 1 and 2 are separate heaps.
+  ASSERT_TRUE(ext->SetThreadHeapPartition(2));
+  void* second = noopt(malloc(100));
+  ASSERT_EQ(portal->GetHeapPartition(second), 2);
+  ASSERT_TRUE(ext->SetThreadHeapPartition(1));
+  free(second);
+
+  MallocExtension::HeapPartitionStats stats;
+  ASSERT_FALSE(ext->GetHeapPartitionStats(0, &stats));
+  ASSERT_TRUE(ext->GetHeapPartitionStats(200, &stats));
+  ASSERT_EQ(stats.system_bytes, 0);
+
+  std::string text(1 << 16, '\0');
+  ext->GetStats(text.data(), text.size());
+  ASSERT_NE(strstr(text.c_str(), "Tenant heap partitions"), nullptr);
+  ASSERT_NE(strstr(text.c_str(), "partition 2:"), nullptr);
+
+  if (portal->IsDebuggingMalloc() || !portal->HaveSystemRelease()) {
+    // Debug allocator keeps freed objects for a while, and we need to
+    // release memory to check limits.
+    return;
+  }
+  tcmalloc::Cleanup release_rate_cleanup = SetFlag(&portal->GetReleaseRate(), 0);
+
+  // Releasing returns cached objects to the page heap first, so
+  // partition ends up with no free memory.
+  ext->ReleasePartitionFreeMemory(1);
+  ASSERT_TRUE(ext->GetHeapPartitionStats(1, &stats));
+  ASSERT_GT(stats.system_bytes, 0);
+  ASSERT_EQ(stats.free_bytes, 0);
+
+  // Partition limit doesn't let partition 1 grow, but other
+  // partitions are unaffected.
+  const size_t limit = stats.system_bytes - stats.unmapped_bytes + (32 << 20);
+  ASSERT_TRUE(ext->SetHeapPartitionLimit(1, limit));
+  ASSERT_TRUE(ext->GetHeapPartitionStats(1, &stats));
+  ASSERT_LE(stats.limit_bytes, limit);
+  ASSERT_GT(stats.limit_bytes, limit - (1 << 20));
+
+  void* small = noopt(malloc(16 << 20));
+  ASSERT_NE(small, nullptr);
+  ASSERT_TRUE(ext->GetHeapPartitionStats(1, &stats));
+  const size_t unmapped_before = stats.unmapped_bytes;
+  ASSERT_EQ(noopt(malloc(64 << 20)), nullptr);
+  ext->SetThreadHeapPartition(2);
+  void* other = noopt(malloc(64 << 20));
+  ASSERT_NE(other, nullptr);
+  free(other);
+  ext->SetThreadHeapPartition(0);
+  other = noopt(malloc(64 << 20));
+  ASSERT_NE(other, nullptr);
+  free(other);
+
+  // Freed memory of partition 1 is kept for it (or already unmapped
+  // under aggressive decommit), and is released separately.
+  free(small);
+  ASSERT_TRUE(ext->GetHeapPartitionStats(1, &stats));
+  ASSERT_GE(stats.free_bytes + stats.unmapped_bytes - unmapped_before,
+            16 << 20);
+  ext->ReleasePartitionFreeMemory(1);
+  ASSERT_TRUE(ext->GetHeapPartitionStats(1, &stats));
+  ASSERT_EQ(stats.free_bytes, 0);
+
+  ASSERT_TRUE(ext->SetHeapPartitionLimit(1, 0));
+  ext->SetThreadHeapPartition(1);
+  void* big = noopt(malloc(64 << 20));
+  ASSERT_NE(big, nullptr);
+  free(big);
+}
+
 struct NewHandlerHelper {
   NewHandlerHelper(NewHandlerHelper* prev) : prev(prev) {
     memset(filler, 0, sizeof(filler));
@@ -1667,10 +2067,10 @@ TEST(TCMallocTest, EmergencyMalloc) {
 
   SetNewHook();
   SetDeleteHook();
-  tcmalloc::Cleanup unhook([] () {
+  tcmalloc::Cleanup unhook{[] () {
     ResetNewHook();
     ResetDeleteHook();
-  });
+  }};
 
   void* p1 = noopt(tc_malloc)(32);
   void* p2 = nullptr;
@@ -1740,10 +2140,10 @@ TEST(TCMallocTest, EmergencyMallocNoHook) {
 
   SetNewHook();
   SetDeleteHook();
-  tcmalloc::Cleanup unhook([] () {
+  tcmalloc::Cleanup unhook{[] () {
     ResetNewHook();
     ResetDeleteHook();
-  });
+  }};
 
   // Emergency malloc automagically does the right thing for free()
   // calls and doesn't invoke hooks.
@@ -1985,6 +2385,20 @@ static void ReSpawnWithEnv(EnvProperty::env_override_fn env_override) {
 //
 // * TCMALLOC_ENABLE_SIZED_DELETE = t (note, this one is no-op in most
 //     common builds)
+//
+// * TCMALLOC_PERCPU_CACHE = t (falls back to thread caches where
+//     current cpu cannot be queried)
+//
+// * TCMALLOC_PERCPU_CACHE = t and TCMALLOC_PERCPU_RSEQ = f (per-cpu
+//     slabs guarded by spinlocks even where rseq works)
+//
+// * TCMALLOC_NUMA_AWARE = t and TCMALLOC_NUMA_FAKE_NODES = 2
+//
+// * TCMALLOC_HUGEPAGE_AWARE = t
+//
+// * TCMALLOC_RELEASE_ADVICE = hybrid
+//
+// * TCMALLOC_BITMAP_SPANS = t
 void HandleVariableRuns(int argc, char** argv) {
   if (argc != 1) {
     return;
@@ -1997,6 +2411,13 @@ void HandleVariableRuns(int argc, char** argv) {
   static constexpr EnvProperty kAggressiveDecommitEnv{"TCMALLOC_AGGRESSIVE_DECOMMIT"};
   static constexpr EnvProperty kHeapLimitEnv{"TCMALLOC_HEAP_LIMIT_MB"};
   static constexpr EnvProperty kEnableSizedDeleteEnv{"TCMALLOC_ENABLE_SIZED_DELETE"};
+  static constexpr EnvProperty kPerCpuCacheEnv{"TCMALLOC_PERCPU_CACHE"};
+  static constexpr EnvProperty kPerCpuRseqEnv{"TCMALLOC_PERCPU_RSEQ"};
+  static constexpr EnvProperty kNumaAwareEnv{"TCMALLOC_NUMA_AWARE"};
+  static constexpr EnvProperty kNumaFakeNodesEnv{"TCMALLOC_NUMA_FAKE_NODES"};
+  static constexpr EnvProperty kHugePageAwareEnv{"TCMALLOC_HUGEPAGE_AWARE"};
+  static constexpr EnvProperty kReleaseAdviceEnv{"TCMALLOC_RELEASE_ADVICE"};
+  static constexpr EnvProperty kBitmapSpansEnv{"TCMALLOC_BITMAP_SPANS"};
 
   if (!kMarker.Get().empty()) {
     return; // We're unitttest child
@@ -2036,6 +2457,44 @@ void HandleVariableRuns(int argc, char** argv) {
     kMarker.Set(overrides, "_");
   });
 
+  ReSpawnWithEnv([] (override_set* overrides) {
+    kEnableSizedDeleteEnv.Set(overrides, "");
+    kPerCpuCacheEnv.SetAndPrint(overrides, "t");
+    kMarker.Set(overrides, "_");
+  });
+
+  ReSpawnWithEnv([] (override_set* overrides) {
+    kPerCpuRseqEnv.SetAndPrint(overrides, "f");
+    kMarker.Set(overrides, "_");
+  });
+
+  ReSpawnWithEnv([] (override_set* overrides) {
+    kPerCpuCacheEnv.Set(overrides, "");
+    kPerCpuRseqEnv.Set(overrides, "");
+    kNumaAwareEnv.SetAndPrint(overrides, "t");
+    kNumaFakeNodesEnv.SetAndPrint(overrides, "2");
+    kMarker.Set(overrides, "_");
+  });
+
+  ReSpawnWithEnv([] (override_set* overrides) {
+    kNumaAwareEnv.Set(overrides, "");
+    kNumaFakeNodesEnv.Set(overrides, "");
+    kHugePageAwareEnv.SetAndPrint(overrides, "t");
+    kMarker.Set(overrides, "_");
+  });
+
+  ReSpawnWithEnv([] (override_set* overrides) {
+    kHugePageAwareEnv.Set(overrides, "");
+    kReleaseAdviceEnv.SetAndPrint(overrides, "hybrid");
+    kMarker.Set(overrides, "_");
+  });
+
+  ReSpawnWithEnv([] (override_set* overrides) {
+    kReleaseAdviceEnv.Set(overrides, "");
+    kBitmapSpansEnv.SetAndPrint(overrides, "t");
+    kMarker.Set(overrides, "_");
+  });
+
   exit(0);
 }
 
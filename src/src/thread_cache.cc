@@ -44,6 +44,7 @@
 #include "base/spinlock.h"              // for SpinLockHolder
 #include "central_freelist.h"
 #include "getenv_safe.h"                // for TCMallocGetenvSafe
+#include "heap_partition.h"
 #include "tcmalloc_internal.h"
 #include "thread_cache_ptr.h"
 
@@ -68,6 +69,7 @@ volatile size_t ThreadCache::per_thread_cache_size_ = kMaxThreadCacheSize;
 std::atomic<size_t> ThreadCache::min_per_thread_cache_size_ = kMinThreadCacheSize;
 size_t ThreadCache::overall_thread_cache_size_ = kDefaultOverallThreadCacheSize;
 ssize_t ThreadCache::unclaimed_cache_space_ = kDefaultOverallThreadCacheSize;
+uint64_t ThreadCache::rebalanced_bytes_;
 PageHeapAllocator<ThreadCache> threadcache_allocator;
 ThreadCache* ThreadCache::thread_heaps_;
 int ThreadCache::thread_heap_count_;
@@ -77,6 +79,14 @@ ThreadCache::ThreadCache() {
   ASSERT(Static::pageheap_lock()->IsHeld());
 
   size_ = 0;
+  idle_check_size_ = -1;
+  underflows_ = 0;
+  overflows_ = 0;
+  prev_misses_ = 0;
+  window_misses_ = 0;
+
+  partition_ = HeapPartition::ThreadPartition();
+  central_ = partition_ ? partition_->central_cache() : Static::central_cache();
 
   max_size_ = 0;
   IncreaseCacheLimitLocked();
@@ -106,6 +116,19 @@ ThreadCache::ThreadCache() {
 
 ThreadCache::~ThreadCache() {
   // Put unused memory back into central cache
+  ReleaseAll();
+}
+
+void ThreadCache::SetPartition(HeapPartition* p) {
+  if (p == partition_) {
+    return;
+  }
+  ReleaseAll();
+  partition_ = p;
+  central_ = p ? p->central_cache() : Static::central_cache();
+}
+
+void ThreadCache::ReleaseAll() {
   for (uint32_t cl = 0; cl < Static::num_size_classes(); ++cl) {
     if (list_[cl].length() > 0) {
       ReleaseToCentralCache(&list_[cl], cl, list_[cl].length());
@@ -120,10 +143,11 @@ void* ThreadCache::FetchFromCentralCache(uint32_t cl, int32_t byte_size,
   FreeList* list = &list_[cl];
   ASSERT(list->empty());
   const int batch_size = Static::sizemap()->num_objects_to_move(cl);
+  underflows_++;
 
   const int num_to_move = std::min<int>(list->max_length(), batch_size);
   void *start, *end;
-  int fetch_count = Static::central_cache()[cl].RemoveRange(
+  int fetch_count = central_[cl].RemoveRange(
       &start, &end, num_to_move);
 
   if (fetch_count == 0) {
@@ -158,8 +182,50 @@ void* ThreadCache::FetchFromCentralCache(uint32_t cl, int32_t byte_size,
   return start;
 }
 
+int ThreadCache::AllocateBatch(uint32_t cl, void** batch, int N) {
+  FreeList* list = &list_[cl];
+  int count = std::min<int>(N, list->length());
+  if (count > 0) {
+    void *start, *end;
+    list->PopRange(count, &start, &end);
+    size_ -= count * list->object_size();
+    for (int i = 0; i < count; i++) {
+      batch[i] = start;
+      start = SLL_Next(start);
+    }
+  }
+  if (count < N) {
+    count += central_[cl].RemoveBatch(batch + count, N - count);
+  }
+  return count;
+}
+
+void ThreadCache::DeallocateBatch(uint32_t cl, void** batch, int N) {
+  ASSERT(N > 0);
+  FreeList* list = &list_[cl];
+  for (int i = 0; i < N - 1; i++) {
+    SLL_SetNext(batch[i], batch[i + 1]);
+  }
+  SLL_SetNext(batch[N - 1], nullptr);
+  list->PushRange(N, batch[0], batch[N - 1]);
+  size_ += N * list->object_size();
+
+  if (PREDICT_FALSE(list->length() > list->max_length())) {
+    // Unlike Deallocate we may be over max_length by more than
+    // one object, so release whole excess, but at least a batch.
+    const int batch_size = Static::sizemap()->num_objects_to_move(cl);
+    ReleaseToCentralCache(list, cl,
+                          std::max<int>(list->length() - list->max_length(),
+                                        batch_size));
+  }
+  if (PREDICT_FALSE(size_ > max_size_)) {
+    Scavenge();
+  }
+}
+
 void ThreadCache::ListTooLong(FreeList* list, uint32_t cl) {
   size_ += list->object_size();
+  overflows_++;
 
   const int batch_size = Static::sizemap()->num_objects_to_move(cl);
   ReleaseToCentralCache(list, cl, batch_size);
@@ -200,12 +266,12 @@ void ThreadCache::ReleaseToCentralCache(FreeList* src, uint32_t cl, int N) {
   while (N > batch_size) {
     void *tail, *head;
     src->PopRange(batch_size, &head, &tail);
-    Static::central_cache()[cl].InsertRange(head, tail, batch_size);
+    central_[cl].InsertRange(head, tail, batch_size);
     N -= batch_size;
   }
   void *tail, *head;
   src->PopRange(N, &head, &tail);
-  Static::central_cache()[cl].InsertRange(head, tail, N);
+  central_[cl].InsertRange(head, tail, N);
   size_ -= delta_bytes;
 }
 
@@ -217,6 +283,7 @@ void ThreadCache::Scavenge() {
   // that situation by dropping L/2 nodes from the free list.  This
   // may not release much memory, but if so we will call scavenge again
   // pretty soon and the low-water marks will be high on that call.
+  overflows_++;
   for (int cl = 0; cl < Static::num_size_classes(); cl++) {
     FreeList* list = &list_[cl];
     const int lowmark = list->lowwatermark();
@@ -279,6 +346,92 @@ void ThreadCache::IncreaseCacheLimitLocked() {
   }
 }
 
+void ThreadCache::ReclaimIdleCacheSpace() {
+  const int32_t min_size =
+    min_per_thread_cache_size_.load(std::memory_order_relaxed);
+  for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
+    // Racy read of size_, same as in GetThreadStats. Unchanged size
+    // is a good enough sign that thread didn't touch its cache.
+    const int32_t size = h->size_;
+    if (size == h->idle_check_size_ && h->max_size_ > min_size) {
+      const int32_t take = std::min<int32_t>(
+        h->max_size_ - min_size,
+        std::max<int32_t>(h->max_size_ / 2, kStealAmount));
+      h->SetMaxSize(h->max_size_ - take);
+      unclaimed_cache_space_ += take;
+    }
+    h->idle_check_size_ = size;
+  }
+}
+
+void ThreadCache::RebalanceCacheSpace() {
+  uint64_t total_misses = 0;
+  for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
+    // Racy reads, same as in ReclaimIdleCacheSpace. Unsigned
+    // arithmetic takes care of wraparound.
+    const uint32_t misses = h->underflows_ + h->overflows_;
+    h->window_misses_ = misses - h->prev_misses_;
+    h->prev_misses_ = misses;
+    total_misses += h->window_misses_;
+  }
+  if (total_misses == 0 || thread_heap_count_ < 2) {
+    return;
+  }
+  const uint64_t average = total_misses / thread_heap_count_;
+
+  // Threads that missed at most quarter of average give back 1/8th
+  // of their budget above the minimum. If that turns out to be too
+  // much, they'll start missing and get it back next time.
+  const int32_t min_size =
+    min_per_thread_cache_size_.load(std::memory_order_relaxed);
+  uint64_t high_misses = 0;
+  for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
+    if (h->window_misses_ > average) {
+      high_misses += h->window_misses_;
+    } else if (uint64_t{h->window_misses_} * 4 <= average
+               && h->max_size_ > min_size) {
+      const int32_t excess = h->max_size_ - min_size;
+      const int32_t take = std::min<int32_t>(
+        excess, std::max<int32_t>(excess / 8, kStealAmount));
+      h->SetMaxSize(h->max_size_ - take);
+      unclaimed_cache_space_ += take;
+    }
+  }
+  if (unclaimed_cache_space_ <= 0 || high_misses == 0) {
+    return;
+  }
+
+  // Hand out unclaimed space to threads that missed more than
+  // average, in proportion to their misses.
+  const uint64_t pool = unclaimed_cache_space_;
+  for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
+    if (h->window_misses_ <= average
+        || h->max_size_ >= static_cast<int32_t>(kMaxThreadCacheSize)) {
+      continue;
+    }
+    const int32_t grant = std::min<uint64_t>(
+      pool * h->window_misses_ / high_misses,
+      kMaxThreadCacheSize - h->max_size_);
+    h->SetMaxSize(h->max_size_ + grant);
+    unclaimed_cache_space_ -= grant;
+    rebalanced_bytes_ += grant;
+  }
+}
+
+void ThreadCache::GetBudgetStats(size_t* min_budget, size_t* max_budget,
+                                 uint64_t* rebalanced_bytes) {
+  *min_budget = 0;
+  *max_budget = 0;
+  for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
+    const size_t budget = h->max_size_;
+    if (h == thread_heaps_ || budget < *min_budget) {
+      *min_budget = budget;
+    }
+    *max_budget = std::max(*max_budget, budget);
+  }
+  *rebalanced_bytes = rebalanced_bytes_;
+}
+
 int ThreadCache::GetSamplePeriod() {
   return Sampler::GetSamplePeriod();
 }
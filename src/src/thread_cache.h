@@ -35,6 +35,7 @@
 #define TCMALLOC_THREAD_CACHE_H_
 
 #include <config.h>
+#include <algorithm>
 #include <atomic>
 #include <stddef.h>                     // for size_t
 #include <stdint.h>                     // for uint32_t, uint64_t
@@ -58,6 +59,9 @@ DECLARE_int64(tcmalloc_sample_parameter);
 
 namespace tcmalloc {
 
+class CentralFreeList;
+class HeapPartition;
+
 //-------------------------------------------------------------------
 // Data kept per thread
 //-------------------------------------------------------------------
@@ -75,11 +79,31 @@ class ThreadCache {
   // Total byte size in cache
   size_t Size() const { return size_; }
 
+  // Heap partition we take objects from, or nullptr for the default
+  // heap, and its central free lists.
+  HeapPartition* partition() const { return partition_; }
+  CentralFreeList* central_cache() const { return central_; }
+
+  // Returns everything we cache to the central cache of our current
+  // partition and switches to partition p.
+  void SetPartition(HeapPartition* p);
+
+  // Returns everything we cache to the central cache.
+  void ReleaseAll();
+
   // Allocate an object of the given size and class. The size given
   // must be the same as the size of the class in the size map.
   void* Allocate(size_t size, uint32_t cl, void *(*oom_handler)(size_t size));
   void Deallocate(void* ptr, uint32_t size_class);
 
+  // Batch versions of the above. AllocateBatch fills batch[0..N) with
+  // objects of class cl, taking them from our freelist first and
+  // from the central cache when it runs dry. It returns number of
+  // objects stored, which is less than N only when we're out of
+  // memory.
+  int AllocateBatch(uint32_t cl, void** batch, int N);
+  void DeallocateBatch(uint32_t cl, void** batch, int N);
+
   void Scavenge();
 
   int GetSamplePeriod();
@@ -119,11 +143,36 @@ class ThreadCache {
     return min_per_thread_cache_size_.load(std::memory_order_relaxed);
   }
 
+  // Takes back part of the cache budget (max_size_) of thread caches
+  // that were not used since the previous call. We cannot touch
+  // freelists of other threads, but lowered limit makes such cache
+  // scavenge itself on its next free, and the budget goes to threads
+  // that need it without them having to steal it on their own.
+  // REQUIRES: Static::pageheap lock is held.
+  static void ReclaimIdleCacheSpace();
+
+  // Moves cache budget from thread caches that rarely go to the
+  // central cache to ones that do it often. Miss counts are taken
+  // over the period since the previous call, so it is meant to be
+  // called periodically, off the allocation path.
+  // REQUIRES: Static::pageheap lock is held.
+  static void RebalanceCacheSpace();
+
+  // Returns smallest and largest max_size_ across thread caches, and
+  // total amount of budget handed out by RebalanceCacheSpace.
+  // REQUIRES: Static::pageheap lock is held.
+  static void GetBudgetStats(size_t* min_budget, size_t* max_budget,
+                             uint64_t* rebalanced_bytes);
+
   static int thread_heap_count() {
     return thread_heap_count_;
   }
 
  private:
+  // Free list of one size class. When kFreeListSlots is non-zero,
+  // up to that many objects are kept in slots_ array, and only the
+  // rest are linked through list_. Push and Pop always prefer the
+  // array, so allocation of recently freed objects never reads them.
   class FreeList {
    private:
     void*    list_;       // Linked list of nodes
@@ -147,9 +196,17 @@ class ThreadCache {
 
     int32_t size_;
 
+#if TCMALLOC_FREELIST_SLOTS > 0
+    uint32_t top_;        // Number of objects in slots_.
+    void*    slots_[kFreeListSlots];
+#endif
+
    public:
     void Init(size_t size) {
       list_ = nullptr;
+#if TCMALLOC_FREELIST_SLOTS > 0
+      top_ = 0;
+#endif
       length_ = 0;
       lowater_ = 0;
       max_length_ = 1;
@@ -188,7 +245,7 @@ class ThreadCache {
 
     // Is list empty?
     bool empty() const {
-      return list_ == nullptr;
+      return length_ == 0;
     }
 
     // Low-water mark management
@@ -197,39 +254,106 @@ class ThreadCache {
 
     uint32_t Push(void* ptr) {
       uint32_t length = length_ + 1;
+#if TCMALLOC_FREELIST_SLOTS > 0
+      if (PREDICT_TRUE(top_ < kFreeListSlots)) {
+        slots_[top_++] = ptr;
+      } else {
+        SLL_Push(&list_, ptr);
+      }
+#else
       SLL_Push(&list_, ptr);
+#endif
       length_ = length;
       return length;
     }
 
     void* Pop() {
-      ASSERT(list_ != nullptr);
+      ASSERT(length_ > 0);
       length_--;
       if (length_ < lowater_) lowater_ = length_;
+#if TCMALLOC_FREELIST_SLOTS > 0
+      if (top_ > 0) {
+        return slots_[--top_];
+      }
+#endif
       return SLL_Pop(&list_);
     }
 
     bool TryPop(void **rv) {
+#if TCMALLOC_FREELIST_SLOTS > 0
+      if (PREDICT_TRUE(top_ > 0)) {
+        *rv = slots_[--top_];
+      } else if (!SLL_TryPop(&list_, rv)) {
+        return false;
+      }
+      length_--;
+      if (PREDICT_FALSE(length_ < lowater_)) lowater_ = length_;
+      return true;
+#else
       if (SLL_TryPop(&list_, rv)) {
         length_--;
         if (PREDICT_FALSE(length_ < lowater_)) lowater_ = length_;
         return true;
       }
       return false;
+#endif
     }
 
+    // Returns most recently pushed object (or nullptr if list is empty).
     void* Next() {
+#if TCMALLOC_FREELIST_SLOTS > 0
+      if (top_ > 0) {
+        return slots_[top_ - 1];
+      }
+#endif
       return SLL_Next(&list_);
     }
 
+    // Adds N objects linked from start to end. As many of them as
+    // fit go to slots_, so they're walked here, off the fast path.
     void PushRange(int N, void *start, void *end) {
-      SLL_PushRange(&list_, start, end);
       length_ += N;
+#if TCMALLOC_FREELIST_SLOTS > 0
+      while (N > 0 && top_ < kFreeListSlots) {
+        void* next = (--N > 0) ? SLL_Next(start) : nullptr;
+        slots_[top_++] = start;
+        start = next;
+      }
+      if (N == 0) {
+        return;
+      }
+#endif
+      SLL_PushRange(&list_, start, end);
     }
 
+    // Removes N objects and returns them linked from *start to
+    // *end. Linked part of the list goes first, then the oldest
+    // objects of slots_, so most recently freed objects stay.
     void PopRange(int N, void **start, void **end) {
-      SLL_PopRange(&list_, N, start, end);
       ASSERT(length_ >= N);
+#if TCMALLOC_FREELIST_SLOTS > 0
+      const int linked = std::min<int>(N, length_ - top_);
+      SLL_PopRange(&list_, linked, start, end);
+      const int from_slots = N - linked;
+      if (from_slots > 0) {
+        for (int i = 0; i < from_slots - 1; i++) {
+          SLL_SetNext(slots_[i], slots_[i + 1]);
+        }
+        SLL_SetNext(slots_[from_slots - 1], nullptr);
+        if (linked > 0) {
+          SLL_SetNext(*end, slots_[0]);
+        } else {
+          *start = slots_[0];
+        }
+        *end = slots_[from_slots - 1];
+        top_ -= from_slots;
+        for (uint32_t i = 0; i < top_; i++) {
+          slots_[i] = slots_[i + from_slots];
+        }
+      }
+#else
+      SLL_PopRange(&list_, N, start, end);
+#endif
       length_ -= N;
       if (length_ < lowater_) lowater_ = length_;
     }
@@ -289,6 +413,10 @@ class ThreadCache {
   // across all ThreadCaches.  Protected by Static::pageheap_lock.
   static ssize_t unclaimed_cache_space_;
 
+  // Total budget given out by RebalanceCacheSpace. Protected by
+  // Static::pageheap_lock.
+  static uint64_t rebalanced_bytes_;
+
   // This class is laid out with the most frequently used fields
   // first so that hot elements are placed on the same cache line.
 
@@ -297,9 +425,27 @@ class ThreadCache {
   int32_t       size_;                     // Combined size of data
   int32_t       max_size_;                 // size_ > max_size_ --> Scavenge()
 
+  HeapPartition*   partition_;             // See partition()
+  CentralFreeList* central_;               // partition_'s central cache
+
   // We sample allocations, biased by the size of the allocation
   Sampler       sampler_;               // A sampler
 
+  // size_ as seen by previous ReclaimIdleCacheSpace. Protected by
+  // Static::pageheap_lock.
+  int32_t       idle_check_size_;
+
+  // Number of trips to the central cache because freelist was empty
+  // (underflows_) or too long or whole cache was over max_size_
+  // (overflows_). Only updated by owning thread, off the fast path.
+  uint32_t      underflows_;
+  uint32_t      overflows_;
+
+  // Sum of the above as seen by previous RebalanceCacheSpace, and the
+  // number of misses since then. Protected by Static::pageheap_lock.
+  uint32_t      prev_misses_;
+  uint32_t      window_misses_;
+
   static void RecomputePerThreadCacheSize();
 
   // All ThreadCache objects are kept in a linked list (for stats collection)
@@ -171,6 +171,24 @@ bool TCMalloc_SystemRelease(void* start, size_t length) {
   return true;
 }
 
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemRelease(void* start, size_t length, bool low_pressure,
+                            bool* lazy) {
+  // Decommitted memory is always gone right away.
+  *lazy = false;
+  return TCMalloc_SystemRelease(start, length);
+}
+
+extern PERFTOOLS_DLL_DECL
+TCMalloc_ReleaseAdvice TCMalloc_GetReleaseAdvice() {
+  return TCMALLOC_RELEASE_DONTNEED;
+}
+
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SetReleaseAdvice(int advice) {
+  return advice == TCMALLOC_RELEASE_DONTNEED;
+}
+
 extern PERFTOOLS_DLL_DECL
 void TCMalloc_SystemCommit(void* start, size_t length) {
   if (VirtualAlloc(start, length, MEM_COMMIT, PAGE_READWRITE) == start)
@@ -196,6 +214,26 @@ void TCMalloc_SystemCommit(void* start, size_t length) {
   }
 }
 
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemHintHugePages(void* start, size_t length) {
+  // Large pages on windows require special privileges and cannot be
+  // requested after the fact. So nothing to do here.
+}
+
+// There is no mremap equivalent here, so we don't do dedicated
+// mappings at all.
+void* TCMalloc_SystemMapDedicated(size_t bytes) {
+  return nullptr;
+}
+
+void* TCMalloc_SystemRemapDedicated(void* start, size_t old_bytes,
+                                    size_t new_bytes, bool may_move) {
+  return nullptr;
+}
+
+void TCMalloc_SystemUnmapDedicated(void* start, size_t bytes) {
+}
+
 bool RegisterSystemAllocator(SysAllocator *allocator, int priority) {
   return false;   // we don't allow registration on windows, right now
 }
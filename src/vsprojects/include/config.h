@@ -21,6 +21,9 @@
 /* Report large allocation */
 /* #undef ENABLE_LARGE_ALLOC_REPORT */
 
+/* Enable per-cpu caches by default */
+/* #undef ENABLE_PERCPU_CACHE_BY_DEFAULT */
+
 /* Build sized deletion operators */
 /* #undef ENABLE_SIZED_DELETE */
 
@@ -153,6 +156,9 @@
 /* Define 8 bytes of allocation alignment for tcmalloc */
 /* #undef TCMALLOC_ALIGN_8BYTES */
 
+/* Define number of pointer array slots of tcmalloc per-thread free lists */
+/* #undef TCMALLOC_FREELIST_SLOTS */
+
 /* Define internal page size for tcmalloc as number of left bitshift */
 /* #undef TCMALLOC_PAGE_SIZE_SHIFT */
 